@@ -0,0 +1,134 @@
+/** This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libufe.h"
+#include "libufe-tools.h"
+#include "libufe-evb.h"
+
+#define CHUNK 1024
+
+uint64_t n_received, n_windows;
+
+void count_window(const ufe_hit *hits, size_t n_hits, uint64_t window_start, void *arg) {
+  n_received += n_hits;
+  ++n_windows;
+}
+
+double now_s() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Generates a time-ordered stream with random gaps between the hits.
+void generate(ufe_hit *hits, size_t n_hits, int board_id, uint32_t seed) {
+  uint64_t t = 0;
+  size_t i;
+  for (i = 0; i < n_hits; ++i) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    t += seed % 64;
+    hits[i].time_ = t;
+    hits[i].board_id_ = board_id;
+    hits[i].channel_ = seed % 96;
+    hits[i].type_ = 0;
+    hits[i].amplitude_ = seed % 4096;
+  }
+}
+
+int run(int n_boards, size_t n_hits, uint64_t window) {
+  ufe_evb *evb;
+  int status = ufe_evb_init(&evb, n_boards, 4*CHUNK, window, 1 << 20, &count_window, NULL);
+  if (status != 0)
+    return status;
+
+  ufe_hit **streams = (ufe_hit**) malloc(n_boards*sizeof(ufe_hit*));
+  int b;
+  for (b = 0; b < n_boards; ++b) {
+    streams[b] = (ufe_hit*) malloc(n_hits*sizeof(ufe_hit));
+    generate(streams[b], n_hits, b, 2463534242u + b);
+  }
+
+  n_received = n_windows = 0;
+  double start = now_s();
+
+  size_t pos;
+  for (pos = 0; pos < n_hits; pos += CHUNK) {
+    size_t n = (n_hits - pos < CHUNK)? n_hits - pos : CHUNK;
+    for (b = 0; b < n_boards; ++b)
+      ufe_evb_push(evb, b, streams[b] + pos, n);
+
+    ufe_evb_process(evb);
+  }
+
+  ufe_evb_flush(evb);
+  double elapsed = now_s() - start;
+
+  printf("%6i boards  %12lu hits  %10lu windows  %8.3f s  %8.2f Mhits/s  late %lu\n",
+         n_boards,
+         (unsigned long) n_received,
+         (unsigned long) n_windows,
+         elapsed,
+         n_received/elapsed*1e-6,
+         (unsigned long) evb->n_late_);
+
+  for (b = 0; b < n_boards; ++b)
+    free(streams[b]);
+
+  free(streams);
+  ufe_evb_free(evb);
+  return 0;
+}
+
+void print_usage(char *argv) {
+  fprintf(stderr, "\nUsage: %s [OPTION] ARG \n\n", argv);
+  fprintf(stderr, "    -n / --boards       <int dec/hex>   ( Number of boards )          [ optional / Default 4 ... 64 ]\n");
+  fprintf(stderr, "    -H / --hits         <int dec/hex>   ( Hits per board )            [ optional / Default 1000000 ]\n");
+  fprintf(stderr, "    -w / --window       <int dec/hex>   ( Width of the window )       [ optional / Default 4096 ]\n");
+}
+
+int main (int argc, char **argv) {
+
+  int boards_arg = get_arg_val('n', "boards", argc, argv);
+  int hits_arg   = get_arg_val('H', "hits",   argc, argv);
+  int window_arg = get_arg_val('w', "window", argc, argv);
+  int help_arg       = get_arg('h', "help",   argc, argv);
+
+  if (help_arg) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  size_t n_hits = (hits_arg)? arg_as_int(argv[hits_arg]) : 1000000;
+  uint64_t window = (window_arg)? arg_as_int(argv[window_arg]) : 4096;
+
+  if (boards_arg)
+    return (run(arg_as_int(argv[boards_arg]), n_hits, window) != 0)? 1 : 0;
+
+  int n_boards;
+  for (n_boards = 4; n_boards <= 64; n_boards *= 2)
+    if (run(n_boards, n_hits, window) != 0)
+      return 1;
+
+  return 0;
+}
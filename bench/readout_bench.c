@@ -0,0 +1,231 @@
+/** This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "libufe.h"
+#include "libufe-tools.h"
+#include "libufe-readout.h"
+#include "libufe-emu.h"
+#include "libufe-histo.h"
+
+// The boards are emulated in process (see libufe-emu.h). The numbers include the cost of
+// generating the synthetic data.
+
+enum sink_type { SINK_NULL, SINK_FILE, SINK_FIFO, N_SINKS };
+const char *sink_names[N_SINKS] = {"null", "file", "fifo"};
+
+const char *file_name = "/tmp/ufe_bench.bin";
+
+double now_s() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+double cpu_s() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6;
+}
+
+// Consumer of the FIFO sink.
+void* drain_pipe(void *arg) {
+  int fd = *(int*) arg;
+  size_t size = 1024*1024;
+  char *buffer = (char*) malloc(size);
+  while (read(fd, buffer, size) > 0) {}
+
+  free(buffer);
+  return NULL;
+}
+
+int run(int sink, int n_boards, int n_writers, int buffer_size, int time_s) {
+  ufe_context *ctx = NULL;
+  ufe_default_context(&ctx);
+  ctx->verbose_ = 0;
+  ctx->readout_buffer_size_ = buffer_size;
+  ctx->readout_timeout_ = 100;
+
+  ufe_emu_config config;
+  ufe_emu_default_config(&config);
+  config.n_boards_ = n_boards;
+  int status = ufe_emu_start(&config);
+  if (status != 0)
+    return status;
+
+  ctx->transport_ = ufe_emu_transport();
+  status = ufe_init(&ctx);
+  if (status != 0)
+    return status;
+
+  ufe_readout *ro = NULL;
+  status = ufe_readout_open(&ro, NULL, 0);
+  if (status != 0) {
+    ufe_exit(ctx);
+    return status;
+  }
+
+  ro->n_writers_ = n_writers;
+  ro->container_ = (n_boards > 1);
+
+  int fd = -1, pipe_fd[2] = {-1, -1};
+  pthread_t consumer;
+  if (sink == SINK_NULL) {
+    fd = open("/dev/null", O_WRONLY);
+  } else if (sink == SINK_FILE) {
+    fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  } else if (pipe(pipe_fd) == 0) {
+    fd = pipe_fd[1];
+    pthread_create(&consumer, NULL, &drain_pipe, &pipe_fd[0]);
+  }
+
+  if (fd < 0) {
+    fprintf(stderr, "\n!!! Error: cannot open the %s sink.\n\n", sink_names[sink]);
+    ufe_readout_close(ro);
+    ufe_exit(ctx);
+    return 1;
+  }
+
+  int i;
+  for (i = 0; i < ro->n_streams_; ++i)
+    ufe_readout_set_output(ro, i, fd);
+
+  double start = now_s(), cpu_start = cpu_s();
+  status = ufe_readout_start(ro, DR_START);
+  if (status == 0)
+    sleep(time_s);
+
+  int stop_status = ufe_readout_stop(ro, DR_STOP);
+  if (status == 0)
+    status = stop_status;
+
+  double elapsed = now_s() - start, cpu = cpu_s() - cpu_start;
+
+  ufe_readout_stats *stats = (ufe_readout_stats*) malloc(sizeof(ufe_readout_stats));
+  ufe_histo *latency = (ufe_histo*) malloc(sizeof(ufe_histo));
+  ufe_get_stats(ro, stats);
+  ufe_get_latency(ro, -1, latency);
+
+  uint64_t bytes = 0;
+  for (i = 0; i < stats->n_streams_; ++i)
+    bytes += stats->streams_[i].bytes_;
+
+  double gb = bytes*1e-9;
+  printf("%-4s  %3i boards  %2i writers  %8i B  %9.1f MB/s  %6.2f cpu-s/GB   latency [us] p50 %8.1f  p99 %8.1f  p99.9 %8.1f\n",
+         sink_names[sink],
+         n_boards,
+         n_writers,
+         buffer_size,
+         bytes*1e-6/elapsed,
+         (gb > 0)? cpu/gb : 0.,
+         ufe_histo_percentile(latency, 50.)*1e-3,
+         ufe_histo_percentile(latency, 99.)*1e-3,
+         ufe_histo_percentile(latency, 99.9)*1e-3);
+  fflush(stdout);
+
+  free(stats);
+  free(latency);
+  ufe_readout_close(ro);
+  ufe_exit(ctx);
+
+  close(fd);
+  if (sink == SINK_FIFO) {
+    pthread_join(consumer, NULL);
+    close(pipe_fd[0]);
+  } else if (sink == SINK_FILE) {
+    unlink(file_name);
+  }
+
+  return status;
+}
+
+void print_usage(char *argv) {
+  fprintf(stderr, "\nUsage: %s [OPTION] ARG \n\n", argv);
+  fprintf(stderr, "    -s / --sink         <null/file/fifo> ( Output of the data )       [ optional / Default all ]\n");
+  fprintf(stderr, "    -n / --boards       <int dec/hex>   ( Number of boards )          [ optional / Default 1 ]\n");
+  fprintf(stderr, "    -w / --writers      <int dec/hex>   ( Number of writer threads )  [ optional / Default 1 ... boards ]\n");
+  fprintf(stderr, "    -B / --buffer-size  <int dec/hex>   ( Readout buffer size )       [ optional / Default 16K ... 1M ]\n");
+  fprintf(stderr, "    -f / --file         <string>        ( File of the file sink )     [ optional / Default %s ]\n", file_name);
+  fprintf(stderr, "    -t / --time         <int dec/hex>   ( Duration of each run in s ) [ optional / Default 2 ]\n");
+}
+
+int main (int argc, char **argv) {
+
+  int sink_arg    = get_arg_val('s', "sink",        argc, argv);
+  int boards_arg  = get_arg_val('n', "boards",      argc, argv);
+  int writers_arg = get_arg_val('w', "writers",     argc, argv);
+  int buffer_arg  = get_arg_val('B', "buffer-size", argc, argv);
+  int file_arg    = get_arg_val('f', "file",        argc, argv);
+  int time_arg    = get_arg_val('t', "time",        argc, argv);
+  int help_arg        = get_arg('h', "help",        argc, argv);
+
+  if (help_arg) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  int first_sink = 0, last_sink = N_SINKS - 1;
+  if (sink_arg) {
+    for (first_sink = 0; first_sink < N_SINKS; ++first_sink)
+      if (strcmp(argv[sink_arg], sink_names[first_sink]) == 0)
+        break;
+
+    if (first_sink == N_SINKS) {
+      print_usage(argv[0]);
+      return 1;
+    }
+
+    last_sink = first_sink;
+  }
+
+  if (file_arg)
+    file_name = argv[file_arg];
+
+  int n_boards = (boards_arg)? arg_as_int(argv[boards_arg]) : 1;
+  int time_s = (time_arg)? arg_as_int(argv[time_arg]) : 2;
+
+  // Scan the buffer sizes and the number of writers, unless fixed by the user.
+  int buffer_sizes[] = {16*1024, 64*1024, 256*1024, 1024*1024};
+  int n_sizes = sizeof(buffer_sizes)/sizeof(int);
+  if (buffer_arg) {
+    buffer_sizes[0] = arg_as_int(argv[buffer_arg]);
+    n_sizes = 1;
+  }
+
+  int sink, i_size, n_writers;
+  for (sink = first_sink; sink <= last_sink; ++sink)
+    for (i_size = 0; i_size < n_sizes; ++i_size)
+      for (n_writers = 1; n_writers <= n_boards; n_writers *= 2) {
+        int w = (writers_arg)? arg_as_int(argv[writers_arg]) : n_writers;
+        if (run(sink, n_boards, w, buffer_sizes[i_size], time_s) != 0)
+          return 1;
+
+        if (writers_arg)
+          break;
+      }
+
+  return 0;
+}
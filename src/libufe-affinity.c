@@ -0,0 +1,151 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-affinity.h"
+
+/** Preferred node policy of mbind(), see linux/mempolicy.h. */
+#define UFE_MPOL_PREFERRED 1
+
+static int read_line(const char *path, char *line, size_t size) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return UFE_NOT_FOUND_ERROR;
+
+  char *l = fgets(line, size, file);
+  fclose(file);
+  if (!l)
+    return UFE_IO_ERROR;
+
+  line[strcspn(line, "\n")] = 0;
+  return 0;
+}
+
+int ufe_usb_numa_node(libusb_device_handle *handle) {
+  int bus = ufe_usb()->get_bus_number(handle);
+  if (bus < 0)
+    return -1;
+
+  // The root hub of the bus is a child of the PCI device of the host controller.
+  char path[128], line[16];
+  snprintf(path, sizeof(path), "/sys/bus/usb/devices/usb%i/../numa_node", bus);
+  if (read_line(path, line, sizeof(line)) != 0)
+    return -1;
+
+  return atoi(line);
+}
+
+int ufe_numa_node_cpus(int node, char *cpus, size_t size) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%i/cpulist", node);
+  return read_line(path, cpus, size);
+}
+
+static int parse_cpus(const char *cpus, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *c = cpus;
+  while (*c) {
+    char *end;
+    long first = strtol(c, &end, 10), last = first;
+    if (end == c)
+      return UFE_INVALID_ARG_ERROR;
+
+    if (*end == '-') {
+      c = end + 1;
+      last = strtol(c, &end, 10);
+      if (end == c)
+        return UFE_INVALID_ARG_ERROR;
+    }
+
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+      return UFE_INVALID_ARG_ERROR;
+
+    for (; first <= last; ++first)
+      CPU_SET(first, set);
+
+    c = end;
+    if (*c == ',' && c[1])
+      ++c;
+    else if (*c)
+      return UFE_INVALID_ARG_ERROR;
+  }
+
+  return (CPU_COUNT(set) > 0)? 0 : UFE_INVALID_ARG_ERROR;
+}
+
+int ufe_set_thread_cpus(pthread_t thread, const char *cpus) {
+  cpu_set_t set;
+  if (parse_cpus(cpus, &set) != 0) {
+    ufe_error_print("invalid CPU list \"%s\".", cpus);
+    return UFE_INVALID_ARG_ERROR;
+  }
+
+  int status = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+  if (status != 0) {
+    ufe_warning_print("cannot pin a thread to the CPUs %s (%s).", cpus, strerror(status));
+    return UFE_INTERNAL_ERROR;
+  }
+
+  return 0;
+}
+
+int ufe_set_thread_fifo(pthread_t thread, int priority) {
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
+  int status = pthread_setschedparam(thread, SCHED_FIFO, &param);
+  if (status != 0) {
+    ufe_warning_print("cannot set the SCHED_FIFO priority %i (%s).", priority, strerror(status));
+    return UFE_INTERNAL_ERROR;
+  }
+
+  return 0;
+}
+
+int ufe_bind_memory(void *addr, size_t size, int node) {
+  if (node < 0)
+    return 0;
+
+  unsigned long mask[16];
+  if (node >= (int) (8*sizeof(mask)) - 1)
+    return UFE_INVALID_ARG_ERROR;
+
+  memset(mask, 0, sizeof(mask));
+  mask[node/(8*sizeof(long))] = 1ul << (node%(8*sizeof(long)));
+#ifdef SYS_mbind
+  if (syscall(SYS_mbind, addr, size, UFE_MPOL_PREFERRED, mask, 8*sizeof(mask), 0) == 0)
+    return 0;
+#else
+  errno = ENOSYS;
+#endif
+
+  ufe_warning_print("cannot bind memory to the NUMA node %i (%s).", node, strerror(errno));
+  return UFE_INTERNAL_ERROR;
+}
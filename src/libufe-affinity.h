@@ -0,0 +1,89 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file    libufe-affinity.h
+ *  \brief   File containing the placement of the readout on multi-socket hosts: the NUMA node of
+ *  the USB host controller of a board (found in sysfs from the bus of the device), the pinning of
+ *  threads to a list of CPUs, the real-time priority of a thread and the NUMA binding of memory.
+ *  The CPU lists use the format of taskset -c and of sysfs ("0-3,8,10-11").
+ */
+
+#ifndef LIBUFE_AFFINITY_H
+#define LIBUFE_AFFINITY_H 1
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** CPU list meaning the CPUs of the NUMA node of the USB controller of the board. */
+#define UFE_CPUS_NODE "node"
+
+/** \brief Gets the NUMA node of the USB host controller of a device.
+ *  \param handle: A device handle.
+ *  \returns The node, or -1 if unknown (single node host, emulated board ...).
+ */
+int ufe_usb_numa_node(libusb_device_handle *handle);
+
+
+/** \brief Gets the CPUs of a NUMA node.
+ *  \param node: The node.
+ *  \param cpus: Output location for the CPU list.
+ *  \param size: Size of the output location.
+ *  \returns 0 on success, or a UFE_ERROR code on failure.
+ */
+int ufe_numa_node_cpus(int node, char *cpus, size_t size);
+
+
+/** \brief Pins a thread to a list of CPUs.
+ *  \param thread: The thread.
+ *  \param cpus: The CPU list.
+ *  \returns 0 on success, or a UFE_ERROR code on failure.
+ */
+int ufe_set_thread_cpus(pthread_t thread, const char *cpus);
+
+
+/** \brief Gives a real-time (SCHED_FIFO) priority to a thread. Needs CAP_SYS_NICE or a large enough
+ *  RLIMIT_RTPRIO.
+ *  \param thread: The thread.
+ *  \param priority: The priority (1-99).
+ *  \returns 0 on success, or a UFE_ERROR code on failure.
+ */
+int ufe_set_thread_fifo(pthread_t thread, int priority);
+
+
+/** \brief Places the pages of a memory range on a NUMA node, where possible. Only the pages not
+ *  yet faulted in are affected.
+ *  \param addr: Start of the range (page aligned).
+ *  \param size: Size of the range.
+ *  \param node: The node. Nothing is done if negative.
+ *  \returns 0 on success, or a UFE_ERROR code on failure.
+ */
+int ufe_bind_memory(void *addr, size_t size, int node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
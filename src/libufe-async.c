@@ -0,0 +1,319 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-async.h"
+
+extern ufe_context *ufe_context_handler;
+
+/** The steps of a command. */
+enum async_step {
+  STEP_SEND,
+  STEP_WRAPUP,
+  STEP_ANSWER
+};
+
+/** Protects the list of the commands waiting for their processing time. */
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Commands waiting before the wrap-up request, in the order of their due time. */
+static ufe_async_command *async_delayed = NULL;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static void transfer_done(ufe_transfer *transfer);
+
+// Calls the function of the command. The command may be reused by the function.
+static void finish(ufe_async_command *cmd, int status) {
+  cmd->status_ = status;
+  (*cmd->func_)(cmd, cmd->user_data_);
+}
+
+// Submits the transfer of the current step.
+static int submit_step(ufe_async_command *cmd) {
+  ufe_transfer *t = &cmd->transfer_;
+  memset(t, 0, sizeof(ufe_transfer));
+  t->handle_ = cmd->handle_;
+  t->timeout_ = UFE_CMD_TIMEOUT;
+  t->callback_ = &transfer_done;
+  t->user_data_ = cmd;
+
+  switch (cmd->step_) {
+    case STEP_SEND:
+      // Max size, allowed for a single transfer is 256.
+      t->type_ = LIBUSB_TRANSFER_TYPE_BULK;
+      t->endpoint_ = UFE_USB_EP2_OUT | LIBUSB_ENDPOINT_OUT;
+      t->data_ = (unsigned char*) cmd->buffer_ + cmd->sent_;
+      t->length_ = (cmd->size_ - cmd->sent_ < 256)? cmd->size_ - cmd->sent_ : 256;
+      break;
+
+    case STEP_WRAPUP:
+      t->type_ = LIBUSB_TRANSFER_TYPE_CONTROL;
+      t->request_type_ = CLASS_REQUEST | LIBUSB_ENDPOINT_IN;
+      t->request_ = UFE_EP2IN_WRAPPUP_REQ;
+      t->value_ = 2;
+      t->data_ = &cmd->wrapup_data_;
+      t->length_ = 1;
+      break;
+
+    case STEP_ANSWER:
+      t->type_ = LIBUSB_TRANSFER_TYPE_BULK;
+      t->endpoint_ = UFE_USB_EP2_IN | LIBUSB_ENDPOINT_IN;
+      t->data_ = (unsigned char*) cmd->buffer_;
+      t->length_ = ufe_command_size(cmd->answer_argc_);
+      break;
+  }
+
+  return ufe_usb()->submit_transfer(t);
+}
+
+static void run_step(ufe_async_command *cmd) {
+  int status = submit_step(cmd);
+  if (status != 0) {
+    ufe_error_print("error during command %s ( board %i )",
+                    ufe_get_command_name(cmd->command_id_), cmd->board_id_);
+    finish(cmd, status);
+  }
+}
+
+// Runs the wrap-up request after the processing time of the board.
+static void run_wrapup(ufe_async_command *cmd) {
+  cmd->step_ = STEP_WRAPUP;
+  if (cmd->delay_us_ < 1000) {
+    run_step(cmd);
+    return;
+  }
+
+  cmd->due_ns_ = now_ns() + cmd->delay_us_*1000ull;
+  pthread_mutex_lock(&async_mutex);
+  ufe_async_command **pos = &async_delayed;
+  while (*pos && (*pos)->due_ns_ <= cmd->due_ns_)
+    pos = &(*pos)->next_;
+
+  cmd->next_ = *pos;
+  *pos = cmd;
+  pthread_mutex_unlock(&async_mutex);
+}
+
+static void encode(ufe_async_command *cmd, const ufe_command_desc *desc, int sub_cmd_id, uint16_t *argv) {
+  cmd->size_ = ufe_encode_command(cmd->buffer_, cmd->board_id_, desc->command_id_,
+                                  (desc->sub_cmd_ & UFE_CMD_SUB)? sub_cmd_id : NO_SUB_CMD_ID,
+                                  desc->argc_, argv);
+  cmd->sent_ = 0;
+  cmd->answer_argc_ = desc->answer_argc_;
+  cmd->delay_us_ = desc->wrapup_delay_us_;
+  cmd->step_ = STEP_SEND;
+}
+
+// Sends the validation of a configuration (see ufe_set_config()).
+static void send_validation(ufe_async_command *cmd) {
+  static const uint16_t codes[4] = {UFE_SC_VALIDATE_D0, UFE_SC_VALIDATE_D1,
+                                    UFE_SC_VALIDATE_D2, UFE_SC_VALIDATE_D3};
+  uint16_t code = codes[cmd->validate_device_];
+  encode(cmd, &ufe_validate_config_desc, cmd->validate_device_ + 8, &code);
+  cmd->validate_device_ = -1;
+  cmd->answer_argv_ = &cmd->answer_arg_;
+}
+
+static void transfer_done(ufe_transfer *t) {
+  ufe_async_command *cmd = (ufe_async_command*) t->user_data_;
+  const char* cmd_name = ufe_get_command_name(cmd->command_id_);
+  if (t->status_ != 0 || t->actual_ != t->length_) {
+    ufe_error_print("error during command %s ( board %i )  status: %i, size: %i",
+                    cmd_name, cmd->board_id_, t->status_, t->actual_);
+    finish(cmd, (t->status_ < 0)? t->status_ : UFE_IO_ERROR);
+    return;
+  }
+
+  switch (cmd->step_) {
+    case STEP_SEND:
+      cmd->sent_ += t->actual_;
+      if (cmd->sent_ < cmd->size_)
+        run_step(cmd);
+      else
+        run_wrapup(cmd);
+
+      return;
+
+    case STEP_WRAPUP:
+      if (cmd->wrapup_data_ != 2) {
+        ufe_error_print("ep2in_wrappup failed ( %i, %i )", t->actual_, cmd->wrapup_data_);
+        finish(cmd, UFE_INVALID_CMD_ANSWER_ERROR);
+        return;
+      }
+
+      cmd->step_ = STEP_ANSWER;
+      run_step(cmd);
+      return;
+
+    case STEP_ANSWER: {
+      int status = ufe_decode_command_answer( cmd->buffer_,
+                                              cmd->board_id_,
+                                              cmd->command_id_,
+                                              NO_SUB_CMD_ID,
+                                              cmd->answer_argc_,
+                                              &cmd->answer_argv_);
+      if (status == 0 && cmd->validate_device_ >= 0) {
+        send_validation(cmd);
+        run_step(cmd);
+        return;
+      }
+
+      finish(cmd, status);
+      return;
+    }
+  }
+}
+
+static void init(ufe_async_command *cmd,
+                 libusb_device_handle *ufe,
+                 int board_id,
+                 int command_id,
+                 uint16_t *answer,
+                 ufe_async_func func,
+                 void *user_data) {
+  cmd->status_ = 0;
+  cmd->func_ = func;
+  cmd->user_data_ = user_data;
+  cmd->handle_ = ufe;
+  cmd->board_id_ = board_id;
+  cmd->command_id_ = command_id;
+  cmd->answer_argv_ = (answer)? answer : &cmd->answer_arg_;
+  cmd->validate_device_ = -1;
+  cmd->next_ = NULL;
+}
+
+int ufe_async_firmware_version(ufe_async_command *cmd,
+                               libusb_device_handle *ufe,
+                               int board_id,
+                               int *data,
+                               ufe_async_func func,
+                               void *user_data) {
+  *data = 0;
+  uint16_t arg = 0;
+  init(cmd, ufe, board_id, FIRMWARE_VERSION_CMD_ID, (uint16_t*) data, func, user_data);
+  encode(cmd, ufe_get_command_desc(FIRMWARE_VERSION_CMD_ID), NO_SUB_CMD_ID, &arg);
+  return submit_step(cmd);
+}
+
+int ufe_async_read_status(ufe_async_command *cmd,
+                          libusb_device_handle *ufe,
+                          int board_id,
+                          uint16_t *data,
+                          ufe_async_func func,
+                          void *user_data) {
+  init(cmd, ufe, board_id, READ_STATUS_CMD_ID, data, func, user_data);
+  encode(cmd, ufe_get_command_desc(READ_STATUS_CMD_ID), NO_SUB_CMD_ID, NULL);
+  return submit_step(cmd);
+}
+
+int ufe_async_set_direct_param(ufe_async_command *cmd,
+                               libusb_device_handle *ufe,
+                               int board_id,
+                               uint16_t params,
+                               ufe_async_func func,
+                               void *user_data) {
+  init(cmd, ufe, board_id, SET_DIRECT_PARAM_CMD_ID, NULL, func, user_data);
+  encode(cmd, ufe_get_command_desc(SET_DIRECT_PARAM_CMD_ID), NO_SUB_CMD_ID, &params);
+  return submit_step(cmd);
+}
+
+int ufe_async_data_readout(ufe_async_command *cmd,
+                           libusb_device_handle *ufe,
+                           int board_id,
+                           uint16_t params,
+                           ufe_async_func func,
+                           void *user_data) {
+  init(cmd, ufe, board_id, DATA_READOUT_CMD_ID, NULL, func, user_data);
+  encode(cmd, ufe_get_command_desc(DATA_READOUT_CMD_ID), NO_SUB_CMD_ID, &params);
+  return submit_step(cmd);
+}
+
+int ufe_async_set_config(ufe_async_command *cmd,
+                         libusb_device_handle *ufe,
+                         int board_id,
+                         int device,
+                         uint32_t *data,
+                         ufe_async_func func,
+                         void *user_data) {
+  if (device < 0 || device > 3)
+    return UFE_INVALID_ARG_ERROR;
+
+  init(cmd, ufe, board_id, SET_CONFIG_CMD_ID, NULL, func, user_data);
+  encode(cmd, ufe_get_command_desc(SET_CONFIG_CMD_ID), device, (uint16_t*) data);
+  cmd->validate_device_ = device;
+  return submit_step(cmd);
+}
+
+int ufe_async_read_buffer(ufe_transfer *transfer,
+                          libusb_device_handle *ufe,
+                          uint8_t *data,
+                          unsigned int timeout,
+                          void (*callback)(ufe_transfer *transfer),
+                          void *user_data) {
+  memset(transfer, 0, sizeof(ufe_transfer));
+  transfer->handle_ = ufe;
+  transfer->type_ = LIBUSB_TRANSFER_TYPE_BULK;
+  transfer->endpoint_ = UFE_USB_EP1_IN | LIBUSB_ENDPOINT_IN;
+  transfer->data_ = data;
+  transfer->length_ = ufe_context_handler->readout_buffer_size_;
+  transfer->timeout_ = timeout;
+  transfer->callback_ = callback;
+  transfer->user_data_ = user_data;
+  return ufe_usb()->submit_transfer(transfer);
+}
+
+int ufe_async_handle_events(int timeout_ms) {
+  // Take the commands which are due, and wait no longer than the next one.
+  uint64_t now = now_ns();
+  pthread_mutex_lock(&async_mutex);
+  ufe_async_command *due = NULL, **last = &due;
+  while (async_delayed && async_delayed->due_ns_ <= now) {
+    *last = async_delayed;
+    last = &async_delayed->next_;
+    async_delayed = async_delayed->next_;
+  }
+
+  *last = NULL;
+  if (async_delayed) {
+    int wait_ms = (async_delayed->due_ns_ - now + 999999)/1000000;
+    if (wait_ms < timeout_ms)
+      timeout_ms = wait_ms;
+  }
+
+  pthread_mutex_unlock(&async_mutex);
+
+  while (due) {
+    ufe_async_command *next = due->next_;
+    run_step(due);
+    due = next;
+  }
+
+  return ufe_usb()->handle_events(ufe_context_handler->usb_ctx_, timeout_ms);
+}
@@ -0,0 +1,208 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-async.h
+ *  \brief   File containing the asynchronous commands and readout. A command is a chain of
+ *  asynchronous transfers (the command to EP2, the wrap-up request, the answer from EP2), each one
+ *  submitted by the completion of the previous one. The commands make progress only inside
+ *  ufe_async_handle_events(), so one thread can drive the slow control of many boards at the same
+ *  time, instead of one blocking thread per device. Only one command at a time can be sent to a
+ *  board. See libufe-async.hpp for the C++20 coroutine interface.
+ */
+
+#ifndef LIBUFE_ASYNC_H
+#define LIBUFE_ASYNC_H 1
+
+#include "libufe.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of arguments of an asynchronous command (the configuration of a device). */
+#define UFE_ASYNC_MAX_ARGS 72
+
+/** Default timeout of the event handling (ms). */
+#define UFE_ASYNC_POLL_MS 100
+
+/** ufe_async_command type */
+typedef struct ufe_async_command ufe_async_command;
+
+/** Function called when an asynchronous command is complete. */
+typedef void (*ufe_async_func)(ufe_async_command *cmd, void *user_data);
+
+/** \brief State of an asynchronous command. The structure is provided by the caller and must stay
+ *  valid until the command is complete. Only status_ is meant to be read.
+ */
+struct ufe_async_command {
+  /** Result of the command: 0 or a LIBUSB_ERROR / UFE_ERROR code. Set when func_ is called. */
+  int status_;
+
+  /** Called by the thread handling the events, when the command is complete. */
+  ufe_async_func func_;
+  void *user_data_;
+
+  libusb_device_handle *handle_;
+  int board_id_;
+  int command_id_;
+
+  /** Number of arguments of the answer and their output location. */
+  int answer_argc_;
+  uint16_t *answer_argv_;
+  uint16_t answer_arg_;
+
+  /** Processing time given to the board, before the wrap-up request (us). */
+  unsigned int delay_us_;
+
+  /** Device of a SET_CONFIG, validated after the configuration, or -1. */
+  int validate_device_;
+
+  /** The encoded command, then the answer. */
+  uint32_t buffer_[UFE_ASYNC_MAX_ARGS + 2];
+  int size_;
+  int sent_;
+
+  uint8_t wrapup_data_;
+  int step_;
+  uint64_t due_ns_;
+  ufe_transfer transfer_;
+  struct ufe_async_command *next_;
+};
+
+
+/** \brief Starts an asynchronous FIRMWARE_VERSION command (see ufe_firmware_version()).
+ *  \param cmd: State of the command.
+ *  \param ufe: A device handle.
+ *  \param board_id: Board identifier.
+ *  \param data: Output location for the firmware version. Must stay valid until the completion.
+ *  \param func: Function called when the command is complete.
+ *  \param user_data: Passed to func.
+ *  \returns 0 if the command is started (func will be called), or a LIBUSB_ERROR code.
+ */
+int ufe_async_firmware_version(ufe_async_command *cmd,
+                               libusb_device_handle *ufe,
+                               int board_id,
+                               int *data,
+                               ufe_async_func func,
+                               void *user_data);
+
+
+/** \brief Starts an asynchronous READ_STATUS command (see ufe_read_status()).
+ *  \param cmd: State of the command.
+ *  \param ufe: A device handle.
+ *  \param board_id: Board identifier.
+ *  \param data: Output location for the status word. Must stay valid until the completion.
+ *  \param func: Function called when the command is complete.
+ *  \param user_data: Passed to func.
+ *  \returns 0 if the command is started (func will be called), or a LIBUSB_ERROR code.
+ */
+int ufe_async_read_status(ufe_async_command *cmd,
+                          libusb_device_handle *ufe,
+                          int board_id,
+                          uint16_t *data,
+                          ufe_async_func func,
+                          void *user_data);
+
+
+/** \brief Starts an asynchronous SET_DIRECT_PARAM command (see ufe_set_direct_param()).
+ *  \param cmd: State of the command.
+ *  \param ufe: A device handle.
+ *  \param board_id: Board identifier.
+ *  \param params: The parameters.
+ *  \param func: Function called when the command is complete.
+ *  \param user_data: Passed to func.
+ *  \returns 0 if the command is started (func will be called), or a LIBUSB_ERROR code.
+ */
+int ufe_async_set_direct_param(ufe_async_command *cmd,
+                               libusb_device_handle *ufe,
+                               int board_id,
+                               uint16_t params,
+                               ufe_async_func func,
+                               void *user_data);
+
+
+/** \brief Starts an asynchronous DATA_READOUT command (see ufe_data_readout()).
+ *  \param cmd: State of the command.
+ *  \param ufe: A device handle.
+ *  \param board_id: Board identifier.
+ *  \param params: The readout parameters (DR_START, DR_STOP ...).
+ *  \param func: Function called when the command is complete.
+ *  \param user_data: Passed to func.
+ *  \returns 0 if the command is started (func will be called), or a LIBUSB_ERROR code.
+ */
+int ufe_async_data_readout(ufe_async_command *cmd,
+                           libusb_device_handle *ufe,
+                           int board_id,
+                           uint16_t params,
+                           ufe_async_func func,
+                           void *user_data);
+
+
+/** \brief Starts an asynchronous SET_CONFIG command, followed by the validation of the
+ *  configuration (see ufe_set_config()).
+ *  \param cmd: State of the command.
+ *  \param ufe: A device handle.
+ *  \param board_id: Board identifier.
+ *  \param device: The device (0-2 ASICs, 3 FPGA).
+ *  \param data: The configuration (36 words), copied before the function returns.
+ *  \param func: Function called when the command is complete.
+ *  \param user_data: Passed to func.
+ *  \returns 0 if the command is started (func will be called), or a LIBUSB_ERROR code.
+ */
+int ufe_async_set_config(ufe_async_command *cmd,
+                         libusb_device_handle *ufe,
+                         int board_id,
+                         int device,
+                         uint32_t *data,
+                         ufe_async_func func,
+                         void *user_data);
+
+
+/** \brief Starts an asynchronous readout transfer of ufe_context::readout_buffer_size_ bytes
+ *  (see ufe_read_buffer_timeout()). A transfer which times out may still have data.
+ *  \param transfer: The transfer, valid until the completion.
+ *  \param ufe: A device handle.
+ *  \param data: Output location for the data.
+ *  \param timeout: Timeout of the transfer (ms).
+ *  \param callback: Called when the transfer is complete.
+ *  \param user_data: Stored in the transfer.
+ *  \returns 0 if the transfer is submitted (callback will be called), or a LIBUSB_ERROR code.
+ */
+int ufe_async_read_buffer(ufe_transfer *transfer,
+                          libusb_device_handle *ufe,
+                          uint8_t *data,
+                          unsigned int timeout,
+                          void (*callback)(ufe_transfer *transfer),
+                          void *user_data);
+
+
+/** \brief Handles the events of the current session: the commands and transfers make progress and
+ *  the functions of the complete ones are called by this function.
+ *  \param timeout_ms: Maximum time to wait for an event (ms).
+ *  \returns 0 on success, or a LIBUSB_ERROR code on failure.
+ */
+int ufe_async_handle_events(int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,443 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-async.hpp
+ *  \brief   File containing the C++20 coroutine interface of the asynchronous commands and readout
+ *  (see libufe-async.h). The commands of ufe::AsyncDevice are awaitable and the readout blocks are
+ *  produced by an asynchronous generator. The coroutines are resumed by the thread running them
+ *  with ufe::run() / ufe::run_all(), which handles the events of the session:
+ *
+ *    ufe::Task<int> configure(ufe::AsyncDevice dev) {
+ *      ufe::Result<void> done = co_await dev.set_direct_param(SDP_GTEN);
+ *      ufe::Result<uint16_t> status = co_await dev.read_status();
+ *      ...
+ *    }
+ *
+ *    std::vector<ufe::Task<int>> tasks;  // one per board
+ *    ufe::run_all(tasks);
+ */
+
+#ifndef LIBUFE_ASYNC_HPP
+#define LIBUFE_ASYNC_HPP 1
+
+#if !defined(__cpp_impl_coroutine)
+#error "libufe-async.hpp needs C++20 coroutines."
+#endif
+
+#include <cassert>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+
+#include "libufe.hpp"
+#include "libufe-async.h"
+
+namespace ufe {
+
+template <typename T>
+class Task;
+
+namespace detail {
+
+/** Resumes the coroutine awaiting a task, at the end of the task. */
+struct FinalAwaiter {
+  bool await_ready() const noexcept { return false; }
+
+  template <typename P>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+    std::coroutine_handle<> awaiting = h.promise().awaiting_;
+    return (awaiting)? awaiting : std::noop_coroutine();
+  }
+
+  void await_resume() const noexcept {}
+};
+
+struct PromiseBase {
+  std::coroutine_handle<> awaiting_;
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() const noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+  std::optional<T> value_;
+
+  Task<T> get_return_object() noexcept;
+
+  template <typename U>
+  void return_value(U &&value) { value_.emplace(std::forward<U>(value)); }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+  Task<void> get_return_object() noexcept;
+  void return_void() const noexcept {}
+};
+
+/** An asynchronous command, started when awaited. */
+template <typename T, typename Submit>
+class CommandAwaiter {
+ public:
+  explicit CommandAwaiter(Submit submit) : submit_(submit) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    awaiting_ = awaiting;
+    int status = submit_(&cmd_, &value_, &done, this);
+    if (status != 0) {
+      cmd_.status_ = status;
+      return false;
+    }
+
+    return true;
+  }
+
+  Result<T> await_resume() {
+    if (cmd_.status_ != 0)
+      return Error(cmd_.status_);
+
+    if constexpr (std::is_void_v<T>)
+      return {};
+    else
+      return value_;
+  }
+
+ private:
+  static void done(ufe_async_command*, void *self) {
+    static_cast<CommandAwaiter*>(self)->awaiting_.resume();
+  }
+
+  Submit submit_;
+  std::conditional_t<std::is_void_v<T>, int, T> value_{};
+  ufe_async_command cmd_;
+  std::coroutine_handle<> awaiting_;
+};
+
+template <typename T, typename Submit>
+CommandAwaiter<T, Submit> command(Submit submit) {
+  return CommandAwaiter<T, Submit>(submit);
+}
+
+/** An asynchronous readout transfer, started when awaited. */
+class ReadAwaiter {
+ public:
+  ReadAwaiter(libusb_device_handle *handle, ReadoutBuffer &buffer, unsigned int timeout) noexcept
+  : handle_(handle), buffer_(buffer), timeout_(timeout), status_(0), actual_(0) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    if (buffer_.block_size() < ufe_get_context()->readout_buffer_size_) {
+      status_ = UFE_INVALID_ARG_ERROR;
+      return false;
+    }
+
+    if (timeout_ == 0)
+      timeout_ = ufe_get_context()->readout_timeout_;
+
+    awaiting_ = awaiting;
+    block_ = buffer_.next();
+    status_ = ufe_async_read_buffer(&transfer_, handle_, reinterpret_cast<uint8_t*>(block_.data()),
+                                    timeout_, &done, this);
+    return status_ == 0;
+  }
+
+  /** As Device::read(). */
+  Result<Span<const std::byte>> await_resume() const {
+    if (status_ != 0 && status_ != LIBUSB_ERROR_TIMEOUT)
+      return Error(status_);
+
+    return Span<const std::byte>(block_.first(actual_));
+  }
+
+ private:
+  static void done(ufe_transfer *transfer) {
+    ReadAwaiter *self = static_cast<ReadAwaiter*>(transfer->user_data_);
+    self->status_ = transfer->status_;
+    self->actual_ = transfer->actual_;
+    self->awaiting_.resume();
+  }
+
+  libusb_device_handle *handle_;
+  ReadoutBuffer &buffer_;
+  unsigned int timeout_;
+  int status_;
+  int actual_;
+  Span<std::byte> block_;
+  ufe_transfer transfer_;
+  std::coroutine_handle<> awaiting_;
+};
+
+}  // namespace detail
+
+/** \brief A coroutine returning a T. It starts when it is awaited, or run by ufe::run(). */
+template <typename T = void>
+class Task {
+ public:
+  using promise_type = detail::Promise<T>;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  explicit Task(Handle h) noexcept : h_(h) {}
+
+  Task(Task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+
+  Task& operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (h_)
+        h_.destroy();
+
+      h_ = std::exchange(other.h_, nullptr);
+    }
+
+    return *this;
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() {
+    if (h_)
+      h_.destroy();
+  }
+
+  bool done() const noexcept { return !h_ || h_.done(); }
+
+  /** Runs the task until its first suspension. Only once, and not if it is awaited. */
+  void start() { h_.resume(); }
+
+  /** The value returned by the task, once done. */
+  template <typename U = T, typename = std::enable_if_t<!std::is_void_v<U>>>
+  U& result() { assert(h_.done()); return *h_.promise().value_; }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    h_.promise().awaiting_ = awaiting;
+    return h_;
+  }
+
+  T await_resume() {
+    if constexpr (!std::is_void_v<T>)
+      return std::move(*h_.promise().value_);
+  }
+
+ private:
+  Handle h_;
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object() noexcept {
+  return Task<T>(Task<T>::Handle::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() noexcept {
+  return Task<void>(Task<void>::Handle::from_promise(*this));
+}
+
+/** \brief A coroutine producing values asynchronously (co_yield), until it returns. */
+template <typename T>
+class AsyncGenerator {
+ public:
+  struct YieldAwaiter {
+    std::coroutine_handle<> consumer_;
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept { return consumer_; }
+    void await_resume() const noexcept {}
+  };
+
+  struct promise_type {
+    T *value_ = nullptr;
+    std::coroutine_handle<> consumer_;
+
+    AsyncGenerator get_return_object() noexcept {
+      return AsyncGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+
+    YieldAwaiter final_suspend() noexcept {
+      value_ = nullptr;
+      return YieldAwaiter{consumer_};
+    }
+
+    YieldAwaiter yield_value(T &value) noexcept {
+      value_ = std::addressof(value);
+      return YieldAwaiter{consumer_};
+    }
+
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+
+  using Handle = std::coroutine_handle<promise_type>;
+
+  explicit AsyncGenerator(Handle h) noexcept : h_(h) {}
+  AsyncGenerator(AsyncGenerator &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+  AsyncGenerator(const AsyncGenerator&) = delete;
+  AsyncGenerator& operator=(const AsyncGenerator&) = delete;
+
+  ~AsyncGenerator() {
+    if (h_)
+      h_.destroy();
+  }
+
+  /** Awaits the next value. The pointer is valid until the next call, nullptr at the end. */
+  auto next() noexcept {
+    struct NextAwaiter {
+      Handle h_;
+
+      bool await_ready() const noexcept { return h_.done(); }
+
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept {
+        h_.promise().consumer_ = consumer;
+        return h_;
+      }
+
+      T* await_resume() const noexcept { return (h_.done())? nullptr : h_.promise().value_; }
+    };
+
+    return NextAwaiter{h_};
+  }
+
+ private:
+  Handle h_;
+};
+
+/** \brief The asynchronous commands and readout of an open device (see libufe-async.h). The
+ *  Device must stay open while they run. Only one command at a time can be sent to a board.
+ */
+class AsyncDevice {
+ public:
+  explicit AsyncDevice(const Device &dev) noexcept : handle_(dev.handle()), board_id_(dev.board_id()) {}
+
+  libusb_device_handle* handle() const noexcept { return handle_; }
+  int board_id() const noexcept { return board_id_; }
+
+  /** Awaitable ufe_read_status(). */
+  auto read_status() const {
+    return detail::command<uint16_t>([h = handle_, id = board_id_]
+      (ufe_async_command *cmd, uint16_t *status, ufe_async_func func, void *self) {
+        return ufe_async_read_status(cmd, h, id, status, func, self);
+      });
+  }
+
+  /** Awaitable ufe_firmware_version(). */
+  auto firmware_version() const {
+    return detail::command<int>([h = handle_, id = board_id_]
+      (ufe_async_command *cmd, int *fv, ufe_async_func func, void *self) {
+        return ufe_async_firmware_version(cmd, h, id, fv, func, self);
+      });
+  }
+
+  /** Awaitable ufe_set_direct_param(). */
+  auto set_direct_param(uint16_t params) const {
+    return detail::command<void>([h = handle_, id = board_id_, params]
+      (ufe_async_command *cmd, int*, ufe_async_func func, void *self) {
+        return ufe_async_set_direct_param(cmd, h, id, params, func, self);
+      });
+  }
+
+  /** Awaitable ufe_data_readout(). */
+  auto data_readout(uint16_t params) const {
+    return detail::command<void>([h = handle_, id = board_id_, params]
+      (ufe_async_command *cmd, int*, ufe_async_func func, void *self) {
+        return ufe_async_data_readout(cmd, h, id, params, func, self);
+      });
+  }
+
+  /** Awaitable ufe_set_config(). The configuration is copied when the command starts. */
+  auto set_config(int device, const uint32_t *data) const {
+    return detail::command<void>([h = handle_, id = board_id_, device, data]
+      (ufe_async_command *cmd, int*, ufe_async_func func, void *self) {
+        return ufe_async_set_config(cmd, h, id, device, const_cast<uint32_t*>(data), func, self);
+      });
+  }
+
+  /** Awaitable Device::read(). */
+  detail::ReadAwaiter read(ReadoutBuffer &buffer, unsigned int timeout = 0) const noexcept {
+    return detail::ReadAwaiter(handle_, buffer, timeout);
+  }
+
+  /** \brief The readout blocks, read in turn into the buffer, until an error (the last value).
+   *  \param buffer: The pool of blocks, valid as long as the generator.
+   *  \param timeout: Timeout of the transfers (ms), or 0 for the readout timeout of the session.
+   */
+  AsyncGenerator<Result<Span<const std::byte>>> readout(ReadoutBuffer &buffer, unsigned int timeout = 0) const {
+    return readout_blocks(*this, &buffer, timeout);
+  }
+
+ private:
+  static AsyncGenerator<Result<Span<const std::byte>>> readout_blocks(AsyncDevice dev,
+                                                                      ReadoutBuffer *buffer,
+                                                                      unsigned int timeout) {
+    while (true) {
+      Result<Span<const std::byte>> block = co_await dev.read(*buffer, timeout);
+      bool ok = block.has_value();
+      co_yield block;
+      if (!ok)
+        co_return;
+    }
+  }
+
+  libusb_device_handle *handle_;
+  int board_id_;
+};
+
+/** \brief Runs tasks on the calling thread, which handles the events of the session (see
+ *  ufe_async_handle_events()) until all of them are complete.
+ *  \param tasks: The tasks (e.g. a std::vector<ufe::Task<T>>), not yet started.
+ *  \param poll_ms: Timeout of the event handling (ms).
+ */
+template <typename Tasks>
+void run_all(Tasks &tasks, int poll_ms = UFE_ASYNC_POLL_MS) {
+  for (auto &task : tasks)
+    task.start();
+
+  bool done = false;
+  while (!done) {
+    done = true;
+    for (auto &task : tasks)
+      done = done && task.done();
+
+    if (!done)
+      ufe_async_handle_events(poll_ms);
+  }
+}
+
+/** \brief Runs a task (see run_all()).
+ *  \returns The value returned by the task.
+ */
+template <typename T>
+T run(Task<T> task, int poll_ms = UFE_ASYNC_POLL_MS) {
+  Span<Task<T>> one(&task, 1);
+  run_all(one, poll_ms);
+  if constexpr (!std::is_void_v<T>)
+    return std::move(task.result());
+}
+
+}  // namespace ufe
+
+#endif
@@ -0,0 +1,447 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef UFE_LZ4
+  #include <lz4.h>
+#endif
+
+#ifdef UFE_ZSTD
+  #include <zstd.h>
+#endif
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-tools.h"
+#include "libufe-compress.h"
+
+/** States of a job of a compressor. */
+enum job_state {
+  JOB_FREE,
+  JOB_FILLED,
+  JOB_WORKING,
+  JOB_DONE
+};
+
+/** A block on its way through the compressor. */
+struct ufe_compress_job {
+  int state_;
+  uint8_t *data_;
+  size_t size_, capacity_;
+  uint8_t *frame_;
+  size_t frame_size_, frame_capacity_;
+};
+
+int ufe_codec_by_name(const char *name) {
+  if (strcmp(name, "none") == 0)
+    return UFE_CODEC_NONE;
+
+  if (strcmp(name, "delta") == 0)
+    return UFE_CODEC_DELTA;
+
+#ifdef UFE_LZ4
+  if (strcmp(name, "lz4") == 0)
+    return UFE_CODEC_LZ4;
+#endif
+
+#ifdef UFE_ZSTD
+  if (strcmp(name, "zstd") == 0)
+    return UFE_CODEC_ZSTD;
+#endif
+
+  return UFE_INVALID_ARG_ERROR;
+}
+
+size_t ufe_frame_bound(size_t size) {
+  // The built-in codec needs at most 5 bytes per word, LZ4 and zstd much less.
+  return sizeof(ufe_frame_header) + size + size/4 + 64;
+}
+
+bool ufe_frame_header_valid(const ufe_frame_header *header) {
+  return header->magic_ == UFE_FRAME_MAGIC && header->size_ <= UFE_FRAME_MAX_SIZE &&
+         header->payload_size_ <= ufe_frame_bound(header->size_) - sizeof(ufe_frame_header);
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (uint8_t) (v | 0x80);
+    v >>= 7;
+  }
+
+  p[n++] = (uint8_t) v;
+  return n;
+}
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+  int shift;
+  *v = 0;
+  for (shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t b = *(*p)++;
+    *v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+
+  return false;
+}
+
+static uint32_t load_word(const uint8_t *p) {
+  uint32_t w;
+  memcpy(&w, p, 4);
+  return w;
+}
+
+// Each token is the zigzag coded difference to the previous word, shifted left by one. If the low
+// bit is set, a repeat count follows: the difference applies to that many words in a row.
+static size_t delta_encode(const uint8_t *data, size_t size, uint8_t *out) {
+  size_t n_words = size/4, i = 0, n = 0;
+  uint32_t prev = 0;
+  while (i < n_words) {
+    uint32_t word = load_word(data + 4*i);
+    uint32_t d = word - prev;
+    size_t run = 1;
+    while (i + run < n_words && load_word(data + 4*(i + run)) - word == d*run)
+      ++run;
+
+    uint64_t zz = (d << 1) ^ (uint32_t) -(d >> 31);
+    if (run > 1) {
+      n += put_varint(out + n, (zz << 1) | 1);
+      n += put_varint(out + n, run);
+    } else {
+      n += put_varint(out + n, zz << 1);
+    }
+
+    prev = word + d*(run - 1);
+    i += run;
+  }
+
+  memcpy(out + n, data + 4*n_words, size%4);
+  return n + size%4;
+}
+
+static int delta_decode(const uint8_t *in, size_t in_size, uint8_t *data, size_t size) {
+  const uint8_t *p = in, *end = in + in_size;
+  size_t n_words = size/4, i = 0;
+  uint32_t prev = 0;
+  while (i < n_words) {
+    uint64_t token, run = 1;
+    if (!get_varint(&p, end, &token))
+      return UFE_INVALID_ARG_ERROR;
+
+    if ((token & 1) && (!get_varint(&p, end, &run) || run > n_words - i))
+      return UFE_INVALID_ARG_ERROR;
+
+    uint32_t zz = (uint32_t) (token >> 1);
+    uint32_t d = (zz >> 1) ^ -(zz & 1);
+    for (; run > 0; --run, ++i) {
+      prev += d;
+      memcpy(data + 4*i, &prev, 4);
+    }
+  }
+
+  if ((size_t) (end - p) != size%4)
+    return UFE_INVALID_ARG_ERROR;
+
+  memcpy(data + 4*n_words, p, size%4);
+  return 0;
+}
+
+int ufe_compress_frame(int codec, const uint8_t *data, size_t size, uint8_t *frame) {
+  if (size > UFE_FRAME_MAX_SIZE)
+    return UFE_INVALID_ARG_ERROR;
+
+  ufe_frame_header *header = (ufe_frame_header*) frame;
+  uint8_t *payload = frame + sizeof(ufe_frame_header);
+  size_t capacity = ufe_frame_bound(size) - sizeof(ufe_frame_header);
+  size_t payload_size = 0;
+
+  switch (codec) {
+    case UFE_CODEC_NONE:
+      break;
+
+    case UFE_CODEC_DELTA:
+      payload_size = delta_encode(data, size, payload);
+      break;
+
+#ifdef UFE_LZ4
+    case UFE_CODEC_LZ4:
+      payload_size = LZ4_compress_default((const char*) data, (char*) payload, (int) size, (int) capacity);
+      break;
+#endif
+
+#ifdef UFE_ZSTD
+    case UFE_CODEC_ZSTD:
+      payload_size = ZSTD_compress(payload, capacity, data, size, 1);
+      if (ZSTD_isError(payload_size))
+        payload_size = 0;
+
+      break;
+#endif
+
+    default:
+      return UFE_INVALID_ARG_ERROR;
+  }
+
+  (void) capacity;  // Not used without LZ4 and zstd.
+  if (payload_size == 0 || payload_size >= size) {
+    // Not worth it. Store the block.
+    codec = UFE_CODEC_NONE;
+    payload_size = size;
+    memcpy(payload, data, size);
+  }
+
+  header->magic_ = UFE_FRAME_MAGIC;
+  header->codec_ = codec;
+  header->size_ = size;
+  header->payload_size_ = payload_size;
+  return sizeof(ufe_frame_header) + payload_size;
+}
+
+int ufe_decompress_frame(const uint8_t *frame, size_t frame_size, uint8_t *data, size_t size) {
+  const ufe_frame_header *header = (const ufe_frame_header*) frame;
+  if (frame_size < sizeof(ufe_frame_header) || !ufe_frame_header_valid(header) ||
+      header->payload_size_ > frame_size - sizeof(ufe_frame_header))
+    return UFE_INVALID_ARG_ERROR;
+
+  if (header->size_ > size)
+    return LIBUSB_ERROR_OVERFLOW;
+
+  const uint8_t *payload = frame + sizeof(ufe_frame_header);
+  int status = 0;
+  switch (header->codec_) {
+    case UFE_CODEC_NONE:
+      if (header->payload_size_ != header->size_)
+        return UFE_INVALID_ARG_ERROR;
+
+      memcpy(data, payload, header->size_);
+      break;
+
+    case UFE_CODEC_DELTA:
+      status = delta_decode(payload, header->payload_size_, data, header->size_);
+      break;
+
+#ifdef UFE_LZ4
+    case UFE_CODEC_LZ4:
+      if (LZ4_decompress_safe((const char*) payload, (char*) data,
+                              header->payload_size_, header->size_) != (int) header->size_)
+        status = UFE_INVALID_ARG_ERROR;
+
+      break;
+#endif
+
+#ifdef UFE_ZSTD
+    case UFE_CODEC_ZSTD:
+      if (ZSTD_decompress(data, header->size_, payload, header->payload_size_) != header->size_)
+        status = UFE_INVALID_ARG_ERROR;
+
+      break;
+#endif
+
+    default:
+      ufe_error_print("frame of unknown codec %u.", header->codec_);
+      return UFE_INVALID_ARG_ERROR;
+  }
+
+  return (status != 0)? status : (int) header->size_;
+}
+
+static bool grow(uint8_t **buffer, size_t *capacity, size_t size) {
+  if (size <= *capacity)
+    return true;
+
+  uint8_t *b = (uint8_t*) realloc(*buffer, size);
+  if (!b)
+    return false;
+
+  *buffer = b;
+  *capacity = size;
+  return true;
+}
+
+static void* worker_job(void *arg) {
+  ufe_compressor *c = (ufe_compressor*) arg;
+  pthread_mutex_lock(&c->mutex_);
+  while (1) {
+    // Take the blocks in order, so that the writer is not kept waiting.
+    struct ufe_compress_job *job = &c->jobs_[c->next_job_ % c->n_jobs_];
+    if (c->next_job_ == c->next_in_ || job->state_ != JOB_FILLED) {
+      if (c->done_ && c->next_job_ == c->next_in_)
+        break;
+
+      pthread_cond_wait(&c->cond_, &c->mutex_);
+      continue;
+    }
+
+    c->next_job_++;
+    job->state_ = JOB_WORKING;
+    pthread_mutex_unlock(&c->mutex_);
+
+    int size = UFE_INTERNAL_ERROR;
+    if (grow(&job->frame_, &job->frame_capacity_, ufe_frame_bound(job->size_)))
+      size = ufe_compress_frame(c->codec_, job->data_, job->size_, job->frame_);
+
+    pthread_mutex_lock(&c->mutex_);
+    if (size < 0) {
+      if (c->status_ == 0)
+        c->status_ = size;
+
+      size = 0;
+    }
+
+    job->frame_size_ = size;
+    job->state_ = JOB_DONE;
+    pthread_cond_broadcast(&c->cond_);
+  }
+
+  pthread_mutex_unlock(&c->mutex_);
+  return NULL;
+}
+
+static void* writer_job(void *arg) {
+  ufe_compressor *c = (ufe_compressor*) arg;
+  pthread_mutex_lock(&c->mutex_);
+  while (1) {
+    struct ufe_compress_job *job = &c->jobs_[c->next_out_ % c->n_jobs_];
+    if (c->next_out_ == c->next_in_ || job->state_ != JOB_DONE) {
+      if (c->done_ && c->next_out_ == c->next_in_)
+        break;
+
+      pthread_cond_wait(&c->cond_, &c->mutex_);
+      continue;
+    }
+
+    // After a failure, the frames are dropped, but the producer is never blocked.
+    int status = c->status_;
+    pthread_mutex_unlock(&c->mutex_);
+    if (status == 0)
+      status = ufe_write_all(c->fd_, job->frame_, job->frame_size_);
+
+    pthread_mutex_lock(&c->mutex_);
+    if (status != 0 && c->status_ == 0) {
+      ufe_error_print("cannot write the compressed output (%s).", strerror(errno));
+      c->status_ = status;
+    }
+
+    c->bytes_in_ += job->size_;
+    c->bytes_out_ += job->frame_size_;
+    job->state_ = JOB_FREE;
+    c->next_out_++;
+    pthread_cond_broadcast(&c->cond_);
+  }
+
+  pthread_mutex_unlock(&c->mutex_);
+  return NULL;
+}
+
+int ufe_compressor_open(ufe_compressor **comp, int fd, int codec, int n_workers) {
+  if (n_workers < 1 || (codec != UFE_CODEC_NONE && codec != UFE_CODEC_DELTA &&
+                        codec != UFE_CODEC_LZ4 && codec != UFE_CODEC_ZSTD))
+    return UFE_INVALID_ARG_ERROR;
+
+  ufe_compressor *c = (ufe_compressor*) calloc(1, sizeof(ufe_compressor));
+  c->fd_ = fd;
+  c->codec_ = codec;
+  c->n_jobs_ = 2*n_workers;
+  c->jobs_ = (struct ufe_compress_job*) calloc(c->n_jobs_, sizeof(struct ufe_compress_job));
+  c->workers_ = (pthread_t*) calloc(n_workers, sizeof(pthread_t));
+  pthread_mutex_init(&c->mutex_, NULL);
+  pthread_cond_init(&c->cond_, NULL);
+
+  if (pthread_create(&c->writer_, NULL, &writer_job, c)) {
+    ufe_error_print("cannot create compressor thread.");
+    ufe_compressor_close(c);
+    return UFE_INTERNAL_ERROR;
+  }
+
+  for (; c->n_workers_ < n_workers; c->n_workers_++)
+    if (pthread_create(&c->workers_[c->n_workers_], NULL, &worker_job, c)) {
+      ufe_error_print("cannot create compressor thread.");
+      ufe_compressor_close(c);
+      return UFE_INTERNAL_ERROR;
+    }
+
+  *comp = c;
+  return 0;
+}
+
+int ufe_compressor_write(ufe_compressor *c, const uint8_t *data, size_t size) {
+  pthread_mutex_lock(&c->mutex_);
+  struct ufe_compress_job *job = &c->jobs_[c->next_in_ % c->n_jobs_];
+  while (job->state_ != JOB_FREE)
+    pthread_cond_wait(&c->cond_, &c->mutex_);
+
+  int status = c->status_;
+  pthread_mutex_unlock(&c->mutex_);
+  if (status != 0)
+    return status;
+
+  if (size > UFE_FRAME_MAX_SIZE)
+    return UFE_INVALID_ARG_ERROR;
+
+  // The job is owned by the caller until it is marked as filled.
+  if (!grow(&job->data_, &job->capacity_, size))
+    return LIBUSB_ERROR_NO_MEM;
+
+  memcpy(job->data_, data, size);
+  job->size_ = size;
+
+  pthread_mutex_lock(&c->mutex_);
+  job->state_ = JOB_FILLED;
+  c->next_in_++;
+  pthread_cond_broadcast(&c->cond_);
+  pthread_mutex_unlock(&c->mutex_);
+  return 0;
+}
+
+int ufe_compressor_close(ufe_compressor *c) {
+  int i;
+  pthread_mutex_lock(&c->mutex_);
+  c->done_ = true;
+  pthread_cond_broadcast(&c->cond_);
+  pthread_mutex_unlock(&c->mutex_);
+
+  for (i = 0; i < c->n_workers_; ++i)
+    pthread_join(c->workers_[i], NULL);
+
+  if (c->writer_)
+    pthread_join(c->writer_, NULL);
+
+  int status = c->status_;
+  if (c->bytes_in_ > 0)
+    ufe_info_print("compressed %.1f MB to %.1f MB ( ratio %.2f ).", c->bytes_in_/1048576.,
+                   c->bytes_out_/1048576., (double) c->bytes_in_/c->bytes_out_);
+
+  for (i = 0; i < c->n_jobs_; ++i) {
+    free(c->jobs_[i].data_);
+    free(c->jobs_[i].frame_);
+  }
+
+  pthread_mutex_destroy(&c->mutex_);
+  pthread_cond_destroy(&c->cond_);
+  free(c->workers_);
+  free(c->jobs_);
+  free(c);
+  return status;
+}
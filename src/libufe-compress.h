@@ -0,0 +1,202 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file    libufe-compress.h
+ *  \brief   File containing the compression of the raw data output. Every block is compressed into
+ *  an independent frame (ufe_frame_header + payload), which can be decoded without the frames
+ *  before it. The ufe_compressor compresses the blocks on a pool of worker threads and writes the
+ *  frames in the order of the blocks. The built-in codec codes the differences of consecutive
+ *  32-bit words as variable length integers, with runs of equal differences collapsed. LZ4 and
+ *  zstd are available if found by cmake (UFE_LZ4 / UFE_ZSTD defined).
+ */
+
+#ifndef LIBUFE_COMPRESS_H
+#define LIBUFE_COMPRESS_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Magic word ("UFEZ") of a frame. */
+#define UFE_FRAME_MAGIC 0x5546455A
+
+/** Maximum size (in bytes) of a block in a frame. A frame header with a larger size is corrupted. */
+#define UFE_FRAME_MAX_SIZE (256*1024*1024)
+
+/** Default number of worker threads of a compressor. */
+#define UFE_COMPRESS_THREADS 4
+
+/** List of the codecs. */
+enum ufe_codec {
+  /** The block is stored as it is. Used also when a codec does not make the block smaller. */
+  UFE_CODEC_NONE  = 0,
+
+  /** Built-in: word differences + run length. */
+  UFE_CODEC_DELTA = 1,
+
+  /** LZ4 (fast). */
+  UFE_CODEC_LZ4   = 2,
+
+  /** zstd, level 1. */
+  UFE_CODEC_ZSTD  = 3
+};
+
+/** \brief Header in front of each compressed frame (host byte order). */
+struct ufe_frame_header {
+  /** Always UFE_FRAME_MAGIC. */
+  uint32_t magic_;
+
+  /** ufe_codec of the payload. */
+  uint32_t codec_;
+
+  /** Size (in bytes) of the decoded block. */
+  uint32_t size_;
+
+  /** Size (in bytes) of the payload following the header. */
+  uint32_t payload_size_;
+};
+
+/** ufe_frame_header type */
+typedef struct ufe_frame_header ufe_frame_header;
+
+
+/** \brief Finds a codec by name ("none", "delta", "lz4", "zstd").
+ *  \param name: The name.
+ *  \returns The ufe_codec, or UFE_INVALID_ARG_ERROR if unknown or not available in this build.
+ */
+int ufe_codec_by_name(const char *name);
+
+
+/** \brief Gets the maximum size of the frame of a block.
+ *  \param size: Size of the block.
+ *  \returns The maximum size of the frame, header included.
+ */
+size_t ufe_frame_bound(size_t size);
+
+
+/** \brief Checks the header of a frame before allocating memory for it: the magic word, the size
+ *  of the block (at most UFE_FRAME_MAX_SIZE) and the size of the payload (at most
+ *  ufe_frame_bound() of the block).
+ *  \param header: The header.
+ *  \returns True if the header is valid.
+ */
+bool ufe_frame_header_valid(const ufe_frame_header *header);
+
+
+/** \brief Compresses a block into a frame.
+ *  \param codec: The ufe_codec.
+ *  \param data: Input location for the block.
+ *  \param size: Size of the block, at most UFE_FRAME_MAX_SIZE.
+ *  \param frame: Output location for the frame, at least ufe_frame_bound(size) bytes.
+ *  \returns The size of the frame, or a UFE_ERROR code on failure.
+ */
+int ufe_compress_frame(int codec, const uint8_t *data, size_t size, uint8_t *frame);
+
+
+/** \brief Decodes a frame.
+ *  \param frame: Input location for the frame.
+ *  \param frame_size: Number of bytes available at frame.
+ *  \param data: Output location for the block.
+ *  \param size: Size of the output location.
+ *  \returns The size of the block, or a UFE_ERROR code if the frame is corrupted (see
+ *  ufe_frame_header_valid()) or incomplete, or the output location is too small.
+ */
+int ufe_decompress_frame(const uint8_t *frame, size_t frame_size, uint8_t *data, size_t size);
+
+
+struct ufe_compress_job;
+
+/** \brief Structure representing a compression stage in front of an output file. */
+struct ufe_compressor {
+  /** Output file descriptor. */
+  int fd_;
+
+  /** The ufe_codec. */
+  int codec_;
+
+  /** The worker threads. */
+  pthread_t *workers_;
+  int n_workers_;
+
+  /** The thread writing the frames. */
+  pthread_t writer_;
+
+  /** Ring of jobs, twice the number of workers. */
+  struct ufe_compress_job *jobs_;
+  int n_jobs_;
+
+  /** Sequence numbers of the next block to be queued, compressed and written. */
+  uint64_t next_in_, next_job_, next_out_;
+
+  /** Set by ufe_compressor_close(). */
+  bool done_;
+
+  /** First write error, or 0. */
+  int status_;
+
+  /** Total size of the blocks and of the frames written. */
+  uint64_t bytes_in_, bytes_out_;
+
+  /** Protects the jobs and the counters. */
+  pthread_mutex_t mutex_;
+
+  /** Signals any change of the state of a job. */
+  pthread_cond_t cond_;
+};
+
+/** ufe_compressor type */
+typedef struct ufe_compressor ufe_compressor;
+
+
+/** \brief Starts a compressor.
+ *  \param comp: Output location for the compressor.
+ *  \param fd: Output file descriptor.
+ *  \param codec: The ufe_codec.
+ *  \param n_workers: Number of worker threads.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_compressor_open(ufe_compressor **comp, int fd, int codec, int n_workers);
+
+
+/** \brief Queues a block. The data is copied, the call waits only if all jobs are in use.
+ *  \param comp: The compressor.
+ *  \param data: Input location for the block.
+ *  \param size: Size of the block, at most UFE_FRAME_MAX_SIZE.
+ *  \returns 0 on success, or a UFE_ERROR code if the block is too large or the output has failed.
+ */
+int ufe_compressor_write(ufe_compressor *comp, const uint8_t *data, size_t size);
+
+
+/** \brief Writes the queued blocks and stops the threads. Does not close the file.
+ *  \param comp: The compressor.
+ *  \returns 0 on success, or a UFE_ERROR code if the output has failed.
+ */
+int ufe_compressor_close(ufe_compressor *comp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
 
 #ifdef ZMQ_ENABLE
   #include <zmq.h>
@@ -31,10 +38,12 @@
 
 #include "libufe.h"
 #include "libufe-core.h"
+#include "libufe-trace.h"
+#include "libufe-probes.h"
 
 bool is_ufe(libusb_device *dev, int dummy_arg) {
   struct libusb_device_descriptor desc;
-  int status = libusb_get_device_descriptor(dev, &desc);
+  int status = ufe_usb()->get_device_descriptor(dev, &desc);
   if (status < 0) {
     ufe_error_print("failed to get device descriptor; status: %i", status);
     return false;
@@ -48,7 +57,7 @@ bool is_ufe(libusb_device *dev, int dummy_arg) {
 
 bool is_bm_feb(libusb_device *dev, int dummy_arg) {
   struct libusb_device_descriptor desc;
-  int status = libusb_get_device_descriptor(dev, &desc);
+  int status = ufe_usb()->get_device_descriptor(dev, &desc);
   if (status < 0) {
     ufe_error_print("failed to get device descriptor; status: %i", status);
     return false;
@@ -63,7 +72,7 @@ bool is_bm_feb(libusb_device *dev, int dummy_arg) {
 bool is_bm_feb_with_id(libusb_device *dev, int board_id) {
   struct libusb_device_descriptor desc;
   libusb_device_handle *dev_handle;
-  int status = libusb_get_device_descriptor(dev, &desc);
+  int status = ufe_usb()->get_device_descriptor(dev, &desc);
   if (status < 0) {
     ufe_error_print("failed to get device descriptor; status: %i", status);
     return false;
@@ -74,37 +83,302 @@ bool is_bm_feb_with_id(libusb_device *dev, int board_id) {
     return false;
   }
 
-  status = libusb_open(dev, &dev_handle);
+  status = ufe_usb()->open(dev, &dev_handle);
   if(dev_handle == NULL) {
     ufe_error_print("cannot open device.");
     return false;
   }
 
   if (ufe_ping(dev_handle, board_id)) {
-    libusb_close(dev_handle);
+    ufe_usb()->close(dev_handle);
     return true;
   }
 
-  libusb_close(dev_handle);
+  ufe_usb()->close(dev_handle);
   return false;
 }
 
+int ufe_check_board(libusb_device_handle *dev_handle, int board_id) {
+  if (!ufe_ping(dev_handle, board_id))
+    return UFE_NOT_FOUND_ERROR;
+
+  int fv = 0;
+  int status = ufe_firmware_version(dev_handle, board_id, &fv);
+  if (status != 0)
+    return status;
+
+  if (fv != BMFEB_FV) {
+    ufe_error_print("Unsupported firmware version ( 0x%x ) of board %i.", fv, board_id);
+    return UFE_FIRMWARE_ERROR;
+  }
+
+  return 0;
+}
+
+int ufe_probe_board_id(libusb_device_handle *dev_handle, void *board_id) {
+  int id = *(int*) board_id;
+  return (ufe_check_board(dev_handle, id) == 0)? id : -1;
+}
+
 
 crc_context crc16_context_handler;
 crc_context crc21_context_handler;
 extern ufe_context *ufe_context_handler;
 
-int ufe_send_command_req( libusb_device_handle *ufe,
-                      int board_id,
-                      int command_id,
-                      int sub_cmd_id,
-                      int argc,
-                      uint16_t *argv) {
+/** Latencies of the phases of one command of one board. */
+struct cmd_timing {
+  ufe_histo phases_[UFE_N_PHASES];
+};
+
+#define TIMING_N_BOARDS 128
+#define TIMING_N_CMDS   32
+
+/** Allocated on first use. */
+static struct cmd_timing *cmd_timings[TIMING_N_BOARDS][TIMING_N_CMDS];
+
+/** A command sent but not yet answered. */
+struct pending_cmd {
+  libusb_device_handle *handle_;
+  int board_id_;
+  int command_id_;
+  uint64_t start_ns_;
+};
+
+/** The commands in progress in this thread. A command can be sent to several boards before
+ *  collecting the answers (see readout_command_all()), so they are identified by the device. */
+static __thread struct pending_cmd pending_cmds[TIMING_N_BOARDS];
+static __thread int n_pending_cmds = 0;
+
+static struct pending_cmd* find_pending_cmd(libusb_device_handle *ufe) {
+  int i;
+  for (i = 0; i < n_pending_cmds; ++i)
+    if (pending_cmds[i].handle_ == ufe)
+      return &pending_cmds[i];
+
+  return NULL;
+}
 
-  // Allocate memory for the command according to the number of arguments.
-  int size = (argc > 1)? (argc+2)*4 : 4;
-  uint32_t *cmd = (uint32_t*) malloc(size);
+static void set_pending_cmd(libusb_device_handle *ufe, int board_id, int command_id, uint64_t start_ns) {
+  struct pending_cmd *c = find_pending_cmd(ufe);
+  if (c == NULL) {
+    if (n_pending_cmds == TIMING_N_BOARDS)
+      return;
+
+    c = &pending_cmds[n_pending_cmds++];
+  }
+
+  c->handle_     = ufe;
+  c->board_id_   = board_id;
+  c->command_id_ = command_id;
+  c->start_ns_   = start_ns;
+}
+
+static void clear_pending_cmd(struct pending_cmd *c) {
+  *c = pending_cmds[--n_pending_cmds];
+}
+
+static struct cmd_timing* get_cmd_timing(int board_id, int command_id, bool create) {
+  if (board_id < 0 || board_id >= TIMING_N_BOARDS || command_id < 0 || command_id >= TIMING_N_CMDS)
+    return NULL;
+
+  struct cmd_timing **slot = &cmd_timings[board_id][command_id];
+  struct cmd_timing *t = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (t == NULL && create) {
+    struct cmd_timing *x = (struct cmd_timing*) calloc(1, sizeof(struct cmd_timing));
+    if (__atomic_compare_exchange_n(slot, &t, x, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      t = x;
+    else
+      free(x);
+  }
+
+  return t;
+}
+
+uint64_t ufe_cmd_timing_start() {
+  if (ufe_trace_enabled())
+    return ufe_trace_begin();
+
+  if (!ufe_context_handler || !ufe_context_handler->cmd_timing_)
+    return 0;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static void record_phase(struct pending_cmd *c, int phase, uint64_t start_ns) {
+  const char *phase_names[UFE_N_PHASES] = {"send", "wrapup", "answer", NULL};
+  ufe_trace_end("cmd",
+                (phase == UFE_PHASE_TOTAL)? ufe_get_command_name(c->command_id_) : phase_names[phase],
+                start_ns,
+                "board", c->board_id_,
+                "cmd", c->command_id_);
+
+  if (!ufe_context_handler || !ufe_context_handler->cmd_timing_)
+    return;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = ts.tv_sec*1000000000ull + ts.tv_nsec;
+
+  struct cmd_timing *t = get_cmd_timing(c->board_id_, c->command_id_, true);
+  if (t)
+    ufe_histo_add(&t->phases_[phase], now - start_ns);
+}
+
+void ufe_cmd_timing_record(libusb_device_handle *ufe, int phase, uint64_t start_ns) {
+  if (start_ns == 0)
+    return;
+
+  struct pending_cmd *c = find_pending_cmd(ufe);
+  if (c == NULL)
+    return;
 
+  record_phase(c, phase, start_ns);
+
+  // The answer closes the command.
+  if (phase == UFE_PHASE_ANSWER) {
+    record_phase(c, UFE_PHASE_TOTAL, c->start_ns_);
+    clear_pending_cmd(c);
+  }
+}
+
+int ufe_get_cmd_timing(int board_id, int command_id, int phase, ufe_histo *histo) {
+  if (phase < 0 || phase >= UFE_N_PHASES)
+    return UFE_INVALID_ARG_ERROR;
+
+  struct cmd_timing *t = get_cmd_timing(board_id, command_id, false);
+  if (t == NULL)
+    return UFE_NOT_FOUND_ERROR;
+
+  ufe_histo_reset(histo);
+  ufe_histo_merge(histo, &t->phases_[phase]);
+  return 0;
+}
+
+void ufe_reset_cmd_timing() {
+  int b, c;
+  for (b = 0; b < TIMING_N_BOARDS; ++b)
+    for (c = 0; c < TIMING_N_CMDS; ++c)
+      if (cmd_timings[b][c])
+        memset(cmd_timings[b][c], 0, sizeof(struct cmd_timing));
+}
+
+void ufe_free_cmd_timing() {
+  int b, c;
+  for (b = 0; b < TIMING_N_BOARDS; ++b)
+    for (c = 0; c < TIMING_N_CMDS; ++c) {
+      free(cmd_timings[b][c]);
+      cmd_timings[b][c] = NULL;
+    }
+}
+
+void ufe_dump_cmd_timing(FILE *file) {
+  const char *phase_names[UFE_N_PHASES] = {"send", "wrapup", "answer", "total"};
+  int b, c, p;
+  for (b = 0; b < TIMING_N_BOARDS; ++b)
+    for (c = 0; c < TIMING_N_CMDS; ++c) {
+      struct cmd_timing *t = cmd_timings[b][c];
+      if (t == NULL)
+        continue;
+
+      for (p = 0; p < UFE_N_PHASES; ++p) {
+        if (t->phases_[p].n_ == 0)
+          continue;
+
+        fprintf(file, "board %3i  %-18s %-7s [us]  ", b, ufe_get_command_name(c), phase_names[p]);
+        ufe_histo_dump(&t->phases_[p], 1e3, file);
+        fprintf(file, "\n");
+      }
+    }
+}
+
+static const ufe_transport* base_transport() {
+  if (ufe_context_handler && ufe_context_handler->transport_)
+    return ufe_context_handler->transport_;
+
+  return ufe_libusb_transport();
+}
+
+static int traced_bulk_transfer(libusb_device_handle *dev_handle,
+                                unsigned char endpoint,
+                                unsigned char *data,
+                                int length,
+                                int *actual_length,
+                                unsigned int timeout) {
+  uint64_t start_ns = ufe_trace_begin();
+  int status = base_transport()->bulk_transfer(dev_handle, endpoint, data, length, actual_length, timeout);
+  ufe_trace_end("usb", (endpoint & LIBUSB_ENDPOINT_IN)? "bulk_in" : "bulk_out", start_ns,
+                "ep", endpoint,
+                (status == 0)? "bytes" : "status", (status == 0)? *actual_length : status);
+  return status;
+}
+
+static int traced_control_transfer(libusb_device_handle *dev_handle,
+                                   uint8_t request_type,
+                                   uint8_t request,
+                                   uint16_t value,
+                                   uint16_t index,
+                                   unsigned char *data,
+                                   uint16_t length,
+                                   unsigned int timeout) {
+  uint64_t start_ns = ufe_trace_begin();
+  int status = base_transport()->control_transfer(dev_handle, request_type, request, value, index,
+                                                  data, length, timeout);
+  ufe_trace_end("usb", "control", start_ns, "request", request, "status", status);
+  return status;
+}
+
+const ufe_transport* ufe_usb() {
+  if (!ufe_trace_enabled())
+    return base_transport();
+
+  // Same transport, with the transfers recorded in the trace.
+  static __thread ufe_transport traced;
+  traced = *base_transport();
+  traced.bulk_transfer = &traced_bulk_transfer;
+  traced.control_transfer = &traced_control_transfer;
+  return &traced;
+}
+
+int ufe_command_size(int argc) {
+  return UFE_FRAME_SIZE(argc);
+}
+
+const ufe_command_desc ufe_command_descs[UFE_N_COMMAND_ROWS] = {
+#define UFE_CMD_DESC(name, id, argc, answer_argc, sub_cmd, wrapup_us, answer_us, done_us) \
+  [name##_CMD_ROW] = {id, #name, argc, answer_argc, sub_cmd, wrapup_us, answer_us, done_us, \
+                      UFE_FRAME_SIZE(argc), UFE_FRAME_SIZE(answer_argc)},
+  UFE_COMMANDS(UFE_CMD_DESC)
+#undef UFE_CMD_DESC
+};
+
+// The frames of all commands fit in UFE_MAX_FRAME_SIZE.
+#define UFE_CMD_CHECK(name, id, argc, answer_argc, sub_cmd, wrapup_us, answer_us, done_us) \
+  _Static_assert(UFE_FRAME_SIZE(argc) <= UFE_MAX_FRAME_SIZE &&                            \
+                 UFE_FRAME_SIZE(answer_argc) <= UFE_MAX_FRAME_SIZE, #name " frame too large");
+UFE_COMMANDS(UFE_CMD_CHECK)
+#undef UFE_CMD_CHECK
+
+const ufe_command_desc* ufe_get_command_desc(int command_id) {
+  // The table is short, a search is as fast as an index.
+  int i;
+  for (i = 0; i < UFE_N_COMMAND_ROWS; ++i) {
+    const ufe_command_desc *desc = &ufe_command_descs[i];
+    if (desc->command_id_ == command_id && !(desc->sub_cmd_ & UFE_CMD_ALIAS))
+      return desc;
+  }
+
+
+  return NULL;
+}
+
+int ufe_encode_command( uint32_t *cmd,
+                        int board_id,
+                        int command_id,
+                        int sub_cmd_id,
+                        int argc,
+                        uint16_t *argv) {
   // Set the Header of the command.
   *cmd  = (CMD_HEADER_ID << UFE_DW_ID_SHIFT);;
   *cmd |= (board_id << UFE_BOARD_ID_SHIFT) & UFE_BOARD_ID_MASK;
@@ -150,44 +424,121 @@ int ufe_send_command_req( libusb_device_handle *ufe,
 //     printf("trailer: 0x%4x \n", cmd[xArg+1]);
   }
 
+  return ufe_command_size(argc);
+}
+
+int ufe_send_encoded_command( libusb_device_handle *ufe,
+                              int board_id,
+                              int command_id,
+                              uint32_t *cmd,
+                              int size) {
+  uint64_t start_ns = ufe_cmd_timing_start();
+  if (start_ns)
+    set_pending_cmd(ufe, board_id, command_id, start_ns);
+
   // Send the command.
   int status = ufe_user_set_sync(ufe, 2, size, (uint8_t*) cmd);
   if (status < 0) {
     const char* cmd_name = ufe_get_command_name(command_id);
     ufe_error_print("error during command %s ( board %i )", cmd_name, board_id);
     return status;
-    }
+  }
 
-  free(cmd);
+  ufe_cmd_timing_record(ufe, UFE_PHASE_SEND, start_ns);
   return 0;
 }
 
-int ufe_get_command_answer( libusb_device_handle *ufe,
-                        int board_id,
-                        int command_id,
-                        int sub_cmd_id,
-                        int argc,
-                        uint16_t **argv) {
+int ufe_send_command_req( libusb_device_handle *ufe,
+                      int board_id,
+                      int command_id,
+                      int sub_cmd_id,
+                      int argc,
+                      uint16_t *argv) {
 
-  // Allocate memory for the answer according to the number of arguments.
-  int size = (argc > 1)? ((argc+2)*4) : 4;
-  uint32_t *answer = (uint32_t*) malloc(size);
+  UFE_PROBE4(send_command_entry, board_id, command_id, sub_cmd_id, argc);
 
-  // Get the command answer.
-  int status = ufe_user_get_sync(ufe, 2, size, (uint8_t*) answer);
-  if (status < 0) {
-    const char* cmd_name = ufe_get_command_name(command_id);
-    ufe_error_print("error during command %s ( board %i )", cmd_name, board_id);
-    free(answer);
-    return status;
+  // Allocate memory for the command according to the number of arguments.
+  uint32_t *cmd = (uint32_t*) malloc(ufe_command_size(argc));
+  int size = ufe_encode_command(cmd, board_id, command_id, sub_cmd_id, argc, argv);
+  int status = ufe_send_encoded_command(ufe, board_id, command_id, cmd, size);
+  free(cmd);
+
+  UFE_PROBE3(send_command_return, board_id, command_id, status);
+  return status;
+}
+
+/** The upper half of the argument word i of an answer: the argument Id and the frame index. */
+#define ARG_TAG(i) (((uint32_t) CMD_ARG_ID << UFE_DW_ID_SHIFT) | ((uint32_t) (i) << UEF_FRAME_INDEX_SHIFT))
+
+// Checks the Id and the frame index of the argument words of an answer and copies their values
+// to argv. Blocks of 16 (AVX2) or 8 (SSE2) words are checked with vector compares, and the
+// values are packed in the same pass. Returns the index of the first inconsistent word or -1.
+static int check_arguments(const uint32_t *words, int argc, uint16_t *argv) {
+  int i = 0;
+#if defined(__AVX2__)
+  const __m256i tag_mask = _mm256_set1_epi32((int) (UFE_DW_ID_MASK | UEF_FRAME_INDEX_MASK));
+  const __m256i tag_step = _mm256_set1_epi32(8 << UEF_FRAME_INDEX_SHIFT);
+  __m256i tag = _mm256_setr_epi32(ARG_TAG(0), ARG_TAG(1), ARG_TAG(2), ARG_TAG(3),
+                                  ARG_TAG(4), ARG_TAG(5), ARG_TAG(6), ARG_TAG(7));
+  for (; i + 16 <= argc; i += 16) {
+    __m256i lo = _mm256_loadu_si256((const __m256i*) &words[i]);
+    __m256i hi = _mm256_loadu_si256((const __m256i*) &words[i + 8]);
+    __m256i ok_lo = _mm256_cmpeq_epi32(_mm256_and_si256(lo, tag_mask), tag);
+    tag = _mm256_add_epi32(tag, tag_step);
+    __m256i ok_hi = _mm256_cmpeq_epi32(_mm256_and_si256(hi, tag_mask), tag);
+    tag = _mm256_add_epi32(tag, tag_step);
+    if (_mm256_movemask_epi8(_mm256_and_si256(ok_lo, ok_hi)) != -1)
+      break;
+
+    // Sign extend the values, so that the saturating pack keeps them unchanged.
+    lo = _mm256_srai_epi32(_mm256_slli_epi32(lo, 16), 16);
+    hi = _mm256_srai_epi32(_mm256_slli_epi32(hi, 16), 16);
+    __m256i values = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+    _mm256_storeu_si256((__m256i*) &argv[i], values);
+  }
+#elif defined(__SSE2__)
+  const __m128i tag_mask = _mm_set1_epi32((int) (UFE_DW_ID_MASK | UEF_FRAME_INDEX_MASK));
+  const __m128i tag_step = _mm_set1_epi32(4 << UEF_FRAME_INDEX_SHIFT);
+  __m128i tag = _mm_setr_epi32(ARG_TAG(0), ARG_TAG(1), ARG_TAG(2), ARG_TAG(3));
+  for (; i + 8 <= argc; i += 8) {
+    __m128i lo = _mm_loadu_si128((const __m128i*) &words[i]);
+    __m128i hi = _mm_loadu_si128((const __m128i*) &words[i + 4]);
+    __m128i ok_lo = _mm_cmpeq_epi32(_mm_and_si128(lo, tag_mask), tag);
+    tag = _mm_add_epi32(tag, tag_step);
+    __m128i ok_hi = _mm_cmpeq_epi32(_mm_and_si128(hi, tag_mask), tag);
+    tag = _mm_add_epi32(tag, tag_step);
+    if (_mm_movemask_epi8(_mm_and_si128(ok_lo, ok_hi)) != 0xFFFF)
+      break;
+
+    // Sign extend the values, so that the saturating pack keeps them unchanged.
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    _mm_storeu_si128((__m128i*) &argv[i], _mm_packs_epi32(lo, hi));
   }
+#endif
+
+  // The remaining words, or the block with the inconsistent one.
+  for (; i < argc; ++i) {
+    if ((words[i] & (UFE_DW_ID_MASK | UEF_FRAME_INDEX_MASK)) != ARG_TAG(i))
+      return i;
+
+    argv[i] = words[i] & UFE_ARGUMENT_MASK;
+  }
+
+  return -1;
+}
 
+int ufe_decode_command_answer( uint32_t *answer,
+                               int board_id,
+                               int command_id,
+                               int sub_cmd_id,
+                               int argc,
+                               uint16_t **argv) {
   // Check for firmware errors.
   if ( (*answer & UFE_CMD_ID_MASK) >>  UFE_CMD_ID_SHIFT == ERROR_CMD_ID ) {
     const char* cmd_name = ufe_get_command_name(command_id);
     ufe_error_print("Firmware Error ( 0x%4x ) after command %s.", *answer, cmd_name);
     **argv = *answer & UFE_ARGUMENT_MASK;
-    free(answer);
     return UFE_INTERNAL_ERROR;
   }
 
@@ -199,7 +550,6 @@ int ufe_get_command_answer( libusb_device_handle *ufe,
     const char* cmd_name = ufe_get_command_name(command_id);
     ufe_error_print("inconsistent answer header ( 0x%4x ) after command %s.",
              *answer, cmd_name);
-    free(answer);
     return UFE_INVALID_CMD_ANSWER_ERROR;
   }
 
@@ -214,8 +564,7 @@ int ufe_get_command_answer( libusb_device_handle *ufe,
       const char* cmd_name = ufe_get_command_name(command_id);
       ufe_error_print("inconsistent answer header ( 0x%4x ) after command %s.",
                *answer, cmd_name);
-      free(answer);
-      return UFE_INVALID_CMD_ANSWER_ERROR;
+        return UFE_INVALID_CMD_ANSWER_ERROR;
     }
   }
 
@@ -225,25 +574,16 @@ int ufe_get_command_answer( libusb_device_handle *ufe,
       const char* cmd_name = ufe_get_command_name(command_id);
       ufe_error_print("inconsistent answer header ( 0x%4x ) after command %s.",
                *answer, cmd_name);
-      free(answer);
-      return UFE_INVALID_CMD_ANSWER_ERROR;
+        return UFE_INVALID_CMD_ANSWER_ERROR;
     }
 
-    // Loop over the arguments.
-    int i;
-    for (i=0; i<argc; ++i) {
-      // Check the consistency of the argument.
-      if ( (answer[i+1] & UFE_DW_ID_MASK)       >> UFE_DW_ID_SHIFT       != CMD_ARG_ID ||
-           (answer[i+1] & UEF_FRAME_INDEX_MASK) >> UEF_FRAME_INDEX_SHIFT != i ) {
-        const char* cmd_name = ufe_get_command_name(command_id);
-        ufe_error_print("inconsistent answer argument %i ( 0x%4x ) after command %s.",
-                 i, answer[i+1], cmd_name);
-        free(answer);
+    // Check the arguments and retrieve their values.
+    int i = check_arguments(&answer[1], argc, *argv);
+    if (i >= 0) {
+      const char* cmd_name = ufe_get_command_name(command_id);
+      ufe_error_print("inconsistent answer argument %i ( 0x%4x ) after command %s.",
+               i, answer[i+1], cmd_name);
         return UFE_INVALID_CMD_ANSWER_ERROR;
-      }
-
-      // Retrieve the value.
-      (*argv)[i] = (~UFE_DW_ID_MASK) & answer[i+1];
     }
 
     // Check the trailer
@@ -253,8 +593,7 @@ int ufe_get_command_answer( libusb_device_handle *ufe,
       const char* cmd_name = ufe_get_command_name(command_id);
       ufe_error_print("inconsistent answer trailer ( 0x%4x ) after command %s.",
                answer[argc+1], cmd_name);
-      free(answer);
-      return UFE_INVALID_CMD_ANSWER_ERROR;
+        return UFE_INVALID_CMD_ANSWER_ERROR;
     }
 
     // Check the CRC16
@@ -263,16 +602,109 @@ int ufe_get_command_answer( libusb_device_handle *ufe,
     if (answer_crc != (answer[argc+1] & crc16_context_handler.mask_)) {
       const char* cmd_name = ufe_get_command_name(command_id);
       ufe_error_print("CRC16 mismatch after command %s.", cmd_name);
-      free(answer);
-      return UFE_INVALID_CMD_ANSWER_ERROR;
+        return UFE_INVALID_CMD_ANSWER_ERROR;
     }
   }
 
-  free(answer);
   return 0;
 }
 
-int ufe_user_set_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *data) {
+// Gets the answer of a command into frame (ufe_command_size(argc) bytes) and decodes it.
+static int receive_answer( libusb_device_handle *ufe,
+                           int board_id,
+                           int command_id,
+                           int sub_cmd_id,
+                           int argc,
+                           uint16_t **argv,
+                           uint32_t *frame) {
+  // Get the command answer.
+  uint64_t start_ns = ufe_cmd_timing_start();
+  int status = ufe_user_get_sync(ufe, 2, ufe_command_size(argc), (uint8_t*) frame);
+  if (status == 0)
+    ufe_cmd_timing_record(ufe, UFE_PHASE_ANSWER, start_ns);
+
+  if (status < 0) {
+    const char* cmd_name = ufe_get_command_name(command_id);
+    ufe_error_print("error during command %s ( board %i )", cmd_name, board_id);
+    return status;
+  }
+
+  return ufe_decode_command_answer(frame, board_id, command_id, sub_cmd_id, argc, argv);
+}
+
+static int get_command_answer( libusb_device_handle *ufe,
+                        int board_id,
+                        int command_id,
+                        int sub_cmd_id,
+                        int argc,
+                        uint16_t **argv) {
+
+  // Allocate memory for the answer according to the number of arguments.
+  uint32_t *answer = (uint32_t*) malloc(ufe_command_size(argc));
+  int status = receive_answer(ufe, board_id, command_id, sub_cmd_id, argc, argv, answer);
+  free(answer);
+  return status;
+}
+
+int ufe_get_command_answer( libusb_device_handle *ufe,
+                        int board_id,
+                        int command_id,
+                        int sub_cmd_id,
+                        int argc,
+                        uint16_t **argv) {
+  UFE_PROBE3(command_answer_entry, board_id, command_id, argc);
+  int status = get_command_answer(ufe, board_id, command_id, sub_cmd_id, argc, argv);
+  UFE_PROBE3(command_answer_return, board_id, command_id, status);
+  return status;
+}
+
+int ufe_exchange_command( libusb_device_handle *ufe,
+                          int board_id,
+                          const ufe_command_desc *desc,
+                          int sub_cmd_id,
+                          uint16_t *argv,
+                          uint16_t *answer) {
+  uint32_t frame[UFE_MAX_FRAME_SIZE/4];
+  uint16_t dummy_answer[UFE_MAX_FRAME_SIZE/2];
+  int command_id = desc->command_id_;
+
+  UFE_PROBE4(send_command_entry, board_id, command_id, sub_cmd_id, desc->argc_);
+  ufe_encode_command( frame,
+                      board_id,
+                      command_id,
+                      (desc->sub_cmd_ & UFE_CMD_SUB)? sub_cmd_id : NO_SUB_CMD_ID,
+                      desc->argc_,
+                      argv);
+
+  int status = ufe_send_encoded_command(ufe, board_id, command_id, frame, desc->size_);
+  UFE_PROBE3(send_command_return, board_id, command_id, status);
+  if (status != 0 || desc->answer_argc_ < 0)
+    return status;
+
+  ufe_usleep(desc->wrapup_delay_us_);
+  status = ufe_ep2in_wrappup(ufe);
+  if (status != 0)
+    return status;
+
+  ufe_usleep(desc->answer_delay_us_);
+  if (answer == NULL)
+    answer = dummy_answer;
+
+  UFE_PROBE3(command_answer_entry, board_id, command_id, desc->answer_argc_);
+  status = receive_answer( ufe,
+                           board_id,
+                           command_id,
+                           (desc->sub_cmd_ & UFE_ANSWER_SUB)? sub_cmd_id : NO_SUB_CMD_ID,
+                           desc->answer_argc_,
+                           &answer,
+                           frame);
+  UFE_PROBE3(command_answer_return, board_id, command_id, status);
+
+  ufe_usleep(desc->done_delay_us_);
+  return status;
+}
+
+static int user_set_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *data) {
 
   // Prepare the End Point identifier.
   uint8_t ep_id;
@@ -293,7 +725,7 @@ int ufe_user_set_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *dat
     // If the command buffer is bigger, make multiple transfers.
     int tr_size = ( (size-actual_tot) < 256 )? size-actual_tot : 256;
     int actual;
-    int status = libusb_bulk_transfer( ufe,
+    int status = ufe_usb()->bulk_transfer( ufe,
                                      ep_id,
                                      data_tmp,
                                      tr_size,
@@ -329,14 +761,21 @@ int ufe_user_set_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *dat
 
       data_tmp += tr_size;
       actual_tot += tr_size;
-      usleep(10);
+      ufe_usleep(10);
     }
   }
 
   return 0;
 }
 
-int ufe_user_get_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *data) {
+int ufe_user_set_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *data) {
+  UFE_PROBE2(set_sync_entry, ep, size);
+  int status = user_set_sync(ufe, ep, size, data);
+  UFE_PROBE3(set_sync_return, ep, size, status);
+  return status;
+}
+
+static int user_get_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *data) {
 
   // Prepare the End Point identifier.
   uint8_t ep_id;
@@ -351,7 +790,7 @@ int ufe_user_get_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *dat
 
   // Make bulk transfer.
   int actual;
-  int status = libusb_bulk_transfer( ufe,
+  int status = ufe_usb()->bulk_transfer( ufe,
                                      ep_id,
                                      data,
                                      size,
@@ -389,6 +828,13 @@ int ufe_user_get_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *dat
   return UFE_IO_ERROR;
 }
 
+int ufe_user_get_sync( libusb_device_handle *ufe, int ep, int size, uint8_t *data) {
+  UFE_PROBE2(get_sync_entry, ep, size);
+  int status = user_get_sync(ufe, ep, size, data);
+  UFE_PROBE3(get_sync_return, ep, size, status);
+  return status;
+}
+
 
 void ufe_build_crc_table(crc_context *this_crc) {
 
@@ -479,11 +925,20 @@ uint32_t crc( crc_context *this_crc,
   return l_crc;
 }
 
+/** Verbosity limit of this thread (see ufe_set_thread_verbose()). */
+static __thread int thread_verbose = 3;
+
+int ufe_set_thread_verbose(int max_level) {
+  int x_level = thread_verbose;
+  thread_verbose = max_level;
+  return x_level;
+}
+
 int ufe_get_verbose() {
   if (!ufe_context_handler)
-    return 3;
+    return thread_verbose;
 
-  return ufe_context_handler->verbose_;
+  return (ufe_context_handler->verbose_ < thread_verbose)? ufe_context_handler->verbose_ : thread_verbose;
 }
 
 #ifdef ZMQ_ENABLE
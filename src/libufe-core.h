@@ -42,6 +42,32 @@ extern "C" {
 #define UFE_CMD_TIMEOUT 1000
 
 
+/** \brief Gets the usb operations of the current session.
+ *  \returns The transport of the session context, or the libusb transport if there is no context.
+ *  While the tracing is running, the transfers are recorded in the trace (see libufe-trace.h).
+ */
+const ufe_transport* ufe_usb();
+
+
+/** \brief Gets the start time of a timed command phase.
+ *  \returns The current time (ns), or 0 if both the command timing and the tracing are disabled.
+ */
+uint64_t ufe_cmd_timing_start();
+
+
+/** \brief Records the duration of a phase of the command sent to a device by this thread.
+ *  \param ufe: The device handle.
+ *  \param phase: The phase (ufe_cmd_phase).
+ *  \param start_ns: Start time of the phase, as given by ufe_cmd_timing_start().
+ */
+void ufe_cmd_timing_record(libusb_device_handle *ufe, int phase, uint64_t start_ns);
+
+
+/** \brief Frees the memory of the recorded command latencies.
+ */
+void ufe_free_cmd_timing();
+
+
 /** \brief Checks the type of the device.
  *  \param dev: A device handle.
  *  \param dummy_arg: Not used.
@@ -66,6 +92,24 @@ bool is_bm_feb(libusb_device *dev, int dummy_arg);
 bool is_bm_feb_with_id(libusb_device *dev, int board_id);
 
 
+/** \brief Checks that a board answers on a device and runs a supported firmware (BMFEB_FV).
+ *  \param dev_handle: A device handle.
+ *  \param board_id: Board identifier (unique number).
+ *  \returns 0 if the board is usable, UFE_NOT_FOUND_ERROR if it does not answer,
+ *  UFE_FIRMWARE_ERROR if its firmware is not supported, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_check_board(libusb_device_handle *dev_handle, int board_id);
+
+
+/** \brief Probe function (see ufe_probe_devices()) selecting the device connected to a given board.
+ *  \param dev_handle: A device handle.
+ *  \param board_id: Pointer to the board identifier (int).
+ *  \returns The board identifier if the board answers with a supported firmware (see
+ *  ufe_check_board()), else -1.
+ */
+int ufe_probe_board_id(libusb_device_handle *dev_handle, void *board_id);
+
+
 /** \brief Send a command.
  *  \param ufe: A device handle.
  *  \param board_id: Board identifier (unique number), addressed by this command.
@@ -83,6 +127,138 @@ int ufe_send_command_req( libusb_device_handle *ufe,
                           uint16_t *argv);
 
 
+/** Size in bytes of a command or an answer with argc arguments (a constant expression). */
+#define UFE_FRAME_SIZE(argc) (((argc) > 1)? ((argc)+2)*4 : 4)
+
+/** Maximum size in bytes of a command or an answer (configuration of a device). */
+#define UFE_MAX_FRAME_SIZE UFE_FRAME_SIZE(72)
+
+/** \brief Size of a command.
+ *  \param argc: Number of argumants.
+ *  \returns The size of the command in bytes.
+ */
+int ufe_command_size(int argc);
+
+
+/** \brief Descriptor of a command, generated from UFE_COMMANDS. */
+struct ufe_command_desc {
+  int command_id_;
+  const char *name_;
+
+  /** Number of arguments of the command and of the answer (-1 if there is no answer). */
+  int argc_;
+  int answer_argc_;
+
+  /** UFE_CMD_SUB / UFE_ANSWER_SUB. */
+  int sub_cmd_;
+
+  /** Time given to the board before the wrap-up request, before reading the answer and after
+   *  the answer (us). */
+  unsigned int wrapup_delay_us_;
+  unsigned int answer_delay_us_;
+  unsigned int done_delay_us_;
+
+  /** Size in bytes of the command and of the answer. */
+  int size_;
+  int answer_size_;
+};
+
+/** ufe_command_desc type */
+typedef struct ufe_command_desc ufe_command_desc;
+
+
+/** Index of the rows of UFE_COMMANDS in ufe_command_descs. */
+enum ufe_command_row {
+#define UFE_CMD_ROW(name, id, argc, answer_argc, sub_cmd, wrapup_us, answer_us, done_us) \
+  name##_CMD_ROW,
+  UFE_COMMANDS(UFE_CMD_ROW)
+#undef UFE_CMD_ROW
+  UFE_N_COMMAND_ROWS
+};
+
+/** The descriptors of all rows of UFE_COMMANDS, aliases included. */
+extern const ufe_command_desc ufe_command_descs[UFE_N_COMMAND_ROWS];
+
+/** Descriptor of the validation of a configuration, sent after SET_CONFIG with the subcommand
+ *  identifier device+8 (see ufe_set_config()). */
+#define ufe_validate_config_desc (ufe_command_descs[VALIDATE_CONFIG_CMD_ROW])
+
+
+/** \brief Gets the descriptor of a command.
+ *  \param command_id: Command identifier.
+ *  \returns The descriptor, or NULL if the command is unknown.
+ */
+const ufe_command_desc* ufe_get_command_desc(int command_id);
+
+
+/** \brief Sends a command and gets its answer, as described by its descriptor: the frames have a
+ *  size fixed by the descriptor and are not allocated.
+ *  \param ufe: A device handle.
+ *  \param board_id: Board identifier (unique number), addressed by this command.
+ *  \param desc: The descriptor of the command.
+ *  \param sub_cmd_id: Subcommand identifier, if the command has one.
+ *  \param argv: Input location for the desc->argc_ arguments of the command.
+ *  \param answer: Output location for the desc->answer_argc_ arguments of the answer, or NULL to discard
+ *  them.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_exchange_command( libusb_device_handle *ufe,
+                          int board_id,
+                          const ufe_command_desc *desc,
+                          int sub_cmd_id,
+                          uint16_t *argv,
+                          uint16_t *answer);
+
+
+/** \brief Encode a command, without sending it. Used to prepare the commands in advance.
+ *  \param cmd: Output location for the command (ufe_command_size() bytes).
+ *  \param board_id: Board identifier (unique number), addressed by this command.
+ *  \param command_id: Command identifier (unique number).
+ *  \param sub_cmd_id: Subcommand identifier (unique number).
+ *  \param argc: Number of argumants.
+ *  \param argv: Intput location for the command's argumants data.
+ *  \returns The size of the command in bytes.
+ */
+int ufe_encode_command( uint32_t *cmd,
+                        int board_id,
+                        int command_id,
+                        int sub_cmd_id,
+                        int argc,
+                        uint16_t *argv);
+
+
+/** \brief Send a command encoded by ufe_encode_command().
+ *  \param ufe: A device handle.
+ *  \param board_id: Board identifier (unique number), addressed by this command.
+ *  \param command_id: Command identifier (unique number).
+ *  \param cmd: Intput location for the command.
+ *  \param size: Size of the command in bytes.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_send_encoded_command( libusb_device_handle *ufe,
+                              int board_id,
+                              int command_id,
+                              uint32_t *cmd,
+                              int size);
+
+
+/** \brief Decodes and checks the answer of a command (see ufe_get_command_answer()).
+ *  \param answer: The answer received (ufe_command_size(argc) bytes).
+ *  \param board_id: Board identifier (unique number), addressed by this command.
+ *  \param command_id: Command identifier (unique number).
+ *  \param sub_cmd_id: Subcommand identifier (unique number).
+ *  \param argc: Number of argumants.
+ *  \param argv: Output location for the command's argumants data.
+ *  \returns 0 on success, or a UFE_ERROR code on failure.
+ */
+int ufe_decode_command_answer( uint32_t *answer,
+                               int board_id,
+                               int command_id,
+                               int sub_cmd_id,
+                               int argc,
+                               uint16_t **argv);
+
+
 /** \brief Get the answer of a command.
  *  \param ufe: A device handle.
  *  \param board_id: Board identifier (unique number), addressed by this command.
@@ -154,6 +330,20 @@ int ufe_warning_print(const char *fmt, ...);
  */
 int ufe_error_print(const char *fmt, ...);
 
+
+/** \brief Limits the verbosity of the messages printed by the current thread, without changing
+ *  the verbosity of the session (see ufe_context::verbose_).
+ *  \param max_level: Maximum verbosity level of this thread (3 for no limit, -1 to mute).
+ *  \returns The previous limit.
+ */
+int ufe_set_thread_verbose(int max_level);
+
+
+/** \brief Gets the verbosity level of the current thread.
+ *  \returns The verbosity of the session, limited by ufe_set_thread_verbose().
+ */
+int ufe_get_verbose();
+
 #ifdef ZMQ_ENABLE
 
 /** \brief Convert C string to 0MQ string and send to socket
@@ -0,0 +1,869 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-emu.h"
+
+extern crc_context crc16_context_handler;
+
+/** Number of configuration words of each device (see ufe_set_config()). */
+#define EMU_CONFIG_SIZE 72
+
+/** Maximum size (in 32 bit words) of a command or an answer. */
+#define EMU_MAX_WORDS (EMU_CONFIG_SIZE + 2)
+
+/** \brief State of one emulated board. */
+struct ufe_emu_device {
+  /** Identifier of the board. */
+  int board_id_;
+
+  /** Protects the command exchange (EP2). */
+  pthread_mutex_t mutex_;
+
+  /** The command being received. */
+  uint32_t cmd_[EMU_MAX_WORDS];
+
+  /** Number of bytes of the command received so far. */
+  int cmd_size_;
+
+  /** The answer of the last command. */
+  uint32_t answer_[EMU_MAX_WORDS];
+
+  /** Size of the answer in bytes (0 if no answer). */
+  int answer_size_;
+
+  /** True after the EP2 IN wrap-up request. */
+  bool answer_ready_;
+
+  /** Last value of SET_DIRECT_PARAM. */
+  uint16_t direct_params_;
+
+  /** Configuration data of the devices (3 ASICs + FPGA). */
+  uint16_t config_[4][EMU_CONFIG_SIZE];
+
+  /** Bit array of the validated configurations. */
+  uint16_t valid_;
+
+  /** 1 while the readout is running. */
+  int running_;
+
+  /** 1 after the readout has been stopped. */
+  int stopped_;
+
+  /** Start time of the readout (ns). */
+  uint64_t start_ns_;
+
+  /** Stop time of the readout (ns). The data produced until then can still be read. */
+  uint64_t stop_ns_;
+
+  /** 1 after the EP1 IN wrap-up request, until the empty packet is read. */
+  int zlp_;
+
+  /** Number of bytes produced since the start of the readout. */
+  uint64_t bytes_sent_;
+
+  /** State of the data pattern. */
+  uint32_t pattern_state_;
+
+  /** 1 while the board is connected (see ufe_emu_set_connected()). */
+  int connected_;
+
+  /** 1 while EP1 IN is halted (see ufe_emu_stall()). */
+  int halted_;
+};
+
+static struct ufe_emu_device *emu_devices = NULL;
+static int emu_n_devices = 0;
+static ufe_emu_config emu_config;
+
+/** Hotplug events not yet handled (see emu_handle_events()). */
+struct emu_hotplug_event {
+  struct ufe_emu_device *dev_;
+  bool arrived_;
+};
+
+static pthread_mutex_t emu_hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t emu_hotplug_cond = PTHREAD_COND_INITIALIZER;
+static struct emu_hotplug_event emu_hotplug_events[2*UFE_EMU_MAX_BOARDS];
+static int emu_n_hotplug_events = 0;
+static ufe_hotplug_func emu_hotplug_func = NULL;
+static void *emu_hotplug_data = NULL;
+
+/** Maximum number of transfers submitted and not complete. */
+#define EMU_MAX_TRANSFERS (4*UFE_EMU_MAX_BOARDS)
+
+/** Interval of the polling of the readout data, while a transfer from EP1 is pending (ms). */
+#define EMU_POLL_MS 1
+
+/** A transfer submitted and not complete (see emu_handle_events()). Protected by the hotplug mutex. */
+struct emu_transfer {
+  ufe_transfer *transfer_;
+
+  /** Expiry of the transfer (ns), 0 if it has no timeout. */
+  uint64_t deadline_ns_;
+};
+
+static struct emu_transfer emu_transfers[EMU_MAX_TRANSFERS];
+static int emu_n_transfers = 0;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+void ufe_emu_default_config(ufe_emu_config *config) {
+  config->n_boards_ = 1;
+  config->first_board_id_ = 0;
+  config->firmware_version_ = BMFEB_FV;
+  config->rate_ = 0.;
+  config->max_transfer_ = 0;
+  config->pattern_ = UFE_EMU_COUNTER;
+}
+
+int ufe_emu_parse_config(const char *str, ufe_emu_config *config) {
+  char buffer[256], *save = NULL;
+  snprintf(buffer, sizeof(buffer), "%s", str);
+
+  char *item = strtok_r(buffer, ",", &save);
+  while (item) {
+    char *value = strchr(item, '=');
+    if (value == NULL) {
+      ufe_error_print("invalid emulator option %s.", item);
+      return UFE_INVALID_ARG_ERROR;
+    }
+
+    *value++ = '\0';
+    if (strcmp(item, "boards") == 0)
+      config->n_boards_ = strtol(value, NULL, 0);
+    else if (strcmp(item, "first") == 0)
+      config->first_board_id_ = strtol(value, NULL, 0);
+    else if (strcmp(item, "fv") == 0)
+      config->firmware_version_ = strtol(value, NULL, 0);
+    else if (strcmp(item, "rate") == 0)
+      config->rate_ = atof(value);
+    else if (strcmp(item, "transfer") == 0)
+      config->max_transfer_ = strtol(value, NULL, 0);
+    else if (strcmp(item, "pattern") == 0 && strcmp(value, "counter") == 0)
+      config->pattern_ = UFE_EMU_COUNTER;
+    else if (strcmp(item, "pattern") == 0 && strcmp(value, "random") == 0)
+      config->pattern_ = UFE_EMU_RANDOM;
+    else if (strcmp(item, "pattern") == 0 && strcmp(value, "zero") == 0)
+      config->pattern_ = UFE_EMU_ZERO;
+    else {
+      ufe_error_print("invalid emulator option %s=%s.", item, value);
+      return UFE_INVALID_ARG_ERROR;
+    }
+
+    item = strtok_r(NULL, ",", &save);
+  }
+
+  return 0;
+}
+
+int ufe_emu_start(const ufe_emu_config *config) {
+  if (config->n_boards_ < 1 ||
+      config->first_board_id_ < 0 ||
+      config->first_board_id_ + config->n_boards_ > UFE_EMU_MAX_BOARDS) {
+    ufe_error_print("invalid number of emulated boards ( %i from Id %i ).",
+                    config->n_boards_, config->first_board_id_);
+    return UFE_INVALID_ARG_ERROR;
+  }
+
+  ufe_emu_stop();
+  emu_config = *config;
+  emu_n_devices = config->n_boards_;
+  emu_devices = (struct ufe_emu_device*) calloc(emu_n_devices, sizeof(struct ufe_emu_device));
+
+  int i;
+  for (i = 0; i < emu_n_devices; ++i) {
+    emu_devices[i].board_id_ = config->first_board_id_ + i;
+    emu_devices[i].pattern_state_ = 2463534242u + i;
+    emu_devices[i].connected_ = 1;
+    pthread_mutex_init(&emu_devices[i].mutex_, NULL);
+  }
+
+  ufe_info_print("%i emulated board(s) created.", emu_n_devices);
+  return 0;
+}
+
+void ufe_emu_stop() {
+  int i;
+  for (i = 0; i < emu_n_devices; ++i)
+    pthread_mutex_destroy(&emu_devices[i].mutex_);
+
+  free(emu_devices);
+  emu_devices = NULL;
+  emu_n_devices = 0;
+
+  pthread_mutex_lock(&emu_hotplug_mutex);
+  emu_n_hotplug_events = 0;
+  emu_n_transfers = 0;
+  pthread_mutex_unlock(&emu_hotplug_mutex);
+}
+
+int ufe_emu_set_connected(int board_id, bool connected) {
+  int i;
+  for (i = 0; i < emu_n_devices; ++i) {
+    struct ufe_emu_device *dev = &emu_devices[i];
+    if (dev->board_id_ != board_id)
+      continue;
+
+    if (__atomic_exchange_n(&dev->connected_, connected, __ATOMIC_ACQ_REL) == connected)
+      return 0;
+
+    // A disconnected board loses its state.
+    if (!connected) {
+      __atomic_store_n(&dev->running_, 0, __ATOMIC_RELEASE);
+      __atomic_store_n(&dev->stopped_, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_lock(&emu_hotplug_mutex);
+    if (emu_n_hotplug_events < 2*UFE_EMU_MAX_BOARDS) {
+      emu_hotplug_events[emu_n_hotplug_events].dev_ = dev;
+      emu_hotplug_events[emu_n_hotplug_events].arrived_ = connected;
+      ++emu_n_hotplug_events;
+    }
+
+    pthread_cond_broadcast(&emu_hotplug_cond);
+    pthread_mutex_unlock(&emu_hotplug_mutex);
+    ufe_info_print("emulated board %i %s.", board_id, (connected)? "connected" : "disconnected");
+    return 0;
+  }
+
+  return UFE_NOT_FOUND_ERROR;
+}
+
+int ufe_emu_stall(int board_id) {
+  int i;
+  for (i = 0; i < emu_n_devices; ++i)
+    if (emu_devices[i].board_id_ == board_id) {
+      __atomic_store_n(&emu_devices[i].halted_, 1, __ATOMIC_RELEASE);
+      ufe_info_print("EP1 of emulated board %i halted.", board_id);
+      return 0;
+    }
+
+  return UFE_NOT_FOUND_ERROR;
+}
+
+static bool is_connected(struct ufe_emu_device *dev) {
+  return __atomic_load_n(&dev->connected_, __ATOMIC_ACQUIRE);
+}
+
+static ssize_t emu_get_device_list(libusb_context *ctx, libusb_device ***list) {
+  libusb_device **devs = (libusb_device**) calloc(emu_n_devices + 1, sizeof(libusb_device*));
+  int i, n_devs = 0;
+  for (i = 0; i < emu_n_devices; ++i)
+    if (is_connected(&emu_devices[i]))
+      devs[n_devs++] = (libusb_device*) &emu_devices[i];
+
+  *list = devs;
+  return n_devs;
+}
+
+static void emu_free_device_list(libusb_device **list, int unref_devices) {
+  free(list);
+}
+
+static libusb_device* emu_ref_device(libusb_device *dev) {
+  return dev;
+}
+
+static void emu_unref_device(libusb_device *dev) {}
+
+static int emu_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+  memset(desc, 0, sizeof(struct libusb_device_descriptor));
+  desc->bLength = sizeof(struct libusb_device_descriptor);
+  desc->bDescriptorType = LIBUSB_DT_DEVICE;
+  desc->idVendor = UFE_VENDOR_ID;
+  desc->idProduct = BMFEB_PRODUCT_ID;
+  desc->bcdDevice = emu_config.firmware_version_;
+  desc->bNumConfigurations = 1;
+  return 0;
+}
+
+static int emu_get_device_speed(libusb_device *dev) {
+  return LIBUSB_SPEED_HIGH;
+}
+
+static int emu_open(libusb_device *dev, libusb_device_handle **handle) {
+  if (!is_connected((struct ufe_emu_device*) dev)) {
+    *handle = NULL;
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  *handle = (libusb_device_handle*) dev;
+  return 0;
+}
+
+static void emu_close(libusb_device_handle *handle) {}
+
+// Builds the header of an answer.
+static uint32_t answer_header(struct ufe_emu_device *dev, int command_id) {
+  uint32_t header = (CMD_HEADER_ID << UFE_DW_ID_SHIFT);
+  header |= (dev->board_id_ << UFE_BOARD_ID_SHIFT) & UFE_BOARD_ID_MASK;
+  header |= (command_id << UFE_CMD_ID_SHIFT) & UFE_CMD_ID_MASK;
+  return header;
+}
+
+static void set_answer(struct ufe_emu_device *dev, int command_id, uint16_t arg) {
+  dev->answer_[0] = answer_header(dev, command_id) | arg;
+  dev->answer_size_ = 4;
+}
+
+// Builds an answer with multiple arguments (header / arguments / trailer).
+static void set_answer_args(struct ufe_emu_device *dev, int command_id, int sub_cmd_id, int argc, uint16_t *argv) {
+  int i;
+  dev->answer_[0]  = answer_header(dev, command_id);
+  dev->answer_[0] |= (sub_cmd_id << UFE_SUBCMD_ID_SHIFT) & UFE_SUBCMD_ID_MASK;
+  dev->answer_[0] |= argc & UFE_ARG_FR_NUM_MASK;
+
+  for (i = 0; i < argc; ++i) {
+    dev->answer_[i+1]  = argv[i];
+    dev->answer_[i+1] |= (CMD_ARG_ID << UFE_DW_ID_SHIFT);
+    dev->answer_[i+1] |= (i << UEF_FRAME_INDEX_SHIFT) & UEF_FRAME_INDEX_MASK;
+  }
+
+  dev->answer_[argc+1]  = (CMD_TRAILER_ID << UFE_DW_ID_SHIFT);
+  dev->answer_[argc+1] |= (dev->board_id_ << UFE_BOARD_ID_SHIFT) & UFE_BOARD_ID_MASK;
+  dev->answer_[argc+1] |= (command_id << UFE_CMD_ID_SHIFT) & UFE_CMD_ID_MASK;
+  dev->answer_[argc+1] |= crc(&crc16_context_handler, (uint8_t*) argv, argc*2);
+  dev->answer_size_ = (argc+2)*4;
+}
+
+static uint16_t read_status(struct ufe_emu_device *dev) {
+  uint16_t status = 0;
+  if (dev->direct_params_ & SDP_GTEN)
+    status |= RS_GTEN;
+
+  if (dev->direct_params_ & SDP_AVE)
+    status |= RS_AVE;
+
+  if (dev->direct_params_ & SDP_HVON)
+    status |= RS_HVON;
+
+  if (dev->direct_params_ & SDP_IGEN)
+    status |= RS_IGEN;
+
+  // Validated configurations of ASIC0, ASIC1, ASIC2 and FPGA.
+  status |= (dev->valid_ & 0xF) * RS_VW_ASIC0;
+  return status;
+}
+
+// Executes a complete command. Must be called with the mutex of the device locked.
+static void process_command(struct ufe_emu_device *dev, int n_words) {
+  uint32_t header = dev->cmd_[0];
+  int board_id   = (header & UFE_BOARD_ID_MASK)  >> UFE_BOARD_ID_SHIFT;
+  int command_id = (header & UFE_CMD_ID_MASK)    >> UFE_CMD_ID_SHIFT;
+  int sub_cmd_id = (header & UFE_SUBCMD_ID_MASK) >> UFE_SUBCMD_ID_SHIFT;
+  uint16_t arg   = header & UFE_ARGUMENT_MASK;
+  uint16_t argv[EMU_CONFIG_SIZE];
+  int i, argc = 0;
+
+  dev->answer_size_ = 0;
+  dev->answer_ready_ = false;
+
+  // Commands addressed to other boards are ignored.
+  if ((header & UFE_DW_ID_MASK) >> UFE_DW_ID_SHIFT != CMD_HEADER_ID || board_id != dev->board_id_)
+    return;
+
+  if (n_words > 1) {
+    // Command with multiple arguments. Check the arguments, the trailer and the CRC16.
+    argc = n_words - 2;
+    for (i = 0; i < argc; ++i)
+      argv[i] = dev->cmd_[i+1] & UFE_ARGUMENT_MASK;
+
+    uint32_t trailer = dev->cmd_[argc+1];
+    if ((trailer & UFE_DW_ID_MASK) >> UFE_DW_ID_SHIFT != CMD_TRAILER_ID ||
+        (trailer & 0xFFFF) != crc(&crc16_context_handler, (uint8_t*) argv, argc*2)) {
+      set_answer(dev, ERROR_CMD_ID, 1);
+      return;
+    }
+  }
+
+  switch (command_id) {
+    case FIRMWARE_VERSION_CMD_ID:
+      set_answer(dev, command_id, emu_config.firmware_version_);
+      break;
+
+    case SET_DIRECT_PARAM_CMD_ID:
+      dev->direct_params_ = arg;
+      set_answer(dev, command_id, 0);
+      break;
+
+    case READ_STATUS_CMD_ID:
+      set_answer(dev, command_id, read_status(dev));
+      break;
+
+    case SET_CONFIG_CMD_ID:
+      if (argc == EMU_CONFIG_SIZE && sub_cmd_id < 4) {
+        memcpy(dev->config_[sub_cmd_id], argv, sizeof(argv));
+        dev->valid_ &= ~(1 << sub_cmd_id);
+      } else if (argc == 0 && sub_cmd_id >= 8 && sub_cmd_id < 12) {
+        dev->valid_ |= 1 << (sub_cmd_id - 8);
+      } else {
+        set_answer(dev, ERROR_CMD_ID, 2);
+        break;
+      }
+
+      set_answer(dev, command_id, 0);
+      break;
+
+    case GET_CONFIG_CMD_ID:
+      set_answer_args(dev, command_id, arg & 0x3, EMU_CONFIG_SIZE, dev->config_[arg & 0x3]);
+      break;
+
+    case APPLY_CONFIG_CMD_ID:
+      set_answer(dev, command_id, 0);
+      break;
+
+    case DATA_READOUT_CMD_ID:
+      if (arg & DR_STOP) {
+        dev->stop_ns_ = now_ns();
+        __atomic_store_n(&dev->running_, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&dev->stopped_, 1, __ATOMIC_RELEASE);
+      } else {
+        dev->start_ns_ = now_ns();
+        dev->bytes_sent_ = 0;
+        __atomic_store_n(&dev->zlp_, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&dev->stopped_, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&dev->running_, 1, __ATOMIC_RELEASE);
+      }
+
+      set_answer(dev, command_id, arg);
+      break;
+
+    case IDLE_CMD_ID:
+      break;
+
+    default:
+      set_answer(dev, ERROR_CMD_ID, 3);
+      break;
+  }
+}
+
+static int ep2_out(struct ufe_emu_device *dev, unsigned char *data, int length, int *actual) {
+  pthread_mutex_lock(&dev->mutex_);
+  if (dev->cmd_size_ + length > (int) sizeof(dev->cmd_)) {
+    dev->cmd_size_ = 0;
+    pthread_mutex_unlock(&dev->mutex_);
+    return LIBUSB_ERROR_OVERFLOW;
+  }
+
+  memcpy((uint8_t*) dev->cmd_ + dev->cmd_size_, data, length);
+  dev->cmd_size_ += length;
+  *actual = length;
+
+  // A command with multiple arguments has an argument word after the header.
+  int n_words = 1;
+  if (dev->cmd_size_ >= 8 && (dev->cmd_[1] & UFE_DW_ID_MASK) >> UFE_DW_ID_SHIFT == CMD_ARG_ID)
+    n_words = (dev->cmd_[0] & UFE_ARG_FR_NUM_MASK) + 2;
+
+  if (n_words > EMU_MAX_WORDS) {
+    dev->cmd_size_ = 0;
+    set_answer(dev, ERROR_CMD_ID, 4);
+  } else if (dev->cmd_size_ >= n_words*4) {
+    process_command(dev, n_words);
+    dev->cmd_size_ = 0;
+  }
+
+  pthread_mutex_unlock(&dev->mutex_);
+  return 0;
+}
+
+static int ep2_in(struct ufe_emu_device *dev, unsigned char *data, int length, int *actual) {
+  int status = 0;
+  pthread_mutex_lock(&dev->mutex_);
+  if (dev->answer_size_ == 0 || !dev->answer_ready_) {
+    // No answer. A real board would not answer either, but there is no need to wait.
+    status = LIBUSB_ERROR_TIMEOUT;
+  } else {
+    *actual = (length < dev->answer_size_)? length : dev->answer_size_;
+    memcpy(data, dev->answer_, *actual);
+    dev->answer_size_ = 0;
+  }
+
+  pthread_mutex_unlock(&dev->mutex_);
+  return status;
+}
+
+static void fill_pattern(struct ufe_emu_device *dev, uint8_t *data, int size) {
+  uint32_t *words = (uint32_t*) data;
+  uint32_t x = dev->pattern_state_;
+  int i, n_words = size/4;
+
+  switch (emu_config.pattern_) {
+    case UFE_EMU_RANDOM:
+      for (i = 0; i < n_words; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        words[i] = x;
+      }
+      break;
+
+    case UFE_EMU_ZERO:
+      memset(data, 0, size);
+      break;
+
+    default:
+      for (i = 0; i < n_words; ++i)
+        words[i] = x++;
+      break;
+  }
+
+  dev->pattern_state_ = x;
+}
+
+// Sends the data produced before the stop of the readout, then the empty packet of the wrap-up.
+static int ep1_drain(struct ufe_emu_device *dev, unsigned char *data, int length, int *actual) {
+  int64_t left = 0;
+  if (emu_config.rate_ > 0)
+    left = (int64_t) ((dev->stop_ns_ - dev->start_ns_)*emu_config.rate_*1e-3) - dev->bytes_sent_;
+
+  int size = (left < length)? (int) left & ~3 : length & ~3;
+  if (emu_config.max_transfer_ > 0 && size > emu_config.max_transfer_)
+    size = emu_config.max_transfer_ & ~3;
+
+  if (size > 0) {
+    fill_pattern(dev, data, size);
+    dev->bytes_sent_ += size;
+    *actual = size;
+    return 0;
+  }
+
+  if (__atomic_exchange_n(&dev->zlp_, 0, __ATOMIC_ACQ_REL))
+    return 0;
+
+  return LIBUSB_ERROR_TIMEOUT;
+}
+
+static int ep1_in(struct ufe_emu_device *dev, unsigned char *data, int length, int *actual, unsigned int timeout) {
+  uint64_t start = now_ns(), timeout_ns = timeout*1000000ull;
+  if (__atomic_load_n(&dev->halted_, __ATOMIC_ACQUIRE))
+    return LIBUSB_ERROR_PIPE;
+
+  // Wait for the start of the readout.
+  while (!__atomic_load_n(&dev->running_, __ATOMIC_ACQUIRE)) {
+    if (!is_connected(dev))
+      return LIBUSB_ERROR_NO_DEVICE;
+
+    if (__atomic_load_n(&dev->stopped_, __ATOMIC_ACQUIRE) &&
+        ep1_drain(dev, data, length, actual) == 0)
+      return 0;
+
+    if (now_ns() - start >= timeout_ns)
+      return LIBUSB_ERROR_TIMEOUT;
+
+    usleep(100);
+  }
+
+  int size = length;
+  if (emu_config.max_transfer_ > 0 && size > emu_config.max_transfer_)
+    size = emu_config.max_transfer_;
+
+  size &= ~3;
+  if (emu_config.rate_ > 0) {
+    // Respect the data rate: the data of this transfer is available only at due_ns.
+    double bytes_per_ns = emu_config.rate_*1e-3;
+    uint64_t due_ns = dev->start_ns_ + (uint64_t) ((dev->bytes_sent_ + size)/bytes_per_ns);
+    uint64_t now = now_ns();
+    if (due_ns > now) {
+      if (due_ns - now > timeout_ns) {
+        // Return only what has been produced until the timeout.
+        usleep(timeout_ns/1000);
+        int64_t available = (int64_t) ((now_ns() - dev->start_ns_)*bytes_per_ns) - dev->bytes_sent_;
+        if (available < 4)
+          return LIBUSB_ERROR_TIMEOUT;
+
+        size = (available < size)? (available & ~3) : size;
+      } else {
+        usleep((due_ns - now)/1000);
+      }
+    }
+  }
+
+  fill_pattern(dev, data, size);
+  dev->bytes_sent_ += size;
+  *actual = size;
+  return 0;
+}
+
+static int emu_bulk_transfer(libusb_device_handle *handle,
+                             unsigned char endpoint,
+                             unsigned char *data,
+                             int length,
+                             int *actual,
+                             unsigned int timeout) {
+  struct ufe_emu_device *dev = (struct ufe_emu_device*) handle;
+  *actual = 0;
+  if (!is_connected(dev))
+    return LIBUSB_ERROR_NO_DEVICE;
+
+  switch (endpoint) {
+    case UFE_USB_EP2_OUT | LIBUSB_ENDPOINT_OUT:
+      return ep2_out(dev, data, length, actual);
+
+    case UFE_USB_EP2_IN | LIBUSB_ENDPOINT_IN:
+      return ep2_in(dev, data, length, actual);
+
+    case UFE_USB_EP1_IN | LIBUSB_ENDPOINT_IN:
+      return ep1_in(dev, data, length, actual, timeout);
+
+    default:
+      return LIBUSB_ERROR_INVALID_PARAM;
+  }
+}
+
+static int emu_clear_halt(libusb_device_handle *handle, unsigned char endpoint) {
+  struct ufe_emu_device *dev = (struct ufe_emu_device*) handle;
+  if (!is_connected(dev))
+    return LIBUSB_ERROR_NO_DEVICE;
+
+  if (endpoint == (UFE_USB_EP1_IN | LIBUSB_ENDPOINT_IN))
+    __atomic_store_n(&dev->halted_, 0, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+static int emu_control_transfer(libusb_device_handle *handle,
+                                uint8_t request_type,
+                                uint8_t request,
+                                uint16_t value,
+                                uint16_t index,
+                                unsigned char *data,
+                                uint16_t length,
+                                unsigned int timeout) {
+  struct ufe_emu_device *dev = (struct ufe_emu_device*) handle;
+  if (!is_connected(dev))
+    return LIBUSB_ERROR_NO_DEVICE;
+
+  memset(data, 0, length);
+
+  switch (request) {
+    case UFE_GET_VERSION_REQ:
+    case UFE_GET_BUF_SIZE:
+      break;
+
+    case UFE_EP2IN_WRAPPUP_REQ:
+      if (value == 1) {
+        __atomic_store_n(&dev->zlp_, 1, __ATOMIC_RELEASE);
+      } else {
+        pthread_mutex_lock(&dev->mutex_);
+        dev->answer_ready_ = true;
+        pthread_mutex_unlock(&dev->mutex_);
+      }
+
+      data[0] = value;
+      break;
+
+    case UFE_EPxIN_RESET_REQ:
+      if (value == 2) {
+        pthread_mutex_lock(&dev->mutex_);
+        dev->answer_size_ = 0;
+        dev->cmd_size_ = 0;
+        pthread_mutex_unlock(&dev->mutex_);
+      }
+
+      data[0] = value;
+      break;
+
+    case UFE_LED_OFF_REQ:
+      data[0] = value;
+      break;
+
+    default:
+      return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+
+  return length;
+}
+
+static int emu_hotplug_register(libusb_context *ctx, ufe_hotplug_func func, void *user_data) {
+  pthread_mutex_lock(&emu_hotplug_mutex);
+  emu_hotplug_func = func;
+  emu_hotplug_data = user_data;
+  emu_n_hotplug_events = 0;
+  pthread_mutex_unlock(&emu_hotplug_mutex);
+
+  // Report the boards already connected.
+  int i;
+  for (i = 0; i < emu_n_devices; ++i)
+    if (is_connected(&emu_devices[i]))
+      (*func)((libusb_device*) &emu_devices[i], true, user_data);
+
+  return 0;
+}
+
+static void emu_hotplug_deregister(libusb_context *ctx) {
+  pthread_mutex_lock(&emu_hotplug_mutex);
+  emu_hotplug_func = NULL;
+  pthread_mutex_unlock(&emu_hotplug_mutex);
+}
+
+static int emu_submit_transfer(ufe_transfer *transfer) {
+  if (!is_connected((struct ufe_emu_device*) transfer->handle_))
+    return LIBUSB_ERROR_NO_DEVICE;
+
+  transfer->status_ = 0;
+  transfer->actual_ = 0;
+  pthread_mutex_lock(&emu_hotplug_mutex);
+  if (emu_n_transfers == EMU_MAX_TRANSFERS) {
+    pthread_mutex_unlock(&emu_hotplug_mutex);
+    return LIBUSB_ERROR_BUSY;
+  }
+
+  emu_transfers[emu_n_transfers].transfer_ = transfer;
+  emu_transfers[emu_n_transfers].deadline_ns_ = (transfer->timeout_)? now_ns() + transfer->timeout_*1000000ull : 0;
+  ++emu_n_transfers;
+  pthread_cond_broadcast(&emu_hotplug_cond);
+  pthread_mutex_unlock(&emu_hotplug_mutex);
+  return 0;
+}
+
+// Makes a transfer without waiting. Returns false if it has to be retried later.
+static bool run_transfer(struct emu_transfer *t) {
+  ufe_transfer *transfer = t->transfer_;
+  if (transfer->type_ == LIBUSB_TRANSFER_TYPE_CONTROL) {
+    int status = emu_control_transfer(transfer->handle_, transfer->request_type_, transfer->request_,
+                                      transfer->value_, transfer->index_, transfer->data_,
+                                      transfer->length_, transfer->timeout_);
+    transfer->status_ = (status < 0)? status : 0;
+    transfer->actual_ = (status < 0)? 0 : status;
+    return true;
+  }
+
+  // The readout data is polled, until the expiry of the transfer.
+  transfer->status_ = emu_bulk_transfer(transfer->handle_, transfer->endpoint_, transfer->data_,
+                                        transfer->length_, &transfer->actual_, 0);
+  return !(transfer->status_ == LIBUSB_ERROR_TIMEOUT &&
+           (t->deadline_ns_ == 0 || now_ns() < t->deadline_ns_));
+}
+
+// Makes the pending transfers, calls the callbacks of the complete ones and returns their number.
+static int run_transfers() {
+  // Take the transfers, another thread may handle the events at the same time.
+  struct emu_transfer pending[EMU_MAX_TRANSFERS];
+  pthread_mutex_lock(&emu_hotplug_mutex);
+  int i, n_pending = emu_n_transfers, n_done = 0;
+  memcpy(pending, emu_transfers, n_pending*sizeof(struct emu_transfer));
+  emu_n_transfers = 0;
+  pthread_mutex_unlock(&emu_hotplug_mutex);
+
+  for (i = 0; i < n_pending; ++i)
+    if (run_transfer(&pending[i])) {
+      pending[n_done] = pending[i];
+      ++n_done;
+    } else {
+      // Put it back, before the transfers submitted meanwhile.
+      pthread_mutex_lock(&emu_hotplug_mutex);
+      memmove(&emu_transfers[1], &emu_transfers[0], emu_n_transfers*sizeof(struct emu_transfer));
+      emu_transfers[0] = pending[i];
+      ++emu_n_transfers;
+      pthread_mutex_unlock(&emu_hotplug_mutex);
+    }
+
+  // The callbacks may submit new transfers.
+  for (i = 0; i < n_done; ++i)
+    (*pending[i].transfer_->callback_)(pending[i].transfer_);
+
+  return n_done;
+}
+
+static int emu_handle_events(libusb_context *ctx, int timeout_ms) {
+  uint64_t deadline_ns = now_ns() + timeout_ms*1000000ull;
+
+  // Until a transfer is complete, a board is connected / disconnected or the timeout expires.
+  while (run_transfers() == 0) {
+    pthread_mutex_lock(&emu_hotplug_mutex);
+    uint64_t now = now_ns();
+    if (emu_n_hotplug_events > 0 || now >= deadline_ns) {
+      pthread_mutex_unlock(&emu_hotplug_mutex);
+      break;
+    }
+
+    // Poll the pending transfers.
+    uint64_t wait_ns = deadline_ns - now;
+    if (emu_n_transfers > 0 && wait_ns > EMU_POLL_MS*1000000ull)
+      wait_ns = EMU_POLL_MS*1000000ull;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += wait_ns/1000000000;
+    deadline.tv_nsec += wait_ns%1000000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_nsec -= 1000000000;
+      ++deadline.tv_sec;
+    }
+
+    pthread_cond_timedwait(&emu_hotplug_cond, &emu_hotplug_mutex, &deadline);
+    pthread_mutex_unlock(&emu_hotplug_mutex);
+  }
+
+  pthread_mutex_lock(&emu_hotplug_mutex);
+  struct emu_hotplug_event events[2*UFE_EMU_MAX_BOARDS];
+  int i, n_events = emu_n_hotplug_events;
+  memcpy(events, emu_hotplug_events, n_events*sizeof(struct emu_hotplug_event));
+  emu_n_hotplug_events = 0;
+  ufe_hotplug_func func = emu_hotplug_func;
+  void *user_data = emu_hotplug_data;
+  pthread_mutex_unlock(&emu_hotplug_mutex);
+
+  // Call the hotplug function without holding the lock, as libusb does.
+  for (i = 0; func && i < n_events; ++i)
+    (*func)((libusb_device*) events[i].dev_, events[i].arrived_, user_data);
+
+  return 0;
+}
+
+static int emu_get_bus_number(libusb_device_handle *handle) {
+  return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static const ufe_transport emu_transport = {
+  "emulator",
+  &emu_get_device_list,
+  &emu_free_device_list,
+  &emu_ref_device,
+  &emu_unref_device,
+  &emu_get_device_descriptor,
+  &emu_get_device_speed,
+  &emu_open,
+  &emu_close,
+  &emu_bulk_transfer,
+  &emu_control_transfer,
+  &emu_clear_halt,
+  &emu_hotplug_register,
+  &emu_hotplug_deregister,
+  &emu_handle_events,
+  &emu_submit_transfer,
+  &emu_get_bus_number
+};
+
+const ufe_transport* ufe_emu_transport() {
+  return &emu_transport;
+}
@@ -0,0 +1,138 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-emu.h
+ *  \brief   File containing a software emulation of the Baby MIND front-end boards. The emulated
+ *  boards implement the command protocol (header / arguments / trailer / CRC16) and produce
+ *  synthetic readout data, so that the library and the tools can be tested and benchmarked
+ *  without hardware.
+ *
+ *  The emulation is enabled either by setting the environment variable UFE_EMULATOR before
+ *  ufe_init() (e.g. UFE_EMULATOR="boards=4,rate=100,pattern=random"), or by calling ufe_emu_start()
+ *  and setting the transport_ of the context to ufe_emu_transport() before ufe_init().
+ */
+
+#ifndef LIBUFE_EMU_H
+#define LIBUFE_EMU_H 1
+
+#include <stdint.h>
+
+#include "libufe.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of emulated boards. */
+#define UFE_EMU_MAX_BOARDS 128
+
+/** List of the patterns of the synthetic readout data. */
+enum ufe_emu_pattern {
+  /** 32 bit words, incremented by one. */
+  UFE_EMU_COUNTER = 0,
+
+  /** Pseudo random 32 bit words. */
+  UFE_EMU_RANDOM  = 1,
+
+  /** All bytes 0. */
+  UFE_EMU_ZERO    = 2
+};
+
+/** \brief Configuration of the emulated boards. */
+struct ufe_emu_config {
+  /** Number of boards (one usb device per board). Default 1. */
+  int n_boards_;
+
+  /** Board Id of the first board. The others have consecutive Ids. Default 0. */
+  int first_board_id_;
+
+  /** Firmware version reported by the boards. Default BMFEB_FV. */
+  int firmware_version_;
+
+  /** Data rate of each board in MB/s. 0 means as fast as possible (default). */
+  double rate_;
+
+  /** Maximum size (in bytes) of one readout transfer. 0 means the full readout buffer (default). */
+  int max_transfer_;
+
+  /** Pattern of the readout data (ufe_emu_pattern). Default UFE_EMU_COUNTER. */
+  int pattern_;
+};
+
+/** ufe_emu_config type */
+typedef struct ufe_emu_config ufe_emu_config;
+
+
+/** \brief Initializes a default configuration.
+ *  \param config: Output location for the configuration.
+ */
+void ufe_emu_default_config(ufe_emu_config *config);
+
+
+/** \brief Parses a configuration string of the form "key=value,key=value". The keys are boards,
+ *  first, fv, rate, transfer and pattern (counter / random / zero).
+ *  \param str: The string.
+ *  \param config: Input/output location for the configuration.
+ *  \returns 0 on success, or UFE_INVALID_ARG_ERROR on failure.
+ */
+int ufe_emu_parse_config(const char *str, ufe_emu_config *config);
+
+
+/** \brief Creates the emulated boards.
+ *  \param config: The configuration.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_emu_start(const ufe_emu_config *config);
+
+
+/** \brief Removes the emulated boards. Called by ufe_exit() if the session uses the emulation.
+ */
+void ufe_emu_stop();
+
+
+/** \brief Connects or disconnects an emulated board. The change is reported to the hotplug
+ *  function of the transport (see ufe_transport). A disconnected board stops its readout and its
+ *  transfers fail with LIBUSB_ERROR_NO_DEVICE.
+ *  \param board_id: Identifier of the board.
+ *  \param connected: True to connect the board, false to disconnect it.
+ *  \returns 0 on success, or UFE_NOT_FOUND_ERROR if there is no such emulated board.
+ */
+int ufe_emu_set_connected(int board_id, bool connected);
+
+
+/** \brief Halts EP1 IN of an emulated board, as after a transfer error. The readout transfers fail
+ *  with LIBUSB_ERROR_PIPE until the halt is cleared (see libusb_clear_halt()).
+ *  \param board_id: Identifier of the board.
+ *  \returns 0 on success, or UFE_NOT_FOUND_ERROR if there is no such emulated board.
+ */
+int ufe_emu_stall(int board_id);
+
+
+/** \brief Gets the transport of the emulated boards.
+ *  \returns The transport.
+ */
+const ufe_transport* ufe_emu_transport();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-evb.h"
+
+#define EMPTY_KEY UINT64_MAX
+
+int ufe_evb_init( ufe_evb **evb,
+                  int n_inputs,
+                  size_t capacity,
+                  uint64_t window,
+                  uint64_t max_latency,
+                  ufe_evb_func func,
+                  void *arg) {
+  if (n_inputs < 1 || capacity < 1 || window < 1) {
+    ufe_error_print("invalid event builder parameters.");
+    return UFE_INVALID_ARG_ERROR;
+  }
+
+  ufe_evb *e = (ufe_evb*) calloc(1, sizeof(ufe_evb));
+  if (!e)
+    return LIBUSB_ERROR_NO_MEM;
+
+  // Round the capacity up to a power of 2. The positions in the ring are then masked.
+  e->capacity_ = 1;
+  while (e->capacity_ < capacity)
+    e->capacity_ <<= 1;
+
+  e->n_inputs_ = n_inputs;
+  e->window_ = window;
+  e->max_latency_ = max_latency;
+  e->func_ = func;
+  e->arg_ = arg;
+
+  e->inputs_  = (struct ufe_evb_input*) calloc(n_inputs, sizeof(struct ufe_evb_input));
+  e->tree_    = (int*) calloc(n_inputs, sizeof(int));
+  e->winners_ = (int*) calloc(2*n_inputs, sizeof(int));
+  e->keys_    = (uint64_t*) calloc(n_inputs, sizeof(uint64_t));
+
+  // In the worst case all buffered hits end up in the same window.
+  e->out_capacity_ = e->capacity_*n_inputs;
+  e->out_ = (ufe_hit*) malloc(e->out_capacity_*sizeof(ufe_hit));
+
+  if (!e->inputs_ || !e->tree_ || !e->winners_ || !e->keys_ || !e->out_) {
+    ufe_evb_free(e);
+    return LIBUSB_ERROR_NO_MEM;
+  }
+
+  int i;
+  for (i = 0; i < n_inputs; ++i) {
+    e->inputs_[i].hits_ = (ufe_hit*) malloc(e->capacity_*sizeof(ufe_hit));
+    if (!e->inputs_[i].hits_) {
+      ufe_evb_free(e);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  }
+
+  *evb = e;
+  return 0;
+}
+
+void ufe_evb_free(ufe_evb *evb) {
+  if (!evb)
+    return;
+
+  int i;
+  if (evb->inputs_)
+    for (i = 0; i < evb->n_inputs_; ++i)
+      free(evb->inputs_[i].hits_);
+
+  free(evb->inputs_);
+  free(evb->tree_);
+  free(evb->winners_);
+  free(evb->keys_);
+  free(evb->out_);
+  free(evb);
+}
+
+size_t ufe_evb_push(ufe_evb *evb, int input, const ufe_hit *hits, size_t n_hits) {
+  struct ufe_evb_input *in = &evb->inputs_[input];
+  uint64_t mask = evb->capacity_ - 1;
+  size_t n_free = evb->capacity_ - (in->tail_ - in->head_);
+  size_t n = (n_hits < n_free)? n_hits : n_free;
+
+  // Copy in at most two pieces (the ring may wrap).
+  uint64_t pos = in->tail_ & mask;
+  size_t n_first = (n < evb->capacity_ - pos)? n : evb->capacity_ - pos;
+  memcpy(in->hits_ + pos, hits, n_first*sizeof(ufe_hit));
+  memcpy(in->hits_, hits + n_first, (n - n_first)*sizeof(ufe_hit));
+  in->tail_ += n;
+
+  if (n && hits[n-1].time_ >= in->horizon_)
+    in->horizon_ = hits[n-1].time_;
+
+  return n;
+}
+
+void ufe_evb_advance(ufe_evb *evb, int input, uint64_t time) {
+  if (time > evb->inputs_[input].horizon_)
+    evb->inputs_[input].horizon_ = time;
+}
+
+static inline uint64_t input_key(ufe_evb *evb, int i) {
+  struct ufe_evb_input *in = &evb->inputs_[i];
+  if (in->head_ == in->tail_)
+    return EMPTY_KEY;
+
+  return in->hits_[in->head_ & (evb->capacity_ - 1)].time_;
+}
+
+static void build_tree(ufe_evb *evb) {
+  int k = evb->n_inputs_, n;
+  int *w = evb->winners_;
+
+  for (n = 0; n < k; ++n) {
+    evb->keys_[n] = input_key(evb, n);
+    w[k + n] = n;
+  }
+
+  // Leaves are the nodes k ... 2k-1. The winner of each match goes up, the loser stays.
+  for (n = k - 1; n >= 1; --n) {
+    int l = w[2*n], r = w[2*n + 1];
+    if (evb->keys_[l] <= evb->keys_[r]) {
+      w[n] = l;
+      evb->tree_[n] = r;
+    } else {
+      w[n] = r;
+      evb->tree_[n] = l;
+    }
+  }
+
+  evb->tree_[0] = (k > 1)? w[1] : 0;
+}
+
+static inline void replay(ufe_evb *evb, int input) {
+  int winner = input;
+  int n = (input + evb->n_inputs_) >> 1;
+  while (n >= 1) {
+    int loser = evb->tree_[n];
+    if (evb->keys_[loser] < evb->keys_[winner]) {
+      evb->tree_[n] = winner;
+      winner = loser;
+    }
+
+    n >>= 1;
+  }
+
+  evb->tree_[0] = winner;
+}
+
+static void emit_window(ufe_evb *evb) {
+  if (evb->n_out_ && evb->func_)
+    evb->func_(evb->out_, evb->n_out_, evb->out_start_, evb->arg_);
+
+  if (evb->n_out_)
+    ++evb->n_windows_;
+
+  evb->n_out_ = 0;
+}
+
+static void close_window(ufe_evb *evb) {
+  emit_window(evb);
+  evb->emitted_until_ = evb->out_start_ + evb->window_;
+}
+
+static uint64_t watermark(ufe_evb *evb) {
+  int i;
+  uint64_t newest = 0, mark = EMPTY_KEY;
+  for (i = 0; i < evb->n_inputs_; ++i)
+    if (evb->inputs_[i].horizon_ > newest)
+      newest = evb->inputs_[i].horizon_;
+
+  for (i = 0; i < evb->n_inputs_; ++i) {
+    struct ufe_evb_input *in = &evb->inputs_[i];
+
+    // Do not wait for inputs lagging too much behind.
+    if (newest - in->horizon_ > evb->max_latency_)
+      continue;
+
+    // The newest hit of an input may still be followed by hits with the same time.
+    if (in->horizon_ < mark)
+      mark = in->horizon_;
+
+    // A full input must be released, otherwise nothing can be pushed anymore.
+    if (in->tail_ - in->head_ == evb->capacity_) {
+      uint64_t mid = in->hits_[(in->head_ + evb->capacity_/2) & (evb->capacity_ - 1)].time_;
+      if (mid > mark)
+        mark = mid;
+    }
+  }
+
+  return mark;
+}
+
+static size_t merge(ufe_evb *evb, uint64_t mark) {
+  uint64_t mask = evb->capacity_ - 1;
+  size_t n_merged = 0;
+
+  build_tree(evb);
+  while (1) {
+    int i = evb->tree_[0];
+    uint64_t t = evb->keys_[i];
+
+    // Merge only the hits older than the watermark.
+    if (t == EMPTY_KEY || t >= mark)
+      break;
+
+    struct ufe_evb_input *in = &evb->inputs_[i];
+    ufe_hit *hit = &in->hits_[in->head_ & mask];
+    ++in->head_;
+
+    if (t < evb->emitted_until_) {
+      // The window of this hit is already gone.
+      ++evb->n_late_;
+    } else {
+      if (t >= evb->out_start_ + evb->window_) {
+        close_window(evb);
+        evb->out_start_ = t - t % evb->window_;
+      } else if (evb->n_out_ == evb->out_capacity_) {
+        // Too many hits. Deliver the window in several parts.
+        emit_window(evb);
+      }
+
+      evb->out_[evb->n_out_++] = *hit;
+      ++n_merged;
+    }
+
+    evb->keys_[i] = input_key(evb, i);
+    replay(evb, i);
+  }
+
+  evb->n_merged_ += n_merged;
+  return n_merged;
+}
+
+size_t ufe_evb_process(ufe_evb *evb) {
+  uint64_t mark = watermark(evb);
+  size_t n_merged = merge(evb, mark);
+
+  // The open window is complete if all inputs have passed its end.
+  if (mark != EMPTY_KEY && mark >= evb->out_start_ + evb->window_)
+    close_window(evb);
+
+  return n_merged;
+}
+
+size_t ufe_evb_flush(ufe_evb *evb) {
+  size_t n_merged = merge(evb, EMPTY_KEY);
+  close_window(evb);
+  return n_merged;
+}
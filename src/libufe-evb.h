@@ -0,0 +1,203 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-evb.h
+ *  \brief   File containing an event builder, merging the time-ordered hit streams of several
+ *  boards into time slices (event windows).
+ */
+
+#ifndef LIBUFE_EVB_H
+#define LIBUFE_EVB_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Structure representing a decoded hit. */
+struct ufe_hit {
+  /** TDM timestamp of the hit. */
+  uint64_t time_;
+
+  /** Identifier of the board. */
+  uint16_t board_id_;
+
+  /** Channel of the board. */
+  uint8_t channel_;
+
+  /** Type of the measurement (decoder specific). */
+  uint8_t type_;
+
+  /** Amplitude (if any). */
+  uint16_t amplitude_;
+};
+
+/** ufe_hit type */
+typedef struct ufe_hit ufe_hit;
+
+/** \brief Type of the function receiving the event windows.
+ *  \param hits: Input location for the time-ordered hits of the window.
+ *  \param n_hits: Number of hits.
+ *  \param window_start: Timestamp of the beginning of the window.
+ *  \param arg: User argument.
+ */
+typedef void (*ufe_evb_func)(const ufe_hit *hits, size_t n_hits, uint64_t window_start, void *arg);
+
+/** \brief Structure representing the input (hit stream) of one board. */
+struct ufe_evb_input {
+  /** Ring buffer of hits. */
+  ufe_hit *hits_;
+
+  /** Position of the oldest hit in the ring. */
+  uint64_t head_;
+
+  /** Position after the newest hit in the ring. */
+  uint64_t tail_;
+
+  /** Time up to which the stream is known to be complete. */
+  uint64_t horizon_;
+};
+
+/** \brief Structure representing an event builder. All memory is allocated by ufe_evb_init(). */
+struct ufe_evb {
+  /** Number of inputs. */
+  int n_inputs_;
+
+  /** The inputs. */
+  struct ufe_evb_input *inputs_;
+
+  /** Capacity (power of 2) of the ring of each input. */
+  uint64_t capacity_;
+
+  /** Loser tree. tree_[0] is the input holding the oldest hit. */
+  int *tree_;
+
+  /** Timestamp of the oldest hit of each input (UINT64_MAX if empty). */
+  uint64_t *keys_;
+
+  /** Work space used when building the tree. */
+  int *winners_;
+
+  /** Width of the event window. */
+  uint64_t window_;
+
+  /** Inputs lagging behind the most advanced input by more than this are not waited for. */
+  uint64_t max_latency_;
+
+  /** Hits of the currently open window. */
+  ufe_hit *out_;
+
+  /** Number of hits in the currently open window. */
+  size_t n_out_;
+
+  /** Capacity of the output window. */
+  size_t out_capacity_;
+
+  /** Start of the currently open window. */
+  uint64_t out_start_;
+
+  /** End of the last emitted window. Hits older than this are late. */
+  uint64_t emitted_until_;
+
+  /** Receives the event windows. */
+  ufe_evb_func func_;
+
+  /** Argument of func_. */
+  void *arg_;
+
+  /** Number of merged hits. */
+  uint64_t n_merged_;
+
+  /** Number of emitted windows. */
+  uint64_t n_windows_;
+
+  /** Number of hits dropped because they arrived after their window has been emitted. */
+  uint64_t n_late_;
+};
+
+/** ufe_evb type */
+typedef struct ufe_evb ufe_evb;
+
+
+/** \brief Creates an event builder.
+ *  \param evb: Output location for the event builder.
+ *  \param n_inputs: Number of inputs (boards).
+ *  \param capacity: Number of hits buffered for each input (rounded up to a power of 2).
+ *  \param window: Width of the event window.
+ *  \param max_latency: Maximum time lag of an input, before the builder stops waiting for it.
+ *  \param func: Function receiving the event windows.
+ *  \param arg: Argument of func.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_evb_init( ufe_evb **evb,
+                  int n_inputs,
+                  size_t capacity,
+                  uint64_t window,
+                  uint64_t max_latency,
+                  ufe_evb_func func,
+                  void *arg);
+
+
+/** \brief Adds hits to an input. The hits of each input must be ordered in time.
+ *  \param evb: The event builder.
+ *  \param input: Index of the input.
+ *  \param hits: Input location for the hits.
+ *  \param n_hits: Number of hits.
+ *  \returns The number of hits accepted. Less than n_hits if the buffer of the input is full.
+ */
+size_t ufe_evb_push(ufe_evb *evb, int input, const ufe_hit *hits, size_t n_hits);
+
+
+/** \brief Declares that an input has no more hits older than a given time (e.g. after a TDM beacon).
+ *  \param evb: The event builder.
+ *  \param input: Index of the input.
+ *  \param time: Timestamp.
+ */
+void ufe_evb_advance(ufe_evb *evb, int input, uint64_t time);
+
+
+/** \brief Merges all hits which are complete in time and emits the complete windows.
+ *  \param evb: The event builder.
+ *  \returns The number of merged hits.
+ */
+size_t ufe_evb_process(ufe_evb *evb);
+
+
+/** \brief Merges all buffered hits and emits the last window. To be called at the end of the run.
+ *  \param evb: The event builder.
+ *  \returns The number of merged hits.
+ */
+size_t ufe_evb_flush(ufe_evb *evb);
+
+
+/** \brief Frees the event builder.
+ *  \param evb: The event builder.
+ */
+void ufe_evb_free(ufe_evb *evb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
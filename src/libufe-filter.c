@@ -0,0 +1,224 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-filter.h"
+
+/** State of the frame being read. */
+enum filter_state {
+  /** Outside of a frame, or inside of a frame with data. */
+  STATE_PASS,
+
+  /** Header of a frame read, no data yet. The header words are held back. */
+  STATE_HELD,
+
+  /** Trailer of an empty frame read. The following trailer words are dropped too. */
+  STATE_DROP_TRAILER
+};
+
+void ufe_filter_default_config(ufe_filter_config *config) {
+  config->id_shift_ = UFE_DW_ID_SHIFT;
+  config->header_ids_ = 1 << 0x1;
+  config->trailer_ids_ = (1 << 0xD) | (1 << 0xE);
+  config->beacon_ids_ = 1 << 0xF;
+  config->drop_empty_frames_ = true;
+  config->beacon_keep_ = 16;
+}
+
+int ufe_filter_init(ufe_filter *filter, const ufe_filter_config *config) {
+  if (config->id_shift_ < 0 || config->id_shift_ > 28 || config->beacon_keep_ < 1 ||
+      (config->header_ids_ & (config->trailer_ids_ | config->beacon_ids_)) ||
+      (config->trailer_ids_ & config->beacon_ids_))
+    return UFE_INVALID_ARG_ERROR;
+
+  memset(filter, 0, sizeof(ufe_filter));
+  filter->config_ = *config;
+  filter->state_ = STATE_PASS;
+  return 0;
+}
+
+static uint32_t load_word(const uint8_t *p) {
+  uint32_t w;
+  memcpy(&w, p, 4);
+  return w;
+}
+
+// Returns the index of the first frame or beacon word from word i, or n if there is none.
+static size_t next_special(const ufe_filter *f, const uint8_t *words, size_t i, size_t n) {
+  const ufe_filter_config *c = &f->config_;
+  uint32_t special = c->header_ids_ | c->trailer_ids_ | c->beacon_ids_;
+#if defined(__AVX2__)
+  // Bit Id of the set of the special Ids, for 8 words at a time.
+  const __m256i set = _mm256_set1_epi32(special);
+  const __m256i nibble = _mm256_set1_epi32(0xF);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m128i shift = _mm_cvtsi32_si128(c->id_shift_);
+  for (; i + 8 <= n; i += 8) {
+    __m256i w = _mm256_loadu_si256((const __m256i*) (words + 4*i));
+    __m256i id = _mm256_and_si256(_mm256_srl_epi32(w, shift), nibble);
+    __m256i hit = _mm256_and_si256(_mm256_srlv_epi32(set, id), one);
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(hit, one)));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  // One compare per special Id, for 4 words at a time.
+  __m128i ids[16];
+  int n_ids = 0, k;
+  for (k = 0; k < 16; ++k)
+    if (special & (1 << k))
+      ids[n_ids++] = _mm_set1_epi32(k);
+
+  const __m128i nibble = _mm_set1_epi32(0xF);
+  const __m128i shift = _mm_cvtsi32_si128(c->id_shift_);
+  for (; i + 4 <= n; i += 4) {
+    __m128i w = _mm_loadu_si128((const __m128i*) (words + 4*i));
+    __m128i id = _mm_and_si128(_mm_srl_epi32(w, shift), nibble);
+    __m128i hit = _mm_setzero_si128();
+    for (k = 0; k < n_ids; ++k)
+      hit = _mm_or_si128(hit, _mm_cmpeq_epi32(id, ids[k]));
+
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(hit));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; i < n; ++i)
+    if (special & (1 << ((load_word(words + 4*i) >> c->id_shift_) & 0xF)))
+      return i;
+
+  return n;
+}
+
+static void put_word(uint8_t **out, uint32_t w) {
+  memcpy(*out, &w, 4);
+  *out += 4;
+}
+
+// The frame has data: writes the header words held back.
+static void release_held(ufe_filter *f, uint8_t **out) {
+  int i;
+  for (i = 0; i < f->n_held_; ++i)
+    put_word(out, f->held_[i]);
+
+  f->n_held_ = 0;
+  f->state_ = STATE_PASS;
+}
+
+// Data words (anything else than frame and beacon words) have been seen.
+static void got_data(ufe_filter *f, uint8_t **out) {
+  release_held(f, out);
+  f->data_since_beacon_ = true;
+  f->n_idle_beacons_ = 0;
+}
+
+static void filter_word(ufe_filter *f, uint32_t w, uint8_t **out) {
+  const ufe_filter_config *c = &f->config_;
+  uint32_t id_bit = 1 << ((w >> c->id_shift_) & 0xF);
+
+  if (id_bit & c->beacon_ids_) {
+    // The idle beacons are dropped, except the first one and then one every beacon_keep_.
+    if (!f->data_since_beacon_ && (f->n_idle_beacons_++ % c->beacon_keep_) != 0) {
+      f->dropped_beacons_++;
+      return;
+    }
+
+    release_held(f, out);
+    f->data_since_beacon_ = false;
+    put_word(out, w);
+    return;
+  }
+
+  if (!c->drop_empty_frames_) {
+    put_word(out, w);
+    return;
+  }
+
+  if (id_bit & c->header_ids_) {
+    if (f->state_ != STATE_HELD || f->n_held_ == UFE_FILTER_MAX_HELD)
+      release_held(f, out);
+
+    f->held_[f->n_held_++] = w;
+    f->state_ = STATE_HELD;
+    return;
+  }
+
+  // A trailer word.
+  if (f->state_ == STATE_HELD) {
+    f->n_held_ = 0;
+    f->empty_frames_++;
+    f->state_ = STATE_DROP_TRAILER;
+  } else if (f->state_ == STATE_PASS) {
+    put_word(out, w);
+  }
+}
+
+size_t ufe_filter_block(ufe_filter *f, uint8_t *data, size_t size) {
+  uint8_t *out = data;
+  size_t pos = 0;
+  f->bytes_in_ += size;
+
+  // The end of a word started in the previous block stays as it is.
+  if (f->phase_) {
+    pos = (size < (size_t) (4 - f->phase_))? size : (size_t) (4 - f->phase_);
+    f->phase_ = (f->phase_ + pos) % 4;
+    out += pos;
+  }
+
+  const uint8_t *words = data + pos;
+  size_t n = (size - pos)/4, i = 0;
+  while (i < n) {
+    size_t j = next_special(f, words, i, n);
+    if (j > i) {
+      got_data(f, &out);
+      memmove(out, words + 4*i, 4*(j - i));
+      out += 4*(j - i);
+      i = j;
+      if (i == n)
+        break;
+    }
+
+    filter_word(f, load_word(words + 4*i), &out);
+    ++i;
+  }
+
+  // A frame open at the end of the block is kept.
+  release_held(f, &out);
+
+  size_t tail = (size - pos) % 4;
+  if (tail) {
+    memmove(out, words + 4*n, tail);
+    out += tail;
+    f->phase_ = tail;
+  }
+
+  size = out - data;
+  f->bytes_out_ += size;
+  return size;
+}
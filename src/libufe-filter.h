@@ -0,0 +1,135 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ *  \file    libufe-filter.h
+ *  \brief   File containing the zero suppression of the readout data. The filter runs on the
+ *  blocks of a stream, in place and in order, before they are written. It drops the empty TDM
+ *  frames (a frame header followed directly by the frame trailer) and the idle beacons (beacons
+ *  with no other data since the previous beacon) beyond one out of beacon_keep_. The time can
+ *  still be reconstructed: the frames with data keep their headers and trailers, and the idle
+ *  periods keep one beacon every beacon_keep_. The words are classified by their 4-bit Id. The
+ *  data words are skipped with vector compares (AVX2 or SSE2), only the frame and beacon words
+ *  are looked at one by one.
+ */
+
+#ifndef LIBUFE_FILTER_H
+#define LIBUFE_FILTER_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of header words of a frame. */
+#define UFE_FILTER_MAX_HELD 4
+
+/** \brief Configuration of a filter. The word classes are bit sets of word Ids (bit i set for the
+ *  Id i). The Ids depend on the firmware, the defaults are set by ufe_filter_default_config().
+ */
+struct ufe_filter_config {
+  /** Position of the 4-bit word Id in a data word (default 28). */
+  int id_shift_;
+
+  /** Ids of the frame header words. */
+  uint16_t header_ids_;
+
+  /** Ids of the frame trailer words. */
+  uint16_t trailer_ids_;
+
+  /** Ids of the beacon words. */
+  uint16_t beacon_ids_;
+
+  /** If true, the empty frames are dropped (default true). */
+  bool drop_empty_frames_;
+
+  /** One idle beacon out of beacon_keep_ is kept. 1 keeps all beacons (default 16). */
+  int beacon_keep_;
+};
+
+/** ufe_filter_config type */
+typedef struct ufe_filter_config ufe_filter_config;
+
+/** \brief Structure representing the filter of one stream. */
+struct ufe_filter {
+  /** The configuration. */
+  ufe_filter_config config_;
+
+  /** State of the frame (filter_state in libufe-filter.c). */
+  int state_;
+
+  /** Header words of a frame not known yet to have data. */
+  uint32_t held_[UFE_FILTER_MAX_HELD];
+  int n_held_;
+
+  /** Bytes of a word split between two blocks, already seen in the previous block. */
+  int phase_;
+
+  /** True if data words came after the last beacon. */
+  bool data_since_beacon_;
+
+  /** Number of idle beacons in a row. */
+  uint64_t n_idle_beacons_;
+
+  /** Total size of the blocks, before and after the filter. */
+  uint64_t bytes_in_, bytes_out_;
+
+  /** Number of empty frames dropped. */
+  uint64_t empty_frames_;
+
+  /** Number of idle beacons dropped. */
+  uint64_t dropped_beacons_;
+};
+
+/** ufe_filter type */
+typedef struct ufe_filter ufe_filter;
+
+
+/** \brief Sets the default configuration: frame header Id 0x1, frame trailer Ids 0xD and 0xE,
+ *  beacon Id 0xF, empty frames dropped, one idle beacon out of 16 kept.
+ *  \param config: The configuration.
+ */
+void ufe_filter_default_config(ufe_filter_config *config);
+
+
+/** \brief Initializes a filter.
+ *  \param filter: The filter.
+ *  \param config: The configuration (copied).
+ *  \returns 0 on success, or UFE_INVALID_ARG_ERROR if the configuration is not valid.
+ */
+int ufe_filter_init(ufe_filter *filter, const ufe_filter_config *config);
+
+
+/** \brief Filters the next block of a stream, in place. A frame open at the end of the block is
+ *  kept, even if it turns out to be empty.
+ *  \param filter: The filter.
+ *  \param data: Input / output location for the block.
+ *  \param size: Size of the block.
+ *  \returns The size of the block after the filter.
+ */
+size_t ufe_filter_block(ufe_filter *filter, uint8_t *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
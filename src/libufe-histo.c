@@ -0,0 +1,97 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "libufe-histo.h"
+
+#define SUB_BINS (1 << UFE_HISTO_SUB_BITS)
+
+static int bin_index(uint64_t value) {
+  if (value < SUB_BINS)
+    return (int) value;
+
+  // The position of the leading 1 gives the power of 2, the next bits give the sub-bin.
+  int msb = 63 - __builtin_clzll(value);
+  int sub = (value >> (msb - UFE_HISTO_SUB_BITS)) & (SUB_BINS - 1);
+  return (msb - UFE_HISTO_SUB_BITS + 1)*SUB_BINS + sub;
+}
+
+static uint64_t bin_upper_edge(int index) {
+  if (index < SUB_BINS)
+    return index;
+
+  int shift = index/SUB_BINS - 1;
+  uint64_t sub = index % SUB_BINS;
+  return ((SUB_BINS + sub + 1) << shift) - 1;
+}
+
+void ufe_histo_reset(ufe_histo *h) {
+  memset(h, 0, sizeof(ufe_histo));
+}
+
+void ufe_histo_add(ufe_histo *h, uint64_t value) {
+  __atomic_add_fetch(&h->counts_[bin_index(value)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum_, value, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->n_, 1, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&h->max_, __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&h->max_, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void ufe_histo_merge(ufe_histo *h, const ufe_histo *other) {
+  int i;
+  for (i = 0; i < UFE_HISTO_N_BINS; ++i)
+    h->counts_[i] += __atomic_load_n(&other->counts_[i], __ATOMIC_RELAXED);
+
+  h->n_   += __atomic_load_n(&other->n_, __ATOMIC_RELAXED);
+  h->sum_ += __atomic_load_n(&other->sum_, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&other->max_, __ATOMIC_RELAXED);
+  if (max > h->max_)
+    h->max_ = max;
+}
+
+uint64_t ufe_histo_percentile(const ufe_histo *h, double p) {
+  if (h->n_ == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t) (p/100.*h->n_ + 0.5), count = 0;
+  if (rank < 1)
+    rank = 1;
+
+  int i;
+  for (i = 0; i < UFE_HISTO_N_BINS; ++i) {
+    count += h->counts_[i];
+    if (count >= rank)
+      return (bin_upper_edge(i) < h->max_)? bin_upper_edge(i) : h->max_;
+  }
+
+  return h->max_;
+}
+
+void ufe_histo_dump(const ufe_histo *h, double scale, FILE *file) {
+  fprintf(file, "n %8lu  mean %9.1f  p50 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f",
+          (unsigned long) h->n_,
+          (h->n_)? h->sum_/scale/h->n_ : 0.,
+          ufe_histo_percentile(h, 50.)/scale,
+          ufe_histo_percentile(h, 99.)/scale,
+          ufe_histo_percentile(h, 99.9)/scale,
+          h->max_/scale);
+}
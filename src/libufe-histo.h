@@ -0,0 +1,103 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-histo.h
+ *  \brief   File containing a histogram with logarithmic bins (HDR style) used to record latencies.
+ *  Every power of 2 is divided into 2^UFE_HISTO_SUB_BITS bins, so the relative error of a value is
+ *  below 12.5% over the full 64 bit range.
+ */
+
+#ifndef LIBUFE_HISTO_H
+#define LIBUFE_HISTO_H 1
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of bits of the sub-bins of each power of 2. */
+#define UFE_HISTO_SUB_BITS 3
+
+/** Number of bins of a histogram. */
+#define UFE_HISTO_N_BINS ((64 - UFE_HISTO_SUB_BITS + 1) << UFE_HISTO_SUB_BITS)
+
+/** \brief Structure representing a histogram. Values can be added from several threads. */
+struct ufe_histo {
+  /** Number of values. */
+  uint64_t n_;
+
+  /** Sum of the values. */
+  uint64_t sum_;
+
+  /** Maximum value. */
+  uint64_t max_;
+
+  /** Number of values in each bin. */
+  uint64_t counts_[UFE_HISTO_N_BINS];
+};
+
+/** ufe_histo type */
+typedef struct ufe_histo ufe_histo;
+
+
+/** \brief Clears a histogram.
+ *  \param h: The histogram.
+ */
+void ufe_histo_reset(ufe_histo *h);
+
+
+/** \brief Adds a value to a histogram.
+ *  \param h: The histogram.
+ *  \param value: The value.
+ */
+void ufe_histo_add(ufe_histo *h, uint64_t value);
+
+
+/** \brief Adds all values of one histogram to another.
+ *  \param h: Output location for the sum.
+ *  \param other: The histogram to be added.
+ */
+void ufe_histo_merge(ufe_histo *h, const ufe_histo *other);
+
+
+/** \brief Gets a percentile of the values.
+ *  \param h: The histogram.
+ *  \param p: The percentile (0 ... 100).
+ *  \returns The upper edge of the bin containing the percentile, or 0 if the histogram is empty.
+ */
+uint64_t ufe_histo_percentile(const ufe_histo *h, double p);
+
+
+/** \brief Prints count, mean, p50, p99, p99.9 and max of a histogram on one line.
+ *  \param h: The histogram.
+ *  \param scale: The values are divided by scale (e.g. 1000 to print ns as us).
+ *  \param file: Output stream (e.g. stdout).
+ */
+void ufe_histo_dump(const ufe_histo *h, double scale, FILE *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
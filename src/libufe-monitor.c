@@ -0,0 +1,319 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-readout.h"
+#include "libufe-monitor.h"
+
+/** Stream state of a board slot. */
+struct monitor_board {
+  /** Sequence number of the next block expected. */
+  uint32_t next_seq_;
+  bool started_;
+
+  /** Number of records seen, for the sampling. */
+  uint64_t n_seen_;
+
+  /** Bytes of a word split between two records. */
+  uint8_t carry_[4];
+  int n_carry_;
+};
+
+struct ufe_monitor {
+  ufe_monitor_config config_;
+
+  /** Ids of the words looked at (hits or amplitudes). */
+  uint16_t ids_;
+
+  /** The counters of the current interval. */
+  ufe_monitor_snapshot live_;
+
+  struct monitor_board *boards_;
+
+  /** Start of the current interval (monotonic clock, s). */
+  double start_;
+};
+
+static double now_s(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static uint32_t load_word(const uint8_t *p) {
+  uint32_t w;
+  memcpy(&w, p, 4);
+  return w;
+}
+
+void ufe_monitor_default_config(ufe_monitor_config *config) {
+  memset(config, 0, sizeof(ufe_monitor_config));
+  config->id_shift_ = UFE_DW_ID_SHIFT;
+  config->hit_ids_ = 1 << 0x2;
+  config->amplitude_ids_ = 1 << 0x4;
+  config->channel_shift_ = 20;
+  config->channel_mask_ = 0x7F;
+  config->amplitude_mask_ = 0xFFF;
+  config->amplitude_shift_ = 4;
+  config->max_boards_ = 16;
+  config->interval_ms_ = UFE_MONITOR_INTERVAL;
+  config->sample_ = 1;
+}
+
+int ufe_monitor_create(ufe_monitor **mon, const ufe_monitor_config *config) {
+  if (config->id_shift_ < 0 || config->id_shift_ > 28 ||
+      config->channel_shift_ < 0 || config->channel_shift_ > 31 ||
+      config->channel_mask_ >= UFE_MONITOR_CHANNELS ||
+      config->amplitude_shift_ < 0 || config->amplitude_shift_ > 31 ||
+      (config->amplitude_mask_ >> config->amplitude_shift_) >= UFE_MONITOR_AMP_BINS ||
+      config->max_boards_ < 1 || config->interval_ms_ < 1 || config->sample_ < 1)
+    return UFE_INVALID_ARG_ERROR;
+
+  ufe_monitor *m = (ufe_monitor*) calloc(1, sizeof(ufe_monitor));
+  if (!m)
+    return LIBUSB_ERROR_NO_MEM;
+
+  int n = config->max_boards_;
+  m->config_ = *config;
+  m->ids_ = config->hit_ids_ | config->amplitude_ids_;
+  m->boards_ = (struct monitor_board*) calloc(n, sizeof(struct monitor_board));
+  m->live_.board_ids_ = (int*) calloc(n, sizeof(int));
+  m->live_.records_ = (uint64_t*) calloc(n, sizeof(uint64_t));
+  m->live_.missing_ = (uint64_t*) calloc(n, sizeof(uint64_t));
+  m->live_.bytes_ = (uint64_t*) calloc(n, sizeof(uint64_t));
+  m->live_.hits_ = (uint32_t*) calloc(n*UFE_MONITOR_CHANNELS, sizeof(uint32_t));
+  m->live_.rates_ = (double*) calloc(n*UFE_MONITOR_CHANNELS, sizeof(double));
+  m->live_.amplitudes_ = (uint32_t*) calloc(n*UFE_MONITOR_CHANNELS*UFE_MONITOR_AMP_BINS,
+                                            sizeof(uint32_t));
+  if (!m->boards_ || !m->live_.board_ids_ || !m->live_.records_ || !m->live_.missing_ ||
+      !m->live_.bytes_ || !m->live_.hits_ || !m->live_.rates_ || !m->live_.amplitudes_) {
+    ufe_monitor_destroy(m);
+    return LIBUSB_ERROR_NO_MEM;
+  }
+
+  m->start_ = now_s(CLOCK_MONOTONIC);
+  *mon = m;
+  return 0;
+}
+
+// Returns the slot of a board. A new board takes the next free slot, or gets -1 if there is none.
+static int board_slot(ufe_monitor *m, int board_id) {
+  ufe_monitor_snapshot *s = &m->live_;
+  int i;
+  for (i = 0; i < s->n_boards_; ++i)
+    if (s->board_ids_[i] == board_id)
+      return i;
+
+  if (s->n_boards_ == m->config_.max_boards_)
+    return -1;
+
+  s->board_ids_[s->n_boards_] = board_id;
+  return s->n_boards_++;
+}
+
+static void decode_word(ufe_monitor *m, uint32_t *hits, uint32_t *amplitudes, uint32_t w) {
+  const ufe_monitor_config *c = &m->config_;
+  unsigned int id = (w >> c->id_shift_) & 0xF;
+  unsigned int ch = (w >> c->channel_shift_) & c->channel_mask_;
+  if ((c->hit_ids_ >> id) & 1)
+    hits[ch]++;
+
+  if ((c->amplitude_ids_ >> id) & 1)
+    amplitudes[ch*UFE_MONITOR_AMP_BINS + ((w & c->amplitude_mask_) >> c->amplitude_shift_)]++;
+}
+
+static void decode(ufe_monitor *m, int slot, const uint8_t *data, size_t size) {
+  struct monitor_board *b = &m->boards_[slot];
+  uint32_t *hits = m->live_.hits_ + slot*UFE_MONITOR_CHANNELS;
+  uint32_t *amplitudes = m->live_.amplitudes_ + slot*UFE_MONITOR_CHANNELS*UFE_MONITOR_AMP_BINS;
+
+  // Complete the word split with the previous record.
+  size_t i = 0;
+  if (b->n_carry_ > 0) {
+    while (b->n_carry_ < 4 && i < size)
+      b->carry_[b->n_carry_++] = data[i++];
+
+    if (b->n_carry_ < 4)
+      return;
+
+    decode_word(m, hits, amplitudes, load_word(b->carry_));
+    b->n_carry_ = 0;
+  }
+
+  // Most words are neither hits nor amplitudes, only the Id is looked at.
+  for (; i + 4 <= size; i += 4) {
+    uint32_t w = load_word(data + i);
+    if ((m->ids_ >> ((w >> m->config_.id_shift_) & 0xF)) & 1)
+      decode_word(m, hits, amplitudes, w);
+  }
+
+  for (; i < size; ++i)
+    b->carry_[b->n_carry_++] = data[i];
+}
+
+int ufe_monitor_add_record(ufe_monitor *mon, const uint8_t *data, size_t size) {
+  ufe_block_header header;
+  if (size < sizeof(ufe_block_header))
+    return UFE_INVALID_ARG_ERROR;
+
+  memcpy(&header, data, sizeof(ufe_block_header));
+  if (header.magic_ != UFE_BLOCK_MAGIC || header.size_ > size - sizeof(ufe_block_header))
+    return UFE_INVALID_ARG_ERROR;
+
+  int slot = board_slot(mon, header.board_id_);
+  if (slot < 0) {
+    mon->live_.dropped_records_++;
+    ufe_monitor_poll(mon);
+    return 0;
+  }
+
+  // After missing records, the next word is assumed to start with the record. A sequence number
+  // going back is a new run, nothing is missing. The blocks emptied by the zero suppression come
+  // as records without data, they are not missing either.
+  struct monitor_board *b = &mon->boards_[slot];
+  if (b->started_ && header.seq_ != b->next_seq_) {
+    int32_t delta = (int32_t) (header.seq_ - b->next_seq_);
+    if (delta > 0)
+      mon->live_.missing_[slot] += delta;
+
+    b->n_carry_ = 0;
+  }
+
+  if (header.flags_ & UFE_BLOCK_GAP)
+    b->n_carry_ = 0;
+
+  b->started_ = true;
+  b->next_seq_ = header.seq_ + 1;
+  if (header.size_ > 0) {
+    if (b->n_seen_++ % mon->config_.sample_ == 0) {
+      decode(mon, slot, data + sizeof(ufe_block_header), header.size_);
+      mon->live_.records_[slot]++;
+      mon->live_.bytes_[slot] += header.size_;
+    } else {
+      mon->live_.missing_[slot]++;
+      b->n_carry_ = 0;
+    }
+  }
+
+  ufe_monitor_poll(mon);
+  return 0;
+}
+
+bool ufe_monitor_poll(ufe_monitor *mon) {
+  if (ufe_monitor_time_left(mon) > 0)
+    return false;
+
+  ufe_monitor_publish(mon);
+  return true;
+}
+
+void ufe_monitor_publish(ufe_monitor *mon) {
+  ufe_monitor_snapshot *s = &mon->live_;
+  double now = now_s(CLOCK_MONOTONIC);
+  s->time_ = now_s(CLOCK_REALTIME);
+  s->duration_ = now - mon->start_;
+
+  // The hits of the records not decoded are estimated from the records decoded.
+  int b, ch;
+  for (b = 0; b < s->n_boards_; ++b) {
+    double scale = 0.;
+    if (s->records_[b] > 0 && s->duration_ > 0.)
+      scale = (s->records_[b] + s->missing_[b])/(s->records_[b]*s->duration_);
+
+    for (ch = 0; ch < UFE_MONITOR_CHANNELS; ++ch)
+      s->rates_[b*UFE_MONITOR_CHANNELS + ch] = s->hits_[b*UFE_MONITOR_CHANNELS + ch]*scale;
+  }
+
+  if (mon->config_.func_)
+    (*mon->config_.func_)(s, mon->config_.user_data_);
+
+  int n = s->n_boards_;
+  memset(s->records_, 0, n*sizeof(uint64_t));
+  memset(s->missing_, 0, n*sizeof(uint64_t));
+  memset(s->bytes_, 0, n*sizeof(uint64_t));
+  memset(s->hits_, 0, n*UFE_MONITOR_CHANNELS*sizeof(uint32_t));
+  memset(s->amplitudes_, 0, n*UFE_MONITOR_CHANNELS*UFE_MONITOR_AMP_BINS*sizeof(uint32_t));
+  s->dropped_records_ = 0;
+  s->seq_++;
+  mon->start_ = now;
+}
+
+int ufe_monitor_time_left(ufe_monitor *mon) {
+  double left = mon->start_ + mon->config_.interval_ms_*1e-3 - now_s(CLOCK_MONOTONIC);
+  return (left > 0.)? (int) (left*1e3) + 1 : 0;
+}
+
+void ufe_monitor_dump(const ufe_monitor_snapshot *snapshot, bool channels, FILE *file) {
+  const ufe_monitor_snapshot *s = snapshot;
+  fprintf(file, "snapshot %lu  time %.3f  interval %.3f s\n",
+          (unsigned long) s->seq_, s->time_, s->duration_);
+
+  int b, ch, bin;
+  for (b = 0; b < s->n_boards_; ++b) {
+    const double *rates = s->rates_ + b*UFE_MONITOR_CHANNELS;
+    double total = 0.;
+    int hot = 0, silent = 0;
+    for (ch = 0; ch < UFE_MONITOR_CHANNELS; ++ch) {
+      total += rates[ch];
+      if (rates[ch] > rates[hot])
+        hot = ch;
+
+      if (rates[ch] == 0.)
+        silent++;
+    }
+
+    fprintf(file, "board %i:  %lu records (%lu missing), %.2f MB,  rate %.1f Hz,  "
+                  "hottest channel %i (%.1f Hz),  %i silent channels\n",
+            s->board_ids_[b], (unsigned long) s->records_[b], (unsigned long) s->missing_[b],
+            s->bytes_[b]/1e6, total, hot, rates[hot], silent);
+
+    if (!channels)
+      continue;
+
+    for (ch = 0; ch < UFE_MONITOR_CHANNELS; ++ch) {
+      int i = b*UFE_MONITOR_CHANNELS + ch;
+      const uint32_t *amplitudes = s->amplitudes_ + i*UFE_MONITOR_AMP_BINS;
+      fprintf(file, "%i %i %u %.3f", s->board_ids_[b], ch, s->hits_[i], s->rates_[i]);
+      for (bin = 0; bin < UFE_MONITOR_AMP_BINS; ++bin)
+        fprintf(file, " %u", amplitudes[bin]);
+
+      fputc('\n', file);
+    }
+  }
+
+  if (s->dropped_records_ > 0)
+    fprintf(file, "%lu records of boards without a slot\n", (unsigned long) s->dropped_records_);
+}
+
+void ufe_monitor_destroy(ufe_monitor *mon) {
+  free(mon->boards_);
+  free(mon->live_.board_ids_);
+  free(mon->live_.records_);
+  free(mon->live_.missing_);
+  free(mon->live_.bytes_);
+  free(mon->live_.hits_);
+  free(mon->live_.rates_);
+  free(mon->live_.amplitudes_);
+  free(mon);
+}
@@ -0,0 +1,212 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-monitor.h
+ *  \brief   File containing the online monitor of the readout data. The monitor decodes the
+ *  records of the readout (ufe_block_header + data, e.g. read from the shared memory ring by a
+ *  lossy reader, so that the readout is never slowed down) and counts the hits and the amplitudes
+ *  of every channel in flat arrays, indexed by board slot and channel. At a fixed interval, the
+ *  counters are handed to a function as a snapshot and cleared. Records missing from the stream
+ *  (lost by a lossy reader, or skipped by the sampling) are detected from the block sequence
+ *  numbers, and the rates are scaled accordingly. The blocks emptied by the zero suppression come
+ *  as records without data (UFE_BLOCK_FILTERED) and are not missing, a sequence number going back
+ *  is a new run. The words are classified by their 4-bit Id.
+ */
+
+#ifndef LIBUFE_MONITOR_H
+#define LIBUFE_MONITOR_H 1
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Number of channels of a board in the counters. */
+#define UFE_MONITOR_CHANNELS 128
+
+/** Number of bins of an amplitude histogram. */
+#define UFE_MONITOR_AMP_BINS 256
+
+/** Default interval between two snapshots (ms). */
+#define UFE_MONITOR_INTERVAL 1000
+
+/** ufe_monitor_snapshot type */
+typedef struct ufe_monitor_snapshot ufe_monitor_snapshot;
+
+/** Function called with every snapshot. The snapshot is valid only during the call. */
+typedef void (*ufe_monitor_func)(const ufe_monitor_snapshot *snapshot, void *user_data);
+
+/** \brief Configuration of a monitor. The word classes are bit sets of word Ids (bit i set for the
+ *  Id i). The Ids and fields depend on the firmware, the defaults are set by
+ *  ufe_monitor_default_config().
+ */
+struct ufe_monitor_config {
+  /** Position of the 4-bit word Id in a data word (default 28). */
+  int id_shift_;
+
+  /** Ids of the words counted as hits (the rates). */
+  uint16_t hit_ids_;
+
+  /** Ids of the words filled into the amplitude histograms. */
+  uint16_t amplitude_ids_;
+
+  /** Position and mask of the channel in a hit or amplitude word. The mask must be smaller than
+   *  UFE_MONITOR_CHANNELS.
+   */
+  int channel_shift_;
+  uint32_t channel_mask_;
+
+  /** Mask of the amplitude in an amplitude word, and the shift from the amplitude to its bin.
+   *  (amplitude_mask_ >> amplitude_shift_) must be smaller than UFE_MONITOR_AMP_BINS.
+   */
+  uint32_t amplitude_mask_;
+  int amplitude_shift_;
+
+  /** Number of board slots. The boards are given a slot in the order of their first record, the
+   *  records of the boards beyond max_boards_ are not decoded (default 16).
+   */
+  int max_boards_;
+
+  /** Interval between two snapshots (ms, default UFE_MONITOR_INTERVAL). */
+  int interval_ms_;
+
+  /** One record out of sample_ of each board is decoded. 1 decodes all (default 1). */
+  int sample_;
+
+  /** Called with every snapshot, by the thread adding the records. */
+  ufe_monitor_func func_;
+  void *user_data_;
+};
+
+/** ufe_monitor_config type */
+typedef struct ufe_monitor_config ufe_monitor_config;
+
+/** \brief Counters of one interval. The arrays are flat: the counter of the channel ch of the
+ *  board slot b is at [b*UFE_MONITOR_CHANNELS + ch], its amplitude histogram starts at
+ *  [(b*UFE_MONITOR_CHANNELS + ch)*UFE_MONITOR_AMP_BINS].
+ */
+struct ufe_monitor_snapshot {
+  /** Number of the snapshot, starting from 0. */
+  uint64_t seq_;
+
+  /** Wall clock time of the end of the interval (s). */
+  double time_;
+
+  /** Length of the interval (s). */
+  double duration_;
+
+  /** Number of board slots in use. */
+  int n_boards_;
+
+  /** Board Id of each slot. */
+  int *board_ids_;
+
+  /** Per board slot: records decoded, records missing from the stream, and bytes decoded. */
+  uint64_t *records_;
+  uint64_t *missing_;
+  uint64_t *bytes_;
+
+  /** Per channel: number of hits decoded. */
+  uint32_t *hits_;
+
+  /** Per channel: hit rate (Hz), scaled by the records missing from the stream. */
+  double *rates_;
+
+  /** Per channel: amplitude histogram. */
+  uint32_t *amplitudes_;
+
+  /** Records of the boards without a slot. */
+  uint64_t dropped_records_;
+};
+
+/** ufe_monitor type */
+typedef struct ufe_monitor ufe_monitor;
+
+
+/** \brief Sets the default configuration: hits Id 0x2 (leading time edge), amplitudes Id 0x4
+ *  (high gain), channel in the bits 20-26, 12-bit amplitude in 256 bins, 16 boards, one snapshot
+ *  per second, no sampling.
+ *  \param config: The configuration.
+ */
+void ufe_monitor_default_config(ufe_monitor_config *config);
+
+
+/** \brief Creates a monitor.
+ *  \param mon: Output location for the monitor.
+ *  \param config: The configuration (copied).
+ *  \returns 0 on success, or UFE_INVALID_ARG_ERROR if the configuration is not valid.
+ */
+int ufe_monitor_create(ufe_monitor **mon, const ufe_monitor_config *config);
+
+
+/** \brief Decodes one record, and takes a snapshot if the interval is over.
+ *  \param mon: The monitor.
+ *  \param data: The record (ufe_block_header + data).
+ *  \param size: Size of the record.
+ *  \returns 0 on success, or UFE_INVALID_ARG_ERROR if the record has no valid header.
+ */
+int ufe_monitor_add_record(ufe_monitor *mon, const uint8_t *data, size_t size);
+
+
+/** \brief Takes a snapshot if the interval is over. Must be called regularly when no records
+ *  arrive, by the thread adding the records.
+ *  \param mon: The monitor.
+ *  \returns True if a snapshot has been taken.
+ */
+bool ufe_monitor_poll(ufe_monitor *mon);
+
+
+/** \brief Takes a snapshot now (e.g. at the end of the data) and starts a new interval.
+ *  \param mon: The monitor.
+ */
+void ufe_monitor_publish(ufe_monitor *mon);
+
+
+/** \brief Gets the time left until the next snapshot.
+ *  \param mon: The monitor.
+ *  \returns The time left (ms).
+ */
+int ufe_monitor_time_left(ufe_monitor *mon);
+
+
+/** \brief Prints a snapshot: one summary line per board, or one line per channel with the full
+ *  amplitude histogram.
+ *  \param snapshot: The snapshot.
+ *  \param channels: If true, prints the channels.
+ *  \param file: Output stream (e.g. stdout).
+ */
+void ufe_monitor_dump(const ufe_monitor_snapshot *snapshot, bool channels, FILE *file);
+
+
+/** \brief Frees a monitor.
+ *  \param mon: The monitor.
+ */
+void ufe_monitor_destroy(ufe_monitor *mon);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
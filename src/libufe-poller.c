@@ -0,0 +1,193 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-poller.h"
+
+extern ufe_context *ufe_context_handler;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+int ufe_poller_open(ufe_poller **poller,
+                    libusb_device_handle **handles,
+                    const int *board_ids,
+                    int n_boards) {
+  if (n_boards < 1)
+    return UFE_INVALID_ARG_ERROR;
+
+  ufe_poller *p = (ufe_poller*) calloc(1, sizeof(ufe_poller));
+  if (!p)
+    return LIBUSB_ERROR_NO_MEM;
+
+  p->boards_ = (struct ufe_poller_board*) calloc(n_boards, sizeof(struct ufe_poller_board));
+  p->changes_ = (ufe_status_change*) calloc(n_boards, sizeof(ufe_status_change));
+  if (!p->boards_ || !p->changes_) {
+    ufe_poller_close(p);
+    return LIBUSB_ERROR_NO_MEM;
+  }
+
+  int i;
+  p->n_boards_ = n_boards;
+  for (i = 0; i < n_boards; ++i) {
+    p->boards_[i].handle_ = handles[i];
+    p->boards_[i].board_id_ = board_ids[i];
+    p->boards_[i].poller_ = p;
+  }
+
+  ufe_histo_reset(&p->latency_);
+  *poller = p;
+  return 0;
+}
+
+static void status_done(ufe_async_command *cmd, void *user_data) {
+  struct ufe_poller_board *b = (struct ufe_poller_board*) user_data;
+  b->poller_->n_pending_--;
+}
+
+int ufe_poller_poll(ufe_poller *poller, const ufe_status_change **changes, int *n_changes) {
+  uint64_t start = now_ns();
+  int i, status = 0;
+
+  // All commands are sent first, the boards answer in parallel.
+  poller->n_pending_ = 0;
+  for (i = 0; i < poller->n_boards_; ++i) {
+    struct ufe_poller_board *b = &poller->boards_[i];
+    poller->n_pending_++;
+    int submit_status = ufe_async_read_status(&b->cmd_, b->handle_, b->board_id_, &b->answer_,
+                                              &status_done, b);
+    if (submit_status != 0) {
+      b->cmd_.status_ = submit_status;
+      poller->n_pending_--;
+    }
+  }
+
+  // The commands time out by themselves (UFE_CMD_TIMEOUT), they must all be complete before the
+  // next poll reuses them.
+  while (poller->n_pending_ > 0) {
+    int events_status = ufe_async_handle_events(UFE_ASYNC_POLL_MS);
+    if (events_status != 0 && status == 0)
+      status = events_status;
+  }
+
+  poller->n_changes_ = 0;
+  for (i = 0; i < poller->n_boards_; ++i) {
+    struct ufe_poller_board *b = &poller->boards_[i];
+    int error = b->cmd_.status_;
+    uint16_t new_status = (error == 0)? b->answer_ : b->status_;
+    if (error != 0 && status == 0)
+      status = error;
+
+    // The first poll reports every board, so that the consumers start from the full status.
+    if (poller->n_polls_ > 0 && new_status == b->status_ && error == b->error_)
+      continue;
+
+    ufe_status_change *c = &poller->changes_[poller->n_changes_++];
+    c->board_id_ = b->board_id_;
+    c->status_ = new_status;
+    c->changed_ = new_status ^ b->status_;
+    c->error_ = error;
+    b->status_ = new_status;
+    b->error_ = error;
+  }
+
+  poller->n_polls_++;
+  ufe_histo_add(&poller->latency_, now_ns() - start);
+  *changes = poller->changes_;
+  *n_changes = poller->n_changes_;
+  return status;
+}
+
+const char* ufe_status_bit_name(uint16_t bit) {
+  switch (bit) {
+    case RS_GTEN       : return "GTEN";
+    case RS_AVE        : return "AVE";
+    case RS_L0F_ERR    : return "L0F_ERR";
+    case RS_L1F_ERR    : return "L1F_ERR";
+    case RS_L2F_ERR    : return "L2F_ERR";
+    case RS_MUX_ERR    : return "MUX_ERR";
+    case RS_L1_ADC_ERR : return "L1_ADC_ERR";
+    case RS_VW_ASIC0   : return "VW_ASIC0";
+    case RS_VW_ASIC1   : return "VW_ASIC1";
+    case RS_VW_ASIC2   : return "VW_ASIC2";
+    case RS_VW_FPGA    : return "VW_FPGA";
+    case RS_HVON       : return "HVON";
+    case RS_IGEN       : return "IGEN";
+  }
+
+  return "?";
+}
+
+int ufe_sprint_status_change(const ufe_status_change *change, char *buffer, size_t size) {
+  int n = snprintf(buffer, size, "board %i: 0x%x", change->board_id_, change->status_);
+  uint16_t bit;
+  for (bit = 1; bit & UFE_RS_ALL; bit <<= 1)
+    if ((change->changed_ & bit) && n < (int) size)
+      n += snprintf(buffer + n, size - n, " %s%c", ufe_status_bit_name(bit),
+                    (change->status_ & bit)? '+' : '-');
+
+  if (n < (int) size)
+    n += snprintf(buffer + n, size - n, (change->error_)? " error %i" : " ok", change->error_);
+
+  return n;
+}
+
+void ufe_dump_status_changes(const ufe_status_change *changes, int n_changes, FILE *file) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  char line[256];
+  int i;
+  for (i = 0; i < n_changes; ++i) {
+    ufe_sprint_status_change(&changes[i], line, sizeof(line));
+    fprintf(file, "%ld.%03ld %s\n", (long) ts.tv_sec, ts.tv_nsec/1000000, line);
+  }
+}
+
+void ufe_publish_status_changes(const ufe_status_change *changes, int n_changes) {
+#ifdef ZMQ_ENABLE
+  if (n_changes == 0)
+    return;
+
+  size_t size = 256*(n_changes + 1);
+  char *buffer = (char*) malloc(size);
+  int i, n = snprintf(buffer, size, "### Status from %s:\n", ufe_context_handler->host_name_);
+  for (i = 0; i < n_changes; ++i) {
+    n += ufe_sprint_status_change(&changes[i], buffer + n, size - n - 1);
+    buffer[n++] = '\n';
+    buffer[n] = '\0';
+  }
+
+  s_send(ufe_context_handler->publisher_socket_, buffer);
+  free(buffer);
+#endif
+}
+
+void ufe_poller_close(ufe_poller *poller) {
+  free(poller->boards_);
+  free(poller->changes_);
+  free(poller);
+}
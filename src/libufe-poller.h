@@ -0,0 +1,175 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-poller.h
+ *  \brief   File containing the periodic polling of the status of many boards. The handles stay
+ *  open between the polls, and the READ_STATUS commands of all boards are sent at the same time
+ *  (see libufe-async.h), so a poll of the whole detector takes about one command round trip. The
+ *  first poll reports every board, with the bits set as changed. The next polls report only the
+ *  changes: the bits which changed since the previous poll of the board, and the appearance or
+ *  disappearance of errors.
+ */
+
+#ifndef LIBUFE_POLLER_H
+#define LIBUFE_POLLER_H 1
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libufe.h"
+#include "libufe-async.h"
+#include "libufe-histo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Default interval between two polls (ms). */
+#define UFE_POLLER_INTERVAL 2000
+
+/** All bits of the READ_STATUS answer (see ufe_read_status_answ_args). */
+#define UFE_RS_ALL 0x1FFF
+
+/** \brief Change of the status of a board. */
+struct ufe_status_change {
+  /** Board Id. */
+  int board_id_;
+
+  /** The status. If the poll failed, the last status read. */
+  uint16_t status_;
+
+  /** Bits which changed since the previous status. */
+  uint16_t changed_;
+
+  /** 0, or the LIBUSB_ERROR / UFE_ERROR code of the poll. */
+  int error_;
+};
+
+/** ufe_status_change type */
+typedef struct ufe_status_change ufe_status_change;
+
+/** \brief State of one board of a poller. */
+struct ufe_poller_board {
+  libusb_device_handle *handle_;
+  int board_id_;
+
+  /** The READ_STATUS command in progress. */
+  ufe_async_command cmd_;
+
+  /** The status read by the command. */
+  uint16_t answer_;
+
+  /** The last status read, and the result of the last poll. */
+  uint16_t status_;
+  int error_;
+
+  struct ufe_poller *poller_;
+};
+
+/** \brief Structure representing a poller. */
+struct ufe_poller {
+  int n_boards_;
+  struct ufe_poller_board *boards_;
+
+  /** Number of commands not complete. */
+  int n_pending_;
+
+  /** The changes found by the last poll. */
+  ufe_status_change *changes_;
+  int n_changes_;
+
+  /** Number of polls. */
+  uint64_t n_polls_;
+
+  /** Duration of the polls (ns). */
+  ufe_histo latency_;
+};
+
+/** ufe_poller type */
+typedef struct ufe_poller ufe_poller;
+
+
+/** \brief Creates a poller for a list of open boards. Must be called within an existing (already
+ *  open) usb session.
+ *  \param poller: Output location for the poller.
+ *  \param handles: The device handles of the boards. They must stay open while the poller is used.
+ *  \param board_ids: The board Ids.
+ *  \param n_boards: Number of boards.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_poller_open(ufe_poller **poller,
+                    libusb_device_handle **handles,
+                    const int *board_ids,
+                    int n_boards);
+
+
+/** \brief Reads the status of all boards, at the same time, and finds the changes. The first poll
+ *  reports all boards.
+ *  \param poller: The poller.
+ *  \param changes: Output location for the changes, valid until the next poll.
+ *  \param n_changes: Output location for the number of changes.
+ *  \returns 0 on success, or the error of the first board which failed.
+ */
+int ufe_poller_poll(ufe_poller *poller, const ufe_status_change **changes, int *n_changes);
+
+
+/** \brief Gets the name of a status bit.
+ *  \param bit: One of ufe_read_status_answ_args.
+ *  \returns The name (e.g. "HVON"), or "?".
+ */
+const char* ufe_status_bit_name(uint16_t bit);
+
+
+/** \brief Prints a change on one line (e.g. "board 3: HVON+ GTEN-").
+ *  \param change: The change.
+ *  \param buffer: Output location for the text.
+ *  \param size: Size of the output location.
+ *  \returns The length of the text (as snprintf).
+ */
+int ufe_sprint_status_change(const ufe_status_change *change, char *buffer, size_t size);
+
+
+/** \brief Prints a list of changes, one per line, after a time stamp.
+ *  \param changes: The changes.
+ *  \param n_changes: Number of changes.
+ *  \param file: Output stream (e.g. stdout).
+ */
+void ufe_dump_status_changes(const ufe_status_change *changes, int n_changes, FILE *file);
+
+
+/** \brief Publishes a list of changes on the network (if enabled, see ZMQ_ENABLE).
+ *  \param changes: The changes.
+ *  \param n_changes: Number of changes.
+ */
+void ufe_publish_status_changes(const ufe_status_change *changes, int n_changes);
+
+
+/** \brief Frees a poller. The handles are not closed.
+ *  \param poller: The poller.
+ */
+void ufe_poller_close(ufe_poller *poller);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-pool.h"
+#include "libufe-affinity.h"
+
+static size_t round_up(size_t size, size_t unit) {
+  return (size + unit - 1)/unit*unit;
+}
+
+// Maps size bytes (a multiple of UFE_HUGEPAGE_SIZE), aligned to a hugepage, so that the kernel
+// can back the whole mapping with transparent hugepages.
+static uint8_t* map_aligned(size_t size) {
+  uint8_t *map = (uint8_t*) mmap(NULL, size + UFE_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  uint8_t *data = (uint8_t*) round_up((uintptr_t) map, UFE_HUGEPAGE_SIZE);
+  if (data > map)
+    munmap(map, data - map);
+
+  if (data + size < map + size + UFE_HUGEPAGE_SIZE)
+    munmap(data + size, map + size + UFE_HUGEPAGE_SIZE - (data + size));
+
+  return data;
+}
+
+static uint8_t* map_pool(ufe_pool *p, size_t size, int flags) {
+  uint8_t *data = NULL;
+  p->pages_ = UFE_POOL_REGULAR_PAGES;
+  p->size_ = size;
+  if (!(flags & UFE_POOL_HUGEPAGES)) {
+    data = (uint8_t*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (data == MAP_FAILED)? NULL : data;
+  }
+
+  p->size_ = round_up(size, UFE_HUGEPAGE_SIZE);
+#ifdef MAP_HUGETLB
+  data = (uint8_t*) mmap(NULL, p->size_, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (data != MAP_FAILED) {
+    p->pages_ = UFE_POOL_HUGETLB;
+    return data;
+  }
+
+  ufe_debug_print("no hugepages reserved (%s), trying transparent hugepages.", strerror(errno));
+#endif
+
+  data = map_aligned(p->size_);
+#ifdef MADV_HUGEPAGE
+  if (data && madvise(data, p->size_, MADV_HUGEPAGE) == 0)
+    p->pages_ = UFE_POOL_THP;
+#endif
+
+  if (data && p->pages_ == UFE_POOL_REGULAR_PAGES)
+    ufe_warning_print("no hugepages available for the readout buffers.");
+
+  return data;
+}
+
+int ufe_pool_create(ufe_pool **pool, int n_blocks, size_t block_size, int flags, int node) {
+  if (n_blocks < 1 || block_size == 0)
+    return UFE_INVALID_ARG_ERROR;
+
+  ufe_pool *p = (ufe_pool*) calloc(1, sizeof(ufe_pool));
+  if (!p)
+    return LIBUSB_ERROR_NO_MEM;
+
+  // Whole pages, so that a block can be given to a pipe without sharing a page with anything else.
+  size_t page = sysconf(_SC_PAGESIZE);
+  p->block_size_ = round_up(block_size, page);
+  p->n_blocks_ = n_blocks;
+  p->data_ = map_pool(p, p->block_size_*n_blocks, flags);
+  if (!p->data_) {
+    ufe_error_print("cannot allocate %zu bytes of readout buffers (%s).", p->size_, strerror(errno));
+    free(p);
+    return LIBUSB_ERROR_NO_MEM;
+  }
+
+  // Before any page is faulted in.
+  p->node_ = node;
+  if (node >= 0 && ufe_bind_memory(p->data_, p->size_, node) != 0)
+    p->node_ = -1;
+
+  if (flags & UFE_POOL_MLOCK) {
+    // Locking faults in the whole pool.
+    p->locked_ = (mlock(p->data_, p->size_) == 0);
+    if (!p->locked_)
+      ufe_warning_print("cannot lock the readout buffers in memory (%s).", strerror(errno));
+  }
+
+  if ((flags & UFE_POOL_PREFAULT) && !p->locked_) {
+    // Every small page, transparent hugepages may be only partially granted.
+    size_t pos;
+    for (pos = 0; pos < p->size_; pos += page)
+      ((volatile uint8_t*) p->data_)[pos] = 0;
+  }
+
+  *pool = p;
+  return 0;
+}
+
+uint8_t* ufe_pool_block(ufe_pool *pool, int i) {
+  return pool->data_ + i*pool->block_size_;
+}
+
+void ufe_pool_print(ufe_pool *pool) {
+  static const char *pages[3] = {"regular pages", "transparent hugepages", "hugepages"};
+  ufe_info_print("readout buffers: %i blocks of %zu bytes, %.1f MB in %s%s, NUMA node %i.",
+                 pool->n_blocks_, pool->block_size_, pool->size_/(1024.*1024.),
+                 pages[pool->pages_], (pool->locked_)? ", locked" : "", pool->node_);
+}
+
+void ufe_pool_destroy(ufe_pool *pool) {
+  if (!pool)
+    return;
+
+  // munmap also unlocks the pages.
+  munmap(pool->data_, pool->size_);
+  free(pool);
+}
@@ -0,0 +1,127 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-pool.h
+ *  \brief   File containing the pool of readout buffers. The blocks of the pool are carved out of
+ *  one mapping, backed by 2 MB hugepages if the system has them reserved, by transparent
+ *  hugepages otherwise, or by regular pages as a last resort. The pool can be locked in memory
+ *  and pre-faulted when it is created, so that the readout and the writers do not take page
+ *  faults during the run. Every block starts on a page boundary.
+ */
+
+#ifndef LIBUFE_POOL_H
+#define LIBUFE_POOL_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Size of a hugepage (bytes). */
+#define UFE_HUGEPAGE_SIZE (2*1024*1024)
+
+/** Allocation flags of a pool (see ufe_context::readout_pool_flags_). */
+enum ufe_pool_flags {
+  /** Try hugepages first, then transparent hugepages. */
+  UFE_POOL_HUGEPAGES = 0x1,
+
+  /** Lock the pool in memory (mlock). Needs a large enough RLIMIT_MEMLOCK. */
+  UFE_POOL_MLOCK     = 0x2,
+
+  /** Touch every page of the pool when it is created. */
+  UFE_POOL_PREFAULT  = 0x4
+};
+
+/** The pages backing a pool. */
+enum ufe_pool_pages {
+  UFE_POOL_REGULAR_PAGES = 0,
+  UFE_POOL_THP           = 1,
+  UFE_POOL_HUGETLB       = 2
+};
+
+/** \brief Structure representing a pool of readout blocks. */
+struct ufe_pool {
+  /** Start of the mapping. */
+  uint8_t *data_;
+
+  /** Size of the mapping (bytes). This is the memory footprint of the pool. */
+  size_t size_;
+
+  /** Distance between two blocks: the requested block size, rounded up to whole pages. */
+  size_t block_size_;
+
+  /** Number of blocks. */
+  int n_blocks_;
+
+  /** ufe_pool_pages. */
+  int pages_;
+
+  /** True if the pool is locked in memory. */
+  bool locked_;
+
+  /** Preferred NUMA node of the pool, or -1. */
+  int node_;
+};
+
+/** ufe_pool type */
+typedef struct ufe_pool ufe_pool;
+
+
+/** \brief Allocates a pool of blocks. A failure to get hugepages, to lock the memory or to place it
+ *  on the NUMA node is not an error: the pool falls back to regular pages, stays unlocked, or is
+ *  placed by the kernel, with a warning.
+ *  \param pool: Output location for the pool.
+ *  \param n_blocks: Number of blocks.
+ *  \param block_size: Minimum size of each block (bytes).
+ *  \param flags: A combination of ufe_pool_flags.
+ *  \param node: Preferred NUMA node of the memory, or -1.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_pool_create(ufe_pool **pool, int n_blocks, size_t block_size, int flags, int node);
+
+
+/** \brief Gets a block of a pool.
+ *  \param pool: The pool.
+ *  \param i: Index of the block.
+ *  \returns The start of the block.
+ */
+uint8_t* ufe_pool_block(ufe_pool *pool, int i);
+
+
+/** \brief Prints the memory footprint of a pool (info level).
+ *  \param pool: The pool.
+ */
+void ufe_pool_print(ufe_pool *pool);
+
+
+/** \brief Releases a pool.
+ *  \param pool: The pool. Can be NULL.
+ */
+void ufe_pool_destroy(ufe_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
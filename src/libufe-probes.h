@@ -0,0 +1,68 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-probes.h
+ *  \brief   File containing the USDT (SystemTap / DTrace style) static probes of the library.
+ *  The probes are compiled in if sys/sdt.h is found by cmake (UFE_SDT defined). Each probe is a
+ *  single nop instruction, until a tracer attaches to it. The provider name is libufec.
+ *
+ *  Probe                    Arguments
+ *  set_sync_entry           ep, size
+ *  set_sync_return          ep, size, status
+ *  get_sync_entry           ep, size
+ *  get_sync_return          ep, size, status
+ *  read_buffer_entry        size
+ *  read_buffer_return       actual, status
+ *  send_command_entry       board_id, command_id, sub_cmd_id, argc
+ *  send_command_return      board_id, command_id, status
+ *  command_answer_entry     board_id, command_id, argc
+ *  command_answer_return    board_id, command_id, status
+ *  block_push               board_id, seq, size  (readout thread hands a block to its writer)
+ *  block_pop                board_id, seq, size  (the writer takes the block)
+ *  stream_recovery          board_id, transfer status, recovery status
+ *  ring_write               size, write position
+ *  ring_read                size, read position
+ *
+ *  Example:  bpftrace -e 'usdt:lib/libufec.so:libufec:read_buffer_return { @[arg1] = hist(arg0); }'
+ */
+
+#ifndef LIBUFE_PROBES_H
+#define LIBUFE_PROBES_H 1
+
+#ifdef UFE_SDT
+
+#include <sys/sdt.h>
+
+#define UFE_PROBE1(name, a)           DTRACE_PROBE1(libufec, name, a)
+#define UFE_PROBE2(name, a, b)        DTRACE_PROBE2(libufec, name, a, b)
+#define UFE_PROBE3(name, a, b, c)     DTRACE_PROBE3(libufec, name, a, b, c)
+#define UFE_PROBE4(name, a, b, c, d)  DTRACE_PROBE4(libufec, name, a, b, c, d)
+
+#else
+
+#define UFE_PROBE1(name, a)
+#define UFE_PROBE2(name, a, b)
+#define UFE_PROBE3(name, a, b, c)
+#define UFE_PROBE4(name, a, b, c, d)
+
+#endif
+
+#endif
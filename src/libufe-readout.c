@@ -0,0 +1,1209 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-trace.h"
+#include "libufe-probes.h"
+#include "libufe-readout.h"
+#include "libufe-registry.h"
+
+extern ufe_context *ufe_context_handler;
+
+#define STAT_ADD(field, n)  __atomic_add_fetch(&(field), (n), __ATOMIC_RELAXED)
+#define STAT_LOAD(field)    __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STAT_STORE(field, n) __atomic_store_n(&(field), (n), __ATOMIC_RELAXED)
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static int write_all(int fd, const struct iovec *iov, int iovcnt) {
+  struct iovec v[2];
+  memcpy(v, iov, iovcnt*sizeof(struct iovec));
+
+  int i = 0;
+  while (i < iovcnt) {
+    ssize_t actual = writev(fd, v+i, iovcnt-i);
+    if (actual < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return -1;
+    }
+
+    // Skip what has been written. Pipes and sockets may accept only a part of the data.
+    while (i < iovcnt && actual >= (ssize_t) v[i].iov_len) {
+      actual -= v[i].iov_len;
+      ++i;
+    }
+
+    if (i < iovcnt) {
+      v[i].iov_base = (uint8_t*) v[i].iov_base + actual;
+      v[i].iov_len -= actual;
+    }
+  }
+
+  return 0;
+}
+
+static struct ufe_readout_block* pop_free_block(struct ufe_readout_stream *s) {
+  pthread_mutex_lock(&s->mutex_);
+  uint64_t start_ns = 0;
+  if (s->free_ == NULL) {
+    STAT_ADD(s->stats_.n_stalls_, 1);
+    start_ns = ufe_trace_begin();
+  }
+
+  while (s->free_ == NULL)
+    pthread_cond_wait(&s->cond_, &s->mutex_);
+
+  struct ufe_readout_block *b = s->free_;
+  s->free_ = b->next_;
+  pthread_mutex_unlock(&s->mutex_);
+
+  ufe_trace_end("readout", "wait_free_block", start_ns, "board", s->board_id_, NULL, 0);
+
+  b->next_ = NULL;
+  return b;
+}
+
+static void push_free_block(struct ufe_readout_block *b) {
+  struct ufe_readout_stream *s = b->stream_;
+  pthread_mutex_lock(&s->mutex_);
+  b->next_ = s->free_;
+  s->free_ = b;
+  pthread_cond_signal(&s->cond_);
+  pthread_mutex_unlock(&s->mutex_);
+}
+
+// Identifies a block in the trace, from its readout to its output.
+static uint64_t block_flow_id(struct ufe_readout_block *b) {
+  return ((uint64_t) b->stream_->board_id_ << 32) | b->seq_;
+}
+
+static void push_filled_block(struct ufe_readout_block *b) {
+  struct ufe_readout_writer *w = b->stream_->writer_;
+  ufe_stream_stats *stats = &b->stream_->stats_;
+  uint32_t n_queued = STAT_ADD(stats->blocks_queued_, 1);
+  if (n_queued > stats->max_blocks_queued_)
+    __atomic_store_n(&stats->max_blocks_queued_, n_queued, __ATOMIC_RELAXED);
+
+  ufe_trace_flow("block", block_flow_id(b), true);
+  UFE_PROBE3(block_push, b->stream_->board_id_, b->seq_, b->size_);
+
+  pthread_mutex_lock(&w->mutex_);
+  if (w->tail_)
+    w->tail_->next_ = b;
+  else
+    w->head_ = b;
+
+  w->tail_ = b;
+  pthread_cond_signal(&w->cond_);
+  pthread_mutex_unlock(&w->mutex_);
+}
+
+static struct ufe_readout_block* pop_filled_block(struct ufe_readout_writer *w) {
+  pthread_mutex_lock(&w->mutex_);
+  while (w->head_ == NULL)
+    pthread_cond_wait(&w->cond_, &w->mutex_);
+
+  struct ufe_readout_block *b = w->head_;
+  w->head_ = b->next_;
+  if (w->head_ == NULL)
+    w->tail_ = NULL;
+
+  pthread_mutex_unlock(&w->mutex_);
+
+  b->next_ = NULL;
+  return b;
+}
+
+// Returns to their streams the blocks already read out of the pipe by the consumer.
+// Must be called with out_mutex_ locked.
+static void recycle_pipe_blocks(struct ufe_readout_pipe *p) {
+  int unread = 0;
+  if (p->head_ == NULL || ioctl(p->fd_, FIONREAD, &unread) != 0)
+    return;
+
+  uint64_t consumed = p->n_written_ - unread;
+  while (p->head_ && p->head_->pipe_end_ <= consumed) {
+    struct ufe_readout_block *b = p->head_;
+    p->head_ = b->next_;
+    if (p->head_ == NULL)
+      p->tail_ = NULL;
+
+    b->stream_->n_in_pipe_--;
+    push_free_block(b);
+  }
+}
+
+// Moves the pages of the block into the pipe. Returns 1 if the pipe keeps the block, 0 if the data
+// has been copied, or -1 on error. Must be called with out_mutex_ locked.
+static int splice_block(struct ufe_readout_pipe *p, struct ufe_readout_block *b, ufe_block_header *header) {
+  struct ufe_readout_stream *s = b->stream_;
+  struct iovec v;
+  bool in_pipe = false;
+
+  if (header) {
+    // The header lives on the stack. Copy it.
+    v.iov_base = header;
+    v.iov_len  = sizeof(ufe_block_header);
+    if (write_all(p->fd_, &v, 1) != 0)
+      return -1;
+
+    p->n_written_ += v.iov_len;
+  }
+
+  v.iov_base = b->data_;
+  v.iov_len  = b->size_;
+  while (v.iov_len > 0 && p->splice_) {
+    ssize_t actual = vmsplice(p->fd_, &v, 1, SPLICE_F_GIFT);
+    if (actual < 0) {
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EINVAL && errno != ENOSYS)
+        return -1;
+
+      ufe_warning_print("vmsplice is not supported. The data will be copied into the pipe.");
+      p->splice_ = false;
+      break;
+    }
+
+    in_pipe = true;
+    v.iov_base = (uint8_t*) v.iov_base + actual;
+    v.iov_len -= actual;
+  }
+
+  if (v.iov_len > 0 && write_all(p->fd_, &v, 1) != 0)
+    return -1;
+
+  p->n_written_ += b->size_;
+  if (!in_pipe)
+    return 0;
+
+  b->pipe_end_ = p->n_written_;
+  b->next_ = NULL;
+  if (p->tail_)
+    p->tail_->next_ = b;
+  else
+    p->head_ = b;
+
+  p->tail_ = b;
+  s->n_in_pipe_++;
+  return 1;
+}
+
+// Waits until at least half of the blocks of the stream are available for the readout again.
+// out_mutex_ is only held to recycle the blocks, never while sleeping, so that the other writers
+// can go on. Returns 0 on success, or UFE_IO_ERROR if the consumer of the pipe is gone.
+static int wait_pipe(struct ufe_readout_stream *s) {
+  struct ufe_readout_pipe *p = s->pipe_;
+  struct ufe_readout *ro = s->ro_;
+
+  for (;;) {
+    pthread_mutex_lock(&ro->out_mutex_);
+    recycle_pipe_blocks(p);
+    bool full = (s->n_in_pipe_ > ro->n_blocks_/2);
+    pthread_mutex_unlock(&ro->out_mutex_);
+    if (!full)
+      return 0;
+
+    struct pollfd pfd = {p->fd_, 0, 0};
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLERR)) {
+      // The consumer is gone. Nobody will read the data still in the pipe.
+      pthread_mutex_lock(&ro->out_mutex_);
+      while (p->head_) {
+        struct ufe_readout_block *x = p->head_;
+        p->head_ = x->next_;
+        x->stream_->n_in_pipe_--;
+        push_free_block(x);
+      }
+
+      p->tail_ = NULL;
+      pthread_mutex_unlock(&ro->out_mutex_);
+      ufe_error_print("cannot write data of board %i (%s).", s->board_id_, strerror(EPIPE));
+      return UFE_IO_ERROR;
+    }
+
+    ufe_usleep(100);
+  }
+}
+
+// Returns 1 if the block is kept by a pipe (it will be recycled later), 0 if it can be reused
+// immediately, or an error code. An empty block is the end of the stream if eos is true, else a
+// block emptied by the filter.
+static int write_block(struct ufe_readout_block *b, bool eos) {
+  struct ufe_readout_stream *s = b->stream_;
+  struct ufe_readout *ro = s->ro_;
+  struct iovec iov[2];
+  int status;
+
+  if (s->pipe_ && b->size_ > 0) {
+    ufe_block_header header;
+    header.magic_    = UFE_BLOCK_MAGIC;
+    header.board_id_ = s->board_id_;
+    header.flags_    = b->flags_;
+    header.seq_      = b->seq_;
+    header.size_     = b->size_;
+
+    pthread_mutex_lock(&ro->out_mutex_);
+    status = splice_block(s->pipe_, b, (ro->container_)? &header : NULL);
+    pthread_mutex_unlock(&ro->out_mutex_);
+    if (status >= 0)
+      return status;
+  } else if (ro->container_ || s->ring_) {
+    ufe_block_header header;
+    header.magic_    = UFE_BLOCK_MAGIC;
+    header.board_id_ = s->board_id_;
+    header.flags_    = (eos)? UFE_BLOCK_EOS : b->flags_;
+    header.seq_      = b->seq_;
+    header.size_     = b->size_;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = b->data_;
+    iov[1].iov_len  = b->size_;
+
+    pthread_mutex_lock(&ro->out_mutex_);
+    if (s->ring_)
+      status = ufe_ring_writev(s->ring_, iov, 2);
+    else
+      status = write_all(s->fd_, iov, (b->size_)? 2 : 1);
+
+    pthread_mutex_unlock(&ro->out_mutex_);
+  } else {
+    if (b->size_ == 0)
+      return 0;
+
+    iov[0].iov_base = b->data_;
+    iov[0].iov_len  = b->size_;
+    status = write_all(s->fd_, iov, 1);
+  }
+
+  if (status != 0) {
+    ufe_error_print("cannot write data of board %i (%s).", s->board_id_, strerror(errno));
+    return UFE_IO_ERROR;
+  }
+
+  return 0;
+}
+
+static void* writer_job(void *arg) {
+  struct ufe_readout_writer *w = (struct ufe_readout_writer*) arg;
+  int status = 0;
+
+  char name[16];
+  snprintf(name, sizeof(name), "ufe-writer %i", (int) (w - w->ro_->writers_));
+  pthread_setname_np(pthread_self(), name);
+
+  while (w->n_done_ < w->n_streams_) {
+    struct ufe_readout_block *b = pop_filled_block(w);
+    if (b->size_ == 0)
+      ++w->n_done_;
+
+    struct ufe_readout_stream *s = b->stream_;
+    int kept = 0;
+    bool eos = (b->size_ == 0);
+    ufe_trace_flow("block", block_flow_id(b), false);
+    UFE_PROBE3(block_pop, s->board_id_, b->seq_, b->size_);
+
+    if (!eos && w->ro_->filter_) {
+      b->size_ = ufe_filter_block(&s->filter_, b->data_, b->size_);
+      b->flags_ |= UFE_BLOCK_FILTERED;
+      STAT_STORE(s->stats_.filtered_bytes_, s->filter_.bytes_in_ - s->filter_.bytes_out_);
+      STAT_STORE(s->stats_.empty_frames_, s->filter_.empty_frames_);
+      STAT_STORE(s->stats_.dropped_beacons_, s->filter_.dropped_beacons_);
+    }
+
+    // After an error keep consuming the blocks, so that the readout threads are never blocked.
+    // A block emptied by the filter is written as a record without data (UFE_BLOCK_FILTERED), so
+    // that the sequence numbers stay contiguous.
+    if (status == 0 && (s->fd_ >= 0 || s->ring_)) {
+      // A block kept by a pipe may be recycled by another writer as soon as out_mutex_ is released.
+      int size = b->size_;
+      uint64_t time_ns = b->time_ns_;
+      uint64_t start = now_ns();
+      kept = write_block(b, eos);
+      status = (kept < 0)? kept : 0;
+      if (kept == 1)
+        status = wait_pipe(s);
+
+      uint64_t end = now_ns();
+      ufe_trace_end("readout", "write_block", start, "board", s->board_id_, "bytes", size);
+      STAT_ADD(s->stats_.write_ns_, end - start);
+      if (size)
+        ufe_histo_add(&s->latency_, end - time_ns);
+    }
+
+    STAT_ADD(s->stats_.blocks_queued_, -1);
+
+    if (kept != 1)
+      push_free_block(b);
+  }
+
+  return NULL;
+}
+
+static void count_transfer(struct ufe_readout_stream *s, int status, int size, uint64_t time_ns) {
+  ufe_stream_stats *stats = &s->stats_;
+  STAT_ADD(stats->usb_ns_, time_ns);
+  if (status == LIBUSB_ERROR_TIMEOUT)
+    STAT_ADD(stats->timeouts_, 1);
+  else if (status != 0)
+    STAT_ADD(stats->errors_, 1);
+
+  if (size <= 0)
+    return;
+
+  STAT_ADD(stats->bytes_, size);
+  STAT_ADD(stats->transfers_, 1);
+  if (size < ufe_context_handler->readout_buffer_size_)
+    STAT_ADD(stats->short_reads_, 1);
+
+  int bin = 0;
+  while ((size >> (bin + 1)) && bin < UFE_STATS_N_BINS - 1)
+    ++bin;
+
+  STAT_ADD(stats->size_hist_[bin], 1);
+}
+
+/** Number of consecutive empty transfers considered as a stuck endpoint. */
+#define STUCK_READS 3
+
+// Clears the halt of EP1 IN and resets the endpoint. Returns 0 if the stream can go on.
+static int recover_stream(struct ufe_readout_stream *s) {
+  ufe_warning_print("EP1 of board %i failed ( %i ), recovering.", s->board_id_, s->status_);
+  uint64_t start_ns = ufe_trace_begin();
+  int status = ufe_usb()->clear_halt(s->handle_, UFE_USB_EP1_IN | LIBUSB_ENDPOINT_IN);
+  if (status == 0)
+    status = ufe_epxin_reset(s->handle_, UFE_USB_EP1_IN & ~LIBUSB_ENDPOINT_IN);
+
+  ufe_trace_end("readout", "recover", start_ns, "board", s->board_id_, "status", s->status_);
+  UFE_PROBE3(stream_recovery, s->board_id_, s->status_, status);
+  if (status != 0) {
+    ufe_error_print("cannot recover EP1 of board %i ( %i ).", s->board_id_, status);
+    return status;
+  }
+
+  STAT_ADD(s->stats_.recoveries_, 1);
+  return 0;
+}
+
+static void* stream_job(void *arg) {
+  struct ufe_readout_stream *s = (struct ufe_readout_stream*) arg;
+  struct ufe_readout *ro = s->ro_;
+  struct ufe_readout_block *b;
+
+  char name[16];
+  snprintf(name, sizeof(name), "ufe-board %i", s->board_id_);
+  pthread_setname_np(pthread_self(), name);
+
+  // Recoveries and empty transfers since the last data.
+  int n_recoveries = 0, n_empty = 0;
+  uint16_t flags = 0;
+  while (1) {
+    b = pop_free_block(s);
+    int timeout = (__atomic_load_n(&ro->state_, __ATOMIC_ACQUIRE) == UFE_READOUT_RUNNING)?
+                  ufe_context_handler->readout_timeout_ : UFE_READOUT_DRAIN_TIMEOUT;
+    uint64_t start = now_ns();
+    s->status_ = ufe_read_buffer_timeout(s->handle_, b->data_, &b->size_, timeout);
+    b->time_ns_ = now_ns();
+    count_transfer(s, s->status_, b->size_, b->time_ns_ - start);
+    // A transfer which timed out may still bring some data.
+    if ((s->status_ == 0 || s->status_ == LIBUSB_ERROR_TIMEOUT) && b->size_ > 0) {
+      b->seq_ = s->seq_++;
+      b->flags_ = flags;
+      push_filled_block(b);
+      n_recoveries = n_empty = flags = 0;
+      continue;
+    }
+
+    // The empty packet after the wrap-up is the end of the data. Once the wrap-up is sent, no
+    // more data is expected.
+    int state = __atomic_load_n(&ro->state_, __ATOMIC_ACQUIRE);
+    if (state == UFE_READOUT_DRAINING || (state == UFE_READOUT_STOPPING && s->status_ != LIBUSB_ERROR_TIMEOUT))
+      break;
+
+    if (state == UFE_READOUT_STOPPING) {
+      push_free_block(b);
+      continue;
+    }
+
+    if (ro->max_recoveries_ == 0 || s->status_ == LIBUSB_ERROR_NO_DEVICE)
+      break;
+
+    // Without trigger, the board has no data to send. Keep waiting.
+    if (s->status_ == LIBUSB_ERROR_TIMEOUT || (s->status_ == 0 && ++n_empty < STUCK_READS)) {
+      push_free_block(b);
+      continue;
+    }
+
+    if (n_recoveries == ro->max_recoveries_) {
+      ufe_error_print("EP1 of board %i failed %i times in a row.", s->board_id_, n_recoveries);
+      break;
+    }
+
+    ++n_recoveries;
+    n_empty = 0;
+    if (recover_stream(s) != 0)
+      break;
+
+    // Data may have been lost. Mark the next block.
+    flags = UFE_BLOCK_GAP;
+    push_free_block(b);
+  }
+
+  ufe_debug_print("end of the stream of board %i ( %i ).", s->board_id_, s->status_);
+
+  // Send the end of the stream.
+  b->size_ = 0;
+  b->flags_ = UFE_BLOCK_EOS;
+  b->seq_ = s->seq_++;
+  push_filled_block(b);
+
+  return NULL;
+}
+
+static ufe_readout* new_readout(int n_streams) {
+  ufe_readout *ro = (ufe_readout*) calloc(1, sizeof(ufe_readout));
+  ro->streams_ = (struct ufe_readout_stream*) calloc(n_streams, sizeof(struct ufe_readout_stream));
+  ro->n_writers_ = (n_streams < 4)? n_streams : 4;
+  ro->n_blocks_ = ufe_context_handler->readout_blocks_;
+  ro->container_ = false;
+  ro->splice_ = true;
+  ro->max_recoveries_ = UFE_READOUT_MAX_RECOVERIES;
+  ro->numa_local_ = true;
+  return ro;
+}
+
+static void add_stream(ufe_readout *ro, int board_id, libusb_device_handle *dev_handle) {
+  struct ufe_readout_stream *s = &ro->streams_[ro->n_streams_++];
+  s->board_id_ = board_id;
+  s->stats_.board_id_ = board_id;
+  s->handle_ = dev_handle;
+  s->numa_node_ = ufe_usb_numa_node(dev_handle);
+  s->fd_ = -1;
+  s->ro_ = ro;
+}
+
+// Opens the boards known by the registry, without probing the devices.
+static int open_registered(ufe_readout **readout, const int *board_ids, int n_boards) {
+  int ids[UFE_MAX_BOARDS];
+  if (board_ids == NULL) {
+    n_boards = ufe_registry_get_boards(ids, UFE_MAX_BOARDS);
+    board_ids = ids;
+  }
+
+  if (n_boards == 0) {
+    ufe_error_print("no UFE board found.");
+    return UFE_NOT_FOUND_ERROR;
+  }
+
+  ufe_readout *ro = new_readout(n_boards);
+  int i;
+  for (i = 0; i < n_boards; ++i) {
+    libusb_device_handle *dev_handle = NULL;
+    int status = ufe_registry_open(board_ids[i], &dev_handle);
+    if (dev_handle == NULL) {
+      ufe_error_print("board %i not found ( %i ).", board_ids[i], status);
+      ufe_readout_close(ro);
+      return UFE_NOT_FOUND_ERROR;
+    }
+
+    add_stream(ro, board_ids[i], dev_handle);
+  }
+
+  *readout = ro;
+  return 0;
+}
+
+/** The boards searched by ufe_readout_open(). */
+struct board_search {
+  const int *board_ids_;
+  int n_boards_;
+
+  /** The boards found so far, by any thread. */
+  bool found_[UFE_MAX_BOARDS];
+};
+
+// Finds which board is connected to this device (see ufe_probe_devices()).
+static int find_board(libusb_device_handle *dev_handle, void *arg) {
+  struct board_search *search = (struct board_search*) arg;
+  int i, n_candidates = (search->board_ids_)? search->n_boards_ : UFE_MAX_BOARDS;
+  for (i = 0; i < n_candidates; ++i) {
+    int id = (search->board_ids_)? search->board_ids_[i] : i;
+    if (__atomic_load_n(&search->found_[id], __ATOMIC_RELAXED))
+      continue;
+
+    if (ufe_check_board(dev_handle, id) == 0) {
+      __atomic_store_n(&search->found_[id], true, __ATOMIC_RELAXED);
+      return id;
+    }
+  }
+
+  return -1;
+}
+
+// Rejects a list of boards with an Id out of range or given twice.
+static int check_board_ids(const int *board_ids, int n_boards) {
+  bool listed[UFE_MAX_BOARDS] = {false};
+  int i;
+  for (i = 0; i < n_boards; ++i) {
+    int id = board_ids[i];
+    if (id < 0 || id >= UFE_MAX_BOARDS) {
+      ufe_error_print("invalid board Id %i (must be in [0, %i)).", id, UFE_MAX_BOARDS);
+      return UFE_INVALID_ARG_ERROR;
+    }
+
+    if (listed[id]) {
+      ufe_error_print("board %i listed twice.", id);
+      return UFE_INVALID_ARG_ERROR;
+    }
+
+    listed[id] = true;
+  }
+
+  return 0;
+}
+
+int ufe_readout_open(ufe_readout **readout, const int *board_ids, int n_boards) {
+  if (board_ids) {
+    int status = check_board_ids(board_ids, n_boards);
+    if (status != 0)
+      return status;
+  }
+
+  if (ufe_registry_running())
+    return open_registered(readout, board_ids, n_boards);
+
+  struct board_search search;
+  memset(&search, 0, sizeof(search));
+  search.board_ids_ = board_ids;
+  search.n_boards_ = n_boards;
+
+  // The probing is very verbose. Mute the info messages.
+  int x_verbose = ufe_set_thread_verbose(1);
+
+  ufe_probed_device *febs;
+  int n_febs = ufe_probe_devices( ufe_context_handler->usb_ctx_,
+                                  &is_bm_feb, 0,
+                                  &find_board, &search,
+                                  &febs);
+  ufe_set_thread_verbose(x_verbose);
+  if (n_febs <= 0) {
+    ufe_error_print("no UFE board found.");
+    if (n_febs == 0)
+      ufe_free_probed_devices(febs, 0);
+
+    return UFE_NOT_FOUND_ERROR;
+  }
+
+  int n_streams = (board_ids)? n_boards : n_febs;
+  ufe_readout *ro = new_readout(n_streams);
+
+  bool found[UFE_MAX_BOARDS];
+  memset(found, 0, sizeof(found));
+
+  int i_dev, i;
+  for (i_dev = 0; i_dev < n_febs && ro->n_streams_ < n_streams; ++i_dev) {
+    int board_id = febs[i_dev].result_;
+    if (found[board_id]) {
+      // Two threads probed the same board on two devices at the same time.
+      ufe_warning_print("board %i found on two devices.", board_id);
+      continue;
+    }
+
+    found[board_id] = true;
+    add_stream(ro, board_id, febs[i_dev].handle_);
+    febs[i_dev].handle_ = NULL;
+    ufe_debug_print("board %i found on device %i.", board_id, i_dev);
+  }
+
+  ufe_free_probed_devices(febs, n_febs);
+
+  if (ro->n_streams_ < n_streams && board_ids) {
+    for (i = 0; i < n_boards; ++i)
+      if (board_ids[i] < 0 || board_ids[i] >= UFE_MAX_BOARDS || !found[board_ids[i]])
+        ufe_error_print("board %i not found.", board_ids[i]);
+
+    ufe_readout_close(ro);
+    return UFE_NOT_FOUND_ERROR;
+  }
+
+  if (ro->n_writers_ > ro->n_streams_)
+    ro->n_writers_ = ro->n_streams_;
+
+  *readout = ro;
+  return 0;
+}
+
+void ufe_readout_set_output(ufe_readout *ro, int i_stream, int fd) {
+  ro->streams_[i_stream].fd_ = fd;
+}
+
+void ufe_readout_set_ring(ufe_readout *ro, int i_stream, ufe_ring *ring) {
+  ro->streams_[i_stream].ring_ = ring;
+}
+
+/** Releases the threads of readout_command_all() at once. */
+struct sync_gate {
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+
+  /** Set when all threads are ready. */
+  bool open_;
+
+  /** Number of commands sent, out of n_threads_. */
+  int n_sent_;
+  int n_threads_;
+};
+
+/** DATA_READOUT command of one board, sent by readout_command_all(). */
+struct sync_command {
+  struct ufe_readout_stream *s_;
+
+  /** The encoded command. */
+  uint32_t cmd_[UFE_MAX_FRAME_SIZE/4];
+  int size_;
+
+  struct sync_gate *gate_;
+
+  /** Time (ns) when the command has been delivered. */
+  uint64_t sent_ns_;
+
+  int status_;
+};
+
+static void* sync_command_job(void *arg) {
+  struct sync_command *c = (struct sync_command*) arg;
+  struct sync_gate *g = c->gate_;
+  struct ufe_readout_stream *s = c->s_;
+
+  pthread_mutex_lock(&g->mutex_);
+  while (!g->open_)
+    pthread_cond_wait(&g->cond_, &g->mutex_);
+
+  pthread_mutex_unlock(&g->mutex_);
+
+  c->status_ = ufe_send_encoded_command(s->handle_, s->board_id_, DATA_READOUT_CMD_ID, c->cmd_, c->size_);
+  c->sent_ns_ = now_ns();
+
+  // Collect the answer only once all commands are sent.
+  pthread_mutex_lock(&g->mutex_);
+  if (++g->n_sent_ >= g->n_threads_)
+    pthread_cond_broadcast(&g->cond_);
+
+  while (g->n_sent_ < g->n_threads_)
+    pthread_cond_wait(&g->cond_, &g->mutex_);
+
+  pthread_mutex_unlock(&g->mutex_);
+  if (c->status_ != 0)
+    return NULL;
+
+  uint16_t answer;
+  uint16_t *answer_ptr = &answer;
+  ufe_usleep(1);
+  c->status_ = ufe_ep2in_wrappup(s->handle_);
+  if (c->status_ != 0)
+    return NULL;
+
+  ufe_usleep(1);
+  c->status_ = ufe_get_command_answer( s->handle_,
+                                       s->board_id_,
+                                       DATA_READOUT_CMD_ID,
+                                       NO_SUB_CMD_ID,
+                                       1,
+                                       &answer_ptr);
+  return NULL;
+}
+
+// readout_command_all() encodes DATA_READOUT with the parameters as its only argument.
+#define DR_ARGC_CHECK(name, id, argc, answer_argc, sub_cmd, wrapup_us, answer_us, done_us) \
+  _Static_assert((id) != DATA_READOUT_CMD_ID || (argc) == 1, "DATA_READOUT takes one argument");
+UFE_COMMANDS(DR_ARGC_CHECK)
+#undef DR_ARGC_CHECK
+
+static int readout_command_all(ufe_readout *ro, uint16_t params) {
+  int i, status = 0;
+  struct sync_command *cmds = (struct sync_command*) calloc(ro->n_streams_, sizeof(struct sync_command));
+  pthread_t *threads = (pthread_t*) calloc(ro->n_streams_, sizeof(pthread_t));
+  struct sync_gate gate;
+  pthread_mutex_init(&gate.mutex_, NULL);
+  pthread_cond_init(&gate.cond_, NULL);
+  gate.open_ = false;
+  gate.n_sent_ = 0;
+
+  // Encode the commands first. Once the gate is open, each thread has only its transfer to make,
+  // so that the boards start (stop) as close together in time as possible.
+  for (i = 0; i < ro->n_streams_; ++i) {
+    struct sync_command *c = &cmds[i];
+    c->s_ = &ro->streams_[i];
+    c->size_ = ufe_encode_command(c->cmd_, c->s_->board_id_, DATA_READOUT_CMD_ID, NO_SUB_CMD_ID, 1, &params);
+    c->gate_ = &gate;
+  }
+
+  int n_threads = 0;
+  while (n_threads < ro->n_streams_ &&
+         pthread_create(&threads[n_threads], NULL, &sync_command_job, &cmds[n_threads]) == 0)
+    ++n_threads;
+
+  pthread_mutex_lock(&gate.mutex_);
+  gate.n_threads_ = n_threads;
+  gate.open_ = true;
+  pthread_cond_broadcast(&gate.cond_);
+  pthread_mutex_unlock(&gate.mutex_);
+
+  for (i = 0; i < n_threads; ++i)
+    pthread_join(threads[i], NULL);
+
+  // Without thread, the command is sent from here (later).
+  for (i = n_threads; i < ro->n_streams_; ++i)
+    sync_command_job(&cmds[i]);
+
+  pthread_cond_destroy(&gate.cond_);
+  pthread_mutex_destroy(&gate.mutex_);
+
+  uint64_t first_ns = UINT64_MAX, last_ns = 0;
+  for (i = 0; i < ro->n_streams_; ++i) {
+    if (cmds[i].status_ != 0 && status == 0)
+      status = cmds[i].status_;
+
+    if (cmds[i].sent_ns_ < first_ns)
+      first_ns = cmds[i].sent_ns_;
+
+    if (cmds[i].sent_ns_ > last_ns)
+      last_ns = cmds[i].sent_ns_;
+  }
+
+  for (i = 0; i < ro->n_streams_; ++i) {
+    ufe_stream_stats *stats = &ro->streams_[i].stats_;
+    uint64_t skew = cmds[i].sent_ns_ - first_ns;
+    if (params & DR_STOP)
+      STAT_STORE(stats->stop_skew_ns_, skew);
+    else
+      STAT_STORE(stats->start_skew_ns_, skew);
+  }
+
+  ufe_info_print("DATA_READOUT ( 0x%x ) delivered to %i board(s) within %.1f us.",
+                 params, ro->n_streams_, (last_ns - first_ns)*1e-3);
+  free(threads);
+  free(cmds);
+  return status;
+}
+
+static void init_blocks(struct ufe_readout_stream *s, int n_blocks, int first) {
+  int i;
+  s->blocks_ = (struct ufe_readout_block*) calloc(n_blocks, sizeof(struct ufe_readout_block));
+  s->free_ = NULL;
+  for (i = 0; i < n_blocks; ++i) {
+    s->blocks_[i].data_ = ufe_pool_block(s->ro_->pool_, first + i);
+    s->blocks_[i].stream_ = s;
+    s->blocks_[i].next_ = s->free_;
+    s->free_ = &s->blocks_[i];
+  }
+}
+
+static void free_blocks(struct ufe_readout_stream *s) {
+  free(s->blocks_);
+  s->blocks_ = NULL;
+}
+
+// Pins a thread to the CPUs of a list, or of a NUMA node for UFE_CPUS_NODE.
+static void place_thread(pthread_t thread, const char *cpus, int node) {
+  char node_cpus[256];
+  if (cpus && strcmp(cpus, UFE_CPUS_NODE) == 0) {
+    if (node < 0 || ufe_numa_node_cpus(node, node_cpus, sizeof(node_cpus)) != 0) {
+      ufe_debug_print("NUMA node of the USB controller unknown, the thread is not pinned.");
+      return;
+    }
+
+    cpus = node_cpus;
+  }
+
+  if (cpus)
+    ufe_set_thread_cpus(thread, cpus);
+}
+
+static void init_pipes(ufe_readout *ro) {
+  int i, j;
+  ro->pipes_ = (struct ufe_readout_pipe*) calloc(ro->n_streams_, sizeof(struct ufe_readout_pipe));
+  ro->n_pipes_ = 0;
+
+  for (i = 0; i < ro->n_streams_; ++i) {
+    struct ufe_readout_stream *s = &ro->streams_[i];
+    struct stat st;
+    s->pipe_ = NULL;
+    s->n_in_pipe_ = 0;
+    if (!ro->splice_ || s->ring_ || s->fd_ < 0 || fstat(s->fd_, &st) != 0 || !S_ISFIFO(st.st_mode))
+      continue;
+
+    // Streams sharing a pipe share the accounting of the pipe.
+    for (j = 0; j < ro->n_pipes_; ++j)
+      if (ro->pipes_[j].fd_ == s->fd_)
+        s->pipe_ = &ro->pipes_[j];
+
+    if (s->pipe_ == NULL) {
+      s->pipe_ = &ro->pipes_[ro->n_pipes_++];
+      s->pipe_->fd_ = s->fd_;
+      s->pipe_->splice_ = true;
+
+      int pipe_size = fcntl(s->fd_, F_SETPIPE_SZ, UFE_PIPE_SIZE);
+      if (pipe_size < 0)
+        ufe_warning_print("cannot resize the output pipe (%s).", strerror(errno));
+      else
+        ufe_debug_print("output pipe of %i bytes.", pipe_size);
+    }
+  }
+}
+
+// Waits until the consumer has read all blocks still referenced by the pipes.
+static void drain_pipes(ufe_readout *ro) {
+  int i, t;
+  for (i = 0; i < ro->n_pipes_; ++i) {
+    struct ufe_readout_pipe *p = &ro->pipes_[i];
+    for (t = 0; p->head_ && t < 1000; ++t) {
+      recycle_pipe_blocks(p);
+      if (p->head_)
+        ufe_usleep(1000);
+    }
+
+    if (p->head_)
+      ufe_warning_print("the consumer of the output pipe does not read the data.");
+  }
+}
+
+// Ends the threads started by an incomplete ufe_readout_start() (the first n_writers writers and
+// the first n_streams readout threads) and releases what it has allocated.
+static void abort_start(ufe_readout *ro, int n_writers, int n_streams) {
+  int i;
+  __atomic_store_n(&ro->state_, UFE_READOUT_DRAINING, __ATOMIC_RELEASE);
+
+  // The streams never started end at once. The others end at their next empty transfer.
+  for (i = n_streams; i < ro->n_streams_; ++i) {
+    struct ufe_readout_block *b = pop_free_block(&ro->streams_[i]);
+    b->size_ = 0;
+    b->flags_ = UFE_BLOCK_EOS;
+    b->seq_ = ro->streams_[i].seq_++;
+    push_filled_block(b);
+  }
+
+  for (i = 0; i < n_streams; ++i)
+    pthread_join(ro->streams_[i].thread_, NULL);
+
+  for (i = 0; i < n_writers; ++i)
+    pthread_join(ro->writers_[i].thread_, NULL);
+
+  for (i = 0; i < ro->n_streams_; ++i) {
+    struct ufe_readout_stream *s = &ro->streams_[i];
+    free_blocks(s);
+    pthread_mutex_destroy(&s->mutex_);
+    pthread_cond_destroy(&s->cond_);
+  }
+
+  for (i = 0; i < ro->n_writers_; ++i) {
+    pthread_mutex_destroy(&ro->writers_[i].mutex_);
+    pthread_cond_destroy(&ro->writers_[i].cond_);
+  }
+
+  pthread_mutex_destroy(&ro->out_mutex_);
+  free(ro->writers_);
+  ro->writers_ = NULL;
+  free(ro->pipes_);
+  ro->pipes_ = NULL;
+  ro->n_pipes_ = 0;
+  ufe_pool_destroy(ro->pool_);
+  ro->pool_ = NULL;
+}
+
+int ufe_readout_start(ufe_readout *ro, uint16_t params) {
+  int i;
+  if (ro->n_writers_ < 1)
+    ro->n_writers_ = 1;
+
+  if (ro->n_blocks_ < 2)
+    ro->n_blocks_ = 2;
+
+  for (i = 0; ro->filter_ && i < ro->n_streams_; ++i)
+    if (ufe_filter_init(&ro->streams_[i].filter_, ro->filter_) != 0) {
+      ufe_error_print("invalid zero suppression configuration.");
+      return UFE_INVALID_ARG_ERROR;
+    }
+
+  int node = (ro->numa_local_)? ro->streams_[0].numa_node_ : -1;
+  int status = ufe_pool_create(&ro->pool_, ro->n_streams_*ro->n_blocks_,
+                               ufe_context_handler->readout_buffer_size_,
+                               ufe_context_handler->readout_pool_flags_, node);
+  if (status != 0)
+    return status;
+
+  ufe_pool_print(ro->pool_);
+
+  ufe_info_print("starting the readout of %i board(s), %i writer(s).", ro->n_streams_, ro->n_writers_);
+  ro->state_ = UFE_READOUT_RUNNING;
+
+  pthread_mutex_init(&ro->out_mutex_, NULL);
+  ro->writers_ = (struct ufe_readout_writer*) calloc(ro->n_writers_, sizeof(struct ufe_readout_writer));
+  for (i = 0; i < ro->n_writers_; ++i) {
+    pthread_mutex_init(&ro->writers_[i].mutex_, NULL);
+    pthread_cond_init(&ro->writers_[i].cond_, NULL);
+    ro->writers_[i].ro_ = ro;
+  }
+
+  // Each stream is served always by the same writer. This preserves the order of the blocks.
+  for (i = 0; i < ro->n_streams_; ++i) {
+    struct ufe_readout_stream *s = &ro->streams_[i];
+    s->writer_ = &ro->writers_[i % ro->n_writers_];
+    s->writer_->n_streams_++;
+    s->seq_ = 0;
+    pthread_mutex_init(&s->mutex_, NULL);
+    pthread_cond_init(&s->cond_, NULL);
+    init_blocks(s, ro->n_blocks_, i*ro->n_blocks_);
+  }
+
+  init_pipes(ro);
+
+  for (i = 0; i < ro->n_writers_; ++i) {
+    if (pthread_create(&ro->writers_[i].thread_, NULL, &writer_job, &ro->writers_[i])) {
+      ufe_error_print("cannot create writer thread.");
+      abort_start(ro, i, 0);
+      return UFE_INTERNAL_ERROR;
+    }
+
+    // The first stream served by writer i is stream i.
+    int node = (i < ro->n_streams_)? ro->streams_[i].numa_node_ : -1;
+    place_thread(ro->writers_[i].thread_, ro->writer_cpus_, node);
+  }
+
+  for (i = 0; i < ro->n_streams_; ++i) {
+    struct ufe_readout_stream *s = &ro->streams_[i];
+    if (pthread_create(&s->thread_, NULL, &stream_job, s)) {
+      ufe_error_print("cannot create readout thread.");
+      abort_start(ro, ro->n_writers_, i);
+      return UFE_INTERNAL_ERROR;
+    }
+
+    place_thread(s->thread_, ro->usb_cpus_, s->numa_node_);
+    if (ro->usb_priority_ > 0)
+      ufe_set_thread_fifo(s->thread_, ro->usb_priority_);
+  }
+
+  ro->started_ = true;
+  return readout_command_all(ro, params & ~DR_STOP);
+}
+
+int ufe_readout_stop(ufe_readout *ro, uint16_t params) {
+  if (!ro->started_)
+    return UFE_INVALID_ARG_ERROR;
+
+  int i;
+  int status = readout_command_all(ro, params | DR_STOP);
+  __atomic_store_n(&ro->state_, UFE_READOUT_STOPPING, __ATOMIC_RELEASE);
+
+  // Push the data left in the boards. Each board ends with an empty packet.
+  for (i = 0; i < ro->n_streams_; ++i) {
+    int wrappup_status = ufe_epxin_wrappup(ro->streams_[i].handle_, 1);
+    if (status == 0)
+      status = wrappup_status;
+  }
+
+  __atomic_store_n(&ro->state_, UFE_READOUT_DRAINING, __ATOMIC_RELEASE);
+
+  for (i = 0; i < ro->n_streams_; ++i)
+    pthread_join(ro->streams_[i].thread_, NULL);
+
+  for (i = 0; i < ro->n_writers_; ++i)
+    pthread_join(ro->writers_[i].thread_, NULL);
+
+  drain_pipes(ro);
+  ro->started_ = false;
+  ufe_info_print("readout stopped.");
+  return status;
+}
+
+int ufe_get_stats(ufe_readout *ro, ufe_readout_stats *stats) {
+  int i, j;
+  memset(stats, 0, sizeof(ufe_readout_stats));
+  stats->n_streams_ = ro->n_streams_;
+  for (i = 0; i < ro->n_streams_; ++i) {
+    ufe_stream_stats *from = &ro->streams_[i].stats_, *to = &stats->streams_[i];
+    to->board_id_          = from->board_id_;
+    to->bytes_             = STAT_LOAD(from->bytes_);
+    to->transfers_         = STAT_LOAD(from->transfers_);
+    to->short_reads_       = STAT_LOAD(from->short_reads_);
+    to->timeouts_          = STAT_LOAD(from->timeouts_);
+    to->errors_            = STAT_LOAD(from->errors_);
+    to->usb_ns_            = STAT_LOAD(from->usb_ns_);
+    to->write_ns_          = STAT_LOAD(from->write_ns_);
+    to->blocks_queued_     = STAT_LOAD(from->blocks_queued_);
+    to->max_blocks_queued_ = STAT_LOAD(from->max_blocks_queued_);
+    to->n_stalls_          = STAT_LOAD(from->n_stalls_);
+    to->recoveries_        = STAT_LOAD(from->recoveries_);
+    to->start_skew_ns_     = STAT_LOAD(from->start_skew_ns_);
+    to->stop_skew_ns_      = STAT_LOAD(from->stop_skew_ns_);
+    to->filtered_bytes_    = STAT_LOAD(from->filtered_bytes_);
+    to->empty_frames_      = STAT_LOAD(from->empty_frames_);
+    to->dropped_beacons_   = STAT_LOAD(from->dropped_beacons_);
+    for (j = 0; j < UFE_STATS_N_BINS; ++j)
+      to->size_hist_[j] = STAT_LOAD(from->size_hist_[j]);
+
+    ufe_ring *ring = ro->streams_[i].ring_;
+    if (ring && stats->ring_size_ == 0) {
+      stats->ring_used_  = ufe_ring_used(ring);
+      stats->ring_size_  = ring->ctrl_->size_;
+      stats->ring_waits_ = STAT_LOAD(ring->n_waits_);
+    }
+  }
+
+  if (ro->pool_) {
+    stats->pool_size_   = ro->pool_->size_;
+    stats->pool_pages_  = ro->pool_->pages_;
+    stats->pool_locked_ = ro->pool_->locked_;
+  }
+
+  return 0;
+}
+
+int ufe_get_latency(ufe_readout *ro, int i_stream, ufe_histo *histo) {
+  if (i_stream >= ro->n_streams_)
+    return UFE_INVALID_ARG_ERROR;
+
+  int i;
+  ufe_histo_reset(histo);
+  for (i = 0; i < ro->n_streams_; ++i)
+    if (i_stream < 0 || i == i_stream)
+      ufe_histo_merge(histo, &ro->streams_[i].latency_);
+
+  return 0;
+}
+
+static int sprint_stats(const ufe_readout_stats *stats, char *buffer, size_t size) {
+  int i, n = 0;
+  n += snprintf(buffer + n, size - n,
+                "board        MB   transfers   short  timeout  error   queue(max)  stalls  recov   usb(s)  write(s)  skew start/stop(us)\n");
+
+  for (i = 0; i < stats->n_streams_ && n < size; ++i) {
+    const ufe_stream_stats *s = &stats->streams_[i];
+    n += snprintf(buffer + n, size - n,
+                  "%5i %9.2f %11lu %7lu %8lu %6lu %6u(%3u) %7lu %6lu %8.2f %9.2f  %9.1f %9.1f\n",
+                  s->board_id_,
+                  s->bytes_/1048576.,
+                  (unsigned long) s->transfers_,
+                  (unsigned long) s->short_reads_,
+                  (unsigned long) s->timeouts_,
+                  (unsigned long) s->errors_,
+                  s->blocks_queued_,
+                  s->max_blocks_queued_,
+                  (unsigned long) s->n_stalls_,
+                  (unsigned long) s->recoveries_,
+                  s->usb_ns_*1e-9,
+                  s->write_ns_*1e-9,
+                  s->start_skew_ns_*1e-3,
+                  s->stop_skew_ns_*1e-3);
+  }
+
+  if (stats->ring_size_ && n < size)
+    n += snprintf(buffer + n, size - n, "ring: %lu / %lu bytes used, producer waited %lu times\n",
+                  (unsigned long) stats->ring_used_,
+                  (unsigned long) stats->ring_size_,
+                  (unsigned long) stats->ring_waits_);
+
+  uint64_t bytes = 0, filtered = 0, frames = 0, beacons = 0;
+  for (i = 0; i < stats->n_streams_; ++i) {
+    bytes    += stats->streams_[i].bytes_;
+    filtered += stats->streams_[i].filtered_bytes_;
+    frames   += stats->streams_[i].empty_frames_;
+    beacons  += stats->streams_[i].dropped_beacons_;
+  }
+
+  if ((filtered || frames || beacons) && n < size)
+    n += snprintf(buffer + n, size - n, "filter: %.2f MB dropped ( %.1f %% ), %lu empty frames, %lu idle beacons\n",
+                  filtered/1048576., (bytes)? 100.*filtered/bytes : 0.,
+                  (unsigned long) frames, (unsigned long) beacons);
+
+  if (stats->pool_size_ && n < size)
+    n += snprintf(buffer + n, size - n, "buffers: %.1f MB, %s%s\n",
+                  stats->pool_size_/1048576.,
+                  (stats->pool_pages_ == UFE_POOL_HUGETLB)? "hugepages" :
+                  (stats->pool_pages_ == UFE_POOL_THP)? "transparent hugepages" : "regular pages",
+                  (stats->pool_locked_)? ", locked" : "");
+
+  return n;
+}
+
+void ufe_dump_stats(const ufe_readout_stats *stats, FILE *file) {
+  char buffer[128*(UFE_MAX_BOARDS + 4)];
+  sprint_stats(stats, buffer, sizeof(buffer));
+  fputs(buffer, file);
+}
+
+void ufe_publish_stats(const ufe_readout_stats *stats) {
+#ifdef ZMQ_ENABLE
+  char buffer[128*(UFE_MAX_BOARDS + 5)];
+  int n = snprintf(buffer, sizeof(buffer), "### Stats from %s:\n", ufe_context_handler->host_name_);
+  sprint_stats(stats, buffer + n, sizeof(buffer) - n);
+  s_send(ufe_context_handler->publisher_socket_, buffer);
+#endif
+}
+
+void ufe_readout_close(ufe_readout *ro) {
+  int i;
+  for (i = 0; i < ro->n_streams_; ++i) {
+    struct ufe_readout_stream *s = &ro->streams_[i];
+    free_blocks(s);
+    if (ro->writers_) {
+      pthread_mutex_destroy(&s->mutex_);
+      pthread_cond_destroy(&s->cond_);
+    }
+
+    ufe_usb()->close(s->handle_);
+  }
+
+  if (ro->writers_) {
+    for (i = 0; i < ro->n_writers_; ++i) {
+      pthread_mutex_destroy(&ro->writers_[i].mutex_);
+      pthread_cond_destroy(&ro->writers_[i].cond_);
+    }
+
+    pthread_mutex_destroy(&ro->out_mutex_);
+    free(ro->writers_);
+  }
+
+  ufe_pool_destroy(ro->pool_);
+  free(ro->pipes_);
+  free(ro->streams_);
+  free(ro);
+}
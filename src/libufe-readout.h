@@ -0,0 +1,516 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-readout.h
+ *  \brief   File containing an API for simultaneous data readout from several front-end boards
+ *  inside a single process.
+ */
+
+#ifndef LIBUFE_READOUT_H
+#define LIBUFE_READOUT_H 1
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "libufe.h"
+#include "libufe-ring.h"
+#include "libufe-histo.h"
+#include "libufe-pool.h"
+#include "libufe-affinity.h"
+#include "libufe-filter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of boards addressable by the command protocol (7 bits of Board Id). */
+#define UFE_MAX_BOARDS 128
+
+/** Size (in bytes) requested for the pipes used as output (see ufe_readout::splice_). */
+#define UFE_PIPE_SIZE (1024*1024)
+
+/** Magic word ("UFEB") marking the beginning of each record in a container output. */
+#define UFE_BLOCK_MAGIC 0x55464542
+
+/** \brief Header of a record in a container output. A container output interleaves the data
+ *  of several boards. Each readout block is written as a header followed by the data.
+ */
+struct ufe_block_header {
+  /** Always UFE_BLOCK_MAGIC. */
+  uint32_t magic_;
+
+  /** Identifier of the board the data is coming from. */
+  uint16_t board_id_;
+
+  /** Bit array of ufe_block_flags. */
+  uint16_t flags_;
+
+  /** Sequence number of the block inside the stream of this board. */
+  uint32_t seq_;
+
+  /** Size (in bytes) of the data following the header. */
+  uint32_t size_;
+};
+
+/** ufe_block_header type */
+typedef struct ufe_block_header ufe_block_header;
+
+/** List of the flags of a container record. */
+enum ufe_block_flags {
+  UFE_BLOCK_EOS = 0x1,
+
+  /** Data may be missing before this block: the stream has recovered from an EP1 failure. */
+  UFE_BLOCK_GAP = 0x2,
+
+  /** The block has been zero suppressed (see libufe-filter.h). A record without data and without
+   *  UFE_BLOCK_EOS is a block emptied by the filter. */
+  UFE_BLOCK_FILTERED = 0x4
+};
+
+/** Default value of ufe_readout::max_recoveries_. */
+#define UFE_READOUT_MAX_RECOVERIES 3
+
+/** Timeout (ms) of the readout transfers while the data left in the boards is drained at the end
+ *  of the run (see ufe_readout_stop()). */
+#define UFE_READOUT_DRAIN_TIMEOUT 10
+
+/** Progress of the end of a run (see ufe_readout::state_). */
+enum ufe_readout_state {
+  /** Taking data. */
+  UFE_READOUT_RUNNING = 0,
+
+  /** The boards have been stopped. An empty transfer ends a stream. */
+  UFE_READOUT_STOPPING,
+
+  /** The boards have sent their last data. An empty or failed transfer ends a stream. */
+  UFE_READOUT_DRAINING
+};
+
+/** Number of bins of the histogram of the transfer sizes. Bin i counts the transfers of
+ *  2^i ... 2^(i+1)-1 bytes, the last bin counts also all bigger transfers.
+ */
+#define UFE_STATS_N_BINS 20
+
+/** \brief Telemetry counters of one data stream. The counters are updated atomically by the
+ *  readout threads and can be read at any time with ufe_get_stats().
+ */
+struct ufe_stream_stats {
+  /** Identifier of the board. */
+  int board_id_;
+
+  /** Number of bytes received. */
+  uint64_t bytes_;
+
+  /** Number of transfers with data. */
+  uint64_t transfers_;
+
+  /** Number of transfers shorter than the readout buffer. */
+  uint64_t short_reads_;
+
+  /** Number of transfers which timed out. */
+  uint64_t timeouts_;
+
+  /** Number of transfers which failed. */
+  uint64_t errors_;
+
+  /** Histogram of the transfer sizes. */
+  uint64_t size_hist_[UFE_STATS_N_BINS];
+
+  /** Time spent waiting for the usb transfers (ns). */
+  uint64_t usb_ns_;
+
+  /** Time spent writing the data (ns). */
+  uint64_t write_ns_;
+
+  /** Number of blocks received but not written yet (writer lag). */
+  uint32_t blocks_queued_;
+
+  /** Maximum of blocks_queued_. */
+  uint32_t max_blocks_queued_;
+
+  /** Number of times the readout had to wait for a free block. */
+  uint64_t n_stalls_;
+
+  /** Number of recoveries of EP1 (halt cleared and endpoint reset). */
+  uint64_t recoveries_;
+
+  /** Delay (ns) between the delivery of the start command to the first board and to this board. */
+  uint64_t start_skew_ns_;
+
+  /** Delay (ns) between the delivery of the stop command to the first board and to this board. */
+  uint64_t stop_skew_ns_;
+
+  /** Number of bytes removed by the zero suppression. */
+  uint64_t filtered_bytes_;
+
+  /** Number of empty frames removed by the zero suppression. */
+  uint64_t empty_frames_;
+
+  /** Number of idle beacons removed by the zero suppression. */
+  uint64_t dropped_beacons_;
+};
+
+/** ufe_stream_stats type */
+typedef struct ufe_stream_stats ufe_stream_stats;
+
+/** \brief Snapshot of the telemetry counters of a readout. */
+struct ufe_readout_stats {
+  /** Number of streams. */
+  int n_streams_;
+
+  /** Counters of the streams. */
+  ufe_stream_stats streams_[UFE_MAX_BOARDS];
+
+  /** Bytes of the output ring not yet read by all normal readers (0 if no ring is used). */
+  uint64_t ring_used_;
+
+  /** Size of the output ring (0 if no ring is used). */
+  uint64_t ring_size_;
+
+  /** Number of times the producer had to wait for a slow ring reader. */
+  uint64_t ring_waits_;
+
+  /** Memory footprint of the readout blocks (bytes, see ufe_pool). */
+  uint64_t pool_size_;
+
+  /** ufe_pool_pages of the readout blocks. */
+  int pool_pages_;
+
+  /** True if the readout blocks are locked in memory. */
+  bool pool_locked_;
+};
+
+/** ufe_readout_stats type */
+typedef struct ufe_readout_stats ufe_readout_stats;
+
+struct ufe_readout;
+struct ufe_readout_stream;
+
+/** \brief Structure representing one block of readout data. */
+struct ufe_readout_block {
+  /** Memory of the block (readout_buffer_size_ bytes). */
+  uint8_t *data_;
+
+  /** Number of bytes in use. A block with size 0 marks the end of the stream. */
+  int size_;
+
+  /** Sequence number of the block inside the stream. */
+  uint32_t seq_;
+
+  /** Time (ns, CLOCK_MONOTONIC) when the data was received. */
+  uint64_t time_ns_;
+
+  /** Bit array of ufe_block_flags. */
+  uint16_t flags_;
+
+  /** The stream owning this block. */
+  struct ufe_readout_stream *stream_;
+
+  /** Position in the pipe of the end of the block. Used while the memory is owned by a pipe. */
+  uint64_t pipe_end_;
+
+  /** Next block in the list / queue the block is currently in. */
+  struct ufe_readout_block *next_;
+};
+
+/** \brief Structure representing an output pipe. The blocks moved into the pipe with vmsplice()
+ *  stay in use until the consumer has read them.
+ */
+struct ufe_readout_pipe {
+  /** File descriptor of the pipe. */
+  int fd_;
+
+  /** False if vmsplice() is not supported. The data is copied into the pipe. */
+  bool splice_;
+
+  /** Total number of bytes written into the pipe. */
+  uint64_t n_written_;
+
+  /** Blocks still referenced by the pipe, in the order of writing. */
+  struct ufe_readout_block *head_, *tail_;
+};
+
+/** \brief Structure representing a writer thread. A writer is shared by several streams. */
+struct ufe_readout_writer {
+  /** The thread. */
+  pthread_t thread_;
+
+  /** Queue of blocks waiting to be written. */
+  struct ufe_readout_block *head_, *tail_;
+
+  /** Number of streams served by this writer. */
+  int n_streams_;
+
+  /** Number of streams which have reached the end. */
+  int n_done_;
+
+  /** Protects the queue. */
+  pthread_mutex_t mutex_;
+
+  /** Signals new blocks in the queue. */
+  pthread_cond_t cond_;
+
+  /** The readout this writer belongs to. */
+  struct ufe_readout *ro_;
+};
+
+/** \brief Structure representing the data stream of one board. */
+struct ufe_readout_stream {
+  /** Identifier of the board. */
+  int board_id_;
+
+  /** Handle of the usb device the board is connected to. */
+  libusb_device_handle *handle_;
+
+  /** NUMA node of the USB controller of the board, or -1 if unknown. */
+  int numa_node_;
+
+  /** Zero suppression of the stream, used if ufe_readout::filter_ is set. */
+  ufe_filter filter_;
+
+  /** Output file descriptor. */
+  int fd_;
+
+  /** Output shared memory ring. If set, fd_ is not used. */
+  ufe_ring *ring_;
+
+  /** Set if the output is a pipe and the data is moved with vmsplice(). */
+  struct ufe_readout_pipe *pipe_;
+
+  /** Number of blocks of this stream referenced by the pipe. */
+  int n_in_pipe_;
+
+  /** Telemetry counters. */
+  ufe_stream_stats stats_;
+
+  /** Latency (ns) between the reception and the end of the writing of each block. */
+  ufe_histo latency_;
+
+  /** The readout thread. */
+  pthread_t thread_;
+
+  /** Status of the last readout transfer. */
+  int status_;
+
+  /** Sequence number of the next block. */
+  uint32_t seq_;
+
+  /** Memory of all blocks of this stream. */
+  struct ufe_readout_block *blocks_;
+
+  /** List of free blocks. */
+  struct ufe_readout_block *free_;
+
+  /** Protects the list of free blocks. */
+  pthread_mutex_t mutex_;
+
+  /** Signals a block returned to the list of free blocks. */
+  pthread_cond_t cond_;
+
+  /** The writer serving this stream. */
+  struct ufe_readout_writer *writer_;
+
+  /** The readout this stream belongs to. */
+  struct ufe_readout *ro_;
+};
+
+/** \brief Structure representing a readout of several boards. The configuration fields can be
+ *  modified between ufe_readout_open() and ufe_readout_start().
+ */
+struct ufe_readout {
+  /** Number of streams (boards). */
+  int n_streams_;
+
+  /** The streams. */
+  struct ufe_readout_stream *streams_;
+
+  /** Number of writer threads (default: one per stream, at most 4). */
+  int n_writers_;
+
+  /** The writers. */
+  struct ufe_readout_writer *writers_;
+
+  /** Number of blocks allocated for each stream (default ufe_context::readout_blocks_). */
+  int n_blocks_;
+
+  /** The blocks of all streams, allocated by ufe_readout_start(). */
+  ufe_pool *pool_;
+
+  /** If true, every block is written with a ufe_block_header in front (default false). Must be
+   *  used if several streams write to the same output.
+   */
+  bool container_;
+
+  /** If true, the blocks written to a pipe (e.g. the FIFO) are moved with vmsplice() instead of
+   *  being copied, and the size of the pipe is raised to UFE_PIPE_SIZE (default true).
+   */
+  bool splice_;
+
+  /** Number of output pipes. */
+  int n_pipes_;
+
+  /** The output pipes. */
+  struct ufe_readout_pipe *pipes_;
+
+  /** Serializes the writes to a shared output. */
+  pthread_mutex_t out_mutex_;
+
+  /** Maximum number of recoveries of a stream without any data received in between (default
+   *  UFE_READOUT_MAX_RECOVERIES). If 0, a stream ends at the first failed transfer.
+   */
+  int max_recoveries_;
+
+  /** ufe_readout_state, set by ufe_readout_stop(). */
+  int state_;
+
+  /** True from a complete ufe_readout_start() until ufe_readout_stop(). */
+  bool started_;
+
+  /** CPUs of the readout threads (see libufe-affinity.h), UFE_CPUS_NODE for the CPUs of the NUMA
+   *  node of the USB controller of each board, or NULL (default, not pinned).
+   */
+  const char *usb_cpus_;
+
+  /** CPUs of the writer threads, same as usb_cpus_. With UFE_CPUS_NODE, the node is the one of
+   *  the first board served by the writer (default NULL).
+   */
+  const char *writer_cpus_;
+
+  /** SCHED_FIFO priority of the readout threads, or 0 for the normal scheduling (default 0). */
+  int usb_priority_;
+
+  /** If true, the blocks are placed on the NUMA node of the USB controller of the first board
+   *  (default true).
+   */
+  bool numa_local_;
+
+  /** Zero suppression applied by the writers to every stream, or NULL (default). The
+   *  configuration is copied by ufe_readout_start().
+   */
+  const ufe_filter_config *filter_;
+};
+
+/** ufe_readout type */
+typedef struct ufe_readout ufe_readout;
+
+
+/** \brief Finds and opens the devices of a list of boards and prepares a data stream for each of them.
+ *  Must be called within an existing (already open) usb session. If the registry is running (see
+ *  libufe-registry.h), the boards are opened without probing the devices.
+ *  \param ro: Output location for the readout.
+ *  \param board_ids: Input location for the list of board Ids. If NULL, all Baby MIND FEBs connected
+ *  to the system are used.
+ *  \param n_boards: Number of boards in the list.
+ *  \returns 0 on success, UFE_INVALID_ARG_ERROR if an Id is out of [0, UFE_MAX_BOARDS) or listed
+ *  twice, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_readout_open(ufe_readout **ro, const int *board_ids, int n_boards);
+
+
+/** \brief Sets the output of a stream.
+ *  \param ro: The readout.
+ *  \param i_stream: Index of the stream.
+ *  \param fd: File descriptor of the output. The same descriptor can be shared by several streams
+ *  only if container_ is set.
+ */
+void ufe_readout_set_output(ufe_readout *ro, int i_stream, int fd);
+
+
+/** \brief Sets a shared memory ring as output of a stream. The data is written in the container
+ *  format (ufe_block_header + data), one record per block.
+ *  \param ro: The readout.
+ *  \param i_stream: Index of the stream.
+ *  \param ring: The ring. Can be shared by several streams.
+ */
+void ufe_readout_set_ring(ufe_readout *ro, int i_stream, ufe_ring *ring);
+
+
+/** \brief Starts the readout threads and the writer threads and sends DATA_READOUT to all boards.
+ *  The commands are encoded in advance and sent at the same time by one thread per board. The
+ *  answers are collected afterwards. The measured skew is in ufe_stream_stats::start_skew_ns_.
+ *  If a thread cannot be created, the threads already running are ended and joined, and the
+ *  buffers are released before the function returns.
+ *  \param ro: The readout.
+ *  \param params: DATA_READOUT argument (DR_START is forced).
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_readout_start(ufe_readout *ro, uint16_t params);
+
+
+/** \brief Sends DATA_READOUT (stop) to all boards and waits until all streams are written.
+ *  The end of the data is explicit: after the stop command, the EP1 IN wrap-up makes each board
+ *  send its last (short) packet and then an empty one. The streams are drained with short
+ *  timeouts (UFE_READOUT_DRAIN_TIMEOUT) until the empty packet, so the stop takes milliseconds
+ *  and no data is left in the boards.
+ *  \param ro: The readout.
+ *  \param params: DATA_READOUT argument (DR_STOP is forced).
+ *  \returns 0 on success, UFE_INVALID_ARG_ERROR if the threads have not been started (e.g.
+ *  ufe_readout_start() failed), or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_readout_stop(ufe_readout *ro, uint16_t params);
+
+
+/** \brief Gets a snapshot of the telemetry counters of a readout. Can be called at any time
+ *  between ufe_readout_open() and ufe_readout_close().
+ *  \param ro: The readout.
+ *  \param stats: Output location for the counters.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_get_stats(ufe_readout *ro, ufe_readout_stats *stats);
+
+
+/** \brief Gets a snapshot of the block latency histogram of a stream (time in ns between the
+ *  reception of a block and the end of its writing).
+ *  \param ro: The readout.
+ *  \param i_stream: Index of the stream. If negative, the histograms of all streams are summed.
+ *  \param histo: Output location for the histogram.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_get_latency(ufe_readout *ro, int i_stream, ufe_histo *histo);
+
+
+/** \brief Prints the telemetry counters in a human readable form.
+ *  \param stats: The counters.
+ *  \param file: Output stream (e.g. stdout).
+ */
+void ufe_dump_stats(const ufe_readout_stats *stats, FILE *file);
+
+
+/** \brief Publishes the telemetry counters on the network (if enabled, see ZMQ_ENABLE).
+ *  \param stats: The counters.
+ */
+void ufe_publish_stats(const ufe_readout_stats *stats);
+
+
+/** \brief Closes the devices and frees the readout.
+ *  \param ro: The readout.
+ */
+void ufe_readout_close(ufe_readout *ro);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
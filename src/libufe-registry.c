@@ -0,0 +1,267 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-readout.h"
+#include "libufe-registry.h"
+
+extern ufe_context *ufe_context_handler;
+
+/** Timeout of the event handling, i.e. the maximum delay to stop the registry (ms). */
+#define REGISTRY_POLL_MS 100
+
+/** A hotplug event, queued by the hotplug function and handled by the registry thread. The
+ *  hotplug function may be called by any thread making usb transfers, so it does no usb I/O. */
+struct registry_event {
+  libusb_device *dev_;
+  bool arrived_;
+  struct registry_event *next_;
+};
+
+/** Protects the table and the event queue. */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** The device of each connected board (with a reference), or NULL. */
+static libusb_device *registry_devices[UFE_MAX_BOARDS];
+
+static struct registry_event *registry_head = NULL, *registry_tail = NULL;
+
+/** True while the hotplug function is registered. */
+static bool registry_hooked = false;
+
+static bool registry_on = false;
+static pthread_t registry_thread;
+static ufe_registry_func registry_func = NULL;
+static void *registry_data = NULL;
+
+static void hotplug(libusb_device *dev, bool arrived, void *user_data) {
+  struct registry_event *e = (struct registry_event*) malloc(sizeof(struct registry_event));
+  e->dev_ = ufe_usb()->ref_device(dev);
+  e->arrived_ = arrived;
+  e->next_ = NULL;
+
+  pthread_mutex_lock(&registry_mutex);
+  if (registry_tail)
+    registry_tail->next_ = e;
+  else
+    registry_head = e;
+
+  registry_tail = e;
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+// Finds the board connected to a device, by pinging all Ids, and checks its firmware.
+static int identify(libusb_device *dev) {
+  libusb_device_handle *dev_handle = NULL;
+  int status = ufe_usb()->open(dev, &dev_handle);
+  if (dev_handle == NULL) {
+    ufe_error_print("cannot open device ( %i ).", status);
+    return -1;
+  }
+
+  int board_id;
+  for (board_id = 0; board_id < UFE_MAX_BOARDS; ++board_id) {
+    status = ufe_check_board(dev_handle, board_id);
+    if (status != UFE_NOT_FOUND_ERROR)
+      break;
+  }
+
+  ufe_usb()->close(dev_handle);
+  return (status == 0)? board_id : -1;
+}
+
+static void handle_arrival(libusb_device *dev) {
+  int board_id = identify(dev);
+  if (board_id < 0) {
+    ufe_warning_print("new device with no responding board.");
+    ufe_usb()->unref_device(dev);
+    return;
+  }
+
+  pthread_mutex_lock(&registry_mutex);
+  libusb_device *old = registry_devices[board_id];
+  registry_devices[board_id] = dev;
+  pthread_mutex_unlock(&registry_mutex);
+
+  if (old) {
+    ufe_warning_print("board %i found on a second device.", board_id);
+    ufe_usb()->unref_device(old);
+  }
+
+  ufe_info_print("board %i connected.", board_id);
+  if (registry_func)
+    (*registry_func)(board_id, true, registry_data);
+}
+
+static void handle_departure(libusb_device *dev) {
+  int board_id;
+  pthread_mutex_lock(&registry_mutex);
+  for (board_id = 0; board_id < UFE_MAX_BOARDS; ++board_id)
+    if (registry_devices[board_id] == dev) {
+      registry_devices[board_id] = NULL;
+      break;
+    }
+
+  pthread_mutex_unlock(&registry_mutex);
+
+  // Reference of the event.
+  ufe_usb()->unref_device(dev);
+  if (board_id == UFE_MAX_BOARDS)
+    return;
+
+  // Reference of the table.
+  ufe_usb()->unref_device(dev);
+  ufe_warning_print("board %i disconnected.", board_id);
+  if (registry_func)
+    (*registry_func)(board_id, false, registry_data);
+}
+
+static void handle_queued_events() {
+  while (1) {
+    pthread_mutex_lock(&registry_mutex);
+    struct registry_event *e = registry_head;
+    if (e) {
+      registry_head = e->next_;
+      if (registry_head == NULL)
+        registry_tail = NULL;
+    }
+
+    pthread_mutex_unlock(&registry_mutex);
+    if (e == NULL)
+      return;
+
+    if (e->arrived_)
+      handle_arrival(e->dev_);
+    else
+      handle_departure(e->dev_);
+
+    free(e);
+  }
+}
+
+static void* registry_job(void *arg) {
+  libusb_context *ctx = (libusb_context*) arg;
+  while (__atomic_load_n(&registry_on, __ATOMIC_ACQUIRE)) {
+    ufe_usb()->handle_events(ctx, REGISTRY_POLL_MS);
+    handle_queued_events();
+  }
+
+  return NULL;
+}
+
+int ufe_registry_start(ufe_registry_func func, void *user_data) {
+  if (registry_hooked)
+    return 0;
+
+  libusb_context *ctx = ufe_context_handler->usb_ctx_;
+  registry_func = func;
+  registry_data = user_data;
+  int status = ufe_usb()->hotplug_register(ctx, &hotplug, NULL);
+  if (status != 0) {
+    ufe_warning_print("no hotplug support ( %i ).", status);
+    return status;
+  }
+
+  registry_hooked = true;
+
+  // Identify the boards already connected. The probing is very verbose, mute the info messages.
+  int x_verbose = ufe_context_handler->verbose_;
+  if (x_verbose > 1)
+    ufe_context_handler->verbose_ = 1;
+
+  handle_queued_events();
+  ufe_context_handler->verbose_ = x_verbose;
+
+  registry_on = true;
+  if (pthread_create(&registry_thread, NULL, &registry_job, ctx)) {
+    ufe_error_print("cannot start the registry thread.");
+    registry_on = false;
+    ufe_registry_stop();
+    return UFE_INTERNAL_ERROR;
+  }
+
+  return 0;
+}
+
+void ufe_registry_stop() {
+  if (!registry_hooked)
+    return;
+
+  if (__atomic_exchange_n(&registry_on, false, __ATOMIC_ACQ_REL))
+    pthread_join(registry_thread, NULL);
+
+  ufe_usb()->hotplug_deregister(ufe_context_handler->usb_ctx_);
+  registry_hooked = false;
+
+  // Drop the events not handled and the table.
+  pthread_mutex_lock(&registry_mutex);
+  struct registry_event *e = registry_head;
+  registry_head = registry_tail = NULL;
+  pthread_mutex_unlock(&registry_mutex);
+  while (e) {
+    struct registry_event *next = e->next_;
+    ufe_usb()->unref_device(e->dev_);
+    free(e);
+    e = next;
+  }
+
+  int i;
+  for (i = 0; i < UFE_MAX_BOARDS; ++i)
+    if (registry_devices[i]) {
+      ufe_usb()->unref_device(registry_devices[i]);
+      registry_devices[i] = NULL;
+    }
+
+  registry_func = NULL;
+}
+
+bool ufe_registry_running() {
+  return __atomic_load_n(&registry_on, __ATOMIC_ACQUIRE);
+}
+
+int ufe_registry_open(int board_id, libusb_device_handle **handle) {
+  if (board_id < 0 || board_id >= UFE_MAX_BOARDS)
+    return UFE_NOT_FOUND_ERROR;
+
+  // The device cannot be released while the lock is held.
+  int status = UFE_NOT_FOUND_ERROR;
+  *handle = NULL;
+  pthread_mutex_lock(&registry_mutex);
+  if (registry_devices[board_id])
+    status = ufe_usb()->open(registry_devices[board_id], handle);
+
+  pthread_mutex_unlock(&registry_mutex);
+  return status;
+}
+
+int ufe_registry_get_boards(int *board_ids, int max_ids) {
+  int i, n_ids = 0;
+  pthread_mutex_lock(&registry_mutex);
+  for (i = 0; i < UFE_MAX_BOARDS && n_ids < max_ids; ++i)
+    if (registry_devices[i])
+      board_ids[n_ids++] = i;
+
+  pthread_mutex_unlock(&registry_mutex);
+  return n_ids;
+}
@@ -0,0 +1,84 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-registry.h
+ *  \brief   File containing the registry of the connected front-end boards. The registry is kept up
+ *  to date by the hotplug events of the transport. Each board is identified once, when its device
+ *  arrives, so a board can then be opened without enumerating or probing the devices.
+ *  While the registry is running, ufe_in_session_on_board_do() and ufe_readout_open() use it.
+ */
+
+#ifndef LIBUFE_REGISTRY_H
+#define LIBUFE_REGISTRY_H 1
+
+#include "libufe.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Function called when a board is connected or disconnected. It is called by the thread of the
+ *  registry, except for the boards already connected when the registry starts. */
+typedef void (*ufe_registry_func)(int board_id, bool connected, void *user_data);
+
+
+/** \brief Starts the registry of the current session. The boards already connected are identified
+ *  before this function returns.
+ *  \param func: Function called when a board is connected or disconnected, or NULL.
+ *  \param user_data: Passed to func.
+ *  \returns 0 on success, LIBUSB_ERROR_NOT_SUPPORTED if the transport has no hotplug support, or
+ *  another LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_registry_start(ufe_registry_func func, void *user_data);
+
+
+/** \brief Stops the registry. Called by ufe_exit().
+ */
+void ufe_registry_stop();
+
+
+/** \brief Tells if the registry is running.
+ *  \returns True if the registry is running.
+ */
+bool ufe_registry_running();
+
+
+/** \brief Opens the device of a connected board.
+ *  \param board_id: Identifier of the board.
+ *  \param handle: Output location for the device handle. Close it with ufe_close().
+ *  \returns 0 on success, UFE_NOT_FOUND_ERROR if the board is not connected, or a LIBUSB_ERROR
+ *  code on failure.
+ */
+int ufe_registry_open(int board_id, libusb_device_handle **handle);
+
+
+/** \brief Gets the identifiers of the connected boards, in increasing order.
+ *  \param board_ids: Output location for the identifiers.
+ *  \param max_ids: Size of board_ids.
+ *  \returns The number of connected boards (at most max_ids).
+ */
+int ufe_registry_get_boards(int *board_ids, int max_ids);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,403 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-trace.h"
+#include "libufe-probes.h"
+#include "libufe-ring.h"
+
+/** Header of each record in the data area. Records are aligned to 8 bytes. */
+struct ring_record {
+  uint32_t size_;
+  uint32_t seq_;
+};
+
+/** Size of a record, marking that the rest of the data area is not used (the next record starts
+ at the beginning). */
+#define RING_PAD_RECORD 0xFFFFFFFF
+
+#define RING_ALIGN(x) (((x) + 7) & ~((uint64_t) 7))
+
+#define LOAD(ptr)        __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE(ptr, val)  __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+static size_t control_size() {
+  long page = sysconf(_SC_PAGESIZE);
+  return (sizeof(struct ufe_ring_control) + page - 1) & ~(page - 1);
+}
+
+// Removes an existing ring, if its producer is gone. Returns 0 if the ring has been removed.
+static int remove_stale_ring(const char *name) {
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return (errno == ENOENT)? 0 : UFE_IO_ERROR;
+
+  struct stat st;
+  int32_t pid = 0;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct ufe_ring_control)) {
+    size_t len = sizeof(struct ufe_ring_control);
+    struct ufe_ring_control *ctrl = (struct ufe_ring_control*) mmap(NULL, len, PROT_READ, MAP_SHARED,
+                                                                    fd, 0);
+    if (ctrl != MAP_FAILED) {
+      if (LOAD(&ctrl->magic_) == UFE_RING_MAGIC)
+        pid = ctrl->pid_;
+
+      munmap(ctrl, len);
+    }
+  }
+
+  close(fd);
+  if (pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH)) {
+    ufe_error_print("shared memory %s is in use by the process %i.", name, pid);
+    return LIBUSB_ERROR_BUSY;
+  }
+
+  ufe_warning_print("removing the stale shared memory %s.", name);
+  shm_unlink(name);
+  return 0;
+}
+
+int ufe_ring_create(ufe_ring **ring, const char *name, size_t size) {
+  uint64_t data_size = 4096;
+  while (data_size < size)
+    data_size <<= 1;
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+  if (fd < 0 && errno == EEXIST) {
+    int status = remove_stale_ring(name);
+    if (status != 0)
+      return status;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+  }
+
+  if (fd < 0) {
+    ufe_error_print("cannot create shared memory %s (%s).", name, strerror(errno));
+    return UFE_IO_ERROR;
+  }
+
+  size_t map_size = control_size() + data_size;
+  if (ftruncate(fd, map_size) != 0) {
+    ufe_error_print("cannot resize shared memory %s (%s).", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return UFE_IO_ERROR;
+  }
+
+  void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ufe_error_print("cannot map shared memory %s (%s).", name, strerror(errno));
+    shm_unlink(name);
+    return UFE_IO_ERROR;
+  }
+
+  ufe_ring *r = (ufe_ring*) calloc(1, sizeof(ufe_ring));
+  snprintf(r->name_, sizeof(r->name_), "%s", name);
+  r->ctrl_ = (struct ufe_ring_control*) map;
+  r->data_ = (uint8_t*) map + control_size();
+  r->map_size_ = map_size;
+
+  memset(r->ctrl_, 0, sizeof(struct ufe_ring_control));
+  r->ctrl_->size_ = data_size;
+  r->ctrl_->pid_ = getpid();
+  STORE(&r->ctrl_->magic_, UFE_RING_MAGIC);
+
+  ufe_debug_print("ring %s created ( %lu bytes ).", name, (unsigned long) data_size);
+  *ring = r;
+  return 0;
+}
+
+static void free_dead_readers(struct ufe_ring_control *ctrl) {
+  int i;
+  for (i = 0; i < UFE_RING_MAX_READERS; ++i) {
+    struct ufe_ring_slot *s = &ctrl->slots_[i];
+    if (LOAD(&s->state_) == 1 && kill(s->pid_, 0) != 0 && errno == ESRCH) {
+      ufe_warning_print("ring reader %i (pid %i) is gone.", i, s->pid_);
+      STORE(&s->state_, 0);
+    }
+  }
+}
+
+// Returns the position of the slowest normal reader. The readers still attaching are not counted,
+// their position is not set yet.
+static uint64_t min_read_pos(struct ufe_ring_control *ctrl, uint64_t pos) {
+  int i;
+  for (i = 0; i < UFE_RING_MAX_READERS; ++i) {
+    struct ufe_ring_slot *s = &ctrl->slots_[i];
+    if (LOAD(&s->state_) == 1 && !s->lossy_) {
+      uint64_t read_pos = LOAD(&s->read_pos_);
+      if (read_pos < pos)
+        pos = read_pos;
+    }
+  }
+
+  return pos;
+}
+
+int ufe_ring_writev(ufe_ring *ring, const struct iovec *iov, int iovcnt) {
+  uint64_t start_ns = ufe_trace_begin();
+  struct ufe_ring_control *ctrl = ring->ctrl_;
+  uint64_t size = ctrl->size_, mask = size - 1;
+  uint64_t pos = ctrl->write_pos_;
+
+  size_t rec_size = 0;
+  int i;
+  for (i = 0; i < iovcnt; ++i)
+    rec_size += iov[i].iov_len;
+
+  uint64_t need = RING_ALIGN(sizeof(struct ring_record) + rec_size);
+  uint64_t offset = pos & mask;
+  uint64_t pad = (offset + need > size)? size - offset : 0;
+
+  if (need > size/2) {
+    ufe_error_print("record too big for the ring ( %zu bytes ).", rec_size);
+    return UFE_INVALID_ARG_ERROR;
+  }
+
+  // Wait for the slow (normal) readers.
+  int n_polls = 0;
+  uint64_t wait_ns = 0;
+  while (pos + pad + need - min_read_pos(ctrl, pos) > size) {
+    if (n_polls++ == 0) {
+      ++ring->n_waits_;
+      wait_ns = ufe_trace_begin();
+    }
+
+    if (n_polls % 10000 == 0)
+      free_dead_readers(ctrl);
+
+    usleep(10);
+  }
+
+  ufe_trace_end("ring", "wait_readers", wait_ns, "polls", n_polls, NULL, 0);
+
+  // Lossy readers detect the overwritten data using this position.
+  STORE(&ctrl->reserve_pos_, pos + pad + need);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (pad) {
+    ((struct ring_record*) (ring->data_ + offset))->size_ = RING_PAD_RECORD;
+    offset = 0;
+  }
+
+  struct ring_record *rec = (struct ring_record*) (ring->data_ + offset);
+  rec->size_ = rec_size;
+  rec->seq_ = (uint32_t) ctrl->n_records_;
+
+  uint8_t *dest = ring->data_ + offset + sizeof(struct ring_record);
+  for (i = 0; i < iovcnt; ++i) {
+    memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+    dest += iov[i].iov_len;
+  }
+
+  ++ctrl->n_records_;
+  STORE(&ctrl->write_pos_, pos + pad + need);
+  UFE_PROBE2(ring_write, rec_size, pos + pad + need);
+  ufe_trace_end("ring", "writev", start_ns, "bytes", rec_size, NULL, 0);
+  return 0;
+}
+
+void ufe_ring_close(ufe_ring *ring, int timeout_ms) {
+  struct ufe_ring_control *ctrl = ring->ctrl_;
+  STORE(&ctrl->eos_, 1);
+
+  // Give the normal readers the chance to get all data.
+  int t;
+  for (t = 0; t < timeout_ms; ++t) {
+    if (min_read_pos(ctrl, ctrl->write_pos_) == ctrl->write_pos_)
+      break;
+
+    ufe_usleep(1000);
+  }
+
+  ufe_debug_print("ring %s closed ( %lu records, producer waited %lu times ).",
+                  ring->name_,
+                  (unsigned long) ctrl->n_records_,
+                  (unsigned long) ring->n_waits_);
+
+  munmap(ring->ctrl_, ring->map_size_);
+  shm_unlink(ring->name_);
+  free(ring);
+}
+
+uint64_t ufe_ring_used(ufe_ring *ring) {
+  uint64_t write_pos = LOAD(&ring->ctrl_->write_pos_);
+  return write_pos - min_read_pos(ring->ctrl_, write_pos);
+}
+
+int ufe_ring_attach(ufe_ring_reader **reader, const char *name, bool lossy) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    ufe_error_print("cannot open shared memory %s (%s).", name, strerror(errno));
+    return UFE_NOT_FOUND_ERROR;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= control_size()) {
+    ufe_error_print("shared memory %s is not a ring.", name);
+    close(fd);
+    return UFE_INVALID_ARG_ERROR;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ufe_error_print("cannot map shared memory %s (%s).", name, strerror(errno));
+    return UFE_IO_ERROR;
+  }
+
+  struct ufe_ring_control *ctrl = (struct ufe_ring_control*) map;
+  if (LOAD(&ctrl->magic_) != UFE_RING_MAGIC) {
+    ufe_error_print("shared memory %s is not a ring.", name);
+    munmap(map, st.st_size);
+    return UFE_INVALID_ARG_ERROR;
+  }
+
+  // Find a free slot.
+  int i;
+  for (i = 0; i < UFE_RING_MAX_READERS; ++i) {
+    uint32_t expected = 0;
+    struct ufe_ring_slot *s = &ctrl->slots_[i];
+    if (__atomic_compare_exchange_n(&s->state_, &expected, 2, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      // Slot reserved (state 2), not yet seen by the producer. The cursor is set before the slot
+      // becomes active. Records written meanwhile are skipped by the first read (see the check
+      // of reserve_pos_ in ufe_ring_read()).
+      s->lossy_ = lossy;
+      s->pid_ = getpid();
+      s->n_lost_ = 0;
+      STORE(&s->read_pos_, LOAD(&ctrl->write_pos_));
+      STORE(&s->state_, 1);
+
+      ufe_ring_reader *r = (ufe_ring_reader*) calloc(1, sizeof(ufe_ring_reader));
+      r->ctrl_ = ctrl;
+      r->data_ = (uint8_t*) map + control_size();
+      r->map_size_ = st.st_size;
+      r->slot_ = s;
+      *reader = r;
+
+      ufe_debug_print("attached to ring %s as %s reader %i.", name, (lossy)? "lossy" : "normal", i);
+      return 0;
+    }
+  }
+
+  ufe_error_print("too many readers of ring %s.", name);
+  munmap(map, st.st_size);
+  return UFE_INTERNAL_ERROR;
+}
+
+int ufe_ring_read(ufe_ring_reader *reader, uint8_t *data, size_t size, size_t *actual, int timeout_ms) {
+  struct ufe_ring_control *ctrl = reader->ctrl_;
+  struct ufe_ring_slot *slot = reader->slot_;
+  uint64_t ring_size = ctrl->size_, mask = ring_size - 1;
+  uint64_t pos = slot->read_pos_;
+  int n_polls = 0;
+
+  *actual = 0;
+  while (1) {
+    uint64_t write_pos = LOAD(&ctrl->write_pos_);
+    if (pos == write_pos) {
+      // Nothing new. Check for the end of the data, or wait.
+      if (LOAD(&ctrl->eos_)) {
+        if (reader->started_)
+          slot->n_lost_ += (uint32_t) (ctrl->n_records_ - reader->next_seq_);
+
+        reader->next_seq_ = ctrl->n_records_;
+        return 0;
+      }
+
+      if (n_polls++ >= timeout_ms*10)
+        return LIBUSB_ERROR_TIMEOUT;
+
+      ufe_usleep(100);
+      continue;
+    }
+
+    if (write_pos - pos > ring_size) {
+      // Overrun (lossy reader only). Restart at the newest record.
+      pos = write_pos;
+      STORE(&slot->read_pos_, pos);
+      continue;
+    }
+
+    struct ring_record rec = *(struct ring_record*) (reader->data_ + (pos & mask));
+    uint64_t need = 0;
+    if (rec.size_ == RING_PAD_RECORD)
+      need = ring_size - (pos & mask);
+    else if ((pos & mask) + sizeof(struct ring_record) + rec.size_ <= ring_size)
+      need = RING_ALIGN(sizeof(struct ring_record) + rec.size_);
+
+    bool fits = (need != 0 && rec.size_ != RING_PAD_RECORD && rec.size_ <= size);
+    if (fits)
+      memcpy(data, reader->data_ + (pos & mask) + sizeof(struct ring_record), rec.size_);
+
+    // Make sure that the record was not overwritten while being copied (lossy readers only).
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (LOAD(&ctrl->reserve_pos_) - pos > ring_size || need == 0) {
+      pos = LOAD(&ctrl->write_pos_);
+      STORE(&slot->read_pos_, pos);
+      continue;
+    }
+
+    if (rec.size_ == RING_PAD_RECORD) {
+      pos += need;
+      STORE(&slot->read_pos_, pos);
+      continue;
+    }
+
+    if (!fits)
+      return LIBUSB_ERROR_OVERFLOW;
+
+    // Records missing in the sequence have been lost.
+    if (reader->started_)
+      slot->n_lost_ += (uint32_t) (rec.seq_ - reader->next_seq_);
+
+    reader->started_ = true;
+    reader->next_seq_ = rec.seq_ + 1;
+
+    pos += need;
+    STORE(&slot->read_pos_, pos);
+    *actual = rec.size_;
+    UFE_PROBE2(ring_read, rec.size_, pos);
+    return 0;
+  }
+}
+
+uint64_t ufe_ring_lost(ufe_ring_reader *reader) {
+  return reader->slot_->n_lost_;
+}
+
+void ufe_ring_detach(ufe_ring_reader *reader) {
+  STORE(&reader->slot_->state_, 0);
+  munmap(reader->ctrl_, reader->map_size_);
+  free(reader);
+}
@@ -0,0 +1,234 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-ring.h
+ *  \brief   File containing a shared memory ring buffer, used to distribute the readout data to
+ *  several consumer processes. The ring has one producer and many readers. Each reader has its
+ *  own cursor. A normal reader is never overwritten (the producer waits for it), a lossy reader
+ *  never slows down the producer (it loses data instead).
+ */
+
+#ifndef LIBUFE_RING_H
+#define LIBUFE_RING_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Default name of the shared memory object. */
+#define UFE_RING_NAME "/ufe_ring"
+
+/** Default size (in bytes) of the data area of the ring. */
+#define UFE_RING_SIZE (64*1024*1024)
+
+/** Maximum number of readers attached at the same time. */
+#define UFE_RING_MAX_READERS 16
+
+/** Magic word ("UFER") identifying the shared memory object. */
+#define UFE_RING_MAGIC 0x55464552
+
+/** \brief Cursor of a reader. Every slot occupies its own cache line. */
+struct ufe_ring_slot {
+  /** 0 if the slot is free, 1 if in use, 2 while the reader is attaching (not yet counted by the
+   *  producer).
+   */
+  uint32_t state_;
+
+  /** 1 if the reader is lossy. */
+  uint32_t lossy_;
+
+  /** Process Id of the reader. */
+  int32_t pid_;
+
+  /** Not used. */
+  uint32_t reserved_;
+
+  /** Position of the next record to be read. */
+  uint64_t read_pos_;
+
+  /** Number of records lost (lossy readers only). */
+  uint64_t n_lost_;
+
+  /** Padding up to a cache line. */
+  uint64_t pad_[4];
+};
+
+/** \brief Control block in the beginning of the shared memory object. */
+struct ufe_ring_control {
+  /** Always UFE_RING_MAGIC. */
+  uint32_t magic_;
+
+  /** 1 after the producer has closed the ring. */
+  uint32_t eos_;
+
+  /** Size (power of 2) of the data area. */
+  uint64_t size_;
+
+  /** Number of records written. */
+  uint64_t n_records_;
+
+  /** Process Id of the producer. */
+  int32_t pid_;
+
+  /** Not used. */
+  uint32_t reserved_;
+
+  /** Padding up to a cache line. */
+  uint64_t pad0_[4];
+
+  /** Position up to which the producer may be writing. */
+  uint64_t reserve_pos_;
+
+  /** Position up to which the data is complete. */
+  uint64_t write_pos_;
+
+  /** Padding up to a cache line. */
+  uint64_t pad1_[6];
+
+  /** The cursors of the readers. */
+  struct ufe_ring_slot slots_[UFE_RING_MAX_READERS];
+};
+
+/** \brief Structure representing a ring buffer (producer side). */
+struct ufe_ring {
+  /** Name of the shared memory object. */
+  char name_[64];
+
+  /** The control block. */
+  struct ufe_ring_control *ctrl_;
+
+  /** The data area. */
+  uint8_t *data_;
+
+  /** Size of the mapping. */
+  size_t map_size_;
+
+  /** Number of times the producer had to wait for a slow reader. */
+  uint64_t n_waits_;
+};
+
+/** ufe_ring type */
+typedef struct ufe_ring ufe_ring;
+
+/** \brief Structure representing a reader attached to a ring buffer. */
+struct ufe_ring_reader {
+  /** The control block. */
+  struct ufe_ring_control *ctrl_;
+
+  /** The data area. */
+  uint8_t *data_;
+
+  /** Size of the mapping. */
+  size_t map_size_;
+
+  /** The slot of this reader. */
+  struct ufe_ring_slot *slot_;
+
+  /** Sequence number of the next record expected. */
+  uint32_t next_seq_;
+
+  /** True after the first record has been read. */
+  bool started_;
+};
+
+/** ufe_ring_reader type */
+typedef struct ufe_ring_reader ufe_ring_reader;
+
+
+/** \brief Creates a ring buffer in shared memory. An existing ring with the same name is replaced
+ *  only if its producer is gone, the ring of a running producer is never touched.
+ *  \param ring: Output location for the ring.
+ *  \param name: Name of the shared memory object (e.g. UFE_RING_NAME).
+ *  \param size: Size of the data area (rounded up to a power of 2).
+ *  \returns 0 on success, LIBUSB_ERROR_BUSY if the ring exists and its producer is running, or a
+ *  LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_ring_create(ufe_ring **ring, const char *name, size_t size);
+
+
+/** \brief Writes one record. Waits if the record would overwrite data not yet read by a normal reader.
+ *  \param ring: The ring.
+ *  \param iov: Input location for the pieces of the record.
+ *  \param iovcnt: Number of pieces.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_ring_writev(ufe_ring *ring, const struct iovec *iov, int iovcnt);
+
+
+/** \brief Marks the end of the data, waits (at most timeout_ms) for the normal readers and removes
+ *  the shared memory object.
+ *  \param ring: The ring.
+ *  \param timeout_ms: Maximum time to wait for the readers (in milliseconds).
+ */
+void ufe_ring_close(ufe_ring *ring, int timeout_ms);
+
+
+/** \brief Gets the number of bytes not yet read by the slowest normal reader.
+ *  \param ring: The ring.
+ *  \returns The number of bytes in use.
+ */
+uint64_t ufe_ring_used(ufe_ring *ring);
+
+
+/** \brief Attaches a new reader to an existing ring. The reader starts with the next record written.
+ *  \param reader: Output location for the reader.
+ *  \param name: Name of the shared memory object.
+ *  \param lossy: If true, the producer never waits for this reader.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_ring_attach(ufe_ring_reader **reader, const char *name, bool lossy);
+
+
+/** \brief Reads the next record.
+ *  \param reader: The reader.
+ *  \param data: Output location for the record.
+ *  \param size: Size of the output location.
+ *  \param actual: Actual size of the record. 0 at the end of the data.
+ *  \param timeout_ms: Maximum time to wait for a record (in milliseconds).
+ *  \returns 0 on success, LIBUSB_ERROR_TIMEOUT if no record arrived, LIBUSB_ERROR_OVERFLOW if the
+ *  record is bigger than size, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_ring_read(ufe_ring_reader *reader, uint8_t *data, size_t size, size_t *actual, int timeout_ms);
+
+
+/** \brief Gets the number of records lost by a lossy reader.
+ *  \param reader: The reader.
+ *  \returns The number of records lost.
+ */
+uint64_t ufe_ring_lost(ufe_ring_reader *reader);
+
+
+/** \brief Detaches a reader from the ring.
+ *  \param reader: The reader.
+ */
+void ufe_ring_detach(ufe_ring_reader *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include"libufe-tools.h"
 
@@ -78,6 +79,24 @@ int get_arg_val(const char arg_short, const char* arg_long, int argc, char **arg
   return 0;
 }
 
+int get_board_ids(char *arg, int *board_ids, int max_ids) {
+  // "all" means all boards connected to the system.
+  if (strcmp(arg, "all") == 0)
+    return 0;
+
+  int n_ids = 0;
+  char *id = strtok(arg, ",");
+  while (id != NULL) {
+    if (n_ids == max_ids)
+      return -1;
+
+    board_ids[n_ids++] = arg_as_int(id);
+    id = strtok(NULL, ",");
+  }
+
+  return n_ids;
+}
+
 
 int ufe_open_fifo() {
   int i=0, status = 0;
@@ -111,6 +130,23 @@ int ufe_open_fifo() {
   return fifo;
 }
 
+int ufe_write_all(int fd, const uint8_t *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return UFE_IO_ERROR;
+    }
+
+    data += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
 int ufe_close_fifo(int fifo) {
   usleep(1000);
 //   sleep(1);
@@ -40,12 +40,19 @@ int get_arg(const char arg_short, const char* arg_long, int argc, char **argv);
 
 int get_arg_val(const char arg_short, const char* arg_long, int argc, char **argv);
 
+// Parses a comma separated list of board Ids. Returns the number of Ids, 0 for "all" or -1 on error.
+int get_board_ids(char *arg, int *board_ids, int max_ids);
+
 
 #define   FIFO_PATH "/tmp/ufe_fifo"
 int ufe_open_fifo();
 
 int ufe_close_fifo(int fifo);
 
+// Writes all the data, also if the file descriptor (pipe, socket) accepts only a part of it at once.
+// Returns 0 on success or UFE_IO_ERROR.
+int ufe_write_all(int fd, const uint8_t *data, size_t size);
+
 // Config
 int load_config(libusb_device_handle *dev_handle, int board, int device, uint32_t *conf_data, int size);
 
@@ -0,0 +1,327 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-trace.h"
+
+#define TRACE_CHUNK_SIZE 4096
+
+struct trace_event {
+  const char *category_;
+  const char *name_;
+
+  /** 'X' (complete), 's' (start of a flow) or 'f' (end of a flow). */
+  char phase_;
+
+  uint64_t ts_;
+
+  /** Duration of a complete event, identifier of a flow. */
+  uint64_t dur_;
+
+  const char *arg_names_[2];
+  int64_t args_[2];
+};
+
+struct trace_chunk {
+  struct trace_chunk *next_;
+
+  /** Number of events, published by the owner thread. */
+  int n_;
+  struct trace_event events_[TRACE_CHUNK_SIZE];
+};
+
+/** The events of one thread. Only the owner thread writes in it. */
+struct trace_buffer {
+  struct trace_buffer *next_;
+  pid_t tid_;
+  char name_[32];
+  struct trace_chunk *first_, *last_;
+  int n_events_;
+  int n_dropped_;
+};
+
+static bool trace_on = false;
+
+/** Number of threads writing an event. ufe_trace_stop() waits for them before freeing the buffers. */
+static int trace_writers = 0;
+static int trace_session = 0;
+static uint64_t trace_start_ns = 0;
+static FILE *trace_file = NULL;
+
+/** List of all buffers. The threads add their buffer with a CAS on the head. */
+static struct trace_buffer *trace_buffers = NULL;
+
+static __thread struct trace_buffer *thread_buffer = NULL;
+static __thread int thread_session = 0;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static struct trace_buffer* get_thread_buffer() {
+  // A buffer from a previous session has been freed by ufe_trace_stop().
+  if (thread_buffer && thread_session == __atomic_load_n(&trace_session, __ATOMIC_ACQUIRE))
+    return thread_buffer;
+
+  struct trace_buffer *buf = (struct trace_buffer*) calloc(1, sizeof(struct trace_buffer));
+  struct trace_chunk *chunk = (struct trace_chunk*) malloc(sizeof(struct trace_chunk));
+  if (buf == NULL || chunk == NULL) {
+    free(buf);
+    free(chunk);
+    return NULL;
+  }
+
+  chunk->next_ = NULL;
+  chunk->n_ = 0;
+  buf->first_ = buf->last_ = chunk;
+  buf->tid_ = syscall(SYS_gettid);
+  pthread_getname_np(pthread_self(), buf->name_, sizeof(buf->name_));
+
+  buf->next_ = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&trace_buffers, &buf->next_, buf, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  thread_buffer = buf;
+  thread_session = trace_session;
+  return buf;
+}
+
+static void leave_event() {
+  __atomic_sub_fetch(&trace_writers, 1, __ATOMIC_RELEASE);
+}
+
+// Starts writing an event, unless the tracing has been stopped since ufe_trace_enabled().
+// Ended by commit_event(), or on failure.
+static struct trace_event* new_event() {
+  __atomic_add_fetch(&trace_writers, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&trace_on, __ATOMIC_SEQ_CST)) {
+    leave_event();
+    return NULL;
+  }
+
+  struct trace_buffer *buf = get_thread_buffer();
+  if (buf == NULL) {
+    leave_event();
+    return NULL;
+  }
+
+  if (buf->n_events_ == UFE_TRACE_MAX_EVENTS) {
+    ++buf->n_dropped_;
+    leave_event();
+    return NULL;
+  }
+
+  struct trace_chunk *chunk = buf->last_;
+  if (chunk->n_ == TRACE_CHUNK_SIZE) {
+    struct trace_chunk *next = (struct trace_chunk*) malloc(sizeof(struct trace_chunk));
+    if (next == NULL) {
+      ++buf->n_dropped_;
+      leave_event();
+      return NULL;
+    }
+
+    next->next_ = NULL;
+    next->n_ = 0;
+    __atomic_store_n(&chunk->next_, next, __ATOMIC_RELEASE);
+    buf->last_ = chunk = next;
+  }
+
+  ++buf->n_events_;
+  return &chunk->events_[chunk->n_];
+}
+
+// Makes the event visible to ufe_trace_stop().
+static void commit_event() {
+  struct trace_chunk *chunk = thread_buffer->last_;
+  __atomic_store_n(&chunk->n_, chunk->n_ + 1, __ATOMIC_RELEASE);
+  leave_event();
+}
+
+bool ufe_trace_enabled() {
+  return __atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+}
+
+uint64_t ufe_trace_begin() {
+  return (ufe_trace_enabled())? now_ns() : 0;
+}
+
+void ufe_trace_end(const char *category,
+                   const char *name,
+                   uint64_t start_ns,
+                   const char *arg0_name,
+                   int64_t arg0,
+                   const char *arg1_name,
+                   int64_t arg1) {
+  if (start_ns == 0 || !ufe_trace_enabled())
+    return;
+
+  uint64_t end_ns = now_ns();
+  struct trace_event *e = new_event();
+  if (e == NULL)
+    return;
+
+  e->category_     = category;
+  e->name_         = name;
+  e->phase_        = 'X';
+  e->ts_           = start_ns;
+  e->dur_          = end_ns - start_ns;
+  e->arg_names_[0] = arg0_name;
+  e->args_[0]      = arg0;
+  e->arg_names_[1] = arg1_name;
+  e->args_[1]      = arg1;
+  commit_event();
+}
+
+void ufe_trace_flow(const char *name, uint64_t id, bool start) {
+  if (!ufe_trace_enabled())
+    return;
+
+  struct trace_event *e = new_event();
+  if (e == NULL)
+    return;
+
+  e->category_     = "flow";
+  e->name_         = name;
+  e->phase_        = (start)? 's' : 'f';
+  e->ts_           = now_ns();
+  e->dur_          = id;
+  e->arg_names_[0] = NULL;
+  e->arg_names_[1] = NULL;
+  commit_event();
+}
+
+void ufe_usleep(unsigned int usec) {
+  uint64_t start_ns = ufe_trace_begin();
+  usleep(usec);
+  ufe_trace_end("sleep", "usleep", start_ns, "us", usec, NULL, 0);
+}
+
+int ufe_trace_start(const char *file_name) {
+  if (ufe_trace_enabled()) {
+    ufe_error_print("the tracing is already running.");
+    return UFE_INTERNAL_ERROR;
+  }
+
+  trace_file = fopen(file_name, "w");
+  if (trace_file == NULL) {
+    ufe_error_print("cannot open the trace file %s.", file_name);
+    return UFE_IO_ERROR;
+  }
+
+  trace_start_ns = now_ns();
+  __atomic_store_n(&trace_on, true, __ATOMIC_RELEASE);
+  ufe_info_print("tracing in %s.", file_name);
+  return 0;
+}
+
+static void write_event(FILE *file, const struct trace_event *e, pid_t pid, pid_t tid, bool *first) {
+  fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":%i,\"tid\":%i,\"ts\":%.3f",
+          (*first)? "" : ",", e->name_, e->category_, e->phase_, pid, tid,
+          (e->ts_ - trace_start_ns)*1e-3);
+  *first = false;
+
+  if (e->phase_ == 'X') {
+    fprintf(file, ",\"dur\":%.3f", e->dur_*1e-3);
+  } else {
+    // The end of a flow is bound to the enclosing event.
+    fprintf(file, ",\"id\":%lu%s", (unsigned long) e->dur_, (e->phase_ == 'f')? ",\"bp\":\"e\"" : "");
+  }
+
+  if (e->arg_names_[0]) {
+    fprintf(file, ",\"args\":{\"%s\":%li", e->arg_names_[0], (long) e->args_[0]);
+    if (e->arg_names_[1])
+      fprintf(file, ",\"%s\":%li", e->arg_names_[1], (long) e->args_[1]);
+
+    fprintf(file, "}");
+  }
+
+  fprintf(file, "}");
+}
+
+int ufe_trace_stop() {
+  if (!ufe_trace_enabled())
+    return UFE_NOT_FOUND_ERROR;
+
+  // Wait for the events being written: the new ones see the tracing stopped.
+  __atomic_store_n(&trace_on, false, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&trace_writers, __ATOMIC_SEQ_CST) > 0)
+    sched_yield();
+
+  pid_t pid = getpid();
+  bool first = true;
+  int n_events = 0, n_dropped = 0;
+  fprintf(trace_file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+  struct trace_buffer *buf = __atomic_exchange_n(&trace_buffers, NULL, __ATOMIC_ACQUIRE);
+  while (buf) {
+    fprintf(trace_file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":%i,\"args\":{\"name\":\"%s\"}}",
+            (first)? "" : ",", pid, buf->tid_, buf->name_);
+    first = false;
+
+    struct trace_chunk *chunk = buf->first_;
+    while (chunk) {
+      int i, n = __atomic_load_n(&chunk->n_, __ATOMIC_ACQUIRE);
+      for (i = 0; i < n; ++i)
+        write_event(trace_file, &chunk->events_[i], pid, buf->tid_, &first);
+
+      n_events += n;
+      struct trace_chunk *next = __atomic_load_n(&chunk->next_, __ATOMIC_ACQUIRE);
+      free(chunk);
+      chunk = next;
+    }
+
+    n_dropped += buf->n_dropped_;
+    struct trace_buffer *next = buf->next_;
+    free(buf);
+    buf = next;
+  }
+
+  // The threads allocate a new buffer at the next session.
+  __atomic_add_fetch(&trace_session, 1, __ATOMIC_RELEASE);
+
+  fprintf(trace_file, "\n]}\n");
+  int status = (ferror(trace_file))? UFE_IO_ERROR : 0;
+  if (fclose(trace_file) != 0)
+    status = UFE_IO_ERROR;
+
+  trace_file = NULL;
+  if (status != 0)
+    ufe_error_print("cannot write the trace file.");
+
+  if (n_dropped)
+    ufe_warning_print("%i trace events dropped (more than %i events per thread).",
+                      n_dropped, UFE_TRACE_MAX_EVENTS);
+
+  ufe_info_print("%i trace events written.", n_events);
+  return status;
+}
@@ -0,0 +1,109 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe-trace.h
+ *  \brief   File containing the timeline tracing of the USB transfers, the commands, the sleeps and
+ *  the hand-off of the readout blocks. The trace is written in the Chrome trace-event JSON format,
+ *  which can be opened with chrome://tracing or https://ui.perfetto.dev.
+ *  Every thread records its events in its own buffer, without locks. The events are written to the
+ *  file only when the tracing is stopped.
+ */
+
+#ifndef LIBUFE_TRACE_H
+#define LIBUFE_TRACE_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum number of events recorded by one thread. Further events are dropped. */
+#define UFE_TRACE_MAX_EVENTS (1 << 20)
+
+/** \brief Starts the tracing. If the environment variable UFE_TRACE is set, ufe_init() starts the
+ *  tracing in the file given by the variable.
+ *  \param file_name: The trace file.
+ *  \returns 0 on success, UFE_IO_ERROR if the file cannot be opened or UFE_INTERNAL_ERROR if the
+ *  tracing is already running.
+ */
+int ufe_trace_start(const char *file_name);
+
+
+/** \brief Stops the tracing and writes the trace file. The other threads can still use the
+ *  library: the events being written are waited for, the later ones are not recorded. Called by
+ *  ufe_exit().
+ *  \returns 0 on success, UFE_IO_ERROR if the file cannot be written, or UFE_NOT_FOUND_ERROR if the
+ *  tracing is not running.
+ */
+int ufe_trace_stop();
+
+
+/** \brief Tells if the tracing is running.
+ *  \returns True if the events are recorded.
+ */
+bool ufe_trace_enabled();
+
+
+/** \brief Gets the start time of a traced operation.
+ *  \returns The current time (ns), or 0 if the tracing is not running.
+ */
+uint64_t ufe_trace_begin();
+
+
+/** \brief Records an operation which started at start_ns and ends now.
+ *  \param category: Category of the event. Must be a string literal.
+ *  \param name: Name of the event. Must be a string literal.
+ *  \param start_ns: Start time, as given by ufe_trace_begin(). Nothing is recorded if 0.
+ *  \param arg0_name: Name of the first argument (string literal), or NULL.
+ *  \param arg0: Value of the first argument.
+ *  \param arg1_name: Name of the second argument (string literal), or NULL.
+ *  \param arg1: Value of the second argument.
+ */
+void ufe_trace_end(const char *category,
+                   const char *name,
+                   uint64_t start_ns,
+                   const char *arg0_name,
+                   int64_t arg0,
+                   const char *arg1_name,
+                   int64_t arg1);
+
+
+/** \brief Records the hand-off of an object between two threads. The two ends are linked by an
+ *  arrow in the timeline.
+ *  \param name: Name of the flow. Must be a string literal.
+ *  \param id: Identifier of the object.
+ *  \param start: True on the producer side, false on the consumer side.
+ */
+void ufe_trace_flow(const char *name, uint64_t id, bool start);
+
+
+/** \brief Sleeps and records the sleep.
+ *  \param usec: Duration of the sleep in microseconds.
+ */
+void ufe_usleep(unsigned int usec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <libusb-1.0/libusb.h>
 
@@ -33,10 +34,153 @@
 #include "libufe.h"
 #include "libufe-core.h"
 #include "libufe-tools.h"
+#include "libufe-emu.h"
+#include "libufe-registry.h"
+#include "libufe-trace.h"
+#include "libufe-probes.h"
+#include "libufe-pool.h"
 
 
 ufe_context *ufe_context_handler = NULL;
 
+static ufe_hotplug_func libusb_hotplug_func = NULL;
+static libusb_hotplug_callback_handle libusb_hotplug_handle;
+
+static int LIBUSB_CALL libusb_hotplug_adapter(libusb_context *ctx,
+                                              libusb_device *dev,
+                                              libusb_hotplug_event event,
+                                              void *user_data) {
+  (*libusb_hotplug_func)(dev, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data);
+  return 0;
+}
+
+static int libusb_hotplug_register(libusb_context *ctx, ufe_hotplug_func func, void *user_data) {
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+
+  libusb_hotplug_func = func;
+  return libusb_hotplug_register_callback(ctx,
+                                          LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                          LIBUSB_HOTPLUG_ENUMERATE,
+                                          UFE_VENDOR_ID,
+                                          BMFEB_PRODUCT_ID,
+                                          LIBUSB_HOTPLUG_MATCH_ANY,
+                                          &libusb_hotplug_adapter,
+                                          user_data,
+                                          &libusb_hotplug_handle);
+}
+
+static void libusb_hotplug_deregister(libusb_context *ctx) {
+  libusb_hotplug_deregister_callback(ctx, libusb_hotplug_handle);
+  libusb_hotplug_func = NULL;
+}
+
+static int libusb_handle_events_ms(libusb_context *ctx, int timeout_ms) {
+  struct timeval tv;
+  tv.tv_sec  = timeout_ms/1000;
+  tv.tv_usec = (timeout_ms%1000)*1000;
+  return libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+}
+
+static void LIBUSB_CALL libusb_transfer_done(struct libusb_transfer *transfer) {
+  ufe_transfer *t = (ufe_transfer*) transfer->user_data;
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      t->status_ = 0; break;
+
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      t->status_ = LIBUSB_ERROR_TIMEOUT; break;
+
+    case LIBUSB_TRANSFER_STALL:
+      t->status_ = LIBUSB_ERROR_PIPE; break;
+
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      t->status_ = LIBUSB_ERROR_NO_DEVICE; break;
+
+    case LIBUSB_TRANSFER_CANCELLED:
+      t->status_ = LIBUSB_ERROR_INTERRUPTED; break;
+
+    case LIBUSB_TRANSFER_OVERFLOW:
+      t->status_ = LIBUSB_ERROR_OVERFLOW; break;
+
+    default:
+      t->status_ = LIBUSB_ERROR_IO; break;
+  }
+
+  t->actual_ = transfer->actual_length;
+  if (t->type_ == LIBUSB_TRANSFER_TYPE_CONTROL) {
+    // The data follows the setup packet.
+    if (t->request_type_ & LIBUSB_ENDPOINT_IN)
+      memcpy(t->data_, libusb_control_transfer_get_data(transfer), t->actual_);
+
+    free(transfer->buffer);
+  }
+
+  libusb_free_transfer(transfer);
+  (*t->callback_)(t);
+}
+
+static int libusb_submit_ufe_transfer(ufe_transfer *t) {
+  struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+  if (transfer == NULL)
+    return LIBUSB_ERROR_NO_MEM;
+
+  if (t->type_ == LIBUSB_TRANSFER_TYPE_CONTROL) {
+    unsigned char *buffer = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + t->length_);
+    if (buffer == NULL) {
+      libusb_free_transfer(transfer);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+
+    libusb_fill_control_setup(buffer, t->request_type_, t->request_, t->value_, t->index_, t->length_);
+    if (!(t->request_type_ & LIBUSB_ENDPOINT_IN))
+      memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, t->data_, t->length_);
+
+    libusb_fill_control_transfer(transfer, t->handle_, buffer, &libusb_transfer_done, t, t->timeout_);
+  } else {
+    libusb_fill_bulk_transfer(transfer, t->handle_, t->endpoint_, t->data_, t->length_,
+                              &libusb_transfer_done, t, t->timeout_);
+  }
+
+  int status = libusb_submit_transfer(transfer);
+  if (status != 0) {
+    if (t->type_ == LIBUSB_TRANSFER_TYPE_CONTROL)
+      free(transfer->buffer);
+
+    libusb_free_transfer(transfer);
+  }
+
+  return status;
+}
+
+static int libusb_get_handle_bus_number(libusb_device_handle *handle) {
+  return libusb_get_bus_number(libusb_get_device(handle));
+}
+
+static const ufe_transport libusb_transport = {
+  "libusb",
+  &libusb_get_device_list,
+  &libusb_free_device_list,
+  &libusb_ref_device,
+  &libusb_unref_device,
+  &libusb_get_device_descriptor,
+  &libusb_get_device_speed,
+  &libusb_open,
+  &libusb_close,
+  &libusb_bulk_transfer,
+  &libusb_control_transfer,
+  &libusb_clear_halt,
+  &libusb_hotplug_register,
+  &libusb_hotplug_deregister,
+  &libusb_handle_events_ms,
+  &libusb_submit_ufe_transfer,
+  &libusb_get_handle_bus_number
+};
+
+const ufe_transport* ufe_libusb_transport() {
+  return &libusb_transport;
+}
+
 extern crc_context crc16_context_handler;
 extern crc_context crc21_context_handler;
 
@@ -49,6 +193,8 @@ int ufe_default_context(ufe_context **context) {
 
   ctx->readout_buffer_size_ = 1024*32;
   ctx->readout_timeout_ = 100;
+  ctx->readout_blocks_ = 16;
+  ctx->readout_pool_flags_ = UFE_POOL_HUGEPAGES | UFE_POOL_PREFAULT;
   ctx->verbose_ = 1;
 
   if (*context && *context != ufe_context_handler) {
@@ -63,6 +209,7 @@ int ufe_default_context(ufe_context **context) {
   ufe_context_handler = ctx;
   *context = ctx;
   (*context)->usb_ctx_ = NULL;
+  (*context)->transport_ = NULL;
 
 #ifdef ZMQ_ENABLE
   ctx->zmq_ctx_ = NULL;
@@ -103,11 +250,44 @@ int ufe_init(ufe_context **context) {
   ufe_debug_print("ZMQ socket created.");
 #endif
 
+  // Use the emulated boards if requested.
+  const char *emu_config = getenv("UFE_EMULATOR");
+  if ((*context)->transport_ == NULL && emu_config) {
+    ufe_emu_config config;
+    ufe_emu_default_config(&config);
+    int status = ufe_emu_parse_config(emu_config, &config);
+    if (status == 0)
+      status = ufe_emu_start(&config);
+
+    if (status != 0)
+      return status;
+
+    (*context)->transport_ = ufe_emu_transport();
+  }
+
+  if ((*context)->transport_ == NULL)
+    (*context)->transport_ = &libusb_transport;
+
+  // Record the timeline of the session if requested.
+  const char *trace_file = getenv("UFE_TRACE");
+  if (trace_file && !ufe_trace_enabled()) {
+    int status = ufe_trace_start(trace_file);
+    if (status != 0)
+      return status;
+  }
+
+  if ((*context)->transport_ != &libusb_transport) {
+    ufe_info_print("using the %s transport.", (*context)->transport_->name_);
+    return 0;
+  }
+
   return libusb_init(&(*context)->usb_ctx_);
 }
 
 void ufe_set_verbose(ufe_context *ctx, int libusb_level, int ufe_level) {
-  libusb_set_debug(ctx->usb_ctx_, libusb_level);
+  if (ctx->usb_ctx_)
+    libusb_set_debug(ctx->usb_ctx_, libusb_level);
+
   ctx->verbose_ = ufe_level;
 }
 
@@ -115,6 +295,10 @@ void ufe_set_readout_timeout(ufe_context *ctx, int t) {
   ctx->readout_timeout_ = t;
 }
 
+void ufe_set_cmd_timing(ufe_context *ctx, bool enable) {
+  ctx->cmd_timing_ = enable;
+}
+
 size_t ufe_get_device_list(libusb_context *ctx, libusb_device ***feb_devs) {
   int dummy_arg=0;
   return ufe_get_custom_device_list(ctx, &is_ufe, dummy_arg, feb_devs);
@@ -126,7 +310,7 @@ size_t ufe_get_bm_device_list(libusb_context *ctx, libusb_device ***feb_devs) {
 }
 
 int ufe_open(libusb_device *dev, libusb_device_handle **handle) {
-  int status = libusb_open(dev, handle);
+  int status = ufe_usb()->open(dev, handle);
   ufe_debug_print("Opening the device (%p).", (void*) *handle);
   if (status !=0)
     return status;
@@ -156,11 +340,11 @@ int ufe_open(libusb_device *dev, libusb_device_handle **handle) {
 
 void ufe_close(libusb_device_handle *handle) {
   ufe_debug_print("Closing the device (%p).", (void*) handle);
-  libusb_close(handle);
+  ufe_usb()->close(handle);
 }
 
 void ufe_free_device_list(libusb_device **list, int unref_devices) {
-  libusb_free_device_list(list, unref_devices);
+  ufe_usb()->free_device_list(list, unref_devices);
 }
 
 ufe_context* ufe_get_context() {
@@ -169,15 +353,31 @@ ufe_context* ufe_get_context() {
 
 void ufe_exit(ufe_context *ctx) {
   ufe_debug_print("Closing the session.");
+  // The registry thread records events until it is stopped.
+  ufe_registry_stop();
+  if (ufe_trace_enabled())
+    ufe_trace_stop();
+
+  ufe_free_cmd_timing();
   if (ctx) {
-    libusb_exit(ctx->usb_ctx_);
+    if (ctx->transport_ == ufe_emu_transport())
+      ufe_emu_stop();
+
+    if (ctx->usb_ctx_)
+      libusb_exit(ctx->usb_ctx_);
+
 #ifdef ZMQ_ENABLE
     zmq_close(ctx->publisher_socket_);
     zmq_ctx_destroy(ctx->zmq_ctx_);
 #endif
     free(ctx);
   } else if (ufe_context_handler) {
-    libusb_exit(ufe_context_handler->usb_ctx_);
+    if (ufe_context_handler->transport_ == ufe_emu_transport())
+      ufe_emu_stop();
+
+    if (ufe_context_handler->usb_ctx_)
+      libusb_exit(ufe_context_handler->usb_ctx_);
+
 #ifdef ZMQ_ENABLE
     zmq_close(ctx->publisher_socket_);
     zmq_ctx_destroy(ctx->zmq_ctx_);
@@ -190,10 +390,10 @@ void ufe_exit(ufe_context *ctx) {
 bool ufe_ping(libusb_device_handle *dev_handle, uint8_t board_id) {
   uint16_t buff;
 
-  int xVerbose = ufe_context_handler->verbose_;
-  ufe_context_handler->verbose_ = -1;
+  // Several threads may ping at the same time (see ufe_probe_devices()), mute only this one.
+  int xVerbose = ufe_set_thread_verbose(-1);
   int status = ufe_read_status(dev_handle, board_id, &buff);
-  ufe_context_handler->verbose_ = xVerbose;
+  ufe_set_thread_verbose(xVerbose);
 
   if (status != 0) {
     ufe_info_print("board %i is unreachable.", board_id);
@@ -209,7 +409,7 @@ int ufe_get_version(libusb_device_handle *ufe, int *data) {
   uint16_t value = 0, lenght = 2;
   *data = 7;
 
-  int status = libusb_control_transfer( ufe,
+  int status = ufe_usb()->control_transfer( ufe,
                                         CLASS_REQUEST | LIBUSB_ENDPOINT_IN,
                                         UFE_GET_VERSION_REQ,
                                         value,
@@ -224,7 +424,7 @@ int ufe_get_version(libusb_device_handle *ufe, int *data) {
   } else
     ufe_debug_print("get_version ( %i, 0x%4x )", status, *data);
 
-  usleep(1);
+  ufe_usleep(1);
   return 0;
 }
 
@@ -233,7 +433,7 @@ int ufe_get_buff_size(libusb_device_handle *ufe, uint64_t *data) {
   uint16_t value = 0, lenght = 8;
   *data = 7;
 
-  int status = libusb_control_transfer( ufe,
+  int status = ufe_usb()->control_transfer( ufe,
                                         CLASS_REQUEST | LIBUSB_ENDPOINT_IN,
                                         UFE_GET_BUF_SIZE,
                                         value,
@@ -249,7 +449,7 @@ int ufe_get_buff_size(libusb_device_handle *ufe, uint64_t *data) {
     ufe_debug_print("get_buff_size ( %i, 0x%" PRIx64 " ): ", status, *data);
 
 
-  usleep(1);
+  ufe_usleep(1);
   return 0;
 }
 
@@ -258,7 +458,7 @@ int ufe_enable_led(libusb_device_handle *ufe, bool enable) {
   uint16_t value = (uint16_t)(!enable), lenght = 1;
   uint8_t data = 7;
 
-  int status = libusb_control_transfer( ufe,
+  int status = ufe_usb()->control_transfer( ufe,
                                         CLASS_REQUEST | LIBUSB_ENDPOINT_IN,
                                         UFE_LED_OFF_REQ,
                                         value,
@@ -272,16 +472,16 @@ int ufe_enable_led(libusb_device_handle *ufe, bool enable) {
   } else
     ufe_debug_print("enable_led ( %i, %i )", status, data);
 
-  usleep(1);
+  ufe_usleep(1);
   return 0;
 }
 
-int ufe_ep2in_wrappup(libusb_device_handle *ufe) {
+static int wrappup(libusb_device_handle *ufe, int ep_id) {
 
-  uint16_t value = 2, lenght = 1;
+  uint16_t value = ep_id, lenght = 1;
   uint8_t data = 7;
 
-  int status = libusb_control_transfer( ufe,
+  int status = ufe_usb()->control_transfer( ufe,
                                         CLASS_REQUEST | LIBUSB_ENDPOINT_IN,
                                         UFE_EP2IN_WRAPPUP_REQ,
                                         value,
@@ -290,12 +490,31 @@ int ufe_ep2in_wrappup(libusb_device_handle *ufe) {
                                         lenght,
                                         UFE_CMD_TIMEOUT);
   if(status != lenght || data != value) {
-    ufe_error_print("ep2in_wrappup failed ( %i, %i )", status, data);
+    ufe_error_print("ep%iin_wrappup failed ( %i, %i )", ep_id, status, data);
     return UFE_INVALID_CMD_ANSWER_ERROR;
   } else
-    ufe_debug_print("ep2in_wrappup ( %i, %i )", status, data);
+    ufe_debug_print("ep%iin_wrappup ( %i, %i )", ep_id, status, data);
+
+  return 0;
+}
+
+int ufe_epxin_wrappup(libusb_device_handle *ufe, int ep_id) {
+  int status = wrappup(ufe, ep_id);
+  if (status != 0)
+    return status;
+
+  ufe_usleep(1);
+  return 0;
+}
+
+int ufe_ep2in_wrappup(libusb_device_handle *ufe) {
+  uint64_t start_ns = ufe_cmd_timing_start();
+  int status = wrappup(ufe, 2);
+  if (status != 0)
+    return status;
 
-  usleep(1);
+  ufe_cmd_timing_record(ufe, UFE_PHASE_WRAPUP, start_ns);
+  ufe_usleep(1);
   return 0;
 }
 
@@ -304,7 +523,7 @@ int ufe_epxin_reset(libusb_device_handle *ufe, int ep_id) {
   uint16_t value = ep_id, lenght = 1;
   uint8_t data = 7;
 
-  int status = libusb_control_transfer( ufe,
+  int status = ufe_usb()->control_transfer( ufe,
                                         CLASS_REQUEST | LIBUSB_ENDPOINT_IN,
                                         UFE_EPxIN_RESET_REQ,
                                         value,
@@ -318,185 +537,85 @@ int ufe_epxin_reset(libusb_device_handle *ufe, int ep_id) {
   } else
     ufe_debug_print("epxin_reset on EP %i ( %i, %i )", ep_id, status, data);
 
-  usleep(1);
+  ufe_usleep(1);
   return 0;
 }
 
 
 int ufe_read_buffer(libusb_device_handle *ufe, uint8_t* data, /*size_t size,*/ int *actual) {
+  return ufe_read_buffer_timeout(ufe, data, actual, ufe_context_handler->readout_timeout_);
+}
+
+int ufe_read_buffer_timeout(libusb_device_handle *ufe, uint8_t* data, int *actual, unsigned int timeout) {
   // Prepare the End Point identifier.
   uint8_t ep_id = UFE_USB_EP1_IN | LIBUSB_ENDPOINT_IN;
 
   // Make bulk transfer.
-  int status = libusb_bulk_transfer( ufe,
+  UFE_PROBE1(read_buffer_entry, ufe_context_handler->readout_buffer_size_);
+  int status = ufe_usb()->bulk_transfer( ufe,
                                      ep_id,
                                      data,
 //                                      size,
                                      ufe_context_handler->readout_buffer_size_,
                                      actual,
-//                                      UFE_CMD_TIMEOUT);
-                                     ufe_context_handler->readout_timeout_);
-
-  ufe_debug_print( "data resieved from EP 1 ( %i, %g KB): 0x%x",
-                   status,
-                   (*actual)/1024.,
-                   *((uint32_t *) data));
+                                     timeout);
 
+  UFE_PROBE2(read_buffer_return, *actual, status);
   return status;
 }
 
 
 int ufe_idle(libusb_device_handle *ufe, int board_id) {
   ufe_info_print("executing command IDLE ( %i )", board_id);
-
-  int command_id = IDLE_CMD_ID;
-  int status = ufe_send_command_req( ufe,
-                                     board_id,
-                                     command_id,
-                                     NO_SUB_CMD_ID,
-                                     0,
-                                     NULL);
-  return status;
+  return ufe_exchange_command(ufe, board_id, ufe_get_command_desc(IDLE_CMD_ID), NO_SUB_CMD_ID, NULL, NULL);
 }
 
 int ufe_firmware_version(libusb_device_handle *ufe, int board_id, int *data) {
   ufe_info_print("executing command FIRMWARE_VERSION ( board %i )", board_id);
 
-  int command_id = FIRMWARE_VERSION_CMD_ID;
-  int status=0;
   uint16_t *data_16 = (uint16_t*) data;
-
-  status = ufe_send_command_req( ufe,
-                                 board_id,
-                                 command_id,
-                                 NO_SUB_CMD_ID,
-                                 1,
-                                 data_16);
-  if (status != 0)
-    return status;
-
-  usleep(1);
-  status = ufe_ep2in_wrappup(ufe);
-
-  if (status != 0)
-    return status;
-
-  usleep(1);
-  status = ufe_get_command_answer( ufe,
-                                   board_id,
-                                   command_id,
-                                   NO_SUB_CMD_ID,
-                                   1,
-                                   &data_16);
-  usleep(1);
-  return status;
+  return ufe_exchange_command( ufe,
+                               board_id,
+                               ufe_get_command_desc(FIRMWARE_VERSION_CMD_ID),
+                               NO_SUB_CMD_ID,
+                               data_16,
+                               data_16);
 }
 
 int ufe_set_direct_param(libusb_device_handle *ufe, int board_id, uint16_t *data) {
   ufe_info_print("executing command SET_DIRECT_PARAM ( board %i, par: 0x%x )", board_id, *data);
 
-  int command_id = SET_DIRECT_PARAM_CMD_ID;
-  int status=0;
-
-  status = ufe_send_command_req( ufe,
-                                 board_id,
-                                 command_id,
-                                 NO_SUB_CMD_ID,
-                                 1,
-                                 data);
-  if (status != 0)
-    return status;
-
-  usleep(1);
-  status = ufe_ep2in_wrappup(ufe);
-
-  if (status != 0)
-    return status;
-
-  usleep(1);
-  status = ufe_get_command_answer( ufe,
-                                   board_id,
-                                   command_id,
-                                   NO_SUB_CMD_ID,
-                                   0,
-                                   &data);
-  usleep(1);
-  return status;
+  return ufe_exchange_command( ufe,
+                               board_id,
+                               ufe_get_command_desc(SET_DIRECT_PARAM_CMD_ID),
+                               NO_SUB_CMD_ID,
+                               data,
+                               NULL);
 }
 
 int ufe_read_status(libusb_device_handle *ufe, int board_id, uint16_t *data) {
   ufe_info_print("executing command READ_STATUS ( board %i )", board_id);
 
-  int command_id = READ_STATUS_CMD_ID;
-  int status=0;
-
-  status = ufe_send_command_req( ufe,
-                                 board_id,
-                                 command_id,
-                                 NO_SUB_CMD_ID,
-                                 0,
-                                 NULL);
-  if (status != 0)
-    return status;
-
-  usleep(1);
-  status = ufe_ep2in_wrappup(ufe);
-
-  if (status != 0)
-    return status;
-
-  usleep(1);
-  status = ufe_get_command_answer( ufe,
-                                   board_id,
-                                   command_id,
-                                   NO_SUB_CMD_ID,
-                                   1,
-                                   &data);
-  usleep(1);
-  return status;
+  return ufe_exchange_command( ufe,
+                               board_id,
+                               ufe_get_command_desc(READ_STATUS_CMD_ID),
+                               NO_SUB_CMD_ID,
+                               NULL,
+                               data);
 }
 
 int ufe_set_config(libusb_device_handle *ufe, int board_id, int device, uint32_t *data) {
   ufe_info_print("executing command SET_CONFIG ( board %i, device %i )", board_id, device);
 
-  int command_id = SET_CONFIG_CMD_ID, argc = 72;
-  int status=0;
-  uint16_t *data_16 = (uint16_t*) data;
-
-// #ifdef UFE_DEBUG
-//   printf("### Debug: sending configuration data\n");
-//   int i;
-//   for (i=0; i<argc; ++i)
-//     printf("### Debug: %i 0x%x \n", i, data_16[i]);
-// #endif
-
-  status = ufe_send_command_req( ufe,
-                                 board_id,
-                                 command_id,
-                                 device,
-                                 argc,
-                                 data_16);
-  if (status != 0)
-    return status;
-
-  usleep(argc*100);
-  status = ufe_ep2in_wrappup(ufe);
-
-  if (status != 0)
-    return status;
-
-  usleep(1);
-  status = ufe_get_command_answer( ufe,
-                                   board_id,
-                                   command_id,
-                                   NO_SUB_CMD_ID,
-                                   0,
-                                   &data_16);
-
+  int status = ufe_exchange_command( ufe,
+                                     board_id,
+                                     ufe_get_command_desc(SET_CONFIG_CMD_ID),
+                                     device,
+                                     (uint16_t*) data,
+                                     NULL);
   if (status != 0)
     return status;
 
-  usleep(1);
   // Now validate the configuration.
   uint16_t code = 0;
   switch (device) {
@@ -513,145 +632,47 @@ int ufe_set_config(libusb_device_handle *ufe, int board_id, int device, uint32_t
       code = UFE_SC_VALIDATE_D3; break;
   }
 
-  status = ufe_send_command_req( ufe,
-                                 board_id,
-                                 command_id,
-                                 device+8,
-                                 1,
-                                 &code);
-  if (status != 0)
-    return status;
-
-  usleep(argc*100);
-  status = ufe_ep2in_wrappup(ufe);
-
-  if (status != 0)
-    return status;
-
-  usleep(1);
-  status = ufe_get_command_answer( ufe,
-                                   board_id,
-                                   command_id,
-                                   NO_SUB_CMD_ID,
-                                   0,
-                                   &data_16);
-  usleep(1);
-  return status;
+  return ufe_exchange_command(ufe, board_id, &ufe_validate_config_desc, device+8, &code, NULL);
 }
 
 int ufe_get_config(libusb_device_handle *ufe, int board_id, int device, uint32_t *data) {
   ufe_info_print("executing command GET_CONFIG ( board %i, device %i )", board_id, device);
 
-  int command_id = GET_CONFIG_CMD_ID, argc = 72;
-  int status=0;
-  uint16_t *data_16 = (uint16_t*) data;
-
-  status = ufe_send_command_req( ufe,
-                                 board_id,
-                                 command_id,
-                                 NO_SUB_CMD_ID,
-                                 1,
-                                 (uint16_t*) &device);
-
-  if (status != 0)
-    return status;
-
-  usleep(argc*500);
-  status = ufe_ep2in_wrappup(ufe);
-
-  if (status != 0)
-    return status;
-
-  usleep(argc*100);
-  status = ufe_get_command_answer( ufe,
-                                   board_id,
-                                   command_id,
-                                   device,
-                                   argc,
-                                   &data_16);
-
-// #ifdef UFE_DEBUG
-//   printf("### Debug: configuration data received\n");
-//   int i;
-//   for (i=0; i<argc; ++i)
-//     printf("### Debug: %i 0x%x \n", i, data_16[i]);
-// #endif
-
-  usleep(1);
-  return status;
+  uint16_t arg = device;
+  return ufe_exchange_command( ufe,
+                               board_id,
+                               ufe_get_command_desc(GET_CONFIG_CMD_ID),
+                               device,
+                               &arg,
+                               (uint16_t*) data);
 }
 
 int ufe_apply_config(libusb_device_handle *ufe, int board_id, uint16_t* data) {
   ufe_info_print("executing command APPLY_CONFIG ( board %i, arg 0x%x )", board_id, *data);
 
-  int command_id = APPLY_CONFIG_CMD_ID;
-  int status=0;
-
-  status = ufe_send_command_req( ufe,
-                                 board_id,
-                                 command_id,
-                                 NO_SUB_CMD_ID,
-                                 1,
-                                 data);
-  if (status != 0)
-    return status;
-
-  usleep(700);
-  status = ufe_ep2in_wrappup(ufe);
-
-  if (status != 0)
-    return status;
-
-  usleep(100);
-  status = ufe_get_command_answer( ufe,
-                                   board_id,
-                                   command_id,
-                                   NO_SUB_CMD_ID,
-                                   0,
-                                   &data);
-  usleep(70000);
-  return status;
+  return ufe_exchange_command( ufe,
+                               board_id,
+                               ufe_get_command_desc(APPLY_CONFIG_CMD_ID),
+                               NO_SUB_CMD_ID,
+                               data,
+                               NULL);
 }
 
 int ufe_data_readout(libusb_device_handle *ufe, int board_id, uint16_t *data) {
   ufe_info_print("executing command DATA_READOUT ( board %i, arg 0x%x )", board_id, *data);
 
-  int command_id = DATA_READOUT_CMD_ID, argc = 1;
-  int status=0;
-  uint16_t *data_16 = (uint16_t*) malloc(2);
-
-  status = ufe_send_command_req( ufe,
-                                 board_id,
-                                 command_id,
-                                 NO_SUB_CMD_ID,
-                                 argc,
-                                 data);
-
-  if (status != 0)
-    return status;
-
-  usleep(1);
-  status = ufe_ep2in_wrappup(ufe);
-
-  if (status != 0)
-    return status;
-
-
-  usleep(1);
-  status = ufe_get_command_answer( ufe,
-                                   board_id,
-                                   command_id,
-                                   NO_SUB_CMD_ID,
-                                   argc,
-                                   &data_16);
-  usleep(1);
-  free(data_16);
-  return status;
+  uint16_t answer = 0;
+  return ufe_exchange_command( ufe,
+                               board_id,
+                               ufe_get_command_desc(DATA_READOUT_CMD_ID),
+                               NO_SUB_CMD_ID,
+                               data,
+                               &answer);
 }
 
 size_t ufe_get_custom_device_list(libusb_context *ctx, ufe_cond_func cond, int arg, libusb_device ***feb_devs) {
   libusb_device **devs;
-  ssize_t n_devs = libusb_get_device_list(ctx, &devs); //get the list of devices
+  ssize_t n_devs = ufe_usb()->get_device_list(ctx, &devs); //get the list of devices
   size_t n_febs = 0;
 
   if(n_devs < 0) {
@@ -659,26 +680,126 @@ size_t ufe_get_custom_device_list(libusb_context *ctx, ufe_cond_func cond, int a
     return 0;
   }
 
-  uint8_t* dev_id = (uint8_t*) calloc(n_devs, sizeof(uint8_t));
-  int i_dev, i_feb = 0;
+  // The list is NULL terminated, as the lists of libusb.
+  libusb_device **febs_found = (libusb_device**) calloc(n_devs + 1, sizeof(struct libusb_device*));
+  int i_dev;
   for(i_dev = 0; i_dev < n_devs; i_dev++) {
     if ( (*cond)(devs[i_dev], arg) ) {
-      dev_id[n_febs++] = i_dev;
+      febs_found[n_febs++] = ufe_usb()->ref_device(devs[i_dev]);
+    }
+  }
+
+  *feb_devs = febs_found;
+  ufe_usb()->free_device_list(devs, 1); //free the list, unref the devices in it
+  return n_febs;
+}
+
+/** Shared state of the threads of ufe_probe_devices(). */
+struct probe_job {
+  ufe_probed_device *devs_;
+  int n_devs_;
+
+  /** Index of the next device to probe. */
+  int next_;
+
+  ufe_probe_func probe_;
+  void *arg_;
+
+  /** Verbosity of the calling thread. */
+  int verbose_;
+};
+
+static void* probe_job_run(void *arg) {
+  struct probe_job *job = (struct probe_job*) arg;
+  int x_verbose = ufe_set_thread_verbose(job->verbose_);
+  int i;
+  while ((i = __atomic_fetch_add(&job->next_, 1, __ATOMIC_RELAXED)) < job->n_devs_) {
+    ufe_probed_device *d = &job->devs_[i];
+    int status = ufe_usb()->open(d->dev_, &d->handle_);
+    if (d->handle_ == NULL) {
+      ufe_error_print("cannot open device ( %i ).", status);
+      continue;
+    }
+
+    d->result_ = (*job->probe_)(d->handle_, job->arg_);
+    if (d->result_ < 0) {
+      ufe_usb()->close(d->handle_);
+      d->handle_ = NULL;
     }
   }
 
-  libusb_device **febs_found = (libusb_device**) calloc(n_febs, sizeof(struct libusb_device*));
+  ufe_set_thread_verbose(x_verbose);
+  return NULL;
+}
 
-  for(i_dev = 0; i_dev < n_febs; i_dev++) {
-    int x_dev = dev_id[i_dev];
-    febs_found[i_feb++] = libusb_ref_device(devs[x_dev]);
+int ufe_probe_devices( libusb_context *ctx,
+                       ufe_cond_func filter,
+                       int filter_arg,
+                       ufe_probe_func probe,
+                       void *probe_arg,
+                       ufe_probed_device **feb_devs) {
+  libusb_device **devs;
+  ssize_t n_devs = ufe_usb()->get_device_list(ctx, &devs);
+  if (n_devs < 0) {
+    ufe_error_print("Device Error.");
+    return (int) n_devs;
   }
 
-  free(dev_id);
+  ufe_probed_device *febs = (ufe_probed_device*) calloc(n_devs + 1, sizeof(ufe_probed_device));
+  int i, n_febs = 0;
+  for (i = 0; i < n_devs; ++i)
+    if ( (*filter)(devs[i], filter_arg) ) {
+      febs[n_febs].dev_ = ufe_usb()->ref_device(devs[i]);
+      febs[n_febs++].result_ = (probe)? -1 : 0;
+    }
 
-  *feb_devs = febs_found;
-  libusb_free_device_list(devs, 1); //free the list, unref the devices in it
-  return n_febs;
+  ufe_usb()->free_device_list(devs, 1);
+
+  if (probe && n_febs > 0) {
+    // The probing of a device is mostly waiting for the board. Probe several devices at once.
+    struct probe_job job = {febs, n_febs, 0, probe, probe_arg, ufe_get_verbose()};
+    pthread_t threads[UFE_MAX_PROBE_THREADS];
+    int n_threads = 0;
+    while (n_threads < n_febs - 1 && n_threads < UFE_MAX_PROBE_THREADS - 1) {
+      if (pthread_create(&threads[n_threads], NULL, &probe_job_run, &job) != 0)
+        break;
+
+      ++n_threads;
+    }
+
+    // The calling thread probes too.
+    probe_job_run(&job);
+    for (i = 0; i < n_threads; ++i)
+      pthread_join(threads[i], NULL);
+
+    ufe_debug_print("%i devices probed by %i threads.", n_febs, n_threads + 1);
+  }
+
+  // Keep the selected devices, in the order of the enumeration.
+  int n_selected = 0;
+  for (i = 0; i < n_febs; ++i) {
+    if (febs[i].result_ < 0) {
+      ufe_usb()->unref_device(febs[i].dev_);
+      continue;
+    }
+
+    febs[n_selected++] = febs[i];
+  }
+
+  *feb_devs = febs;
+  return n_selected;
+}
+
+void ufe_free_probed_devices(ufe_probed_device *feb_devs, int n_devs) {
+  int i;
+  for (i = 0; i < n_devs; ++i) {
+    if (feb_devs[i].handle_)
+      ufe_usb()->close(feb_devs[i].handle_);
+
+    ufe_usb()->unref_device(feb_devs[i].dev_);
+  }
+
+  free(feb_devs);
 }
 
 int ufe_on_device_do(ufe_cond_func cond_func, int arg, ufe_user_func user_func) {
@@ -724,23 +845,59 @@ int ufe_in_session_on_device_do(ufe_cond_func cond_func, int arg, ufe_user_func
     }
 
     ufe_debug_print("device opened.");
-    ufe_debug_print("speed: %i\n", libusb_get_device_speed(febs[i]));
+    ufe_debug_print("speed: %i\n", ufe_usb()->get_device_speed(febs[i]));
     status = (*user_func)(dev_handle);
-    libusb_close(dev_handle);
+    ufe_usb()->close(dev_handle);
     ufe_debug_print("device closed.");
 
     if (status != 0) {
-      libusb_free_device_list(febs, 1);
+      ufe_usb()->free_device_list(febs, 1);
       return status;
     }
   }
 
-  libusb_free_device_list(febs, 1); //free/unref the selected devices.
+  ufe_usb()->free_device_list(febs, 1); //free/unref the selected devices.
   return status;
 }
 
 int ufe_in_session_on_board_do(int board_id, ufe_user_func user_func) {
-  return ufe_in_session_on_device_do(&is_bm_feb_with_id, board_id, user_func);
+  libusb_device_handle *dev_handle = NULL;
+  if (!ufe_registry_running()) {
+    // Filter the devices on the descriptor, then ping the board on all FEBs at once.
+    ufe_probed_device *febs;
+    int n_febs = ufe_probe_devices( ufe_context_handler->usb_ctx_,
+                                    &is_bm_feb, 0,
+                                    &ufe_probe_board_id, &board_id,
+                                    &febs);
+    if (n_febs < 0)
+      return 1;
+
+    if (n_febs == 0) {
+      ufe_error_print("board %i not found.", board_id);
+      ufe_free_probed_devices(febs, 0);
+      return 1;
+    }
+
+    int i, status = 0;
+    for (i = 0; i < n_febs && status == 0; ++i) {
+      ufe_debug_print("board %i found on device %p.", board_id, (void*) febs[i].dev_);
+      status = (*user_func)(febs[i].handle_);
+    }
+
+    ufe_free_probed_devices(febs, n_febs);
+    return status;
+  }
+
+  // The registry knows the device of the board already.
+  int status = ufe_registry_open(board_id, &dev_handle);
+  if (dev_handle == NULL) {
+    ufe_error_print("board %i not found ( %i ).", board_id, status);
+    return 1;
+  }
+
+  status = (*user_func)(dev_handle);
+  ufe_usb()->close(dev_handle);
+  return status;
 }
 
 int ufe_in_session_on_all_boards_do(ufe_user_func user_func) {
@@ -749,7 +906,17 @@ int ufe_in_session_on_all_boards_do(ufe_user_func user_func) {
 }
 
 int ufe_on_board_do(int board_id, ufe_user_func user_func) {
-  return ufe_on_device_do(&is_bm_feb_with_id, board_id, user_func);
+  ufe_context *ctx = NULL;
+  int status = ufe_init(&ctx);
+  if(status < 0) {
+    ufe_error_print("init Error. %i", status);
+    return 1;
+  }
+
+  status = ufe_in_session_on_board_do(board_id, user_func);
+
+  ufe_exit(ctx);
+  return status;
 }
 
 int ufe_on_all_boards_do(ufe_user_func user_func) {
@@ -758,40 +925,8 @@ int ufe_on_all_boards_do(ufe_user_func user_func) {
 }
 
 const char * ufe_get_command_name(int command_id) {
-  char *name = (char*) malloc(20);
-  switch (command_id) {
-    case DATA_READOUT_CMD_ID:
-      return "DATA_READOUT";
-
-    case FIRMWARE_VERSION_CMD_ID:
-      return "FIRMWARE_VERSION";
-
-    case SET_DIRECT_PARAM_CMD_ID:
-      return "SET_DIRECT_PARAM";
-
-    case READ_STATUS_CMD_ID:
-      return "READ_STATUS";
-
-    case SET_CONFIG_CMD_ID:
-      return "SET_CONFIG";
-
-    case GET_CONFIG_CMD_ID:
-      return "GET_CONFIG";
-
-    case APPLY_CONFIG_CMD_ID:
-      return "APPLY_CONFIG";
-
-    case ERROR_CMD_ID:
-      return "ERROR";
-
-    case IDLE_CMD_ID:
-      return "IDLE_CMD_ID";
-
-    default:
-      return "UNKNOWN_CMD";
-  }
-
-  return name;
+  const ufe_command_desc *desc = ufe_get_command_desc(command_id);
+  return (desc)? desc->name_ : "UNKNOWN_CMD";
 }
 
 void ufe_dump_status(uint16_t status) {
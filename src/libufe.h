@@ -30,8 +30,11 @@
 #define LIBUFE_H 1
 
 #include <stdbool.h>
+#include <sys/types.h>
 #include <libusb-1.0/libusb.h>
 
+#include "libufe-histo.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -45,6 +48,121 @@ extern "C" {
 /** Version Id of the Baby MIND Front-end board firmware supported by this library. */
 #define BMFEB_FV             0x30
 
+/** Function called when a front-end board is connected (arrived true) or disconnected. */
+typedef void (*ufe_hotplug_func)(libusb_device *dev, bool arrived, void *user_data);
+
+/** \brief An asynchronous bulk or control transfer (see ufe_transport::submit_transfer). */
+struct ufe_transfer {
+  libusb_device_handle *handle_;
+
+  /** LIBUSB_TRANSFER_TYPE_BULK or LIBUSB_TRANSFER_TYPE_CONTROL. */
+  uint8_t type_;
+
+  /** Endpoint of a bulk transfer. */
+  unsigned char endpoint_;
+
+  /** Setup of a control transfer (see libusb_control_transfer()). */
+  uint8_t request_type_;
+  uint8_t request_;
+  uint16_t value_;
+  uint16_t index_;
+
+  /** The data, without the setup packet of a control transfer. */
+  unsigned char *data_;
+  int length_;
+
+  /** Timeout (ms), 0 for none. */
+  unsigned int timeout_;
+
+  /** Set at the completion: 0 or a LIBUSB_ERROR code, and the number of bytes transferred. */
+  int status_;
+  int actual_;
+
+  /** Called by ufe_transport::handle_events() when the transfer is complete. */
+  void (*callback_)(struct ufe_transfer *transfer);
+  void *user_data_;
+};
+
+/** ufe_transfer type */
+typedef struct ufe_transfer ufe_transfer;
+
+/** \brief Table of the low level usb operations used by libufec. The operations have the same
+ *  signatures as the corresponding libusb functions, except the hotplug and event handling, which are
+ *  simplified. All usb traffic of the library goes through
+ *  this table, so that the boards can be replaced by a software emulation (see libufe-emu.h).
+ */
+struct ufe_transport {
+  /** Name of the transport. */
+  const char *name_;
+
+  /** See libusb_get_device_list(). */
+  ssize_t (*get_device_list)(libusb_context *ctx, libusb_device ***list);
+
+  /** See libusb_free_device_list(). */
+  void (*free_device_list)(libusb_device **list, int unref_devices);
+
+  /** See libusb_ref_device(). */
+  libusb_device* (*ref_device)(libusb_device *dev);
+
+  /** See libusb_unref_device(). */
+  void (*unref_device)(libusb_device *dev);
+
+  /** See libusb_get_device_descriptor(). */
+  int (*get_device_descriptor)(libusb_device *dev, struct libusb_device_descriptor *desc);
+
+  /** See libusb_get_device_speed(). */
+  int (*get_device_speed)(libusb_device *dev);
+
+  /** See libusb_open(). */
+  int (*open)(libusb_device *dev, libusb_device_handle **handle);
+
+  /** See libusb_close(). */
+  void (*close)(libusb_device_handle *handle);
+
+  /** See libusb_bulk_transfer(). */
+  int (*bulk_transfer)(libusb_device_handle *handle,
+                       unsigned char endpoint,
+                       unsigned char *data,
+                       int length,
+                       int *actual,
+                       unsigned int timeout);
+
+  /** See libusb_control_transfer(). */
+  int (*control_transfer)(libusb_device_handle *handle,
+                          uint8_t request_type,
+                          uint8_t request,
+                          uint16_t value,
+                          uint16_t index,
+                          unsigned char *data,
+                          uint16_t length,
+                          unsigned int timeout);
+
+  /** See libusb_clear_halt(). */
+  int (*clear_halt)(libusb_device_handle *handle, unsigned char endpoint);
+
+  /** Registers the function called when a front-end board is connected or disconnected. The
+   *  boards already connected are reported immediately. Only one function can be registered.
+   *  See libusb_hotplug_register_callback(). */
+  int (*hotplug_register)(libusb_context *ctx, ufe_hotplug_func func, void *user_data);
+
+  /** Removes the hotplug function. */
+  void (*hotplug_deregister)(libusb_context *ctx);
+
+  /** Handles the pending events, waiting for them at most timeout_ms. The hotplug function is
+   *  called by this function. See libusb_handle_events_timeout_completed(). */
+  int (*handle_events)(libusb_context *ctx, int timeout_ms);
+
+  /** Submits a transfer and returns at once. The callback of the transfer is called by
+   *  handle_events(). See libusb_submit_transfer(). */
+  int (*submit_transfer)(ufe_transfer *transfer);
+
+  /** Returns the number of the bus of the device, or a LIBUSB_ERROR code if there is none. */
+  int (*get_bus_number)(libusb_device_handle *handle);
+};
+
+/** ufe_transport type */
+typedef struct ufe_transport ufe_transport;
+
 /** \brief Structure representing a libufec session. */
 struct ufe_context {
   /** Verbosity level of the output
@@ -65,6 +183,22 @@ struct ufe_context {
   /** LIBUSB context */
   libusb_context* usb_ctx_;
 
+  /** The usb operations. If not set by the user before ufe_init(), libusb is used, or the
+   *  emulated boards if the environment variable UFE_EMULATOR is defined (see libufe-emu.h).
+   */
+  const ufe_transport *transport_;
+
+  /** If true, the duration of each phase of every command is recorded (see ufe_get_cmd_timing()). */
+  bool cmd_timing_;
+
+  /** Number of readout blocks allocated for each board by ufe_readout_open() (default 16). */
+  unsigned int readout_blocks_;
+
+  /** Allocation of the readout blocks: a combination of ufe_pool_flags (see libufe-pool.h).
+   *  Default UFE_POOL_HUGEPAGES | UFE_POOL_PREFAULT.
+   */
+  int readout_pool_flags_;
+
 #ifdef ZMQ_ENABLE
 
   /** ZeroMQ context */
@@ -83,6 +217,12 @@ struct ufe_context {
 typedef struct ufe_context ufe_context;
 
 
+/** \brief Gets the transport using libusb (real hardware).
+ *  \returns The transport.
+ */
+const ufe_transport* ufe_libusb_transport();
+
+
 /** \brief Initialize a default context.
  *  \param ctx: Optional output location for context pointer. Only valid on return code 0.
  *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
@@ -112,6 +252,13 @@ void ufe_set_verbose(ufe_context *ctx, int libusb_level, int ufe_level);
 void ufe_set_readout_timeout(ufe_context *ctx, int t);
 
 
+/** \brief Enables the recording of the command latencies.
+ *  \param ctx: The context of the session.
+ *  \param enable: If true, every command is timed.
+ */
+void ufe_set_cmd_timing(ufe_context *ctx, bool enable);
+
+
 /** \brief Gets a list of UFE devices currently attached to the system.
  *  \param ctx: The context of the session.
  *  \param feb_devs: Output location for a list of UFE devices.
@@ -207,6 +354,15 @@ int ufe_enable_led(libusb_device_handle *ufe, bool enable);
 int ufe_ep2in_wrappup(libusb_device_handle *ufe);
 
 
+/** \brief Same as ufe_ep2in_wrappup(), for any IN end point. On EP1IN, this sends the data of the
+ *  readout buffer which is not yet in the DMA buffer, followed by an empty packet if nothing is left.
+ *  \param ufe: A device handle.
+ *  \param ep_id: 1 / 2 for EP1IN / EP2IN.
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_epxin_wrappup(libusb_device_handle *ufe, int ep_id);
+
+
 /** \brief The call of this function forces the DMA and USB engines to reset the corresponding
  *  communication link (EP1IN or EP2IN). This might be helpful in case of USB stuck.
  *  \param ufe: A device handle.
@@ -301,17 +457,55 @@ int ufe_apply_config(libusb_device_handle *ufe, int board_id, uint16_t *data);
 int ufe_read_buffer(libusb_device_handle *ufe, uint8_t* data, int *actual);
 
 
+/** \brief Get data from the readout buffer, with a given timeout.
+ *  \param ufe: A device handle.
+ *  \param data: Output location for data to be transferred.
+ *  \param actual: Actual size of the transferred data.
+ *  \param timeout: Timeout of the transfer (in millseconds).
+ *  \returns 0 on success, or a LIBUSB_ERROR / UFE_ERROR code on failure.
+ */
+int ufe_read_buffer_timeout(libusb_device_handle *ufe, uint8_t* data, int *actual, unsigned int timeout);
+
+
+/** The command has a subcommand identifier (see UFE_COMMANDS). */
+#define UFE_CMD_SUB    0x1
+
+/** The subcommand identifier is checked in the answer (see UFE_COMMANDS). */
+#define UFE_ANSWER_SUB 0x2
+
+/** Another form of the command with the same identifier above in UFE_COMMANDS, not returned by
+ *  ufe_get_command_desc(). */
+#define UFE_CMD_ALIAS  0x4
+
+/** \brief Table of the commands of the front-end board. For each command:
+ *  name, identifier, number of arguments of the command and of the answer (-1 if there is no
+ *  answer), subcommand flags (UFE_CMD_SUB / UFE_ANSWER_SUB / UFE_CMD_ALIAS), and the pacing: time
+ *  given to the board before the wrap-up request, before reading the answer and after the answer
+ *  (us). VALIDATE_CONFIG is SET_CONFIG with the subcommand identifier device+8 (see
+ *  ufe_set_config()).
+ *  The identifiers, the names, the descriptors and the frame sizes of the commands (see
+ *  ufe_get_command_desc()) are generated from this table. The functions sending the commands are
+ *  written by hand on top of ufe_exchange_command().
+ */
+#define UFE_COMMANDS(X) \
+  /* name             id    argc  answer  sub-command                   wrap-up  answer  done */  \
+  X(DATA_READOUT,     0x00, 1,    1,      0,                            1,       1,      1)       \
+  X(FIRMWARE_VERSION, 0x01, 1,    1,      0,                            1,       1,      1)       \
+  X(SET_DIRECT_PARAM, 0x02, 1,    0,      0,                            1,       1,      1)       \
+  X(READ_STATUS,      0x03, 0,    1,      0,                            1,       1,      1)       \
+  X(SET_CONFIG,       0x04, 72,   0,      UFE_CMD_SUB,                  7200,    1,      1)       \
+  X(VALIDATE_CONFIG,  0x04, 1,    0,      UFE_CMD_SUB | UFE_CMD_ALIAS,  7200,    1,      1)       \
+  X(GET_CONFIG,       0x05, 1,    72,     UFE_ANSWER_SUB,               36000,   7200,   1)       \
+  X(APPLY_CONFIG,     0x06, 1,    0,      0,                            700,     100,    70000)   \
+  X(ERROR,            0x1E, 0,    -1,     0,                            0,       0,      0)       \
+  X(IDLE,             0x1F, 0,    -1,     0,                            0,       0,      0)
+
 /** List of the Command identifiers for the command requests and command answers */
 enum ufe_cmd_id {
-  DATA_READOUT_CMD_ID     = 0x0,
-  FIRMWARE_VERSION_CMD_ID = 0x01,
-  SET_DIRECT_PARAM_CMD_ID = 0x02,
-  READ_STATUS_CMD_ID      = 0x03,
-  SET_CONFIG_CMD_ID       = 0x04,
-  GET_CONFIG_CMD_ID       = 0x05,
-  APPLY_CONFIG_CMD_ID     = 0x06,
-  ERROR_CMD_ID            = 0x1E,
-  IDLE_CMD_ID             = 0x1F
+#define UFE_CMD_ID(name, id, argc, answer_argc, sub_cmd, wrapup_us, answer_us, done_us) \
+  name##_CMD_ID = id,
+  UFE_COMMANDS(UFE_CMD_ID)
+#undef UFE_CMD_ID
 };
 
 /** List of the UFE_ERROR code returned on failure. */
@@ -421,6 +615,47 @@ void ufe_dump_direct_params(uint16_t params);
 void ufe_dump_readout_params(uint16_t params);
 
 
+/** List of the phases of a command exchange. */
+enum ufe_cmd_phase {
+  /** Sending the command (EP2 OUT). */
+  UFE_PHASE_SEND   = 0,
+
+  /** The EP2 IN wrap-up request. */
+  UFE_PHASE_WRAPUP = 1,
+
+  /** Receiving the answer (EP2 IN). */
+  UFE_PHASE_ANSWER = 2,
+
+  /** From the beginning of the sending to the end of the answer. */
+  UFE_PHASE_TOTAL  = 3,
+
+  UFE_N_PHASES     = 4
+};
+
+
+/** \brief Gets the latencies (in ns) of one phase of a command, recorded while the command timing
+ *  of the context was enabled.
+ *  \param board_id: Identifier of the board.
+ *  \param command_id: Command identifier.
+ *  \param phase: The phase (ufe_cmd_phase).
+ *  \param histo: Output location for the histogram.
+ *  \returns 0 on success, UFE_NOT_FOUND_ERROR if this command was never timed, or
+ *  UFE_INVALID_ARG_ERROR.
+ */
+int ufe_get_cmd_timing(int board_id, int command_id, int phase, ufe_histo *histo);
+
+
+/** \brief Clears all recorded command latencies.
+ */
+void ufe_reset_cmd_timing();
+
+
+/** \brief Prints the recorded command latencies (in us), one line per board, command and phase.
+ *  \param file: Output stream (e.g. stdout).
+ */
+void ufe_dump_cmd_timing(FILE *file);
+
+
 /** Type of the devices spellection function. */
 typedef int (*ufe_user_func)(libusb_device_handle*);
 
@@ -442,6 +677,59 @@ size_t ufe_get_custom_device_list( libusb_context *ctx,
                                    libusb_device ***feb_devs);
 
 
+/** Maximum number of devices probed at the same time by ufe_probe_devices(). */
+#define UFE_MAX_PROBE_THREADS 16
+
+
+/** Type of the device probe function. It is called on an open device, by several threads at the
+ *  same time (one device per thread). It returns a value >= 0 to select the device. */
+typedef int (*ufe_probe_func)(libusb_device_handle*, void *arg);
+
+
+/** \brief A device selected by ufe_probe_devices(). */
+struct ufe_probed_device {
+  /** The device (with a reference). */
+  libusb_device *dev_;
+
+  /** The device handle used for the probing, still open. The caller can take it and set it to NULL. */
+  libusb_device_handle *handle_;
+
+  /** The value returned by the probe function. */
+  int result_;
+};
+
+/** ufe_probed_device type */
+typedef struct ufe_probed_device ufe_probed_device;
+
+
+/** \brief Prepares a list of usb devices selected in two steps. First, the devices are filtered with
+ *  a cheap criteria (e.g. the descriptor, see is_bm_feb()). The devices passing the filter are then
+ *  opened and probed in parallel, with up to UFE_MAX_PROBE_THREADS threads. The number of devices is
+ *  not limited.
+ *  \param ctx:  The context to operate on.
+ *  \param filter: Function filtering the devices, without I/O. Called serially.
+ *  \param filter_arg: Argument for the filter function.
+ *  \param probe: Function probing an open device, or NULL to select all devices passing the filter.
+ *  \param probe_arg: Argument for the probe function.
+ *  \param feb_devs: Output location for the list of the selected devices, in the order of
+ *  enumeration. Free it with ufe_free_probed_devices().
+ *  \returns The number of selected devices, or a LIBUSB_ERROR code on failure.
+ */
+int ufe_probe_devices( libusb_context *ctx,
+                       ufe_cond_func filter,
+                       int filter_arg,
+                       ufe_probe_func probe,
+                       void *probe_arg,
+                       ufe_probed_device **feb_devs);
+
+
+/** \brief Frees a list of devices, prepared by ufe_probe_devices(). The handles left open are closed.
+ *  \param feb_devs: The list of devices.
+ *  \param n_devs: Number of devices in the list.
+ */
+void ufe_free_probed_devices(ufe_probed_device *feb_devs, int n_devs);
+
+
 /** \brief Executes an action specified by the user over a list of usb devices selected according a criteria
  *  provided by the user. New session is created in the beginning and closed at the end.
  *  \param cond_func: A function to be used for spellection of the devices, to be included in the list.
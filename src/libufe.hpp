@@ -0,0 +1,403 @@
+/*
+ * This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ *  \file    libufe.hpp
+ *  \brief   File containing a header-only C++17 interface to libufec. The session, the devices and
+ *  the readout buffers own their resources and can be moved but not copied. The functions return
+ *  a ufe::Result holding either the value or the LIBUSB_ERROR / UFE_ERROR code, like std::expected.
+ *  The readout data is accessed through views of a pool of blocks allocated once by ReadoutBuffer,
+ *  so that reading data needs no buffer per read. Opening the session and the devices allocates
+ *  memory. The commands of a Device use frames on the stack (see ufe_exchange_command()), but
+ *  libusb may still allocate its transfers.
+ */
+
+#ifndef LIBUFE_HPP
+#define LIBUFE_HPP 1
+
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <variant>
+
+#if __cplusplus > 201703L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "libufe.h"
+#include "libufe-core.h"
+#include "libufe-registry.h"
+
+namespace ufe {
+
+#if __cplusplus > 201703L && __has_include(<span>)
+
+template <typename T>
+using Span = std::span<T>;
+
+#else
+
+/** \brief Minimal std::span (C++20) replacement: a view of contiguous memory. */
+template <typename T>
+class Span {
+ public:
+  constexpr Span() noexcept : data_(nullptr), size_(0) {}
+  constexpr Span(T *data, size_t size) noexcept : data_(data), size_(size) {}
+
+  /** A view of non-const memory converts to a view of const memory. */
+  template <typename U>
+  constexpr Span(const Span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+
+  constexpr T* data() const noexcept { return data_; }
+  constexpr size_t size() const noexcept { return size_; }
+  constexpr size_t size_bytes() const noexcept { return size_*sizeof(T); }
+  constexpr bool empty() const noexcept { return size_ == 0; }
+  constexpr T& operator[](size_t i) const noexcept { return data_[i]; }
+  constexpr T* begin() const noexcept { return data_; }
+  constexpr T* end() const noexcept { return data_ + size_; }
+
+  constexpr Span first(size_t n) const noexcept { return Span(data_, n); }
+  constexpr Span subspan(size_t offset, size_t n) const noexcept { return Span(data_ + offset, n); }
+
+ private:
+  T *data_;
+  size_t size_;
+};
+
+#endif
+
+/** \brief Gets the name of an error code.
+ *  \param code: A LIBUSB_ERROR / UFE_ERROR code.
+ *  \returns The name of the error.
+ */
+inline const char* error_name(int code) {
+  switch (code) {
+    case UFE_INTERNAL_ERROR:           return "UFE_INTERNAL_ERROR";
+    case UFE_IO_ERROR:                 return "UFE_IO_ERROR";
+    case UFE_INVALID_CMD_ANSWER_ERROR: return "UFE_INVALID_CMD_ANSWER_ERROR";
+    case UFE_INVALID_ARG_ERROR:        return "UFE_INVALID_ARG_ERROR";
+    case UFE_NOT_FOUND_ERROR:          return "UFE_NOT_FOUND_ERROR";
+    case UFE_FIRMWARE_ERROR:           return "UFE_FIRMWARE_ERROR";
+    default:                           return libusb_error_name(code);
+  }
+}
+
+/** \brief A LIBUSB_ERROR / UFE_ERROR code. */
+class Error {
+ public:
+  constexpr explicit Error(int code) noexcept : code_(code) {}
+
+  constexpr int code() const noexcept { return code_; }
+  const char* name() const { return error_name(code_); }
+
+ private:
+  int code_;
+};
+
+/** \brief Thrown by Result::value() on an error (see std::bad_expected_access). */
+class BadResultAccess : public std::exception {
+ public:
+  explicit BadResultAccess(Error error) noexcept : error_(error) {}
+
+  const char* what() const noexcept override { return error_.name(); }
+  Error error() const noexcept { return error_; }
+
+ private:
+  Error error_;
+};
+
+/** \brief The value returned by an operation, or its error code (see std::expected). */
+template <typename T>
+class Result {
+ public:
+  Result(T value) : value_(std::in_place_index<0>, std::move(value)) {}
+  Result(Error error) : value_(std::in_place_index<1>, error) {}
+
+  bool has_value() const noexcept { return value_.index() == 0; }
+  explicit operator bool() const noexcept { return has_value(); }
+
+  /** Throws BadResultAccess on an error. */
+  T& value() & { check_value(); return *std::get_if<0>(&value_); }
+  const T& value() const & { check_value(); return *std::get_if<0>(&value_); }
+  T&& value() && { check_value(); return std::move(*std::get_if<0>(&value_)); }
+
+  T& operator*() & { return value(); }
+  const T& operator*() const & { return value(); }
+  T* operator->() { return &value(); }
+  const T* operator->() const { return &value(); }
+
+  /** 0 if there is a value. */
+  int error() const noexcept { return (has_value())? 0 : std::get_if<1>(&value_)->code(); }
+
+  T value_or(T other) const & { return (has_value())? value() : other; }
+
+ private:
+  void check_value() const {
+    if (!has_value())
+      throw BadResultAccess(*std::get_if<1>(&value_));
+  }
+
+  std::variant<T, Error> value_;
+};
+
+/** \brief The result of an operation without value. */
+template <>
+class Result<void> {
+ public:
+  Result() noexcept : error_(0) {}
+  Result(Error error) noexcept : error_(error.code()) {}
+
+  bool has_value() const noexcept { return error_ == 0; }
+  explicit operator bool() const noexcept { return has_value(); }
+  int error() const noexcept { return error_; }
+
+ private:
+  int error_;
+};
+
+/** Converts a status code of the C interface. */
+inline Result<void> check(int status) {
+  if (status != 0)
+    return Error(status);
+
+  return {};
+}
+
+/** \brief A pool of readout blocks, allocated once. Device::read() fills the blocks in turn, so
+ *  the view of a block stays valid for the next n_blocks() - 1 reads.
+ */
+class ReadoutBuffer {
+ public:
+  /** \param n_blocks: Number of blocks.
+   *  \param block_size: Size of the blocks (bytes). Must be at least the readout buffer size of
+   *  the session (ufe_context::readout_buffer_size_).
+   */
+  ReadoutBuffer(size_t n_blocks, size_t block_size)
+  : memory_(new std::byte[n_blocks*block_size]), n_blocks_(n_blocks), block_size_(block_size), next_(0) {}
+
+  ReadoutBuffer(ReadoutBuffer &&other) noexcept = default;
+  ReadoutBuffer& operator=(ReadoutBuffer &&other) noexcept = default;
+  ReadoutBuffer(const ReadoutBuffer&) = delete;
+  ReadoutBuffer& operator=(const ReadoutBuffer&) = delete;
+
+  size_t n_blocks() const noexcept { return n_blocks_; }
+  size_t block_size() const noexcept { return block_size_; }
+
+  /** The memory of the block i. */
+  Span<std::byte> block(size_t i) const noexcept {
+    return Span<std::byte>(memory_.get() + i*block_size_, block_size_);
+  }
+
+  /** Takes the next block in turn. */
+  Span<std::byte> next() noexcept {
+    Span<std::byte> b = block(next_);
+    next_ = (next_ + 1 == n_blocks_)? 0 : next_ + 1;
+    return b;
+  }
+
+ private:
+  std::unique_ptr<std::byte[]> memory_;
+  size_t n_blocks_;
+  size_t block_size_;
+  size_t next_;
+};
+
+/** \brief An open device, with the board connected to it. Closed when destroyed. */
+class Device {
+ public:
+  Device() noexcept : handle_(nullptr), board_id_(-1) {}
+
+  /** Takes the ownership of an open device handle. */
+  Device(libusb_device_handle *handle, int board_id) noexcept : handle_(handle), board_id_(board_id) {}
+
+  Device(Device &&other) noexcept : handle_(other.release()), board_id_(other.board_id_) {}
+
+  Device& operator=(Device &&other) noexcept {
+    if (this != &other) {
+      close();
+      board_id_ = other.board_id_;
+      handle_ = other.release();
+    }
+
+    return *this;
+  }
+
+  Device(const Device&) = delete;
+  Device& operator=(const Device&) = delete;
+
+  ~Device() { close(); }
+
+  libusb_device_handle* handle() const noexcept { return handle_; }
+  int board_id() const noexcept { return board_id_; }
+  explicit operator bool() const noexcept { return handle_ != nullptr; }
+
+  /** Gives up the ownership of the handle. */
+  libusb_device_handle* release() noexcept {
+    libusb_device_handle *handle = handle_;
+    handle_ = nullptr;
+    return handle;
+  }
+
+  void close() noexcept {
+    if (handle_)
+      ufe_close(handle_);
+
+    handle_ = nullptr;
+  }
+
+  /** See ufe_ping(). */
+  bool ping() const { return ufe_ping(handle_, board_id_); }
+
+  /** See ufe_read_status(). */
+  Result<uint16_t> read_status() const {
+    uint16_t status_word = 0;
+    int status = ufe_read_status(handle_, board_id_, &status_word);
+    if (status != 0)
+      return Error(status);
+
+    return status_word;
+  }
+
+  /** See ufe_firmware_version(). */
+  Result<int> firmware_version() const {
+    int fv = 0;
+    int status = ufe_firmware_version(handle_, board_id_, &fv);
+    if (status != 0)
+      return Error(status);
+
+    return fv;
+  }
+
+  /** See ufe_set_direct_param(). */
+  Result<void> set_direct_param(uint16_t params) const {
+    return check(ufe_set_direct_param(handle_, board_id_, &params));
+  }
+
+  /** See ufe_data_readout(). */
+  Result<void> data_readout(uint16_t params) const {
+    return check(ufe_data_readout(handle_, board_id_, &params));
+  }
+
+  /** \brief Reads the readout data into the next block of the buffer (see ufe_read_buffer()).
+   *  \param buffer: The pool of blocks.
+   *  \param timeout: Timeout of the transfer (ms), or 0 for the readout timeout of the session.
+   *  \returns A view of the data received. Empty if the transfer timed out without data.
+   */
+  Result<Span<const std::byte>> read(ReadoutBuffer &buffer, unsigned int timeout = 0) const {
+    if (buffer.block_size() < ufe_get_context()->readout_buffer_size_)
+      return Error(UFE_INVALID_ARG_ERROR);
+
+    if (timeout == 0)
+      timeout = ufe_get_context()->readout_timeout_;
+
+    Span<std::byte> b = buffer.next();
+    int actual = 0;
+    int status = ufe_read_buffer_timeout(handle_, reinterpret_cast<uint8_t*>(b.data()), &actual, timeout);
+    if (status != 0 && !(status == LIBUSB_ERROR_TIMEOUT && actual >= 0))
+      return Error(status);
+
+    return Span<const std::byte>(b.first(actual));
+  }
+
+ private:
+  libusb_device_handle *handle_;
+  int board_id_;
+};
+
+/** \brief A libufec session. The library has only one session at a time. Closed when destroyed. */
+class Session {
+ public:
+  /** \brief Starts a session (see ufe_init()).
+   *  \param ctx: The context of the session (owned by the session from then on), or NULL for a
+   *  default context.
+   */
+  static Result<Session> open(ufe_context *ctx = nullptr) {
+    int status = ufe_init(&ctx);
+    if (status != 0)
+      return Error(status);
+
+    return Session(ctx);
+  }
+
+  Session(Session &&other) noexcept : ctx_(std::exchange(other.ctx_, nullptr)) {}
+
+  Session& operator=(Session &&other) noexcept {
+    if (this != &other) {
+      close();
+      ctx_ = std::exchange(other.ctx_, nullptr);
+    }
+
+    return *this;
+  }
+
+  Session(const Session&) = delete;
+  Session& operator=(const Session&) = delete;
+
+  ~Session() { close(); }
+
+  ufe_context* context() const noexcept { return ctx_; }
+
+  /** Ends the session. The devices must be closed before. */
+  void close() noexcept {
+    if (ctx_)
+      ufe_exit(ctx_);
+
+    ctx_ = nullptr;
+  }
+
+  /** \brief Opens the device a board is connected to. The registry is used if it is running,
+   *  else the devices are probed (see ufe_probe_devices()).
+   *  \param board_id: Identifier of the board.
+   */
+  Result<Device> open_board(int board_id) const {
+    libusb_device_handle *handle = nullptr;
+    if (ufe_registry_running()) {
+      int status = ufe_registry_open(board_id, &handle);
+      if (handle == nullptr)
+        return Error(status);
+
+      return Device(handle, board_id);
+    }
+
+    ufe_probed_device *febs = nullptr;
+    int n_febs = ufe_probe_devices(ctx_->usb_ctx_, &is_bm_feb, 0, &ufe_probe_board_id, &board_id, &febs);
+    if (n_febs < 0)
+      return Error(n_febs);
+
+    if (n_febs > 0)
+      std::swap(handle, febs[0].handle_);
+
+    ufe_free_probed_devices(febs, n_febs);
+    if (handle == nullptr)
+      return Error(UFE_NOT_FOUND_ERROR);
+
+    return Device(handle, board_id);
+  }
+
+ private:
+  explicit Session(ufe_context *ctx) noexcept : ctx_(ctx) {}
+
+  ufe_context *ctx_;
+};
+
+}  // namespace ufe
+
+#endif
@@ -23,6 +23,13 @@
 
 // C++
 #include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "TestLibUfec.h"
 
@@ -38,6 +45,28 @@ void TestLibUfec::tearDown() {
   
 }
 
+ufe_context* TestLibUfec::StartEmulator(const char *emu_config, unsigned int buffer_size,
+                                        unsigned int timeout, bool init) {
+  ufe_context *ctx = NULL;
+  ufe_default_context(&ctx);
+  ctx->verbose_ = -1;
+  if (buffer_size)
+    ctx->readout_buffer_size_ = buffer_size;
+
+  if (timeout)
+    ctx->readout_timeout_ = timeout;
+
+  ufe_emu_config config;
+  ufe_emu_default_config(&config);
+  CPPUNIT_ASSERT( ufe_emu_parse_config(emu_config, &config) == 0 );
+  CPPUNIT_ASSERT( ufe_emu_start(&config) == 0 );
+  ctx->transport_ = ufe_emu_transport();
+  if (init)
+    CPPUNIT_ASSERT( ufe_init(&ctx) == 0 );
+
+  return ctx;
+}
+
 void TestLibUfec::TestContext() {
   // Test that the context is empty at start.
   CPPUNIT_ASSERT( ufe_context_handler == NULL );
@@ -51,6 +80,7 @@ void TestLibUfec::TestContext() {
   CPPUNIT_ASSERT( ctx_1->verbose_ == 1 );
   CPPUNIT_ASSERT( ctx_1->readout_buffer_size_ == 1024*32 );
   CPPUNIT_ASSERT( ctx_1->readout_timeout_ == 100 );
+  CPPUNIT_ASSERT( ctx_1->readout_blocks_ == 16 );
 
   ctx_1->verbose_ = 4;
 
@@ -166,6 +196,1058 @@ void TestLibUfec::TestPrint() {
 
 }
 
+struct evb_output {
+  std::vector<ufe_hit> hits_;
+  std::vector<uint64_t> windows_;
+};
+
+static void collect_window(const ufe_hit *hits, size_t n_hits, uint64_t window_start, void *arg) {
+  evb_output *out = (evb_output*) arg;
+  out->hits_.insert(out->hits_.end(), hits, hits + n_hits);
+  out->windows_.push_back(window_start);
+}
+
+void TestLibUfec::TestEventBuilder() {
+  evb_output out;
+  ufe_evb *evb = NULL;
+  CPPUNIT_ASSERT( ufe_evb_init(&evb, 3, 5, 10, 1000, &collect_window, &out) == 0 );
+  CPPUNIT_ASSERT( evb->capacity_ == 8 );
+
+  // Three boards, each ordered in time.
+  uint64_t times[3][4] = { {1, 5, 12, 31}, {2, 3, 14, 22}, {0, 9, 25, 33} };
+  ufe_hit hits[4];
+  for (int b = 0; b < 3; ++b) {
+    for (int i = 0; i < 4; ++i) {
+      hits[i].time_ = times[b][i];
+      hits[i].board_id_ = b;
+    }
+
+    CPPUNIT_ASSERT( ufe_evb_push(evb, b, hits, 4) == 4 );
+  }
+
+  // Board 1 is complete only up to 22. Nothing newer can be merged.
+  ufe_evb_process(evb);
+  CPPUNIT_ASSERT( out.windows_.size() == 2 );
+  CPPUNIT_ASSERT( out.windows_[0] == 0 );
+  CPPUNIT_ASSERT( out.windows_[1] == 10 );
+  CPPUNIT_ASSERT( out.hits_.size() == 8 );
+
+  ufe_evb_flush(evb);
+  CPPUNIT_ASSERT( out.hits_.size() == 12 );
+  CPPUNIT_ASSERT( out.windows_.size() == 4 );
+  CPPUNIT_ASSERT( out.windows_[3] == 30 );
+  for (size_t i = 1; i < out.hits_.size(); ++i)
+    CPPUNIT_ASSERT( out.hits_[i-1].time_ <= out.hits_[i].time_ );
+
+  // A hit older than the last emitted window is late.
+  hits[0].time_ = 15;
+  ufe_evb_push(evb, 2, hits, 1);
+  ufe_evb_flush(evb);
+  CPPUNIT_ASSERT( evb->n_late_ == 1 );
+  CPPUNIT_ASSERT( evb->n_merged_ == 12 );
+
+  ufe_evb_free(evb);
+}
+
+void TestLibUfec::TestRing() {
+  char name[64];
+  sprintf(name, "/ufe_ring_test_%i", getpid());
+
+  ufe_ring *ring = NULL;
+  CPPUNIT_ASSERT( ufe_ring_create(&ring, name, 4000) == 0 );
+  CPPUNIT_ASSERT( ring->ctrl_->size_ == 4096 );
+
+  // The ring of a running producer is not replaced.
+  ufe_ring *other = NULL;
+  CPPUNIT_ASSERT( ufe_ring_create(&other, name, 4000) == LIBUSB_ERROR_BUSY );
+
+  ufe_ring_reader *normal = NULL, *lossy = NULL;
+  CPPUNIT_ASSERT( ufe_ring_attach(&normal, name, false) == 0 );
+  CPPUNIT_ASSERT( ufe_ring_attach(&lossy, name, true) == 0 );
+
+  uint8_t in[1000], out[1000];
+  struct iovec iov = {in, sizeof(in)};
+  size_t actual;
+
+  // The normal reader keeps up, the lossy reader reads only the first record.
+  for (int i = 0; i < 9; ++i) {
+    memset(in, i, sizeof(in));
+    CPPUNIT_ASSERT( ufe_ring_writev(ring, &iov, 1) == 0 );
+    CPPUNIT_ASSERT( ufe_ring_read(normal, out, sizeof(out), &actual, 0) == 0 );
+    CPPUNIT_ASSERT( actual == sizeof(in) && out[0] == i && out[999] == i );
+
+    if (i == 0)
+      CPPUNIT_ASSERT( ufe_ring_read(lossy, out, sizeof(out), &actual, 0) == 0 );
+  }
+
+  // The lossy reader has been overrun. It continues with the next record.
+  CPPUNIT_ASSERT( ufe_ring_read(lossy, out, sizeof(out), &actual, 0) == LIBUSB_ERROR_TIMEOUT );
+  memset(in, 9, sizeof(in));
+  CPPUNIT_ASSERT( ufe_ring_writev(ring, &iov, 1) == 0 );
+  CPPUNIT_ASSERT( ufe_ring_read(lossy, out, sizeof(out), &actual, 0) == 0 );
+  CPPUNIT_ASSERT( actual == sizeof(in) && out[0] == 9 );
+  CPPUNIT_ASSERT( ufe_ring_lost(lossy) == 8 );
+
+  CPPUNIT_ASSERT( ufe_ring_read(normal, out, 10, &actual, 0) == LIBUSB_ERROR_OVERFLOW );
+  CPPUNIT_ASSERT( ufe_ring_read(normal, out, sizeof(out), &actual, 0) == 0 );
+  CPPUNIT_ASSERT( ufe_ring_lost(normal) == 0 );
+
+  // End of the data.
+  ufe_ring_close(ring, 100);
+  CPPUNIT_ASSERT( ufe_ring_read(normal, out, sizeof(out), &actual, 0) == 0 && actual == 0 );
+  CPPUNIT_ASSERT( ufe_ring_read(lossy, out, sizeof(out), &actual, 0) == 0 && actual == 0 );
+
+  ufe_ring_detach(normal);
+  ufe_ring_detach(lossy);
+}
+
+void TestLibUfec::TestPool() {
+  ufe_context *ctx = NULL;
+  ufe_default_context(&ctx);
+  ctx->verbose_ = -1;
+
+  // With or without hugepages, the blocks are whole pages and the pool is pre-faulted.
+  long page = sysconf(_SC_PAGESIZE);
+  ufe_pool *pool = NULL;
+  CPPUNIT_ASSERT( ufe_pool_create(&pool, 5, 5000, ctx->readout_pool_flags_, -1) == 0 );
+  CPPUNIT_ASSERT( pool->block_size_ == (size_t) 2*page );
+  CPPUNIT_ASSERT( pool->size_ >= 5*pool->block_size_ );
+  if (pool->pages_ != UFE_POOL_REGULAR_PAGES)
+    CPPUNIT_ASSERT( pool->size_ % UFE_HUGEPAGE_SIZE == 0 );
+
+  for (int i = 0; i < 5; ++i) {
+    CPPUNIT_ASSERT( (uintptr_t) ufe_pool_block(pool, i) % page == 0 );
+    memset(ufe_pool_block(pool, i), i, 5000);
+  }
+
+  CPPUNIT_ASSERT( ufe_pool_block(pool, 4)[4999] == 4 );
+  ufe_pool_destroy(pool);
+
+  CPPUNIT_ASSERT( ufe_pool_create(&pool, 3, 100, 0, 0) == 0 );
+  CPPUNIT_ASSERT( pool->pages_ == UFE_POOL_REGULAR_PAGES && pool->size_ == (size_t) 3*page );
+  ufe_pool_destroy(pool);
+
+  CPPUNIT_ASSERT( ufe_pool_create(&pool, 0, 100, 0, -1) == UFE_INVALID_ARG_ERROR );
+
+  // CPU lists.
+  CPPUNIT_ASSERT( ufe_set_thread_cpus(pthread_self(), "3-1") == UFE_INVALID_ARG_ERROR );
+  CPPUNIT_ASSERT( ufe_set_thread_cpus(pthread_self(), "0,") == UFE_INVALID_ARG_ERROR );
+  CPPUNIT_ASSERT( ufe_set_thread_cpus(pthread_self(), "x") == UFE_INVALID_ARG_ERROR );
+}
+
+void TestLibUfec::TestCompress() {
+  ufe_context *ctx = NULL;
+  ufe_default_context(&ctx);
+  ctx->verbose_ = -1;
+
+  // Counter words, like the synthetic data of the emulator, a few headers and an odd tail.
+  const size_t size = 4*1000 + 3;
+  vector<uint8_t> block(size), frame(ufe_frame_bound(size)), back(size);
+  uint32_t *words = (uint32_t*) block.data();
+  for (int i = 0; i < 1000; ++i)
+    words[i] = (i % 100 == 0)? 0xf0000000 | i : 0x12340000 + 3*i;
+
+  block[size - 1] = 7;
+  for (const char *name : {"none", "delta", "lz4", "zstd"}) {
+    int codec = ufe_codec_by_name(name);
+    if (codec < 0)
+      continue;
+
+    int n = ufe_compress_frame(codec, block.data(), size, frame.data());
+    CPPUNIT_ASSERT( n > 0 );
+    if (codec == UFE_CODEC_DELTA)
+      CPPUNIT_ASSERT( n < (int) size/4 );
+
+    CPPUNIT_ASSERT( ufe_decompress_frame(frame.data(), n, back.data(), size) == (int) size );
+    CPPUNIT_ASSERT( back == block );
+    CPPUNIT_ASSERT( ufe_decompress_frame(frame.data(), n - 1, back.data(), size) < 0 );
+  }
+
+  CPPUNIT_ASSERT( ufe_codec_by_name("zip") == UFE_INVALID_ARG_ERROR );
+
+  // Random data is stored.
+  srand(1);
+  for (size_t i = 0; i < size; ++i)
+    block[i] = rand();
+
+  int n = ufe_compress_frame(UFE_CODEC_DELTA, block.data(), size, frame.data());
+  CPPUNIT_ASSERT( ((ufe_frame_header*) frame.data())->codec_ == UFE_CODEC_NONE );
+  CPPUNIT_ASSERT( ufe_decompress_frame(frame.data(), n, back.data(), size) == (int) size );
+  CPPUNIT_ASSERT( back == block );
+
+  // The sizes of a corrupted header are rejected before use.
+  ufe_frame_header bad = {UFE_FRAME_MAGIC, UFE_CODEC_NONE, 0xFFFFFFF0, 16};
+  CPPUNIT_ASSERT( !ufe_frame_header_valid(&bad) );
+  CPPUNIT_ASSERT( ufe_decompress_frame((const uint8_t*) &bad, sizeof(bad) + 16, back.data(), size) ==
+                  UFE_INVALID_ARG_ERROR );
+  bad.size_ = 16;
+  bad.payload_size_ = 0xFFFFFFF0;
+  CPPUNIT_ASSERT( !ufe_frame_header_valid(&bad) );
+  bad.payload_size_ = 16;
+  CPPUNIT_ASSERT( ufe_frame_header_valid(&bad) );
+
+  // The frames come out in the order of the blocks.
+  int fds[2];
+  CPPUNIT_ASSERT( pipe(fds) == 0 );
+  fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+  ufe_compressor *comp = NULL;
+  CPPUNIT_ASSERT( ufe_compressor_open(&comp, fds[1], UFE_CODEC_DELTA, 3) == 0 );
+  for (uint32_t i = 0; i < 50; ++i) {
+    for (int j = 0; j < 1000; ++j)
+      words[j] = i*1000 + j;
+
+    CPPUNIT_ASSERT( ufe_compressor_write(comp, block.data(), 4*(i + 1)*20) == 0 );
+  }
+
+  CPPUNIT_ASSERT( ufe_compressor_close(comp) == 0 );
+  close(fds[1]);
+
+  vector<uint8_t> out(1 << 20);
+  size_t n_out = 0;
+  ssize_t r;
+  while ((r = read(fds[0], out.data() + n_out, out.size() - n_out)) > 0)
+    n_out += r;
+
+  close(fds[0]);
+  size_t pos = 0;
+  for (uint32_t i = 0; i < 50; ++i) {
+    ufe_frame_header *header = (ufe_frame_header*) (out.data() + pos);
+    CPPUNIT_ASSERT( pos < n_out && header->size_ == 4*(i + 1)*20 );
+    CPPUNIT_ASSERT( ufe_decompress_frame(out.data() + pos, n_out - pos, back.data(), size) == (int) header->size_ );
+    CPPUNIT_ASSERT( ((uint32_t*) back.data())[0] == i*1000 );
+    pos += sizeof(ufe_frame_header) + header->payload_size_;
+  }
+
+  CPPUNIT_ASSERT( pos == n_out );
+}
+
+void TestLibUfec::TestFilter() {
+  ufe_filter_config config;
+  ufe_filter_default_config(&config);
+  config.beacon_keep_ = 4;
+  ufe_filter filter;
+  CPPUNIT_ASSERT( ufe_filter_init(&filter, &config) == 0 );
+
+  // Header 0x1, trailers 0xD 0xE, beacon 0xF, anything else is data.
+  const uint32_t H = 0x10000000, T1 = 0xD0000000, T2 = 0xE0000000, B = 0xF0000000;
+  vector<uint32_t> in, expected;
+  vector<bool> kept_words;
+  auto add = [&](uint32_t w, bool kept) {
+    in.push_back(w);
+    kept_words.push_back(kept);
+    if (kept)
+      expected.push_back(w);
+  };
+
+  add(B | 1, true);
+  add(H | 1, false); add(T1 | 1, false); add(T2 | 1, false);     // Empty frame.
+  add(H | 2, true);
+  for (uint32_t i = 0; i < 21; ++i)                                 // Data, more than a vector.
+    add(0x20000000 | i, true);
+
+  add(T1 | 2, true); add(T2 | 2, true);
+  add(B | 2, true);                                                 // Data since the last beacon.
+  for (uint32_t i = 0; i < 9; ++i) {
+    add(B | (3 + i), i % 4 == 0);                                   // Idle beacons.
+    add(H | (3 + i), false); add(T1 | (3 + i), false); add(T2 | (3 + i), false);
+  }
+
+  add(H | 20, true);                                                // Open at the end of the block.
+  vector<uint32_t> block = in;
+  size_t size = ufe_filter_block(&filter, (uint8_t*) block.data(), 4*block.size());
+  CPPUNIT_ASSERT( size == 4*expected.size() );
+  CPPUNIT_ASSERT( memcmp(block.data(), expected.data(), size) == 0 );
+  CPPUNIT_ASSERT( filter.empty_frames_ == 10 && filter.dropped_beacons_ == 6 );
+  CPPUNIT_ASSERT( filter.bytes_in_ - filter.bytes_out_ == 4*(in.size() - expected.size()) );
+
+  // Blocks split inside a word. A word cut by the end of a block is not looked at, it passes as
+  // data. A frame open at the end of a block is kept. So an empty frame whose header is cut, or is
+  // the last word of a block, is kept whole (header and both trailers). The beacons are the same.
+  const size_t step = 31;
+  vector<uint32_t> expected_split;
+  size_t n_kept_frames = 0;
+  for (size_t k = 0; k < in.size(); ++k)
+    if ((in[k] & 0xF0000000) == H && !kept_words[k] && 4*k/step != (4*k + 4)/step) {
+      kept_words[k] = kept_words[k + 1] = kept_words[k + 2] = true;
+      ++n_kept_frames;
+    }
+
+  for (size_t k = 0; k < in.size(); ++k)
+    if (kept_words[k])
+      expected_split.push_back(in[k]);
+
+  CPPUNIT_ASSERT( n_kept_frames == 4 );
+  CPPUNIT_ASSERT( ufe_filter_init(&filter, &config) == 0 );
+  vector<uint8_t> bytes((uint8_t*) in.data(), (uint8_t*) (in.data() + in.size())), out;
+  for (size_t pos = 0; pos < bytes.size(); pos += step) {
+    size_t n = min(step, bytes.size() - pos);
+    vector<uint8_t> part(bytes.begin() + pos, bytes.begin() + pos + n);
+    n = ufe_filter_block(&filter, part.data(), n);
+    out.insert(out.end(), part.begin(), part.begin() + n);
+  }
+
+  CPPUNIT_ASSERT( out.size() == 4*expected_split.size() );
+  CPPUNIT_ASSERT( memcmp(out.data(), expected_split.data(), out.size()) == 0 );
+  CPPUNIT_ASSERT( filter.empty_frames_ == 10 - n_kept_frames && filter.dropped_beacons_ == 6 );
+
+  // Overlapping classes.
+  config.beacon_ids_ |= config.header_ids_;
+  CPPUNIT_ASSERT( ufe_filter_init(&filter, &config) == UFE_INVALID_ARG_ERROR );
+}
+
+static void keep_snapshot(const ufe_monitor_snapshot *s, void *user_data) {
+  vector<double> *out = (vector<double>*) user_data;
+  *out = { (double) s->n_boards_, (double) s->board_ids_[0], (double) s->records_[0],
+           (double) s->missing_[0], (double) s->hits_[7], s->rates_[7]*s->duration_,
+           (double) s->amplitudes_[7*UFE_MONITOR_AMP_BINS + 0x12], (double) s->dropped_records_ };
+}
+
+void TestLibUfec::TestMonitor() {
+  vector<double> snapshot;
+  ufe_monitor_config config;
+  ufe_monitor_default_config(&config);
+  config.max_boards_ = 1;
+  config.interval_ms_ = 1000000;
+  config.func_ = &keep_snapshot;
+  config.user_data_ = &snapshot;
+
+  ufe_monitor *mon = NULL;
+  CPPUNIT_ASSERT( ufe_monitor_create(&mon, &config) == 0 );
+
+  // Hits (Id 0x2) and amplitudes (Id 0x4) of the channel 7, and a frame header (Id 0x1).
+  const uint32_t ch = 7 << 20;
+  vector<uint32_t> words = { 0x10000000, 0x20000000 | ch, 0x40000123 | ch, 0x20000000 | ch,
+                             0x10000001, 0x20000000 | ch };
+  vector<uint8_t> bytes((uint8_t*) words.data(), (uint8_t*) (words.data() + words.size()));
+
+  auto add = [&](int board_id, uint32_t seq, size_t begin, size_t end) {
+    ufe_block_header header = {UFE_BLOCK_MAGIC, (uint16_t) board_id, 0, seq, (uint32_t) (end - begin)};
+    vector<uint8_t> record((uint8_t*) &header, (uint8_t*) (&header + 1));
+    record.insert(record.end(), bytes.begin() + begin, bytes.begin() + end);
+    return ufe_monitor_add_record(mon, record.data(), record.size());
+  };
+
+  // A word split between two records, a record missing, and a board without a slot.
+  CPPUNIT_ASSERT( add(3, 0, 0, 10) == 0 );
+  CPPUNIT_ASSERT( add(3, 1, 10, bytes.size()) == 0 );
+  CPPUNIT_ASSERT( add(3, 3, 0, bytes.size()) == 0 );
+  CPPUNIT_ASSERT( add(5, 0, 0, bytes.size()) == 0 );
+  CPPUNIT_ASSERT( ufe_monitor_add_record(mon, bytes.data(), bytes.size()) == UFE_INVALID_ARG_ERROR );
+
+  ufe_monitor_publish(mon);
+  CPPUNIT_ASSERT( snapshot.size() == 8 );
+  CPPUNIT_ASSERT( snapshot[0] == 1 && snapshot[1] == 3 && snapshot[2] == 3 && snapshot[3] == 1 );
+  CPPUNIT_ASSERT( snapshot[4] == 6 && snapshot[6] == 2 && snapshot[7] == 1 );
+  CPPUNIT_ASSERT( fabs(snapshot[5] - 8.) < 1e-6 );
+
+  // The counters start again from 0.
+  ufe_monitor_publish(mon);
+  CPPUNIT_ASSERT( snapshot[2] == 0 && snapshot[4] == 0 && snapshot[5] == 0 );
+
+  // A block emptied by the zero suppression is not missing. A sequence number going back is a
+  // new run.
+  ufe_block_header empty = {UFE_BLOCK_MAGIC, 3, UFE_BLOCK_FILTERED, 4, 0};
+  CPPUNIT_ASSERT( ufe_monitor_add_record(mon, (const uint8_t*) &empty, sizeof(empty)) == 0 );
+  CPPUNIT_ASSERT( add(3, 5, 0, bytes.size()) == 0 );
+  CPPUNIT_ASSERT( add(3, 0, 0, bytes.size()) == 0 );
+  ufe_monitor_publish(mon);
+  CPPUNIT_ASSERT( snapshot[2] == 2 && snapshot[3] == 0 );
+  ufe_monitor_destroy(mon);
+
+  config.channel_mask_ = 0xFF;
+  CPPUNIT_ASSERT( ufe_monitor_create(&mon, &config) == UFE_INVALID_ARG_ERROR );
+}
+
+void TestLibUfec::TestPoller() {
+  ufe_context *ctx = StartEmulator("boards=2,first=3");
+
+  libusb_device **febs;
+  CPPUNIT_ASSERT( ufe_get_bm_device_list(ctx->usb_ctx_, &febs) == 2 );
+  libusb_device_handle *handles[2] = {NULL, NULL};
+  CPPUNIT_ASSERT( ufe_open(febs[0], &handles[0]) == 0 );
+  CPPUNIT_ASSERT( ufe_open(febs[1], &handles[1]) == 0 );
+  int board_ids[2] = {3, 4};
+
+  ufe_poller *poller = NULL;
+  CPPUNIT_ASSERT( ufe_poller_open(&poller, handles, board_ids, 2) == 0 );
+
+  // The first poll reports all boards with the bits set, the next ones only what changed.
+  uint16_t par = SDP_GTEN;
+  CPPUNIT_ASSERT( ufe_set_direct_param(handles[1], 4, &par) == 0 );
+  const ufe_status_change *changes;
+  int n_changes;
+  CPPUNIT_ASSERT( ufe_poller_poll(poller, &changes, &n_changes) == 0 );
+  CPPUNIT_ASSERT( n_changes == 2 );
+  CPPUNIT_ASSERT( changes[0].board_id_ == 3 && changes[0].status_ == 0 && changes[0].changed_ == 0 );
+  CPPUNIT_ASSERT( changes[1].board_id_ == 4 && changes[1].changed_ == RS_GTEN );
+  CPPUNIT_ASSERT( ufe_poller_poll(poller, &changes, &n_changes) == 0 );
+  CPPUNIT_ASSERT( n_changes == 0 );
+
+  par = SDP_HVON;
+  CPPUNIT_ASSERT( ufe_set_direct_param(handles[1], 4, &par) == 0 );
+  CPPUNIT_ASSERT( ufe_poller_poll(poller, &changes, &n_changes) == 0 );
+  CPPUNIT_ASSERT( n_changes == 1 && changes[0].status_ == RS_HVON &&
+                  changes[0].changed_ == (RS_GTEN | RS_HVON) && changes[0].error_ == 0 );
+
+  char line[256];
+  ufe_sprint_status_change(&changes[0], line, sizeof(line));
+  CPPUNIT_ASSERT( string(line) == "board 4: 0x800 GTEN- HVON+ ok" );
+  CPPUNIT_ASSERT( poller->n_polls_ == 3 && poller->latency_.n_ == 3 );
+  ufe_poller_close(poller);
+
+  // A board which does not answer is reported once.
+  board_ids[0] = 5;
+  CPPUNIT_ASSERT( ufe_poller_open(&poller, handles, board_ids, 1) == 0 );
+  CPPUNIT_ASSERT( ufe_poller_poll(poller, &changes, &n_changes) != 0 );
+  CPPUNIT_ASSERT( n_changes == 1 && changes[0].board_id_ == 5 && changes[0].error_ != 0 );
+  CPPUNIT_ASSERT( ufe_poller_poll(poller, &changes, &n_changes) != 0 );
+  CPPUNIT_ASSERT( n_changes == 0 );
+  ufe_poller_close(poller);
+
+  ufe_close(handles[0]);
+  ufe_close(handles[1]);
+  ufe_free_device_list(febs, 1);
+  ufe_exit(ctx);
+}
+
+void TestLibUfec::TestEmulator() {
+  ufe_emu_config config;
+  ufe_emu_default_config(&config);
+  CPPUNIT_ASSERT( ufe_emu_parse_config("speed=2", &config) != 0 );
+
+  ufe_context *ctx = StartEmulator("boards=2,first=3", 4096);
+
+  libusb_device **febs;
+  CPPUNIT_ASSERT( ufe_get_bm_device_list(ctx->usb_ctx_, &febs) == 2 );
+
+  libusb_device_handle *handle = NULL;
+  CPPUNIT_ASSERT( ufe_open(febs[1], &handle) == 0 );
+  CPPUNIT_ASSERT( !ufe_ping(handle, 3) );
+  CPPUNIT_ASSERT( ufe_ping(handle, 4) );
+
+  int fv = 0;
+  CPPUNIT_ASSERT( ufe_firmware_version(handle, 4, &fv) == 0 );
+  CPPUNIT_ASSERT( fv == BMFEB_FV );
+
+  // The descriptors and names are generated from the command table.
+  const ufe_command_desc *desc = ufe_get_command_desc(GET_CONFIG_CMD_ID);
+  CPPUNIT_ASSERT( desc && desc->size_ == 4 && desc->answer_size_ == UFE_MAX_FRAME_SIZE );
+  CPPUNIT_ASSERT( strcmp(ufe_get_command_name(IDLE_CMD_ID), "IDLE") == 0 );
+  CPPUNIT_ASSERT( ufe_get_command_desc(0x10) == NULL );
+
+  // The validation of a configuration is an alias of SET_CONFIG, not returned by identifier.
+  desc = ufe_get_command_desc(SET_CONFIG_CMD_ID);
+  CPPUNIT_ASSERT( desc && desc->argc_ == 72 && strcmp(desc->name_, "SET_CONFIG") == 0 );
+  CPPUNIT_ASSERT( ufe_validate_config_desc.command_id_ == SET_CONFIG_CMD_ID );
+  CPPUNIT_ASSERT( ufe_validate_config_desc.size_ == 4 && ufe_validate_config_desc.wrapup_delay_us_ == 7200 );
+
+  uint16_t par = SDP_GTEN | SDP_HVON, status = 0;
+  CPPUNIT_ASSERT( ufe_set_direct_param(handle, 4, &par) == 0 );
+  CPPUNIT_ASSERT( ufe_read_status(handle, 4, &status) == 0 );
+  CPPUNIT_ASSERT( status == (RS_GTEN | RS_HVON) );
+
+  // The configuration goes through the multiple argument frames and the CRC16.
+  uint32_t conf[36], conf_back[36];
+  for (int i = 0; i < 36; ++i)
+    conf[i] = 0x10001*i + 0xabc;
+
+  // Round-trip latency of the commands.
+  ufe_histo *timing = new ufe_histo;
+  ufe_set_cmd_timing(ctx, true);
+  CPPUNIT_ASSERT( ufe_read_status(handle, 4, &status) == 0 );
+  CPPUNIT_ASSERT( ufe_get_cmd_timing(4, READ_STATUS_CMD_ID, UFE_PHASE_TOTAL, timing) == 0 );
+  CPPUNIT_ASSERT( timing->n_ == 1 && timing->max_ > 0 );
+  CPPUNIT_ASSERT( ufe_get_cmd_timing(3, READ_STATUS_CMD_ID, UFE_PHASE_TOTAL, timing) == UFE_NOT_FOUND_ERROR );
+  CPPUNIT_ASSERT( ufe_get_cmd_timing(4, 32, UFE_PHASE_TOTAL, timing) != 0 );
+  ufe_set_cmd_timing(ctx, false);
+  CPPUNIT_ASSERT( ufe_read_status(handle, 4, &status) == 0 );
+  CPPUNIT_ASSERT( ufe_get_cmd_timing(4, READ_STATUS_CMD_ID, UFE_PHASE_TOTAL, timing) == 0 );
+  CPPUNIT_ASSERT( timing->n_ == 1 );
+  delete timing;
+
+  CPPUNIT_ASSERT( ufe_set_config(handle, 4, 1, conf) == 0 );
+  CPPUNIT_ASSERT( ufe_get_config(handle, 4, 1, conf_back) == 0 );
+  CPPUNIT_ASSERT( memcmp(conf, conf_back, sizeof(conf)) == 0 );
+
+  // An answer of several arguments can be discarded.
+  uint16_t device = 1;
+  desc = ufe_get_command_desc(GET_CONFIG_CMD_ID);
+  CPPUNIT_ASSERT( ufe_exchange_command(handle, 4, desc, device, &device, NULL) == 0 );
+  CPPUNIT_ASSERT( ufe_read_status(handle, 4, &status) == 0 );
+  CPPUNIT_ASSERT( status & RS_VW_ASIC1 );
+
+  // The argument words are checked in blocks, an inconsistent word is found in any position.
+  uint32_t frame[UFE_MAX_FRAME_SIZE/4];
+  uint16_t *args = (uint16_t*) conf, *args_back = (uint16_t*) conf_back;
+  ufe_encode_command(frame, 4, GET_CONFIG_CMD_ID, NO_SUB_CMD_ID, 72, args);
+  CPPUNIT_ASSERT( ufe_decode_command_answer(frame, 4, GET_CONFIG_CMD_ID, NO_SUB_CMD_ID, 72, &args_back) == 0 );
+  CPPUNIT_ASSERT( memcmp(conf, conf_back, sizeof(conf)) == 0 );
+  for (int i : {0, 13, 71}) {
+    frame[i + 1] ^= 1 << UEF_FRAME_INDEX_SHIFT;
+    CPPUNIT_ASSERT( ufe_decode_command_answer(frame, 4, GET_CONFIG_CMD_ID, NO_SUB_CMD_ID, 72, &args_back)
+                    == UFE_INVALID_CMD_ANSWER_ERROR );
+    frame[i + 1] ^= 1 << UEF_FRAME_INDEX_SHIFT;
+  }
+
+  // Synthetic data.
+  uint32_t data[1024];
+  int actual = 0;
+  par = DR_START;
+  CPPUNIT_ASSERT( ufe_data_readout(handle, 4, &par) == 0 );
+  CPPUNIT_ASSERT( ufe_read_buffer(handle, (uint8_t*) data, &actual) == 0 );
+  CPPUNIT_ASSERT( actual == sizeof(data) );
+  CPPUNIT_ASSERT( data[1023] == data[0] + 1023 );
+
+  par = DR_STOP;
+  CPPUNIT_ASSERT( ufe_data_readout(handle, 4, &par) == 0 );
+  CPPUNIT_ASSERT( ufe_read_buffer(handle, (uint8_t*) data, &actual) == LIBUSB_ERROR_TIMEOUT );
+
+  ufe_close(handle);
+  ufe_free_device_list(febs, 1);
+  ufe_exit(ctx);
+}
+
+void TestLibUfec::TestHisto() {
+  ufe_histo h;
+  ufe_histo_reset(&h);
+  CPPUNIT_ASSERT( ufe_histo_percentile(&h, 50.) == 0 );
 
+  for (uint64_t v = 1; v <= 1000; ++v)
+    ufe_histo_add(&h, v);
 
+  // Small values are exact, big values are within one sub-bin (12.5%).
+  CPPUNIT_ASSERT( h.n_ == 1000 && h.max_ == 1000 );
+  CPPUNIT_ASSERT( ufe_histo_percentile(&h, 0.1) == 1 );
+  uint64_t p50 = ufe_histo_percentile(&h, 50.);
+  CPPUNIT_ASSERT( p50 >= 500 && p50 < 500*1.125 );
+  CPPUNIT_ASSERT( ufe_histo_percentile(&h, 100.) == 1000 );
 
+  ufe_histo sum;
+  ufe_histo_reset(&sum);
+  ufe_histo_merge(&sum, &h);
+  ufe_histo_merge(&sum, &h);
+  CPPUNIT_ASSERT( sum.n_ == 2000 && sum.sum_ == 2*h.sum_ );
+  CPPUNIT_ASSERT( ufe_histo_percentile(&sum, 50.) == p50 );
+}
+
+static bool tracing = false;
+
+static void* trace_events(void *arg) {
+  while (__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+    ufe_trace_end("test", "event", ufe_trace_begin(), NULL, 0, NULL, 0);
+
+  return NULL;
+}
+
+void TestLibUfec::TestTrace() {
+  ufe_context *ctx = StartEmulator("");
+
+  const char *file_name = "/tmp/ufe_test_trace.json";
+  CPPUNIT_ASSERT( ufe_trace_stop() == UFE_NOT_FOUND_ERROR );
+  CPPUNIT_ASSERT( ufe_trace_start(file_name) == 0 );
+  CPPUNIT_ASSERT( ufe_trace_start(file_name) != 0 );
+  CPPUNIT_ASSERT( ufe_trace_enabled() );
+
+  libusb_device **febs;
+  CPPUNIT_ASSERT( ufe_get_bm_device_list(ctx->usb_ctx_, &febs) == 1 );
+  libusb_device_handle *handle = NULL;
+  CPPUNIT_ASSERT( ufe_open(febs[0], &handle) == 0 );
+  uint16_t status = 0;
+  CPPUNIT_ASSERT( ufe_read_status(handle, 0, &status) == 0 );
+  ufe_close(handle);
+  ufe_free_device_list(febs, 1);
+
+  CPPUNIT_ASSERT( ufe_trace_stop() == 0 );
+  CPPUNIT_ASSERT( !ufe_trace_enabled() );
+
+  FILE *file = fopen(file_name, "r");
+  CPPUNIT_ASSERT( file );
+  std::vector<char> trace(1 << 22);
+  trace.resize(fread(trace.data(), 1, trace.size(), file));
+  fclose(file);
+  unlink(file_name);
+
+  std::string json(trace.begin(), trace.end());
+  CPPUNIT_ASSERT( json.find("\"traceEvents\"") != std::string::npos );
+  CPPUNIT_ASSERT( json.find("\"name\":\"READ_STATUS\"") != std::string::npos );
+  CPPUNIT_ASSERT( json.find("\"name\":\"bulk_out\"") != std::string::npos );
+  CPPUNIT_ASSERT( json.find("\"name\":\"control\"") != std::string::npos );
+  CPPUNIT_ASSERT( json.find("\"name\":\"usleep\"") != std::string::npos );
+  CPPUNIT_ASSERT( json.rfind("]}") != std::string::npos );
+
+  // The tracing can be stopped and restarted while other threads record events.
+  pthread_t threads[4];
+  tracing = true;
+  for (int i = 0; i < 4; ++i)
+    CPPUNIT_ASSERT( pthread_create(&threads[i], NULL, &trace_events, NULL) == 0 );
+
+  for (int i = 0; i < 20; ++i) {
+    CPPUNIT_ASSERT( ufe_trace_start(file_name) == 0 );
+    usleep(1000);
+    CPPUNIT_ASSERT( ufe_trace_stop() == 0 );
+  }
+
+  __atomic_store_n(&tracing, false, __ATOMIC_RELAXED);
+  for (int i = 0; i < 4; ++i)
+    pthread_join(threads[i], NULL);
+
+  unlink(file_name);
+  ufe_exit(ctx);
+}
+
+static int n_connected = 0;
+
+static void count_boards(int board_id, bool connected, void *user_data) {
+  __atomic_add_fetch(&n_connected, (connected)? 1 : -1, __ATOMIC_RELAXED);
+}
+
+static int do_nothing(libusb_device_handle *dev_handle) {
+  return 0;
+}
+
+void TestLibUfec::TestRegistry() {
+  ufe_context *ctx = StartEmulator("boards=2,first=3");
+
+  n_connected = 0;
+  CPPUNIT_ASSERT( ufe_registry_start(&count_boards, NULL) == 0 );
+  CPPUNIT_ASSERT( ufe_registry_running() );
+  CPPUNIT_ASSERT( n_connected == 2 );
+
+  int ids[4];
+  CPPUNIT_ASSERT( ufe_registry_get_boards(ids, 4) == 2 );
+  CPPUNIT_ASSERT( ids[0] == 3 && ids[1] == 4 );
+  CPPUNIT_ASSERT( ufe_in_session_on_board_do(4, &do_nothing) == 0 );
+  CPPUNIT_ASSERT( ufe_in_session_on_board_do(5, &do_nothing) != 0 );
+
+  // Disconnect and connect a board during the session.
+  CPPUNIT_ASSERT( ufe_emu_set_connected(4, false) == 0 );
+  for (int i = 0; i < 100 && __atomic_load_n(&n_connected, __ATOMIC_RELAXED) != 1; ++i)
+    usleep(10000);
+
+  CPPUNIT_ASSERT( n_connected == 1 );
+  CPPUNIT_ASSERT( ufe_registry_get_boards(ids, 4) == 1 );
+  CPPUNIT_ASSERT( ufe_in_session_on_board_do(4, &do_nothing) != 0 );
+
+  CPPUNIT_ASSERT( ufe_emu_set_connected(4, true) == 0 );
+  for (int i = 0; i < 100 && __atomic_load_n(&n_connected, __ATOMIC_RELAXED) != 2; ++i)
+    usleep(10000);
+
+  CPPUNIT_ASSERT( n_connected == 2 );
+  CPPUNIT_ASSERT( ufe_in_session_on_board_do(4, &do_nothing) == 0 );
+
+  ufe_readout *ro = NULL;
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, NULL, 0) == 0 );
+  CPPUNIT_ASSERT( ro->n_streams_ == 2 );
+  ufe_readout_close(ro);
+
+  ids[1] = 3;
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, ids, 2) == UFE_INVALID_ARG_ERROR );
+
+  ufe_registry_stop();
+  CPPUNIT_ASSERT( !ufe_registry_running() );
+  ufe_exit(ctx);
+}
+
+void TestLibUfec::TestProbeDevices() {
+  ufe_context *ctx = StartEmulator("boards=40,first=20");
+
+  // Only the descriptor filter.
+  ufe_probed_device *febs = NULL;
+  CPPUNIT_ASSERT( ufe_probe_devices(ctx->usb_ctx_, &is_bm_feb, 0, NULL, NULL, &febs) == 40 );
+  CPPUNIT_ASSERT( febs[0].handle_ == NULL );
+  ufe_free_probed_devices(febs, 40);
+
+  int board_id = 45;
+  CPPUNIT_ASSERT( ufe_probe_devices(ctx->usb_ctx_, &is_bm_feb, 0, &ufe_probe_board_id, &board_id, &febs) == 1 );
+  CPPUNIT_ASSERT( febs[0].result_ == 45 );
+  CPPUNIT_ASSERT( ufe_ping(febs[0].handle_, 45) );
+  ufe_free_probed_devices(febs, 1);
+
+  board_id = 3;
+  CPPUNIT_ASSERT( ufe_probe_devices(ctx->usb_ctx_, &is_bm_feb, 0, &ufe_probe_board_id, &board_id, &febs) == 0 );
+  ufe_free_probed_devices(febs, 0);
+
+  // The boards are found on all devices in parallel, each one once.
+  ufe_readout *ro = NULL;
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, NULL, 0) == 0 );
+  CPPUNIT_ASSERT( ro->n_streams_ == 40 );
+  for (int i = 0; i < 40; ++i)
+    CPPUNIT_ASSERT( ro->streams_[i].board_id_ == 20 + i );
+
+  ufe_readout_close(ro);
+
+  int ids[2] = {59, 21};
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, ids, 2) == 0 );
+  CPPUNIT_ASSERT( ro->n_streams_ == 2 );
+  ufe_readout_close(ro);
+
+  // The lists with a repeated or invalid Id are rejected.
+  int bad_ids[3] = {21, 59, 21};
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, bad_ids, 3) == UFE_INVALID_ARG_ERROR );
+  bad_ids[2] = UFE_MAX_BOARDS;
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, bad_ids, 3) == UFE_INVALID_ARG_ERROR );
+  bad_ids[2] = -1;
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, bad_ids, 3) == UFE_INVALID_ARG_ERROR );
+
+  CPPUNIT_ASSERT( ctx->verbose_ == -1 );
+  ufe_exit(ctx);
+
+  // A board with an unsupported firmware is not selected.
+  ctx = StartEmulator("boards=1,first=5,fv=0x20");
+  board_id = 5;
+  CPPUNIT_ASSERT( ufe_probe_devices(ctx->usb_ctx_, &is_bm_feb, 0, &ufe_probe_board_id, &board_id, &febs) == 0 );
+  ufe_free_probed_devices(febs, 0);
+
+  libusb_device_handle *dev_handle = NULL;
+  CPPUNIT_ASSERT( ufe_probe_devices(ctx->usb_ctx_, &is_bm_feb, 0, NULL, NULL, &febs) == 1 );
+  CPPUNIT_ASSERT( ufe_usb()->open(febs[0].dev_, &dev_handle) == 0 );
+  CPPUNIT_ASSERT( ufe_check_board(dev_handle, 5) == UFE_FIRMWARE_ERROR );
+  CPPUNIT_ASSERT( ufe_check_board(dev_handle, 6) == UFE_NOT_FOUND_ERROR );
+  ufe_usb()->close(dev_handle);
+  ufe_free_probed_devices(febs, 1);
+
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, &board_id, 1) == UFE_NOT_FOUND_ERROR );
+  ufe_exit(ctx);
+}
+
+void TestLibUfec::TestRecovery() {
+  ufe_context *ctx = StartEmulator("rate=10", 4096);
+
+  const char *file_name = "/tmp/ufe_test_recovery.bin";
+  int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CPPUNIT_ASSERT( fd >= 0 );
+
+  ufe_readout *ro = NULL;
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, NULL, 0) == 0 );
+  ro->container_ = true;
+  ufe_readout_set_output(ro, 0, fd);
+  CPPUNIT_ASSERT( ufe_readout_start(ro, 0) == 0 );
+
+  // A stall in the middle of the run does not end the stream.
+  usleep(20000);
+  CPPUNIT_ASSERT( ufe_emu_stall(0) == 0 );
+  usleep(20000);
+  CPPUNIT_ASSERT( ufe_readout_stop(ro, 0) == 0 );
+  close(fd);
+
+  ufe_readout_stats stats;
+  ufe_get_stats(ro, &stats);
+  CPPUNIT_ASSERT( stats.streams_[0].recoveries_ == 1 );
+  CPPUNIT_ASSERT( stats.streams_[0].errors_ == 1 );
+
+  // The first block after the recovery is marked.
+  FILE *file = fopen(file_name, "r");
+  CPPUNIT_ASSERT( file );
+  ufe_block_header header;
+  std::vector<char> data(4096);
+  int n_gaps = 0, n_eos = 0;
+  uint32_t seq = 0;
+  while (fread(&header, sizeof(header), 1, file) == 1) {
+    CPPUNIT_ASSERT( header.magic_ == UFE_BLOCK_MAGIC );
+    CPPUNIT_ASSERT( header.seq_ == seq++ );
+    CPPUNIT_ASSERT( fread(data.data(), 1, header.size_, file) == header.size_ );
+    n_gaps += (header.flags_ & UFE_BLOCK_GAP) != 0;
+    n_eos  += (header.flags_ & UFE_BLOCK_EOS) != 0;
+  }
+
+  fclose(file);
+  unlink(file_name);
+  CPPUNIT_ASSERT( n_gaps == 1 );
+  CPPUNIT_ASSERT( n_eos == 1 );
+  CPPUNIT_ASSERT( seq > 2 );
+
+  ufe_readout_close(ro);
+  ufe_exit(ctx);
+}
+
+void TestLibUfec::TestFilteredStream() {
+  ufe_context *ctx = StartEmulator("rate=10,pattern=zero", 4096);
+
+  // All words have the Id 0, taken as idle beacons: only the first one is kept, the other blocks
+  // are emptied by the filter.
+  ufe_filter_config filter;
+  ufe_filter_default_config(&filter);
+  filter.header_ids_ = 1 << 0x1;
+  filter.beacon_ids_ = 1 << 0x0;
+  filter.beacon_keep_ = 1 << 30;
+
+  const char *file_name = "/tmp/ufe_test_filtered.bin";
+  int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CPPUNIT_ASSERT( fd >= 0 );
+
+  ufe_readout *ro = NULL;
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, NULL, 0) == 0 );
+  ro->container_ = true;
+  ro->filter_ = &filter;
+  ufe_readout_set_output(ro, 0, fd);
+  CPPUNIT_ASSERT( ufe_readout_start(ro, 0) == 0 );
+  usleep(20000);
+  CPPUNIT_ASSERT( ufe_readout_stop(ro, 0) == 0 );
+  close(fd);
+  ufe_readout_close(ro);
+  ufe_exit(ctx);
+
+  // The emptied blocks are records without data: the sequence numbers are contiguous and the
+  // monitor finds nothing missing.
+  vector<double> snapshot;
+  ufe_monitor_config mon_config;
+  ufe_monitor_default_config(&mon_config);
+  mon_config.max_boards_ = 1;
+  mon_config.interval_ms_ = 1000000;
+  mon_config.func_ = &keep_snapshot;
+  mon_config.user_data_ = &snapshot;
+  ufe_monitor *mon = NULL;
+  CPPUNIT_ASSERT( ufe_monitor_create(&mon, &mon_config) == 0 );
+
+  FILE *file = fopen(file_name, "r");
+  CPPUNIT_ASSERT( file );
+  vector<uint8_t> record(sizeof(ufe_block_header) + 4096);
+  ufe_block_header header;
+  int n_empty = 0, n_eos = 0;
+  uint32_t seq = 0;
+  while (fread(&header, sizeof(header), 1, file) == 1) {
+    CPPUNIT_ASSERT( header.magic_ == UFE_BLOCK_MAGIC && header.seq_ == seq++ );
+    CPPUNIT_ASSERT( fread(record.data() + sizeof(header), 1, header.size_, file) == header.size_ );
+    if (header.flags_ & UFE_BLOCK_EOS) {
+      ++n_eos;
+      continue;
+    }
+
+    CPPUNIT_ASSERT( header.flags_ & UFE_BLOCK_FILTERED );
+    n_empty += (header.size_ == 0);
+    memcpy(record.data(), &header, sizeof(header));
+    CPPUNIT_ASSERT( ufe_monitor_add_record(mon, record.data(), sizeof(header) + header.size_) == 0 );
+  }
+
+  fclose(file);
+  unlink(file_name);
+  CPPUNIT_ASSERT( n_eos == 1 );
+  CPPUNIT_ASSERT( n_empty > 2 && n_empty == (int) seq - 2 );
+  ufe_monitor_publish(mon);
+  CPPUNIT_ASSERT( snapshot.size() == 8 && snapshot[2] == 1 && snapshot[3] == 0 );
+  ufe_monitor_destroy(mon);
+}
+
+void TestLibUfec::TestStop() {
+  // The reader is slower than the board: some data is left in the board at the stop.
+  ufe_context *ctx = StartEmulator("rate=50,transfer=4096", 1 << 16, 1000);
+
+  int fd = open("/dev/null", O_WRONLY);
+  ufe_readout *ro = NULL;
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, NULL, 0) == 0 );
+  ufe_readout_set_output(ro, 0, fd);
+
+  // An emulated board has no NUMA node. The writer is not pinned, the readout thread is.
+  CPPUNIT_ASSERT( ro->streams_[0].numa_node_ == -1 );
+
+  // Without threads, the start fails and leaves nothing running. The stop does nothing.
+  pthread_attr_t attr, x_attr;
+  pthread_getattr_default_np(&x_attr);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, (size_t) 1 << 52);
+  pthread_setattr_default_np(&attr);
+  int start_status = ufe_readout_start(ro, 0);
+  pthread_setattr_default_np(&x_attr);
+  pthread_attr_destroy(&attr);
+  pthread_attr_destroy(&x_attr);
+  CPPUNIT_ASSERT( start_status == UFE_INTERNAL_ERROR );
+  CPPUNIT_ASSERT( ufe_readout_stop(ro, 0) == UFE_INVALID_ARG_ERROR );
+  CPPUNIT_ASSERT( ro->writers_ == NULL && ro->pool_ == NULL );
+
+  ro->usb_cpus_ = "0";
+  ro->writer_cpus_ = UFE_CPUS_NODE;
+  CPPUNIT_ASSERT( ufe_readout_start(ro, 0) == 0 );
+  cpu_set_t cpus;
+  CPPUNIT_ASSERT( pthread_getaffinity_np(ro->streams_[0].thread_, sizeof(cpus), &cpus) == 0 );
+  CPPUNIT_ASSERT( CPU_COUNT(&cpus) == 1 && CPU_ISSET(0, &cpus) );
+  usleep(20000);
+
+  // The stop does not wait for the readout timeout.
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  CPPUNIT_ASSERT( ufe_readout_stop(ro, 0) == 0 );
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double stop_ms = (t1.tv_sec - t0.tv_sec)*1e3 + (t1.tv_nsec - t0.tv_nsec)*1e-6;
+  CPPUNIT_ASSERT( stop_ms < 200 );
+  close(fd);
+
+  ufe_readout_stats stats;
+  ufe_get_stats(ro, &stats);
+  CPPUNIT_ASSERT( stats.streams_[0].bytes_ > 0 );
+  CPPUNIT_ASSERT( stats.streams_[0].errors_ == 0 );
+  CPPUNIT_ASSERT( stats.streams_[0].start_skew_ns_ == 0 );
+
+  ufe_readout_close(ro);
+  ufe_exit(ctx);
+}
+
+void TestLibUfec::TestSyncStart() {
+  ufe_context *ctx = StartEmulator("boards=4,first=3,rate=10,transfer=4096", 1 << 16, 100);
+
+  int fd = open("/dev/null", O_WRONLY);
+  ufe_readout *ro = NULL;
+  CPPUNIT_ASSERT( ufe_readout_open(&ro, NULL, 0) == 0 );
+  CPPUNIT_ASSERT( ro->n_streams_ == 4 );
+  int i;
+  for (i = 0; i < ro->n_streams_; ++i)
+    ufe_readout_set_output(ro, i, fd);
+
+  CPPUNIT_ASSERT( ufe_readout_start(ro, 0) == 0 );
+  usleep(20000);
+  CPPUNIT_ASSERT( ufe_readout_stop(ro, 0) == 0 );
+  close(fd);
+
+  // An emulated board sends data only once started: every board has been released by the gate.
+  // The skew is relative to the first board to get the command.
+  ufe_readout_stats stats;
+  ufe_get_stats(ro, &stats);
+  uint64_t min_skew = UINT64_MAX, max_skew = 0;
+  for (i = 0; i < ro->n_streams_; ++i) {
+    CPPUNIT_ASSERT( stats.streams_[i].bytes_ > 0 );
+    CPPUNIT_ASSERT( stats.streams_[i].errors_ == 0 );
+    min_skew = std::min(min_skew, stats.streams_[i].start_skew_ns_);
+    max_skew = std::max(max_skew, stats.streams_[i].start_skew_ns_);
+  }
+
+  CPPUNIT_ASSERT( min_skew == 0 );
+  CPPUNIT_ASSERT( max_skew > 0 && max_skew < 50000000 );
+
+  ufe_readout_close(ro);
+  ufe_exit(ctx);
+}
+
+void TestLibUfec::TestCppInterface() {
+  // The session is started by the C++ interface.
+  ufe_context *ctx = StartEmulator("boards=2,first=3,transfer=4096", 4096, 200, false);
+
+  ufe::Result<ufe::Session> session = ufe::Session::open(ctx);
+  CPPUNIT_ASSERT( session.has_value() );
+  CPPUNIT_ASSERT( session->context() == ctx );
+
+  ufe::Result<ufe::Device> missing = session->open_board(7);
+  CPPUNIT_ASSERT( !missing && missing.error() == UFE_NOT_FOUND_ERROR );
+  int thrown = 0;
+  try {
+    missing.value();
+  } catch (const ufe::BadResultAccess &e) {
+    thrown = e.error().code();
+  }
+  CPPUNIT_ASSERT( thrown == UFE_NOT_FOUND_ERROR );
+
+  ufe::Result<ufe::Device> found = session->open_board(4);
+  CPPUNIT_ASSERT( found.has_value() );
+
+  // The handle follows the moves.
+  ufe::Device dev = std::move(found).value();
+  CPPUNIT_ASSERT( dev && dev.board_id() == 4 );
+  CPPUNIT_ASSERT( dev.ping() );
+  CPPUNIT_ASSERT( dev.firmware_version().value_or(0) == BMFEB_FV );
+  CPPUNIT_ASSERT( dev.set_direct_param(SDP_GTEN | SDP_HVON) );
+  CPPUNIT_ASSERT( dev.read_status().value_or(0) == (RS_GTEN | RS_HVON) );
+
+  // The blocks are too small for the readout buffer.
+  ufe::ReadoutBuffer small(2, 1024);
+  CPPUNIT_ASSERT( dev.read(small).error() == UFE_INVALID_ARG_ERROR );
+
+  // The views point to the blocks, in turn.
+  ufe::ReadoutBuffer buffer(2, 4096);
+  CPPUNIT_ASSERT( dev.data_readout(DR_START) );
+  ufe::Result<ufe::Span<const std::byte>> data0 = dev.read(buffer);
+  ufe::Result<ufe::Span<const std::byte>> data1 = dev.read(buffer);
+  ufe::Result<ufe::Span<const std::byte>> data2 = dev.read(buffer);
+  CPPUNIT_ASSERT( data0 && data1 && data2 );
+  CPPUNIT_ASSERT( data0->size() > 0 && data0->size() <= 4096 );
+  CPPUNIT_ASSERT( data0->data() == buffer.block(0).data() );
+  CPPUNIT_ASSERT( data1->data() == buffer.block(1).data() );
+  CPPUNIT_ASSERT( data2->data() == buffer.block(0).data() );
+  CPPUNIT_ASSERT( dev.data_readout(DR_STOP) );
+
+  ufe::Device other(std::move(dev));
+  CPPUNIT_ASSERT( !dev && other );
+  other.close();
+  CPPUNIT_ASSERT( !other );
+}
+
+#ifdef __cpp_impl_coroutine
+
+// Configures a board and reads its status back.
+static ufe::Task<int> configure_board(ufe::AsyncDevice dev, const uint32_t *conf) {
+  ufe::Result<int> fv = co_await dev.firmware_version();
+  if (!fv || *fv != BMFEB_FV)
+    co_return -1;
+
+  if (!co_await dev.set_direct_param(SDP_GTEN | SDP_HVON))
+    co_return -2;
+
+  if (!co_await dev.set_config(1, conf))
+    co_return -3;
+
+  ufe::Result<uint16_t> status = co_await dev.read_status();
+  co_return status.value_or(0);
+}
+
+// Reads n_blocks non-empty readout blocks.
+static ufe::Task<int> read_blocks(ufe::AsyncDevice dev, ufe::ReadoutBuffer &buffer, int n_blocks) {
+  if (!co_await dev.data_readout(DR_START))
+    co_return -1;
+
+  int n = 0;
+  ufe::AsyncGenerator<ufe::Result<ufe::Span<const std::byte>>> blocks = dev.readout(buffer);
+  while (n < n_blocks) {
+    ufe::Result<ufe::Span<const std::byte>> *block = co_await blocks.next();
+    if (block == nullptr || !block->has_value())
+      co_return -2;
+
+    if ((*block)->size() > 0)
+      ++n;
+  }
+
+  if (!co_await dev.data_readout(DR_STOP))
+    co_return -3;
+
+  co_return n;
+}
+
+void TestLibUfec::TestAsync() {
+  // The session is started by the C++ interface.
+  ufe_context *ctx = StartEmulator("boards=4,rate=10,transfer=4096", 4096, 200, false);
+  ufe::Result<ufe::Session> session = ufe::Session::open(ctx);
+  CPPUNIT_ASSERT( session.has_value() );
+
+  std::vector<ufe::Device> devs;
+  for (int i = 0; i < 4; ++i) {
+    ufe::Result<ufe::Device> dev = session->open_board(i);
+    CPPUNIT_ASSERT( dev.has_value() );
+    devs.push_back(std::move(dev).value());
+  }
+
+  // The configuration goes through two transfers.
+  uint32_t conf[36], conf_back[36];
+  for (int i = 0; i < 36; ++i)
+    conf[i] = 0x10001*i + 0x123;
+
+  // The boards are configured concurrently by this thread: the processing times of the
+  // configurations (2 x 7.2 ms per board) overlap.
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  std::vector<ufe::Task<int>> tasks;
+  for (ufe::Device &dev : devs)
+    tasks.push_back(configure_board(ufe::AsyncDevice(dev), conf));
+
+  ufe::run_all(tasks);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double run_ms = (t1.tv_sec - t0.tv_sec)*1e3 + (t1.tv_nsec - t0.tv_nsec)*1e-6;
+  CPPUNIT_ASSERT( run_ms < 40 );
+
+  for (int i = 0; i < 4; ++i) {
+    CPPUNIT_ASSERT( tasks[i].result() == (RS_GTEN | RS_HVON | RS_VW_ASIC1) );
+    CPPUNIT_ASSERT( ufe_get_config(devs[i].handle(), i, 1, conf_back) == 0 );
+    CPPUNIT_ASSERT( memcmp(conf, conf_back, sizeof(conf)) == 0 );
+  }
+
+  // The blocks of the generator are views of the buffer.
+  ufe::ReadoutBuffer buffer(2, 4096);
+  CPPUNIT_ASSERT( ufe::run(read_blocks(ufe::AsyncDevice(devs[2]), buffer, 3)) == 3 );
+}
+
+#endif
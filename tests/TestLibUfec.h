@@ -31,6 +31,22 @@
 // libufec
 #include "libufe.h"
 #include "libufe-core.h"
+#include "libufe-evb.h"
+#include "libufe-ring.h"
+#include "libufe-emu.h"
+#include "libufe-histo.h"
+#include "libufe-trace.h"
+#include "libufe-registry.h"
+#include "libufe-readout.h"
+#include "libufe-compress.h"
+#include "libufe-filter.h"
+#include "libufe-monitor.h"
+#include "libufe-poller.h"
+#include "libufe.hpp"
+
+#ifdef __cpp_impl_coroutine
+#include "libufe-async.hpp"
+#endif
 
 class TestLibUfec : public CppUnit::TestFixture {
  public:
@@ -38,8 +54,31 @@ class TestLibUfec : public CppUnit::TestFixture {
   void tearDown();
 
  protected:
+  // Starts quiet emulated boards (see ufe_emu_parse_config()) and, unless init is false, the
+  // session on them. A buffer size or timeout of 0 keeps the default of the context.
+  ufe_context* StartEmulator(const char *emu_config, unsigned int buffer_size = 0,
+                             unsigned int timeout = 0, bool init = true);
+
   void TestContext();
   void TestPrint();
+  void TestEventBuilder();
+  void TestRing();
+  void TestPool();
+  void TestCompress();
+  void TestFilter();
+  void TestMonitor();
+  void TestPoller();
+  void TestEmulator();
+  void TestHisto();
+  void TestTrace();
+  void TestRegistry();
+  void TestProbeDevices();
+  void TestRecovery();
+  void TestFilteredStream();
+  void TestStop();
+  void TestSyncStart();
+  void TestCppInterface();
+  void TestAsync();
 
  private:
   CPPUNIT_TEST_SUITE( TestLibUfec );
@@ -50,6 +89,26 @@ class TestLibUfec : public CppUnit::TestFixture {
 //   CPPUNIT_TEST(  );
 //   CPPUNIT_TEST(  );
   CPPUNIT_TEST( TestPrint );
+  CPPUNIT_TEST( TestEventBuilder );
+  CPPUNIT_TEST( TestRing );
+  CPPUNIT_TEST( TestPool );
+  CPPUNIT_TEST( TestCompress );
+  CPPUNIT_TEST( TestFilter );
+  CPPUNIT_TEST( TestMonitor );
+  CPPUNIT_TEST( TestPoller );
+  CPPUNIT_TEST( TestEmulator );
+  CPPUNIT_TEST( TestHisto );
+  CPPUNIT_TEST( TestTrace );
+  CPPUNIT_TEST( TestRegistry );
+  CPPUNIT_TEST( TestProbeDevices );
+  CPPUNIT_TEST( TestRecovery );
+  CPPUNIT_TEST( TestFilteredStream );
+  CPPUNIT_TEST( TestStop );
+  CPPUNIT_TEST( TestSyncStart );
+  CPPUNIT_TEST( TestCppInterface );
+#ifdef __cpp_impl_coroutine
+  CPPUNIT_TEST( TestAsync );
+#endif
   CPPUNIT_TEST_SUITE_END();
 };
 
@@ -28,88 +28,162 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
-#include <pthread.h>
 
 #include "libufe.h"
 #include "libufe-tools.h"
+#include "libufe-readout.h"
+#include "libufe-registry.h"
 
-int board_id, time_s, data_fifo=-1;
+int board_ids[UFE_MAX_BOARDS], n_boards, time_s, data_fifo=-1;
 uint16_t data_16;
-char file_name[30];
-uint8_t *data_out;
+ufe_ring *data_ring = NULL;
+const char *stats_file = NULL;
 
 #define NOT_SET   0xFFFF
 
-void* get_data(void *dev) {
-  libusb_device_handle *dev_handle = (libusb_device_handle*) dev;
-  FILE *bFile = fopen (file_name, "wb");
+// Parses a comma separated list of 4-bit word Ids into a bit set. Returns -1 on error.
+int get_word_ids(char *arg, uint16_t *ids) {
+  *ids = 0;
+  char *id = strtok(arg, ",");
+  while (id != NULL) {
+    int value = arg_as_int(id);
+    if (value < 0 || value > 0xF)
+      return -1;
+
+    *ids |= 1 << value;
+    id = strtok(NULL, ",");
+  }
 
-  int actual_read=0;
-  while (ufe_read_buffer(dev_handle, data_out, &actual_read) == 0) {
-    if (actual_read == 0)
-      break;
+  return (*ids)? 0 : -1;
+}
 
-    fwrite(data_out , sizeof(uint8_t), actual_read, bFile);
+int open_output(const char *name, int board_id, bool add_suffix) {
+  char file_name[256];
+  if (add_suffix) {
+    // Insert the board Id before the extension ( run.bin -> run_b3.bin ).
+    const char *ext = strrchr(name, '.');
+    if (ext == NULL || strchr(ext, '/'))
+      ext = name + strlen(name);
+
+    snprintf(file_name, sizeof(file_name), "%.*s_b%i%s", (int)(ext - name), name, board_id, ext);
+  } else {
+    snprintf(file_name, sizeof(file_name), "%s", name);
   }
 
-  fclose (bFile);
+  int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    fprintf(stderr, "\n!!! Error: cannot open file %s.\n\n", file_name);
+
+  return fd;
+}
 
-  return NULL;
+void write_stats(ufe_readout *ro) {
+  ufe_readout_stats stats;
+  if (ufe_get_stats(ro, &stats) != 0)
+    return;
+
+  ufe_publish_stats(&stats);
+  if (!stats_file)
+    return;
+
+  // Write a new file and replace the old one, so that a reader never sees a partial file.
+  char tmp_name[256];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", stats_file);
+  FILE *file = fopen(tmp_name, "w");
+  if (!file)
+    return;
+
+  ufe_dump_stats(&stats, file);
+  fclose(file);
+  rename(tmp_name, stats_file);
 }
 
-void* get_data_to_fifo(void *dev) {
-  libusb_device_handle *dev_handle = (libusb_device_handle*) dev;
-  int actual_read=0, status;
-  while ((status = ufe_read_buffer(dev_handle, data_out, &actual_read)) == 0) {
-    if (actual_read == 0)
-      break;
-
-    ssize_t actual_wtite = write(data_fifo, data_out, actual_read);
-    if (actual_read != actual_wtite) {
-      fprintf(stderr, "\n!!! Error writting data to FIFO (%i!=%zd).\n\n", actual_read, actual_wtite);
-      break;
+int readout(ufe_readout *ro, const char *out_name) {
+  int i, status;
+  int n_out = 0, out_fd[UFE_MAX_BOARDS];
+
+  if (data_ring) {
+    // All boards go to the shared memory ring.
+    for (i = 0; i < ro->n_streams_; ++i)
+      ufe_readout_set_ring(ro, i, data_ring);
+  } else if (data_fifo != -1) {
+    // All boards go to the FIFO.
+    for (i = 0; i < ro->n_streams_; ++i)
+      ufe_readout_set_output(ro, i, data_fifo);
+  } else if (ro->container_) {
+    // All boards go to one file.
+    out_fd[n_out] = open_output(out_name, 0, false);
+    if (out_fd[n_out] < 0)
+      return 1;
+
+    for (i = 0; i < ro->n_streams_; ++i)
+      ufe_readout_set_output(ro, i, out_fd[n_out]);
+
+    ++n_out;
+  } else {
+    // One file per board.
+    for (i = 0; i < ro->n_streams_; ++i) {
+      out_fd[n_out] = open_output(out_name, ro->streams_[i].board_id_, ro->n_streams_ > 1);
+      if (out_fd[n_out] < 0) {
+        while (n_out > 0)
+          close(out_fd[--n_out]);
+
+        return 1;
+      }
+
+      ufe_readout_set_output(ro, i, out_fd[n_out++]);
     }
   }
 
-  ufe_close_fifo(data_fifo);
-  return NULL;
-}
-
-int readout(libusb_device_handle *dev_handle) {
   data_16 &= 0xfffe;
-  int status = ufe_data_readout(dev_handle, board_id, &data_16);
-
-  void* (*job_ptr) (void*);
-  if (data_fifo == -1)
-    job_ptr = &get_data;
-  else
-    job_ptr = &get_data_to_fifo;
-
-  /* Create a second thread which does the readout. */
-  pthread_t readout_thread;
-  if(pthread_create(&readout_thread, NULL, job_ptr, (void*)dev_handle)) {
-    fprintf(stderr, "\n!!! Error creating readout thread.\n\n");
-    return 1;
+  status = ufe_readout_start(ro, data_16);
+
+  // Publish the telemetry counters once per second while the data is taken.
+  int t;
+  for (t = 0; status == 0 && t < time_s; ++t) {
+    sleep(1);
+    write_stats(ro);
   }
 
-  sleep(time_s);
   data_16 |= 0x1;
-  status = ufe_data_readout(dev_handle, board_id, &data_16);
+  int stop_status = ufe_readout_stop(ro, data_16);
+  if (status == 0)
+    status = stop_status;
 
-  /* Wait for the readout thread to finish */
-  if(pthread_join(readout_thread, NULL)) {
-    fprintf(stderr, "Error joining thread\n");
-    return 1;
-  }
+  write_stats(ro);
+
+  for (i = 0; i < n_out; ++i)
+    close(out_fd[i]);
+
+  if (data_fifo != -1)
+    ufe_close_fifo(data_fifo);
+
+  if (data_ring)
+    ufe_ring_close(data_ring, 1000);
 
   return status;
 }
 
 void print_usage(char *argv) {
   fprintf(stderr, "\nUsage: %s [OPTION] ARG \n\n", argv);
-  fprintf(stderr, "    -b / --board-id     <int dec/hex>   ( Board Id )                  [ required ]\n");
-  fprintf(stderr, "    -o / --output-file  <string>        ( Name of the output file)    [ optional OR f ]\n");
-  fprintf(stderr, "    -f / --fifo-output                  ( Output data to FIFO file)   [ optional OR o ]\n");
+  fprintf(stderr, "    -b / --board-id     <list / all>    ( Board Ids, comma separated ) [ required ]\n");
+  fprintf(stderr, "    -o / --output-file  <string>        ( Name of the output file)    [ one of o f r ]\n");
+  fprintf(stderr, "    -f / --fifo-output                  ( Output data to FIFO file)   [ one of o f r ]\n");
+  fprintf(stderr, "    -r / --ring-output  <string>        ( Shared memory ring name )   [ one of o f r ]\n");
+  fprintf(stderr, "    -c / --container                    ( All boards in one file )    [ optional ]\n");
+  fprintf(stderr, "    -w / --writers      <int dec/hex>   ( Number of writer threads )  [ optional ]\n");
+  fprintf(stderr, "    -n / --blocks       <int dec/hex>   ( Buffer blocks per board )   [ optional / Default 16 ]\n");
+  fprintf(stderr, "    -l / --lock-memory                  ( Lock the buffers in RAM )   [ optional ]\n");
+  fprintf(stderr, "    -u / --usb-cpus     <list / node>   ( CPUs of the USB threads )   [ optional ]\n");
+  fprintf(stderr, "    -W / --writer-cpus  <list / node>   ( CPUs of the writers )       [ optional ]\n");
+  fprintf(stderr, "    -P / --priority     <int dec/hex>   ( SCHED_FIFO of USB threads ) [ optional ]\n");
+  fprintf(stderr, "    -z / --zero-suppress                ( Drop empty frames, beacons ) [ optional ]\n");
+  fprintf(stderr, "    -k / --keep-beacons <int dec/hex>   ( Keep 1 idle beacon out of ) [ optional / Default 16, >= 1 ]\n");
+  fprintf(stderr, "    -I / --id-shift     <int dec/hex>   ( Position of the word Id )   [ optional / Default 28 ]\n");
+  fprintf(stderr, "    -H / --header-ids   <list>          ( Frame header word Ids )     [ optional / Default 0x1 ]\n");
+  fprintf(stderr, "    -T / --trailer-ids  <list>          ( Frame trailer word Ids )    [ optional / Default 0xD,0xE ]\n");
+  fprintf(stderr, "    -B / --beacon-ids   <list>          ( Beacon word Ids )           [ optional / Default 0xF ]\n");
+  fprintf(stderr, "    -S / --stats        <string>        ( Telemetry file, 1 Hz )      [ optional ]\n");
   fprintf(stderr, "    -t / --time         <int dec/hex>   ( Duration in seconds )       [ optional / Default 10 s ]\n");
   fprintf(stderr, "    -v / --verbose                      ( Print human readable)       [ optional ]\n");
   fprintf(stderr, "    -p / --param        <int dec/hex>   ( Param bit array value)      [ optional OR s ]\n");
@@ -121,6 +195,21 @@ int main (int argc, char **argv) {
   int board_id_arg = get_arg_val('b', "board-id"    , argc, argv);
   int out_file_arg = get_arg_val('o', "output-file" , argc, argv);
   int fifo_arg         = get_arg('f', "fifo-output" , argc, argv);
+  int ring_arg     = get_arg_val('r', "ring-output" , argc, argv);
+  int container_arg    = get_arg('c', "container"   , argc, argv);
+  int writers_arg  = get_arg_val('w', "writers"     , argc, argv);
+  int blocks_arg   = get_arg_val('n', "blocks"      , argc, argv);
+  int lock_arg         = get_arg('l', "lock-memory" , argc, argv);
+  int usb_cpus_arg = get_arg_val('u', "usb-cpus"    , argc, argv);
+  int wcpus_arg    = get_arg_val('W', "writer-cpus" , argc, argv);
+  int prio_arg     = get_arg_val('P', "priority"    , argc, argv);
+  int zs_arg           = get_arg('z', "zero-suppress", argc, argv);
+  int keep_arg     = get_arg_val('k', "keep-beacons", argc, argv);
+  int shift_arg    = get_arg_val('I', "id-shift"    , argc, argv);
+  int header_arg   = get_arg_val('H', "header-ids"  , argc, argv);
+  int trailer_arg  = get_arg_val('T', "trailer-ids" , argc, argv);
+  int beacon_arg   = get_arg_val('B', "beacon-ids"  , argc, argv);
+  int stats_arg    = get_arg_val('S', "stats"       , argc, argv);
   int time_arg     = get_arg_val('t', "time"        , argc, argv);
   int param_arg    = get_arg_val('p', "param"       , argc, argv);
   int pipe_arg         = get_arg('s', "stdin"       , argc, argv);
@@ -131,7 +220,14 @@ int main (int argc, char **argv) {
     return 1;
   }
 
-  board_id = arg_as_int(argv[board_id_arg]);
+  n_boards = get_board_ids(argv[board_id_arg], board_ids, UFE_MAX_BOARDS);
+  if (n_boards < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (stats_arg != 0)
+    stats_file = argv[stats_arg];
 
   time_s = 10;
   if (time_arg != 0)
@@ -142,7 +238,7 @@ int main (int argc, char **argv) {
     return 1;
   }
 
-  if (!( (fifo_arg == 0)^(out_file_arg == 0) )) {
+  if ( (fifo_arg != 0) + (out_file_arg != 0) + (ring_arg != 0) != 1 ) {
     print_usage(argv[0]);
     return 1;
   }
@@ -167,33 +263,108 @@ int main (int argc, char **argv) {
     return 1;
   }
 
+  // The word Ids of the zero suppression depend on the firmware.
+  ufe_filter_config filter;
+  ufe_filter_default_config(&filter);
+  if (keep_arg != 0)
+    filter.beacon_keep_ = arg_as_int(argv[keep_arg]);
+
+  if (shift_arg != 0)
+    filter.id_shift_ = arg_as_int(argv[shift_arg]);
+
+  if ( filter.beacon_keep_ < 1 ||
+      (header_arg != 0 && get_word_ids(argv[header_arg], &filter.header_ids_) != 0) ||
+      (trailer_arg != 0 && get_word_ids(argv[trailer_arg], &filter.trailer_ids_) != 0) ||
+      (beacon_arg != 0 && get_word_ids(argv[beacon_arg], &filter.beacon_ids_) != 0) ) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  ufe_filter check;
+  if (zs_arg != 0 && ufe_filter_init(&check, &filter) != 0) {
+    fprintf(stderr, "\n!!! Error: invalid zero suppression (overlapping Ids or Id shift).\n\n");
+    return 1;
+  }
+
   if ( v_arg ) {
-    printf("\nOn device 0x%x  board %i -> Setting readout params: 0x%x \n", BMFEB_PRODUCT_ID,
-                                                                            board_id,
-                                                                            data_16);
+    printf("\nOn device 0x%x  board(s) %s -> Setting readout params: 0x%x \n", BMFEB_PRODUCT_ID,
+                                                                               argv[board_id_arg],
+                                                                               data_16);
     ufe_dump_readout_params(data_16);
     printf("\n");
   }
 
-  if (out_file_arg != 0)
-    strcat(file_name, argv[out_file_arg]);
-  else {
-    data_fifo = ufe_open_fifo();
-    if (data_fifo == -1)
-      return 1;
-  }
-
   ufe_context *ctx = NULL;
   ufe_default_context(&ctx);
 //   ctx->readout_buffer_size_ = 1024*64;
   ctx->readout_timeout_= 1000;
+  if (blocks_arg != 0)
+    ctx->readout_blocks_ = arg_as_int(argv[blocks_arg]);
+
+  if (lock_arg != 0)
+    ctx->readout_pool_flags_ |= UFE_POOL_MLOCK;
+
 //   ctx->verbose_ = 3;
 
-  data_out = (uint8_t*) malloc(ctx->readout_buffer_size_);
+  int status = ufe_init(&ctx);
+  if (status != 0) {
+    fprintf(stderr, "\n!!! Error: init Error. %i\n\n", status);
+    return 1;
+  }
 
-  int status = ufe_on_board_do(board_id, &readout);
+  // Keep track of the boards connected or disconnected during the run. Without hotplug support
+  // the boards are found by probing the devices.
+  ufe_registry_start(NULL, NULL);
 
-  free(data_out);
-  return (status)? 0 : 1;
-}
+  ufe_readout *ro = NULL;
+  status = ufe_readout_open(&ro, (n_boards)? board_ids : NULL, n_boards);
+  if (status != 0) {
+    ufe_exit(ctx);
+    return 1;
+  }
+
+  if (writers_arg != 0)
+    ro->n_writers_ = arg_as_int(argv[writers_arg]);
+
+  if (usb_cpus_arg != 0)
+    ro->usb_cpus_ = argv[usb_cpus_arg];
+
+  if (wcpus_arg != 0)
+    ro->writer_cpus_ = argv[wcpus_arg];
 
+  if (prio_arg != 0)
+    ro->usb_priority_ = arg_as_int(argv[prio_arg]);
+
+  if (zs_arg != 0)
+    ro->filter_ = &filter;
+
+  // Several boards sharing the FIFO need the container format.
+  ro->container_ = (container_arg != 0) || (fifo_arg != 0 && ro->n_streams_ > 1);
+
+  if (ring_arg != 0) {
+    status = ufe_ring_create(&data_ring, argv[ring_arg], UFE_RING_SIZE);
+    if (status != 0) {
+      ufe_readout_close(ro);
+      ufe_exit(ctx);
+      return 1;
+    }
+
+    // The ring is written by the writers, next to the USB controller.
+    ufe_bind_memory(data_ring->ctrl_, data_ring->map_size_, ro->streams_[0].numa_node_);
+  }
+
+  if (fifo_arg != 0) {
+    data_fifo = ufe_open_fifo();
+    if (data_fifo == -1) {
+      ufe_readout_close(ro);
+      ufe_exit(ctx);
+      return 1;
+    }
+  }
+
+  status = readout(ro, (out_file_arg)? argv[out_file_arg] : NULL);
+
+  ufe_readout_close(ro);
+  ufe_exit(ctx);
+  return (status!=0)? 1 : 0;
+}
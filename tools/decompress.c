@@ -0,0 +1,165 @@
+/** This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "libufe.h"
+#include "libufe-tools.h"
+#include "libufe-compress.h"
+
+// Reads exactly size bytes. Returns the number of bytes read, less than size at the end of the file.
+size_t read_all(int fd, uint8_t *data, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd, data + done, size - done);
+    if (n <= 0)
+      break;
+
+    done += n;
+  }
+
+  return done;
+}
+
+// Grows a buffer to at least size bytes. Returns false if there is no memory.
+bool grow(uint8_t **buffer, size_t *capacity, size_t size) {
+  if (size <= *capacity)
+    return true;
+
+  uint8_t *b = (uint8_t*) realloc(*buffer, size);
+  if (!b)
+    return false;
+
+  *buffer = b;
+  *capacity = size;
+  return true;
+}
+
+int decompress(int in_fd, int out_fd) {
+  size_t frame_size = 1024*1024, block_size = 1024*1024;
+  uint8_t *frame = (uint8_t*) malloc(frame_size);
+  uint8_t *block = (uint8_t*) malloc(block_size);
+  if (!frame || !block) {
+    fprintf(stderr, "\n!!! Error: no memory.\n\n");
+    free(frame);
+    free(block);
+    return 1;
+  }
+
+  ufe_frame_header *header = (ufe_frame_header*) frame;
+  int status = 0;
+  uint64_t n_frames = 0;
+
+  while (1) {
+    size_t actual = read_all(in_fd, frame, sizeof(ufe_frame_header));
+    if (actual == 0)
+      break;
+
+    if (actual < sizeof(ufe_frame_header) || header->magic_ != UFE_FRAME_MAGIC) {
+      fprintf(stderr, "\n!!! Error: no frame header at frame %lu.\n\n", (unsigned long) n_frames);
+      status = 1;
+      break;
+    }
+
+    // The sizes come from the file. Check them before allocating.
+    if (!ufe_frame_header_valid(header)) {
+      fprintf(stderr, "\n!!! Error: frame %lu is corrupted.\n\n", (unsigned long) n_frames);
+      status = 1;
+      break;
+    }
+
+    // Grow the buffers to the size of this frame. The header moves with the frame buffer.
+    uint32_t payload_size = header->payload_size_;
+    if (!grow(&block, &block_size, header->size_) ||
+        !grow(&frame, &frame_size, sizeof(ufe_frame_header) + payload_size)) {
+      fprintf(stderr, "\n!!! Error: no memory for frame %lu.\n\n", (unsigned long) n_frames);
+      status = 1;
+      break;
+    }
+
+    header = (ufe_frame_header*) frame;
+    actual = read_all(in_fd, frame + sizeof(ufe_frame_header), payload_size);
+    int size = ufe_decompress_frame(frame, sizeof(ufe_frame_header) + actual, block, block_size);
+    if (size < 0) {
+      fprintf(stderr, "\n!!! Error: frame %lu is corrupted.\n\n", (unsigned long) n_frames);
+      status = 1;
+      break;
+    }
+
+    if (ufe_write_all(out_fd, block, size) != 0) {
+      fprintf(stderr, "\n!!! Error: cannot write the output.\n\n");
+      status = 1;
+      break;
+    }
+
+    ++n_frames;
+  }
+
+  free(frame);
+  free(block);
+  return status;
+}
+
+void print_usage(char *argv) {
+  fprintf(stderr, "\nUsage: %s [OPTION] ARG \n\n", argv);
+  fprintf(stderr, "    -i / --input-file   <string>        ( Compressed file )           [ optional / Default stdin ]\n");
+  fprintf(stderr, "    -o / --output-file  <string>        ( Name of the output file)    [ optional / Default stdout ]\n");
+}
+
+int main (int argc, char **argv) {
+
+  int in_file_arg  = get_arg_val('i', "input-file"  , argc, argv);
+  int out_file_arg = get_arg_val('o', "output-file" , argc, argv);
+  int help_arg         = get_arg('h', "help"        , argc, argv);
+
+  if (help_arg) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  int in_fd = STDIN_FILENO, out_fd = STDOUT_FILENO;
+  if (in_file_arg != 0) {
+    in_fd = open(argv[in_file_arg], O_RDONLY);
+    if (in_fd < 0) {
+      fprintf(stderr, "\n!!! Error: cannot open file %s.\n\n", argv[in_file_arg]);
+      return 1;
+    }
+  }
+
+  if (out_file_arg != 0) {
+    out_fd = open(argv[out_file_arg], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+      fprintf(stderr, "\n!!! Error: cannot open file %s.\n\n", argv[out_file_arg]);
+      return 1;
+    }
+  }
+
+  int status = decompress(in_fd, out_fd);
+
+  if (in_fd != STDIN_FILENO)
+    close(in_fd);
+
+  if (out_fd != STDOUT_FILENO)
+    close(out_fd);
+
+  return status;
+}
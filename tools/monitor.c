@@ -0,0 +1,143 @@
+/** This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libufe.h"
+#include "libufe-tools.h"
+#include "libufe-ring.h"
+#include "libufe-monitor.h"
+
+// Name of the file rewritten with every snapshot, or NULL.
+const char *out_file = NULL;
+
+// Prints the summary of a snapshot, and replaces the output file with the full snapshot.
+void publish(const ufe_monitor_snapshot *snapshot, void *user_data) {
+  ufe_monitor_dump(snapshot, false, stdout);
+  fflush(stdout);
+  if (!out_file)
+    return;
+
+  // Written aside and renamed, so that a reader never sees a partial snapshot.
+  char tmp_name[1024];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", out_file);
+  FILE *file = fopen(tmp_name, "w");
+  if (!file) {
+    fprintf(stderr, "\n!!! Error: cannot open file %s.\n\n", tmp_name);
+    return;
+  }
+
+  ufe_monitor_dump(snapshot, true, file);
+  if (fclose(file) != 0 || rename(tmp_name, out_file) != 0)
+    fprintf(stderr, "\n!!! Error: cannot write file %s.\n\n", out_file);
+}
+
+int consume(ufe_ring_reader *reader, ufe_monitor *mon) {
+  size_t buffer_size = 1024*1024, actual;
+  uint8_t *buffer = (uint8_t*) malloc(buffer_size);
+  int status;
+
+  while (1) {
+    status = ufe_ring_read(reader, buffer, buffer_size, &actual, ufe_monitor_time_left(mon));
+    if (status == LIBUSB_ERROR_TIMEOUT) {
+      ufe_monitor_poll(mon);
+      continue;
+    }
+
+    if (status == LIBUSB_ERROR_OVERFLOW) {
+      // The record is bigger than the buffer. Grow and try again.
+      buffer_size *= 2;
+      buffer = (uint8_t*) realloc(buffer, buffer_size);
+      continue;
+    }
+
+    if (status != 0 || actual == 0)
+      break;
+
+    ufe_monitor_add_record(mon, buffer, actual);
+  }
+
+  ufe_monitor_publish(mon);
+  free(buffer);
+  return status;
+}
+
+void print_usage(char *argv) {
+  fprintf(stderr, "\nUsage: %s [OPTION] ARG \n\n", argv);
+  fprintf(stderr, "    -r / --ring         <string>        ( Shared memory ring name )   [ optional / Default %s ]\n", UFE_RING_NAME);
+  fprintf(stderr, "    -o / --output-file  <string>        ( Rewritten with every snapshot ) [ optional ]\n");
+  fprintf(stderr, "    -i / --interval     <int dec/hex>   ( Snapshot interval, ms )     [ optional / Default %i ]\n", UFE_MONITOR_INTERVAL);
+  fprintf(stderr, "    -s / --sample       <int dec/hex>   ( Decode 1 record out of N )  [ optional / Default 1 ]\n");
+  fprintf(stderr, "    -n / --boards       <int dec/hex>   ( Maximum number of boards )  [ optional / Default 16 ]\n");
+  fprintf(stderr, "    -a / --all                          ( Read every record, may slow down the readout ) [ optional ]\n");
+}
+
+int main (int argc, char **argv) {
+
+  int ring_arg     = get_arg_val('r', "ring"        , argc, argv);
+  int out_file_arg = get_arg_val('o', "output-file" , argc, argv);
+  int interval_arg = get_arg_val('i', "interval"    , argc, argv);
+  int sample_arg   = get_arg_val('s', "sample"      , argc, argv);
+  int boards_arg   = get_arg_val('n', "boards"      , argc, argv);
+  int all_arg          = get_arg('a', "all"         , argc, argv);
+  int help_arg         = get_arg('h', "help"        , argc, argv);
+
+  if (help_arg) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  ufe_monitor_config config;
+  ufe_monitor_default_config(&config);
+  config.func_ = &publish;
+  if (interval_arg)
+    config.interval_ms_ = arg_as_int(argv[interval_arg]);
+
+  if (sample_arg)
+    config.sample_ = arg_as_int(argv[sample_arg]);
+
+  if (boards_arg)
+    config.max_boards_ = arg_as_int(argv[boards_arg]);
+
+  if (out_file_arg)
+    out_file = argv[out_file_arg];
+
+  ufe_monitor *mon = NULL;
+  if (ufe_monitor_create(&mon, &config) != 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // By default the reader is lossy: the monitor never slows down the readout.
+  ufe_ring_reader *reader = NULL;
+  int status = ufe_ring_attach(&reader, (ring_arg)? argv[ring_arg] : UFE_RING_NAME, all_arg == 0);
+  if (status != 0) {
+    ufe_monitor_destroy(mon);
+    return 1;
+  }
+
+  status = consume(reader, mon);
+  if (!all_arg)
+    fprintf(stderr, "records lost: %lu\n", (unsigned long) ufe_ring_lost(reader));
+
+  ufe_ring_detach(reader);
+  ufe_monitor_destroy(mon);
+  return (status!=0)? 1 : 0;
+}
@@ -0,0 +1,159 @@
+/** This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "libufe.h"
+#include "libufe-tools.h"
+#include "libufe-readout.h"
+#include "libufe-ring.h"
+#include "libufe-compress.h"
+
+// Writes a block directly, or through the compressor (one frame per block).
+int output(int fd, ufe_compressor *comp, const uint8_t *data, size_t size) {
+  if (comp)
+    return ufe_compressor_write(comp, data, size);
+
+  return ufe_write_all(fd, data, size);
+}
+
+int consume(ufe_ring_reader *reader, int fd, ufe_compressor *comp, bool keep_headers) {
+  size_t buffer_size = 1024*1024, actual;
+  uint8_t *buffer = (uint8_t*) malloc(buffer_size);
+  int status;
+
+  while (1) {
+    status = ufe_ring_read(reader, buffer, buffer_size, &actual, 1000);
+    if (status == LIBUSB_ERROR_TIMEOUT)
+      continue;
+
+    if (status == LIBUSB_ERROR_OVERFLOW) {
+      // The record is bigger than the buffer. Grow and try again.
+      buffer_size *= 2;
+      buffer = (uint8_t*) realloc(buffer, buffer_size);
+      continue;
+    }
+
+    if (status != 0 || actual == 0)
+      break;
+
+    if (actual < sizeof(ufe_block_header))
+      continue;
+
+    // The records emptied by the filter are kept with the headers, for the sequence numbers.
+    ufe_block_header *header = (ufe_block_header*) buffer;
+    if (header->size_ == 0 && (!keep_headers || (header->flags_ & UFE_BLOCK_EOS)))
+      continue;
+
+    if (keep_headers)
+      status = output(fd, comp, buffer, actual);
+    else
+      status = output(fd, comp, buffer + sizeof(ufe_block_header), actual - sizeof(ufe_block_header));
+
+    if (status != 0) {
+      fprintf(stderr, "\n!!! Error: cannot write the output.\n\n");
+      break;
+    }
+  }
+
+  free(buffer);
+  return status;
+}
+
+void print_usage(char *argv) {
+  fprintf(stderr, "\nUsage: %s [OPTION] ARG \n\n", argv);
+  fprintf(stderr, "    -r / --ring         <string>        ( Shared memory ring name )   [ optional / Default %s ]\n", UFE_RING_NAME);
+  fprintf(stderr, "    -o / --output-file  <string>        ( Name of the output file)    [ optional / Default stdout ]\n");
+  fprintf(stderr, "    -l / --lossy                        ( Never slow down the readout) [ optional ]\n");
+  fprintf(stderr, "    -c / --container                    ( Keep the record headers )   [ optional ]\n");
+  fprintf(stderr, "    -z / --compress     <string>        ( none / delta / lz4 / zstd ) [ optional ]\n");
+  fprintf(stderr, "    -j / --threads      <int dec/hex>   ( Compression threads )       [ optional / Default %i ]\n", UFE_COMPRESS_THREADS);
+}
+
+int main (int argc, char **argv) {
+
+  int ring_arg     = get_arg_val('r', "ring"        , argc, argv);
+  int out_file_arg = get_arg_val('o', "output-file" , argc, argv);
+  int lossy_arg        = get_arg('l', "lossy"       , argc, argv);
+  int container_arg    = get_arg('c', "container"   , argc, argv);
+  int compress_arg = get_arg_val('z', "compress"    , argc, argv);
+  int threads_arg  = get_arg_val('j', "threads"     , argc, argv);
+  int help_arg         = get_arg('h', "help"        , argc, argv);
+
+  if (help_arg) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  int codec = UFE_CODEC_NONE;
+  if (compress_arg != 0) {
+    codec = ufe_codec_by_name(argv[compress_arg]);
+    if (codec < 0) {
+      fprintf(stderr, "\n!!! Error: codec %s not available.\n\n", argv[compress_arg]);
+      return 1;
+    }
+  }
+
+  int fd = STDOUT_FILENO;
+  if (out_file_arg != 0) {
+    fd = open(argv[out_file_arg], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "\n!!! Error: cannot open file %s.\n\n", argv[out_file_arg]);
+      return 1;
+    }
+  }
+
+  ufe_ring_reader *reader = NULL;
+  int status = ufe_ring_attach(&reader, (ring_arg)? argv[ring_arg] : UFE_RING_NAME, lossy_arg != 0);
+  if (status != 0) {
+    if (fd != STDOUT_FILENO)
+      close(fd);
+
+    return 1;
+  }
+
+  ufe_compressor *comp = NULL;
+  if (compress_arg != 0) {
+    int n_threads = (threads_arg)? arg_as_int(argv[threads_arg]) : UFE_COMPRESS_THREADS;
+    status = ufe_compressor_open(&comp, fd, codec, n_threads);
+    if (status != 0) {
+      ufe_ring_detach(reader);
+      if (fd != STDOUT_FILENO)
+        close(fd);
+
+      return 1;
+    }
+  }
+
+  status = consume(reader, fd, comp, container_arg != 0);
+  if (comp && ufe_compressor_close(comp) != 0 && status == 0)
+    status = UFE_IO_ERROR;
+
+  if (lossy_arg)
+    fprintf(stderr, "records lost: %lu\n", (unsigned long) ufe_ring_lost(reader));
+
+  ufe_ring_detach(reader);
+  if (fd != STDOUT_FILENO)
+    close(fd);
+
+  return (status!=0)? 1 : 0;
+}
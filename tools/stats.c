@@ -0,0 +1,90 @@
+/** This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libufe.h"
+#include "libufe-tools.h"
+#include "libufe-readout.h"
+
+int board_ids[UFE_MAX_BOARDS], n_boards;
+
+void print_usage(char *argv) {
+  fprintf(stderr, "\nUsage: %s [OPTION] ARG \n\n", argv);
+  fprintf(stderr, "    -b / --board-id     <list / all>    ( Board Ids, comma separated ) [ required ]\n");
+  fprintf(stderr, "    -n / --repeat       <int dec/hex>   ( Number of status polls )    [ optional / Default 100 ]\n");
+}
+
+int main (int argc, char **argv) {
+
+  int board_id_arg = get_arg_val('b', "board-id" , argc, argv);
+  int repeat_arg   = get_arg_val('n', "repeat"   , argc, argv);
+
+  if (board_id_arg == 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  n_boards = get_board_ids(argv[board_id_arg], board_ids, UFE_MAX_BOARDS);
+  if (n_boards < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  int n_repeat = (repeat_arg)? arg_as_int(argv[repeat_arg]) : 100;
+
+  ufe_context *ctx = NULL;
+  ufe_default_context(&ctx);
+  int status = ufe_init(&ctx);
+  if (status != 0) {
+    fprintf(stderr, "\n!!! Error: init Error. %i\n\n", status);
+    return 1;
+  }
+
+  ufe_readout *ro = NULL;
+  status = ufe_readout_open(&ro, (n_boards)? board_ids : NULL, n_boards);
+  if (status != 0) {
+    ufe_exit(ctx);
+    return 1;
+  }
+
+  // Time only the commands below, not the search for the boards.
+  ufe_set_cmd_timing(ctx, true);
+  ufe_reset_cmd_timing();
+
+  int i, r;
+  for (i = 0; status == 0 && i < ro->n_streams_; ++i) {
+    struct ufe_readout_stream *s = &ro->streams_[i];
+    int fv;
+    status = ufe_firmware_version(s->handle_, s->board_id_, &fv);
+  }
+
+  // Poll the status of all boards, as done during the data taking.
+  for (r = 0; status == 0 && r < n_repeat; ++r)
+    for (i = 0; status == 0 && i < ro->n_streams_; ++i) {
+      uint16_t board_status;
+      status = ufe_read_status(ro->streams_[i].handle_, ro->streams_[i].board_id_, &board_status);
+    }
+
+  ufe_dump_cmd_timing(stdout);
+
+  ufe_readout_close(ro);
+  ufe_exit(ctx);
+  return (status!=0)? 1 : 0;
+}
@@ -0,0 +1,128 @@
+/** This file is part of BabyMINDdaq software package. This software
+ * package is designed for internal use for the Baby MIND detector
+ * collaboration and is tailored for this use primarily.
+ *
+ * BabyMINDdaq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BabyMINDdaq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BabyMINDdaq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "libufe.h"
+#include "libufe-tools.h"
+#include "libufe-readout.h"
+#include "libufe-poller.h"
+
+int board_ids[UFE_MAX_BOARDS], n_boards;
+
+void print_usage(char *argv) {
+  fprintf(stderr, "\nUsage: %s [OPTION] ARG \n\n", argv);
+  fprintf(stderr, "    -b / --board-id     <list / all>    ( Board Ids, comma separated ) [ required ]\n");
+  fprintf(stderr, "    -i / --interval     <int dec/hex>   ( Poll interval, ms )         [ optional / Default %i ]\n", UFE_POLLER_INTERVAL);
+  fprintf(stderr, "    -n / --repeat       <int dec/hex>   ( Number of polls, 0 no limit ) [ optional / Default 0 ]\n");
+  fprintf(stderr, "    -t / --timing                       ( Print the duration of the polls ) [ optional ]\n");
+}
+
+// Sleeps until the deadline (monotonic clock).
+void sleep_until(const struct timespec *deadline) {
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) != 0) {}
+}
+
+int main (int argc, char **argv) {
+
+  int board_id_arg = get_arg_val('b', "board-id" , argc, argv);
+  int interval_arg = get_arg_val('i', "interval" , argc, argv);
+  int repeat_arg   = get_arg_val('n', "repeat"   , argc, argv);
+  int timing_arg       = get_arg('t', "timing"   , argc, argv);
+
+  if (board_id_arg == 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  n_boards = get_board_ids(argv[board_id_arg], board_ids, UFE_MAX_BOARDS);
+  if (n_boards < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  int interval_ms = (interval_arg)? arg_as_int(argv[interval_arg]) : UFE_POLLER_INTERVAL;
+  int n_repeat = (repeat_arg)? arg_as_int(argv[repeat_arg]) : 0;
+
+  ufe_context *ctx = NULL;
+  ufe_default_context(&ctx);
+  int status = ufe_init(&ctx);
+  if (status != 0) {
+    fprintf(stderr, "\n!!! Error: init Error. %i\n\n", status);
+    return 1;
+  }
+
+  // The devices stay open for all the polls.
+  ufe_readout *ro = NULL;
+  status = ufe_readout_open(&ro, (n_boards)? board_ids : NULL, n_boards);
+  if (status != 0) {
+    ufe_exit(ctx);
+    return 1;
+  }
+
+  libusb_device_handle *handles[UFE_MAX_BOARDS];
+  int i;
+  for (i = 0; i < ro->n_streams_; ++i) {
+    handles[i] = ro->streams_[i].handle_;
+    board_ids[i] = ro->streams_[i].board_id_;
+  }
+
+  ufe_poller *poller = NULL;
+  status = ufe_poller_open(&poller, handles, board_ids, ro->n_streams_);
+  if (status != 0) {
+    ufe_readout_close(ro);
+    ufe_exit(ctx);
+    return 1;
+  }
+
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  int r;
+  for (r = 0; n_repeat == 0 || r < n_repeat; ++r) {
+    const ufe_status_change *changes;
+    int n_changes;
+    ufe_poller_poll(poller, &changes, &n_changes);
+    ufe_dump_status_changes(changes, n_changes, stdout);
+    ufe_publish_status_changes(changes, n_changes);
+    fflush(stdout);
+
+    if (n_repeat != 0 && r == n_repeat - 1)
+      break;
+
+    next.tv_sec  += interval_ms/1000;
+    next.tv_nsec += (interval_ms%1000)*1000000L;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      ++next.tv_sec;
+    }
+
+    sleep_until(&next);
+  }
+
+  if (timing_arg) {
+    fprintf(stderr, "poll time (us): ");
+    ufe_histo_dump(&poller->latency_, 1000., stderr);
+    fprintf(stderr, "\n");
+  }
+
+  ufe_poller_close(poller);
+  ufe_readout_close(ro);
+  ufe_exit(ctx);
+  return 0;
+}